@@ -0,0 +1,680 @@
+#include "art.h"
+
+#define ART_NODE4 0
+#define ART_NODE16 1
+#define ART_NODE48 2
+#define ART_NODE256 3
+#define ART_LEAF 4
+#define ART_KINDS 5
+#define ART_MAX_PREFIX 10 // Longer prefixes are skipped on lookup and checked at the leaf
+#define ART_SLAB_ITEMS 64
+
+typedef struct {
+    uint64_t version; // Odd while a writer changes it, and once it is removed
+    uint8_t type;
+    uint16_t num_children;
+    uint32_t prefix_len;
+    unsigned char prefix[ART_MAX_PREFIX]; // Its first bytes
+} ArtNode;
+
+typedef struct {
+    ArtNode n;
+    unsigned char keys[4]; // Sorted
+    void *children[4];
+} ArtNode4;
+
+typedef struct {
+    ArtNode n;
+    unsigned char keys[16]; // Sorted
+    void *children[16];
+} ArtNode16;
+
+typedef struct {
+    ArtNode n;
+    unsigned char index[256]; // Slot in children + 1, 0 if none
+    void *children[48];
+} ArtNode48;
+
+typedef struct {
+    ArtNode n;
+    void *children[256];
+} ArtNode256;
+
+typedef struct {
+    uint64_t version;
+    int value;
+    uint32_t key_len; // Including the NUL
+    unsigned char key[MAX_FILENAME];
+} ArtLeaf;
+
+static const size_t kind_sizes[ART_KINDS] = {
+    sizeof(ArtNode4), sizeof(ArtNode16), sizeof(ArtNode48), sizeof(ArtNode256), sizeof(ArtLeaf)
+};
+static const int node_capacity[4] = {4, 16, 48, 256};
+
+// ===== SLABS =====
+
+// Free items keep their kind, and their version stays odd. The free list
+// link lives in bytes a reader only ever compares, never follows.
+static void *free_lists[ART_KINDS];
+static pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void **free_link(void *item, int kind) {
+    return kind == ART_LEAF ? (void**)((ArtLeaf*)item)->key : (void**)((ArtNode*)item)->prefix;
+}
+
+static void *slab_alloc(int kind) {
+    pthread_mutex_lock(&slab_lock);
+    if (!free_lists[kind]) {
+        char *slab = calloc(ART_SLAB_ITEMS, kind_sizes[kind]);
+        if (!slab) {
+            pthread_mutex_unlock(&slab_lock);
+            return NULL;
+        }
+        for (int i = ART_SLAB_ITEMS - 1; i >= 0; i--) {
+            void *item = slab + i * kind_sizes[kind];
+            if (kind != ART_LEAF) ((ArtNode*)item)->type = kind;
+            *(uint64_t*)item = 1; // Free items are odd
+            memcpy(free_link(item, kind), &free_lists[kind], sizeof(void*));
+            free_lists[kind] = item;
+        }
+    }
+
+    void *item = free_lists[kind];
+    memcpy(&free_lists[kind], free_link(item, kind), sizeof(void*));
+    pthread_mutex_unlock(&slab_lock);
+
+    // Still unreachable, so it may go even before it is filled in
+    __atomic_store_n((uint64_t*)item, *(uint64_t*)item + 1, __ATOMIC_RELAXED);
+    return item;
+}
+
+// Called once item is unreachable; readers that still hold it will restart
+static void slab_free(void *item, int kind) {
+    __atomic_store_n((uint64_t*)item, *(uint64_t*)item + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    pthread_mutex_lock(&slab_lock);
+    memcpy(free_link(item, kind), &free_lists[kind], sizeof(void*));
+    free_lists[kind] = item;
+    pthread_mutex_unlock(&slab_lock);
+}
+
+// ===== VERSIONS =====
+
+static uint64_t read_begin(const void *item) {
+    return __atomic_load_n((const uint64_t*)item, __ATOMIC_ACQUIRE);
+}
+
+static int read_valid(const void *item, uint64_t version) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n((const uint64_t*)item, __ATOMIC_RELAXED) == version;
+}
+
+static void write_begin(void *item) {
+    __atomic_store_n((uint64_t*)item, *(uint64_t*)item + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void write_end(void *item) {
+    __atomic_store_n((uint64_t*)item, *(uint64_t*)item + 1, __ATOMIC_RELEASE);
+}
+
+// ===== NODES =====
+
+static int is_leaf(const void *p) {
+    return (uintptr_t)p & 1;
+}
+
+static ArtLeaf *as_leaf(const void *p) {
+    return (ArtLeaf*)((uintptr_t)p & ~(uintptr_t)1);
+}
+
+static void *tag_leaf(ArtLeaf *leaf) {
+    return (void*)((uintptr_t)leaf | 1);
+}
+
+static void *load_child(void **slot) {
+    return __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+}
+
+static void store_child(void **slot, void *child) {
+    __atomic_store_n(slot, child, __ATOMIC_RELEASE);
+}
+
+// Slot holding the child for byte, or NULL. Safe on a node being changed:
+// counts are clamped, so a torn read stays inside the node.
+static void **child_slot(ArtNode *n, unsigned char byte) {
+    int count = n->num_children;
+    switch (n->type) {
+        case ART_NODE4: {
+            ArtNode4 *n4 = (ArtNode4*)n;
+            for (int i = 0; i < count && i < 4; i++) {
+                if (n4->keys[i] == byte) return &n4->children[i];
+            }
+            return NULL;
+        }
+        case ART_NODE16: {
+            ArtNode16 *n16 = (ArtNode16*)n;
+            for (int i = 0; i < count && i < 16; i++) {
+                if (n16->keys[i] == byte) return &n16->children[i];
+            }
+            return NULL;
+        }
+        case ART_NODE48: {
+            ArtNode48 *n48 = (ArtNode48*)n;
+            int slot = n48->index[byte];
+            return slot > 0 && slot <= 48 ? &n48->children[slot - 1] : NULL;
+        }
+        default:
+            return &((ArtNode256*)n)->children[byte];
+    }
+}
+
+// Children of a node in byte order. Writers only.
+static int node_children(ArtNode *n, unsigned char *bytes, void **children) {
+    int count = 0;
+    switch (n->type) {
+        case ART_NODE4:
+        case ART_NODE16: {
+            unsigned char *keys = n->type == ART_NODE4 ? ((ArtNode4*)n)->keys : ((ArtNode16*)n)->keys;
+            void **slots = n->type == ART_NODE4 ? ((ArtNode4*)n)->children : ((ArtNode16*)n)->children;
+            for (; count < n->num_children; count++) {
+                bytes[count] = keys[count];
+                children[count] = slots[count];
+            }
+            break;
+        }
+        case ART_NODE48:
+            for (int b = 0; b < 256; b++) {
+                int slot = ((ArtNode48*)n)->index[b];
+                if (!slot) continue;
+                bytes[count] = b;
+                children[count++] = ((ArtNode48*)n)->children[slot - 1];
+            }
+            break;
+        default:
+            for (int b = 0; b < 256; b++) {
+                void *child = ((ArtNode256*)n)->children[b];
+                if (!child) continue;
+                bytes[count] = b;
+                children[count++] = child;
+            }
+            break;
+    }
+    return count;
+}
+
+static int type_for(int count) {
+    if (count <= 4) return ART_NODE4;
+    if (count <= 16) return ART_NODE16;
+    if (count <= 48) return ART_NODE48;
+    return ART_NODE256;
+}
+
+// A new node of the smallest type that holds count children, given in
+// byte order, with the prefix of like
+static ArtNode *build_node(const ArtNode *like, const unsigned char *bytes, void **children, int count) {
+    int type = type_for(count);
+    ArtNode *n = slab_alloc(type);
+    if (!n) return NULL;
+    n->num_children = count;
+    n->prefix_len = like->prefix_len;
+    memcpy(n->prefix, like->prefix, ART_MAX_PREFIX);
+
+    switch (type) {
+        case ART_NODE4:
+        case ART_NODE16: {
+            unsigned char *keys = type == ART_NODE4 ? ((ArtNode4*)n)->keys : ((ArtNode16*)n)->keys;
+            void **slots = type == ART_NODE4 ? ((ArtNode4*)n)->children : ((ArtNode16*)n)->children;
+            memcpy(keys, bytes, count);
+            memcpy(slots, children, count * sizeof(void*));
+            break;
+        }
+        case ART_NODE48: {
+            ArtNode48 *n48 = (ArtNode48*)n;
+            memset(n48->index, 0, sizeof(n48->index));
+            memset(n48->children, 0, sizeof(n48->children));
+            for (int i = 0; i < count; i++) {
+                n48->index[bytes[i]] = i + 1;
+                n48->children[i] = children[i];
+            }
+            break;
+        }
+        default: {
+            ArtNode256 *n256 = (ArtNode256*)n;
+            memset(n256->children, 0, sizeof(n256->children));
+            for (int i = 0; i < count; i++) {
+                n256->children[bytes[i]] = children[i];
+            }
+            break;
+        }
+    }
+    return n;
+}
+
+// Points *ref, a child slot of parent or the root, at child
+static void replace(ArtNode *parent, void **ref, void *child) {
+    if (parent) write_begin(parent);
+    store_child(ref, child);
+    if (parent) write_end(parent);
+}
+
+// Some leaf below n; all of them share n's full prefix
+static ArtLeaf *any_leaf(void *p) {
+    while (!is_leaf(p)) {
+        unsigned char bytes[256];
+        void *children[256];
+        node_children(p, bytes, children);
+        p = children[0];
+    }
+    return as_leaf(p);
+}
+
+static void set_prefix(ArtNode *n, const unsigned char *bytes, uint32_t len) {
+    n->prefix_len = len;
+    memcpy(n->prefix, bytes, len < ART_MAX_PREFIX ? len : ART_MAX_PREFIX);
+}
+
+// ===== LOOKUP =====
+
+int art_lookup(ArtTree *tree, const char *key) {
+    const unsigned char *k = (const unsigned char*)key;
+    uint32_t len = strlen(key) + 1;
+
+restart:;
+    void *p = load_child(&tree->root);
+    if (!p) return -1;
+    ArtNode *node = NULL;
+    uint64_t version = 0;
+    uint32_t depth = 0;
+
+    while (1) {
+        if (is_leaf(p)) {
+            ArtLeaf *leaf = as_leaf(p);
+            uint64_t leaf_version = read_begin(leaf);
+            if ((leaf_version & 1) || (node && !read_valid(node, version))) goto restart;
+            int match = leaf->key_len == len && memcmp(leaf->key, k, len) == 0;
+            int value = leaf->value;
+            if (!read_valid(leaf, leaf_version)) goto restart;
+            return match ? value : -1;
+        }
+
+        ArtNode *child = p;
+        uint64_t child_version = read_begin(child);
+        if ((child_version & 1) || (node && !read_valid(node, version))) goto restart;
+        node = child;
+        version = child_version;
+
+        uint32_t stored = node->prefix_len < ART_MAX_PREFIX ? node->prefix_len : ART_MAX_PREFIX;
+        int mismatch = 0;
+        for (uint32_t i = 0; i < stored && !mismatch; i++) {
+            mismatch = depth + i >= len || node->prefix[i] != k[depth + i];
+        }
+        depth += node->prefix_len;
+        if (mismatch || depth >= len) {
+            if (!read_valid(node, version)) goto restart;
+            return -1;
+        }
+
+        void **slot = child_slot(node, k[depth]);
+        p = slot ? load_child(slot) : NULL;
+        if (!p) {
+            if (!read_valid(node, version)) goto restart;
+            return -1;
+        }
+        depth++;
+    }
+}
+
+// ===== INSERT =====
+
+static ArtLeaf *new_leaf(const unsigned char *key, uint32_t len, int value) {
+    ArtLeaf *leaf = slab_alloc(ART_LEAF);
+    if (!leaf) return NULL;
+    leaf->value = value;
+    leaf->key_len = len;
+    memcpy(leaf->key, key, len);
+    return leaf;
+}
+
+// Length of the part of n's prefix that key matches from depth
+static uint32_t prefix_match(ArtNode *n, const unsigned char *key, uint32_t len, uint32_t depth) {
+    const unsigned char *full = n->prefix;
+    if (n->prefix_len > ART_MAX_PREFIX) full = any_leaf(n)->key + depth;
+    uint32_t i = 0;
+    while (i < n->prefix_len && depth + i < len && full[i] == key[depth + i]) i++;
+    return i;
+}
+
+// Adds a child under byte, replacing the node with a larger one if full
+static int add_child(ArtNode *parent, void **ref, ArtNode *n, unsigned char byte, void *child) {
+    if (n->num_children < node_capacity[n->type]) {
+        write_begin(n);
+        if (n->type == ART_NODE4 || n->type == ART_NODE16) {
+            unsigned char *keys = n->type == ART_NODE4 ? ((ArtNode4*)n)->keys : ((ArtNode16*)n)->keys;
+            void **slots = n->type == ART_NODE4 ? ((ArtNode4*)n)->children : ((ArtNode16*)n)->children;
+            int pos = 0;
+            while (pos < n->num_children && keys[pos] < byte) pos++;
+            memmove(keys + pos + 1, keys + pos, n->num_children - pos);
+            memmove(slots + pos + 1, slots + pos, (n->num_children - pos) * sizeof(void*));
+            keys[pos] = byte;
+            slots[pos] = child;
+        } else if (n->type == ART_NODE48) {
+            ArtNode48 *n48 = (ArtNode48*)n;
+            int slot = 0;
+            while (n48->children[slot]) slot++;
+            n48->children[slot] = child;
+            n48->index[byte] = slot + 1;
+        } else {
+            ((ArtNode256*)n)->children[byte] = child;
+        }
+        n->num_children++;
+        write_end(n);
+        return 0;
+    }
+
+    unsigned char bytes[257];
+    void *children[257];
+    int count = node_children(n, bytes, children);
+    int pos = 0;
+    while (pos < count && bytes[pos] < byte) pos++;
+    memmove(bytes + pos + 1, bytes + pos, count - pos);
+    memmove(children + pos + 1, children + pos, (count - pos) * sizeof(void*));
+    bytes[pos] = byte;
+    children[pos] = child;
+
+    ArtNode *grown = build_node(n, bytes, children, count + 1);
+    if (!grown) return -1;
+    replace(parent, ref, grown);
+    slab_free(n, n->type);
+    return 0;
+}
+
+static int insert(ArtNode *parent, void **ref, const unsigned char *key, uint32_t len, uint32_t depth,
+                  int value) {
+    void *p = *ref;
+    if (!p) {
+        ArtLeaf *leaf = new_leaf(key, len, value);
+        if (!leaf) return -1;
+        replace(parent, ref, tag_leaf(leaf));
+        return 0;
+    }
+
+    if (is_leaf(p)) {
+        ArtLeaf *existing = as_leaf(p);
+        if (existing->key_len == len && memcmp(existing->key, key, len) == 0) {
+            write_begin(existing);
+            existing->value = value;
+            write_end(existing);
+            return 0;
+        }
+
+        // Split into a node holding both leaves below their common prefix
+        uint32_t common = 0;
+        while (existing->key[depth + common] == key[depth + common]) common++;
+        ArtLeaf *leaf = new_leaf(key, len, value);
+        ArtNode header = {0};
+        set_prefix(&header, key + depth, common);
+        unsigned char bytes[2] = {existing->key[depth + common], key[depth + common]};
+        void *children[2] = {p, leaf ? tag_leaf(leaf) : NULL};
+        if (bytes[1] < bytes[0]) {
+            bytes[0] = key[depth + common];
+            bytes[1] = existing->key[depth + common];
+            children[0] = children[1];
+            children[1] = p;
+        }
+        ArtNode *n = leaf ? build_node(&header, bytes, children, 2) : NULL;
+        if (!n) {
+            if (leaf) slab_free(leaf, ART_LEAF);
+            return -1;
+        }
+        replace(parent, ref, n);
+        return 0;
+    }
+
+    ArtNode *n = p;
+    uint32_t matched = prefix_match(n, key, len, depth);
+    if (matched < n->prefix_len) {
+        // Key leaves the prefix early: put a new node above n at that point
+        unsigned char rest[MAX_FILENAME];
+        const unsigned char *full = n->prefix_len > ART_MAX_PREFIX ? any_leaf(n)->key + depth : n->prefix;
+        uint32_t rest_len = n->prefix_len - matched - 1;
+        unsigned char n_byte = full[matched];
+        memcpy(rest, full + matched + 1, rest_len < ART_MAX_PREFIX ? rest_len : ART_MAX_PREFIX);
+
+        ArtLeaf *leaf = new_leaf(key, len, value);
+        ArtNode header = {0};
+        set_prefix(&header, key + depth, matched);
+        unsigned char bytes[2] = {n_byte, key[depth + matched]};
+        void *children[2] = {n, leaf ? tag_leaf(leaf) : NULL};
+        if (bytes[1] < bytes[0]) {
+            bytes[0] = key[depth + matched];
+            bytes[1] = n_byte;
+            children[0] = children[1];
+            children[1] = n;
+        }
+        ArtNode *above = leaf ? build_node(&header, bytes, children, 2) : NULL;
+        if (!above) {
+            if (leaf) slab_free(leaf, ART_LEAF);
+            return -1;
+        }
+
+        // Readers must not see n under its new parent with the old prefix
+        write_begin(n);
+        replace(parent, ref, above);
+        set_prefix(n, rest, rest_len);
+        write_end(n);
+        return 0;
+    }
+
+    depth += n->prefix_len;
+    void **slot = child_slot(n, key[depth]);
+    if (slot && *slot) return insert(n, slot, key, len, depth + 1, value);
+
+    ArtLeaf *leaf = new_leaf(key, len, value);
+    if (!leaf) return -1;
+    if (add_child(parent, ref, n, key[depth], tag_leaf(leaf)) < 0) {
+        slab_free(leaf, ART_LEAF);
+        return -1;
+    }
+    return 0;
+}
+
+// ===== REMOVE =====
+
+// Removes the child under byte, shrinking the node or, when a single
+// child would be left, splicing that child into the node's place
+static int remove_child(ArtNode *parent, void **ref, ArtNode *n, unsigned char byte) {
+    unsigned char bytes[256];
+    void *children[256];
+    int count = node_children(n, bytes, children);
+    int pos = 0;
+    while (bytes[pos] != byte) pos++;
+    memmove(bytes + pos, bytes + pos + 1, count - pos - 1);
+    memmove(children + pos, children + pos + 1, (count - pos - 1) * sizeof(void*));
+    count--;
+
+    if (count == 1) {
+        void *only = children[0];
+        if (is_leaf(only)) {
+            replace(parent, ref, only);
+            slab_free(n, n->type);
+            return 0;
+        }
+
+        // The child takes over n's prefix and the byte that led to it
+        ArtNode *child = only;
+        unsigned char merged[ART_MAX_PREFIX];
+        uint32_t have = n->prefix_len < ART_MAX_PREFIX ? n->prefix_len : ART_MAX_PREFIX;
+        memcpy(merged, n->prefix, have);
+        if (have < ART_MAX_PREFIX) merged[have++] = bytes[0];
+        uint32_t child_stored = child->prefix_len < ART_MAX_PREFIX ? child->prefix_len : ART_MAX_PREFIX;
+        for (uint32_t i = 0; i < child_stored && have < ART_MAX_PREFIX; i++) {
+            merged[have++] = child->prefix[i];
+        }
+
+        uint32_t merged_len = n->prefix_len + 1 + child->prefix_len;
+        write_begin(child);
+        replace(parent, ref, child);
+        slab_free(n, n->type);
+        memcpy(child->prefix, merged, have);
+        child->prefix_len = merged_len;
+        write_end(child);
+        return 0;
+    }
+
+    // Shrink with some slack, so a node at the boundary does not flap
+    static const int shrink_at[4] = {0, 3, 12, 37};
+    if (count <= shrink_at[n->type]) {
+        ArtNode *smaller = build_node(n, bytes, children, count);
+        if (!smaller) return -1;
+        replace(parent, ref, smaller);
+        slab_free(n, n->type);
+        return 0;
+    }
+
+    write_begin(n);
+    if (n->type == ART_NODE4 || n->type == ART_NODE16) {
+        unsigned char *keys = n->type == ART_NODE4 ? ((ArtNode4*)n)->keys : ((ArtNode16*)n)->keys;
+        void **slots = n->type == ART_NODE4 ? ((ArtNode4*)n)->children : ((ArtNode16*)n)->children;
+        memcpy(keys, bytes, count);
+        memcpy(slots, children, count * sizeof(void*));
+    } else if (n->type == ART_NODE48) {
+        ArtNode48 *n48 = (ArtNode48*)n;
+        n48->children[n48->index[byte] - 1] = NULL;
+        n48->index[byte] = 0;
+    } else {
+        ((ArtNode256*)n)->children[byte] = NULL;
+    }
+    n->num_children = count;
+    write_end(n);
+    return 0;
+}
+
+static int remove_key(ArtNode *parent, void **ref, const unsigned char *key, uint32_t len, uint32_t depth) {
+    ArtNode *n = *ref;
+    if (prefix_match(n, key, len, depth) < n->prefix_len) return 0;
+    depth += n->prefix_len;
+    if (depth >= len) return 0;
+
+    void **slot = child_slot(n, key[depth]);
+    if (!slot || !*slot) return 0;
+    if (!is_leaf(*slot)) return remove_key(n, slot, key, len, depth + 1);
+
+    ArtLeaf *leaf = as_leaf(*slot);
+    if (leaf->key_len != len || memcmp(leaf->key, key, len) != 0) return 0;
+    if (remove_child(parent, ref, n, key[depth]) < 0) return 0;
+    slab_free(leaf, ART_LEAF);
+    return 1;
+}
+
+// ===== SCAN =====
+
+// Child at the lowest byte >= *byte, which is set to that byte; NULL if
+// there is none. Writers only.
+static void *next_child(ArtNode *n, int *byte) {
+    switch (n->type) {
+        case ART_NODE4:
+        case ART_NODE16: {
+            unsigned char *keys = n->type == ART_NODE4 ? ((ArtNode4*)n)->keys : ((ArtNode16*)n)->keys;
+            void **slots = n->type == ART_NODE4 ? ((ArtNode4*)n)->children : ((ArtNode16*)n)->children;
+            for (int i = 0; i < n->num_children; i++) {
+                if (keys[i] < *byte) continue;
+                *byte = keys[i];
+                return slots[i];
+            }
+            return NULL;
+        }
+        case ART_NODE48:
+            for (; *byte < 256; (*byte)++) {
+                int slot = ((ArtNode48*)n)->index[*byte];
+                if (slot) return ((ArtNode48*)n)->children[slot - 1];
+            }
+            return NULL;
+        default:
+            for (; *byte < 256; (*byte)++) {
+                void *child = ((ArtNode256*)n)->children[*byte];
+                if (child) return child;
+            }
+            return NULL;
+    }
+}
+
+// Visits the leaves below p in key order. While bounded, the path to p
+// matches the first depth bytes of after, and keys up to and including
+// after are skipped. Returns nonzero as soon as fn does.
+static int scan(void *p, uint32_t depth, const unsigned char *after, uint32_t after_len,
+                int bounded, ArtScanFn fn, void *arg) {
+    if (is_leaf(p)) {
+        ArtLeaf *leaf = as_leaf(p);
+        if (bounded && strcmp((char*)leaf->key, (const char*)after) <= 0) return 0;
+        return fn((char*)leaf->key, leaf->value, arg);
+    }
+
+    ArtNode *n = p;
+    if (bounded) {
+        // Only the first bytes of a long prefix are stored; a leaf has them all
+        ArtLeaf *leaf = any_leaf(n);
+        for (uint32_t i = 0; i < n->prefix_len && bounded; i++) {
+            if (depth + i >= after_len || leaf->key[depth + i] > after[depth + i]) {
+                bounded = 0;
+            } else if (leaf->key[depth + i] < after[depth + i]) {
+                return 0;
+            }
+        }
+    }
+    depth += n->prefix_len;
+
+    int byte = bounded && depth < after_len ? after[depth] : 0;
+    if (depth >= after_len) bounded = 0;
+    for (void *child; byte < 256 && (child = next_child(n, &byte)) != NULL; byte++) {
+        int stop = scan(child, depth + 1, after, after_len, bounded && byte == after[depth], fn, arg);
+        if (stop) return stop;
+    }
+    return 0;
+}
+
+// ===== API =====
+
+void art_init(ArtTree *tree) {
+    tree->root = NULL;
+    pthread_mutex_init(&tree->write_lock, NULL);
+}
+
+int art_insert(ArtTree *tree, const char *key, int value) {
+    size_t len = strlen(key) + 1;
+    if (len > MAX_FILENAME) return -1;
+    pthread_mutex_lock(&tree->write_lock);
+    int result = insert(NULL, &tree->root, (const unsigned char*)key, len, 0, value);
+    pthread_mutex_unlock(&tree->write_lock);
+    return result;
+}
+
+int art_remove(ArtTree *tree, const char *key) {
+    size_t len = strlen(key) + 1;
+    if (len > MAX_FILENAME) return 0;
+    int removed = 0;
+
+    pthread_mutex_lock(&tree->write_lock);
+    void *root = tree->root;
+    if (root && is_leaf(root)) {
+        ArtLeaf *leaf = as_leaf(root);
+        if (leaf->key_len == len && memcmp(leaf->key, key, len) == 0) {
+            store_child(&tree->root, NULL);
+            slab_free(leaf, ART_LEAF);
+            removed = 1;
+        }
+    } else if (root) {
+        removed = remove_key(NULL, &tree->root, (const unsigned char*)key, len, 0);
+    }
+    pthread_mutex_unlock(&tree->write_lock);
+    return removed;
+}
+
+void art_scan(ArtTree *tree, const char *after, ArtScanFn fn, void *arg) {
+    pthread_mutex_lock(&tree->write_lock);
+    if (tree->root) {
+        scan(tree->root, 0, (const unsigned char*)after, strlen(after) + 1, 1, fn, arg);
+    }
+    pthread_mutex_unlock(&tree->write_lock);
+}
@@ -0,0 +1,44 @@
+#ifndef ART_H
+#define ART_H
+
+#include "common.h"
+
+// Adaptive radix tree from filenames to small integer values.
+//
+// Inner nodes come in four sizes (4, 16, 48 and 256 children) and grow or
+// shrink as children come and go; runs of bytes shared by every key below
+// a node are stored once in the node as a prefix. Keys include their
+// terminating NUL, so no key is a prefix of another and every key ends at
+// a leaf.
+//
+// Lookups take no lock. Every node and leaf carries a version that a
+// writer makes odd while it changes the node, and readers restart if a
+// version they relied on moved. Writers are serialized by the tree's own
+// mutex. Nodes are never handed back to malloc but kept on per-size free
+// lists, so a reader that still holds a removed node reads memory of the
+// same shape and only ever restarts.
+
+typedef struct {
+    void *root; // Inner node, or a leaf pointer tagged in its low bit
+    pthread_mutex_t write_lock;
+} ArtTree;
+
+void art_init(ArtTree *tree);
+
+// Value stored for key, or -1
+int art_lookup(ArtTree *tree, const char *key);
+
+// Adds key or replaces its value. Returns -1 if key is too long or memory
+// ran out.
+int art_insert(ArtTree *tree, const char *key, int value);
+
+// Returns 1 if key was removed, 0 if it was not there
+int art_remove(ArtTree *tree, const char *key);
+
+// Calls fn with each key that sorts after `after` ("" for all of them) and
+// its value, in strcmp order, until fn returns nonzero. Writers wait for
+// the whole scan, and fn must not change the tree.
+typedef int (*ArtScanFn)(const char *key, int value, void *arg);
+void art_scan(ArtTree *tree, const char *after, ArtScanFn fn, void *arg);
+
+#endif
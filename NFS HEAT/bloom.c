@@ -0,0 +1,67 @@
+#include "bloom.h"
+
+#define BLOOM_HASHES 4
+#define BLOOM_COUNTERS_PER_KEY 8 // About 2.4% false positives with 4 hashes
+#define BLOOM_STUCK 255
+
+struct BloomFilter {
+    uint32_t mask;
+    uint8_t counters[];
+};
+
+// Two independent hashes; counter i is at h1 + i * h2
+static void bloom_hash(const char *key, uint32_t *h1, uint32_t *h2) {
+    uint64_t hash = 14695981039346656037ull;
+    for (; *key; key++) {
+        hash = (hash ^ (unsigned char)*key) * 1099511628211ull;
+    }
+    *h1 = (uint32_t)hash;
+    *h2 = (uint32_t)(hash >> 32) | 1;
+}
+
+BloomFilter *bloom_create(uint32_t keys) {
+    uint32_t size = 64;
+    while (size / BLOOM_COUNTERS_PER_KEY < keys && size < (1u << 31)) size <<= 1;
+
+    BloomFilter *b = calloc(1, sizeof(BloomFilter) + size);
+    if (!b) return NULL;
+    b->mask = size - 1;
+    return b;
+}
+
+void bloom_free(BloomFilter *b) {
+    free(b);
+}
+
+uint32_t bloom_capacity(const BloomFilter *b) {
+    return (b->mask + 1) / BLOOM_COUNTERS_PER_KEY;
+}
+
+void bloom_add(BloomFilter *b, const char *key) {
+    uint32_t h1, h2;
+    bloom_hash(key, &h1, &h2);
+    for (int i = 0; i < BLOOM_HASHES; i++) {
+        uint8_t *c = &b->counters[(h1 + i * h2) & b->mask];
+        uint8_t v = __atomic_load_n(c, __ATOMIC_RELAXED);
+        if (v < BLOOM_STUCK) __atomic_store_n(c, v + 1, __ATOMIC_RELAXED);
+    }
+}
+
+void bloom_remove(BloomFilter *b, const char *key) {
+    uint32_t h1, h2;
+    bloom_hash(key, &h1, &h2);
+    for (int i = 0; i < BLOOM_HASHES; i++) {
+        uint8_t *c = &b->counters[(h1 + i * h2) & b->mask];
+        uint8_t v = __atomic_load_n(c, __ATOMIC_RELAXED);
+        if (v > 0 && v < BLOOM_STUCK) __atomic_store_n(c, v - 1, __ATOMIC_RELAXED);
+    }
+}
+
+int bloom_may_contain(const BloomFilter *b, const char *key) {
+    uint32_t h1, h2;
+    bloom_hash(key, &h1, &h2);
+    for (int i = 0; i < BLOOM_HASHES; i++) {
+        if (__atomic_load_n(&b->counters[(h1 + i * h2) & b->mask], __ATOMIC_RELAXED) == 0) return 0;
+    }
+    return 1;
+}
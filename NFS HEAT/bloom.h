@@ -0,0 +1,30 @@
+#ifndef BLOOM_H
+#define BLOOM_H
+
+#include "common.h"
+
+// Counting Bloom filter over strings.
+//
+// Each key bumps a few byte-sized counters instead of setting bits, so keys
+// can be removed again. A key that was never added is usually reported
+// absent; a key that was added is always reported present. Counters that
+// reach their ceiling stay there, since they can no longer count down
+// safely. Lookups take no lock and may run alongside one writer; the
+// caller serializes changes.
+
+typedef struct BloomFilter BloomFilter;
+
+// Sized for about keys entries. Returns NULL if out of memory.
+BloomFilter *bloom_create(uint32_t keys);
+void bloom_free(BloomFilter *b);
+
+// Keys it was sized for; past this, false positives climb
+uint32_t bloom_capacity(const BloomFilter *b);
+
+void bloom_add(BloomFilter *b, const char *key);
+void bloom_remove(BloomFilter *b, const char *key);
+
+// 0 if key is certainly not in the filter
+int bloom_may_contain(const BloomFilter *b, const char *key);
+
+#endif
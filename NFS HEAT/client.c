@@ -1,178 +1,328 @@
-#include "common.h"
+#include "libdocs.h"
 
 char username[MAX_USERNAME];
 char nm_ip[INET_ADDRSTRLEN];
 int nm_port;
 
-int connect_to_nm() {
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in addr;
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(nm_port);
-    inet_pton(AF_INET, nm_ip, &addr.sin_addr);
-    
-    if (connect(sockfd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        perror("Failed to connect to Naming Server");
+DocsClient *docs;
+
+// Waits for an operation and moves its final reply into response. Returns
+// the operation's error code; an unreachable naming server is reported here.
+int wait_reply(DocsOp *op, Message *response) {
+    if (!op) {
+        init_message(response);
+        response->type = MSG_ERROR;
+        response->error_code = DOCS_ERR_NM_UNAVAILABLE;
+        printf("Failed to connect to Naming Server\n");
+        return DOCS_ERR_NM_UNAVAILABLE;
+    }
+    
+    int error = docs_wait(op);
+    *response = *docs_reply(op);
+    init_message(docs_reply(op));
+    docs_release(op);
+    
+    if (error == DOCS_ERR_NM_UNAVAILABLE) {
+        printf("Failed to connect to Naming Server\n");
+    }
+    return error;
+}
+
+int nm_call(Message *msg, Message *response) {
+    int error = wait_reply(docs_request(docs, msg), response);
+    return error == DOCS_ERR_NM_UNAVAILABLE ? -1 : 0;
+}
+
+// Sends msg to every naming server shard at once and collects one reply
+// per shard. Returns -1, with every reply freed, if a shard is unreachable.
+int nm_call_all(Message *msg, Message *replies) {
+    int shards = docs_num_shards(docs);
+    DocsOp *ops[shards];
+    for (int i = 0; i < shards; i++) {
+        ops[i] = docs_request_shard(docs, i, msg);
+    }
+    
+    int failed = 0;
+    for (int i = 0; i < shards; i++) {
+        if (wait_reply(ops[i], &replies[i]) == DOCS_ERR_NM_UNAVAILABLE) failed = 1;
+    }
+    if (failed) {
+        for (int i = 0; i < shards; i++) {
+            free_message(&replies[i]);
+        }
         return -1;
     }
-    return sockfd;
+    return 0;
 }
 
-void handle_view(int flags) {
-    int nm_sock = connect_to_nm();
-    if (nm_sock < 0) return;
-    
-    Message msg;
-    init_message(&msg);
-    msg.type = MSG_LIST_FILES;
-    strcpy(msg.username, username);
-    msg.flags = (flags & 1); // -a flag
-    
-    send_message(nm_sock, &msg);
-    
-    Message response;
-    receive_message(nm_sock, &response);
-    close(nm_sock);
+// One page of a MSG_LIST_FILES or MSG_SEARCH across every shard: each
+// shard's page after cursor, merged in name order and cut to one page.
+// A shard with more to give may be missing names past its own cursor, so
+// the page also stops at the smallest such cursor. Sets *names to the
+// newline-separated page (NULL if a shard refused) and advances cursor,
+// leaving it empty after the last page. Returns -1 if a shard is
+// unreachable.
+int gather_page(Message *msg, char *cursor, char **names) {
+    int shards = docs_num_shards(docs);
+    Message replies[shards];
+    *names = NULL;
+    strcpy(msg->filename, cursor);
+    if (nm_call_all(msg, replies) < 0) return -1;
+    
+    char *next[shards], *end[shards];
+    const char *bound = NULL;
+    int ok = 1;
+    for (int i = 0; i < shards; i++) {
+        ok &= replies[i].type == MSG_RESPONSE;
+        next[i] = message_data(&replies[i]);
+        end[i] = next[i] + strlen(next[i]);
+        for (char *p = next[i]; p < end[i]; p++) {
+            if (*p == '\n') *p = '\0';
+        }
+        if (replies[i].filename[0] && (!bound || strcmp(replies[i].filename, bound) < 0)) {
+            bound = replies[i].filename;
+        }
+    }
     
-    if (response.type == MSG_RESPONSE) {
+    size_t len = 0, cap = MAX_BUFFER;
+    char *out = ok ? malloc(cap) : NULL;
+    char last[MAX_FILENAME] = "";
+    int rows = 0;
+    while (out && rows < msg->sentence_num) {
+        int pick = -1;
+        for (int i = 0; i < shards; i++) {
+            if (next[i] < end[i] && (pick < 0 || strcmp(next[i], next[pick]) < 0)) pick = i;
+        }
+        if (pick < 0 || (bound && strcmp(next[pick], bound) > 0)) break;
+        
+        size_t n = strlen(next[pick]);
+        if (len + n + 2 > cap) {
+            cap = cap * 2 + n;
+            char *grown = realloc(out, cap);
+            if (!grown) break;
+            out = grown;
+        }
+        memcpy(out + len, next[pick], n);
+        len += n;
+        out[len++] = '\n';
+        snprintf(last, sizeof(last), "%s", next[pick]);
+        next[pick] += n + 1;
+        rows++;
+    }
+    
+    if (out) {
+        out[len] = '\0';
+        int more = bound != NULL;
+        for (int i = 0; i < shards; i++) {
+            if (next[i] < end[i]) more = 1;
+        }
+        strcpy(cursor, !more ? "" : rows == msg->sentence_num ? last : bound);
+    }
+    for (int i = 0; i < shards; i++) {
+        free_message(&replies[i]);
+    }
+    *names = out;
+    return 0;
+}
+
+// MSG_BATCH_INFO rows for a page of names, each asked of the shard that
+// owns it, put back in the order of names
+char *gather_batch_info(const char *names) {
+    int shards = docs_num_shards(docs);
+    char *lists[shards];
+    size_t lens[shards];
+    memset(lists, 0, sizeof(lists));
+    memset(lens, 0, sizeof(lens));
+    
+    char *copy = strdup(names);
+    char *copy_end = copy ? copy + strlen(copy) : NULL;
+    char *saveptr;
+    for (char *name = copy ? strtok_r(copy, "\n", &saveptr) : NULL; name; name = strtok_r(NULL, "\n", &saveptr)) {
+        int s = docs_shard_of(docs, name);
+        size_t n = strlen(name);
+        char *grown = realloc(lists[s], lens[s] + n + 2);
+        if (!grown) continue;
+        lists[s] = grown;
+        memcpy(lists[s] + lens[s], name, n);
+        lens[s] += n;
+        lists[s][lens[s]++] = '\n';
+        lists[s][lens[s]] = '\0';
+    }
+    
+    DocsOp *ops[shards];
+    for (int s = 0; s < shards; s++) {
+        ops[s] = NULL;
+        if (!lists[s]) continue;
+        Message msg;
+        init_message(&msg);
+        msg.type = MSG_BATCH_INFO;
+        strcpy(msg.username, username);
+        set_message_data(&msg, lists[s], lens[s]);
+        ops[s] = docs_request_shard(docs, s, &msg);
+        free_message(&msg);
+    }
+    
+    Message replies[shards];
+    char *rows[shards];
+    for (int s = 0; s < shards; s++) {
+        init_message(&replies[s]);
+        rows[s] = NULL;
+        if (lists[s] && wait_reply(ops[s], &replies[s]) == 0 && replies[s].type == MSG_RESPONSE) {
+            rows[s] = message_data(&replies[s]);
+        }
+        free(lists[s]);
+    }
+    
+    // Each shard answers one row per name, in the order it was asked
+    size_t len = 0, cap = MAX_BUFFER;
+    char *out = copy ? malloc(cap) : NULL;
+    if (out) out[0] = '\0';
+    for (const char *name = copy; out && name < copy_end; name += strlen(name) + 1) {
+        if (!*name) continue;
+        int s = docs_shard_of(docs, name);
+        if (!rows[s] || !*rows[s]) continue;
+        size_t n = strcspn(rows[s], "\n");
+        if (len + n + 2 > cap) {
+            cap = cap * 2 + n;
+            char *grown = realloc(out, cap);
+            if (!grown) break;
+            out = grown;
+        }
+        memcpy(out + len, rows[s], n);
+        len += n;
+        out[len++] = '\n';
+        out[len] = '\0';
+        rows[s] += n + (rows[s][n] == '\n');
+    }
+    for (int s = 0; s < shards; s++) {
+        free_message(&replies[s]);
+    }
+    free(copy);
+    return out;
+}
+
+// Prints one VIEW -l row per line of a MSG_BATCH_INFO reply
+void print_view_rows(char *batch) {
+    char *saveptr;
+    char *line = strtok_r(batch, "\n", &saveptr);
+    while (line) {
+        char *fields[7] = {0};
+        int n = 0;
+        for (char *p = line; p && n < 7; n++) {
+            fields[n] = p;
+            p = strchr(p, '\t');
+            if (p) *p++ = '\0';
+        }
+        
+        const char *owner = n > 1 && strcmp(fields[1], "-") != 0 ? fields[1] : "unknown";
+        long chars = n > 4 ? atol(fields[4]) : 0;
+        int words = n > 5 ? atoi(fields[5]) : 0;
+        time_t mtime = n > 6 ? (time_t)atol(fields[6]) : 0;
+        
+        char last_access[20] = "N/A";
+        if (mtime > 0) {
+            strftime(last_access, sizeof(last_access), "%Y-%m-%d %H:%M", localtime(&mtime));
+        }
+        
+        printf("| %-10s | %-5d | %-5ld | %-16s | %-5s |\n",
+               fields[0], words, chars, last_access, owner);
+        line = strtok_r(NULL, "\n", &saveptr);
+    }
+}
+
+// Flags: 1 for -a, 2 for -l, 4 for -o. Fetches the listing a page at a
+// time, so a large namespace streams out instead of being cut short.
+void handle_view(int flags) {
+    char cursor[MAX_FILENAME] = "";
+    int pages = 0;
+    
+    do {
+        Message msg;
+        init_message(&msg);
+        msg.type = MSG_LIST_FILES;
+        strcpy(msg.username, username);
+        msg.flags = ((flags & 1) ? LIST_ALL : 0) | ((flags & 4) ? LIST_OWNED : 0);
+        msg.sentence_num = LIST_DEFAULT_PAGE;
+        
+        char *temp_data;
+        if (gather_page(&msg, cursor, &temp_data) < 0 || !temp_data) break;
+        
         if (flags & 2) { // -l flag
-            printf("---------------------------------------------------------\n");
-            printf("|  Filename  | Words | Chars | Last Access Time | Owner |\n");
-            printf("|------------|-------|-------|------------------|-------|\n");
+            if (pages == 0) {
+                printf("---------------------------------------------------------\n");
+                printf("|  Filename  | Words | Chars | Last Access Time | Owner |\n");
+                printf("|------------|-------|-------|------------------|-------|\n");
+            }
             
-            char temp_data[MAX_BUFFER];
-            strcpy(temp_data, response.data);
-            char *line = strtok(temp_data, "\n");
-            while (line) {
-                // Get file owner from naming server
-                int nm_sock_owner = connect_to_nm();
-                char owner[MAX_USERNAME] = "unknown";
-                
-                if (nm_sock_owner >= 0) {
-                    Message owner_msg;
-                    init_message(&owner_msg);
-                    owner_msg.type = MSG_GET_OWNER;
-                    strcpy(owner_msg.filename, line);
-                    send_message(nm_sock_owner, &owner_msg);
-                    
-                    Message owner_resp;
-                    if (receive_message(nm_sock_owner, &owner_resp) == 0 && 
-                        owner_resp.type == MSG_RESPONSE && strlen(owner_resp.data) > 0) {
-                        strcpy(owner, owner_resp.data);
-                    }
-                    close(nm_sock_owner);
-                }
-                
-                // Get file info from storage server
-                int nm_sock2 = connect_to_nm();
-                int word_count = 0;
-                int char_count = 0;
-                char last_access[20] = "N/A";
-                
-                if (nm_sock2 >= 0) {
-                    Message info_msg;
-                    init_message(&info_msg);
-                    info_msg.type = MSG_READ_FILE;
-                    strcpy(info_msg.filename, line);
-                    strcpy(info_msg.username, username);
-                    
-                    send_message(nm_sock2, &info_msg);
-                    
-                    Message info_resp;
-                    receive_message(nm_sock2, &info_resp);
-                    close(nm_sock2);
-                    
-                    if (info_resp.type == MSG_RESPONSE) {
-                        // Connect to SS to get file info
-                        int ss_sock = socket(AF_INET, SOCK_STREAM, 0);
-                        struct sockaddr_in ss_addr;
-                        ss_addr.sin_family = AF_INET;
-                        ss_addr.sin_port = htons(info_resp.ss_port);
-                        inet_pton(AF_INET, info_resp.ss_ip, &ss_addr.sin_addr);
-                        
-                        if (connect(ss_sock, (struct sockaddr*)&ss_addr, sizeof(ss_addr)) == 0) {
-                            init_message(&info_msg);
-                            info_msg.type = MSG_INFO_FILE;
-                            strcpy(info_msg.filename, line);
-                            send_message(ss_sock, &info_msg);
-                            
-                            Message file_info;
-                            if (receive_message(ss_sock, &file_info) == 0 && file_info.type == MSG_RESPONSE) {
-                                // Parse the info response to get word count, char count, and last modified time
-                                char *words_str = strstr(file_info.data, "Words: ");
-                                char *chars_str = strstr(file_info.data, "Chars: ");
-                                char *modified_str = strstr(file_info.data, "Modified: ");
-                                
-                                if (words_str) {
-                                    sscanf(words_str, "Words: %d", &word_count);
-                                }
-                                if (chars_str) {
-                                    sscanf(chars_str, "Chars: %d", &char_count);
-                                }
-                                if (modified_str) {
-                                    // Extract timestamp - format from ctime: "Dow Mon DD HH:MM:SS YYYY\n"
-                                    // Example: "Tue Nov 19 01:23:45 2024\n"
-                                    char dow[4], mon[4], day[3], time_str[9], year[5];
-                                    if (sscanf(modified_str, "Modified: %3s %3s %2s %8s %4s", 
-                                               dow, mon, day, time_str, year) == 5) {
-                                        // Convert month name to number
-                                        const char *months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
-                                                               "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
-                                        int mon_num = 1;
-                                        for (int i = 0; i < 12; i++) {
-                                            if (strcmp(mon, months[i]) == 0) {
-                                                mon_num = i + 1;
-                                                break;
-                                            }
-                                        }
-                                        
-                                        // Extract hour and minute
-                                        char hour[3], min[3];
-                                        sscanf(time_str, "%2s:%2s", hour, min);
-                                        
-                                        // Format as "YYYY-MM-DD HH:MM"
-                                        snprintf(last_access, sizeof(last_access), "%s-%02d-%s %s:%s", 
-                                                year, mon_num, day, hour, min);
-                                    }
-                                }
-                            }
-                            close(ss_sock);
-                        }
-                    }
-                }
-                
-                printf("| %-10s | %-5d | %-5d | %-16s | %-5s |\n",
-                       line, word_count, char_count, last_access, owner);
-                line = strtok(NULL, "\n");
+            // Owner, location and stats for the whole page in one round trip
+            // per shard
+            if (temp_data[0]) {
+                char *batch = gather_batch_info(temp_data);
+                if (batch) print_view_rows(batch);
+                free(batch);
             }
-            printf("---------------------------------------------------------\n");
         } else {
-            printf("Files:\n");
-            char temp_data[MAX_BUFFER];
-            strcpy(temp_data, response.data);
+            if (pages == 0) printf("Files:\n");
             char *line = strtok(temp_data, "\n");
             while (line) {
                 printf("--> %s\n", line);
                 line = strtok(NULL, "\n");
             }
         }
+        free(temp_data);
+        pages++;
+    } while (cursor[0]);
+    
+    if ((flags & 2) && pages > 0) {
+        printf("---------------------------------------------------------\n");
     }
 }
 
-void handle_read(const char *filename) {
-    int nm_sock = connect_to_nm();
-    if (nm_sock < 0) return;
-    
-    Message msg;
-    init_message(&msg);
-    msg.type = MSG_READ_FILE;
-    strcpy(msg.filename, filename);
-    strcpy(msg.username, username);
-    
-    send_message(nm_sock, &msg);
+// Prints every name matching pattern, fetched a page at a time
+void handle_search(int flags, int mode, const char *pattern) {
+    char cursor[MAX_FILENAME] = "";
+    int matches = 0;
+    
+    do {
+        Message msg;
+        init_message(&msg);
+        msg.type = MSG_SEARCH;
+        strcpy(msg.username, username);
+        set_message_data(&msg, pattern, strlen(pattern));
+        msg.flags = (flags & 1) ? LIST_ALL : 0;
+        msg.word_index = mode;
+        msg.sentence_num = LIST_DEFAULT_PAGE;
+        
+        char *names;
+        int sent = gather_page(&msg, cursor, &names);
+        free_message(&msg);
+        if (sent < 0) return;
+        if (!names) {
+            printf("Error: Search failed\n");
+            return;
+        }
+        
+        char *saveptr;
+        char *line = strtok_r(names, "\n", &saveptr);
+        while (line) {
+            printf("--> %s\n", line);
+            matches++;
+            line = strtok_r(NULL, "\n", &saveptr);
+        }
+        free(names);
+    } while (cursor[0]);
     
+    printf("%d match%s\n", matches, matches == 1 ? "" : "es");
+}
+
+void handle_read(const char *filename) {
     Message response;
-    receive_message(nm_sock, &response);
+    int error = wait_reply(docs_read(docs, filename), &response);
+    if (error == DOCS_ERR_NM_UNAVAILABLE) return;
+    if (error == ERR_SS_UNAVAILABLE) {
+        printf("Error: Storage Server unavailable\n");
+        return;
+    }
     
     if (response.type == MSG_ERROR) {
         printf("Error: ");
@@ -184,54 +334,21 @@ void handle_read(const char *filename) {
                 printf("Access denied\n");
                 break;
             default:
-                printf("Unknown error\n");
+                printf("%s\n", response.data[0] ? response.data : "Unknown error");
         }
-        close(nm_sock);
-        return;
-    }
-    
-    // Connect to SS
-    close(nm_sock);
-    
-    int ss_sock = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in ss_addr;
-    ss_addr.sin_family = AF_INET;
-    ss_addr.sin_port = htons(response.ss_port);
-    inet_pton(AF_INET, response.ss_ip, &ss_addr.sin_addr);
-    
-    if (connect(ss_sock, (struct sockaddr*)&ss_addr, sizeof(ss_addr)) < 0) {
-        printf("Error: Storage Server unavailable\n");
         return;
     }
     
-    init_message(&msg);
-    msg.type = MSG_READ_FILE;
-    strcpy(msg.filename, filename);
-    send_message(ss_sock, &msg);
-    
-    receive_message(ss_sock, &response);
-    close(ss_sock);
-    
     if (response.type == MSG_RESPONSE) {
-        printf("%s\n", response.data);
+        fwrite(message_data(&response), 1, message_data_len(&response), stdout);
+        printf("\n");
     }
+    free_message(&response);
 }
 
 void handle_create(const char *filename) {
-    int nm_sock = connect_to_nm();
-    if (nm_sock < 0) return;
-    
-    Message msg;
-    init_message(&msg);
-    msg.type = MSG_CREATE_FILE;
-    strcpy(msg.filename, filename);
-    strcpy(msg.username, username);
-    
-    send_message(nm_sock, &msg);
-    
     Message response;
-    receive_message(nm_sock, &response);
-    close(nm_sock);
+    if (wait_reply(docs_create(docs, filename), &response) == DOCS_ERR_NM_UNAVAILABLE) return;
     
     if (response.type == MSG_ACK) {
         printf("File Created Successfully!\n");
@@ -241,23 +358,29 @@ void handle_create(const char *filename) {
 }
 
 void handle_write(const char *filename, int sentence_num) {
-    int nm_sock = connect_to_nm();
-    if (nm_sock < 0) return;
-    
-    Message msg;
-    init_message(&msg);
-    msg.type = MSG_WRITE_FILE;
-    strcpy(msg.filename, filename);
-    strcpy(msg.username, username);
-    msg.sentence_num = sentence_num;
-    
-    send_message(nm_sock, &msg);
-    
-    Message response;
-    receive_message(nm_sock, &response);
+    // Take the write lock first; the commands are typed while it is held
+    DocsOp *op = docs_write_lock(docs, filename, sentence_num);
+    if (!op) {
+        printf("Error: Storage Server unavailable\n");
+        return;
+    }
     
-    if (response.type == MSG_ERROR) {
+    int error = docs_wait(op);
+    if (error != ERR_SUCCESS) {
+        Message response;
+        wait_reply(op, &response);
+        if (error == DOCS_ERR_NM_UNAVAILABLE) return;
+        if (error == ERR_SS_UNAVAILABLE) {
+            printf("Error: Storage Server unavailable\n");
+            return;
+        }
+        
+        // The storage server explains its refusals; the naming server's are codes
         printf("Error: ");
+        if (response.data[0]) {
+            printf("%s\n", response.data);
+            return;
+        }
         switch (response.error_code) {
             case ERR_FILE_NOT_FOUND:
                 printf("File not found\n");
@@ -269,73 +392,47 @@ void handle_write(const char *filename, int sentence_num) {
                 printf("File is currently being accessed by another user\n");
                 break;
             default:
-                printf("%s\n", response.data);
+                printf("\n");
         }
-        close(nm_sock);
         return;
     }
     
-    close(nm_sock);
-    
-    // Connect to SS and acquire lock FIRST
-    int ss_sock = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in ss_addr;
-    ss_addr.sin_family = AF_INET;
-    ss_addr.sin_port = htons(response.ss_port);
-    inet_pton(AF_INET, response.ss_ip, &ss_addr.sin_addr);
-    
-    if (connect(ss_sock, (struct sockaddr*)&ss_addr, sizeof(ss_addr)) < 0) {
-        printf("Error: Storage Server unavailable\n");
-        return;
-    }
-    
-    // Send initial WRITE request to acquire lock
-    init_message(&msg);
-    msg.type = MSG_WRITE_FILE;
-    strcpy(msg.filename, filename);
-    msg.sentence_num = sentence_num;
-    strcpy(msg.data, ""); // Empty data to signal lock acquisition
-    
-    send_message(ss_sock, &msg);
-    
-    // Wait for lock acknowledgment
-    Message lock_response;
-    receive_message(ss_sock, &lock_response);
-    
-    if (lock_response.type == MSG_ERROR) {
-        printf("Error: %s\n", lock_response.data);
-        close(ss_sock);
-        return;
-    }
-    
-    // Lock acquired! Now prompt user for commands
-    char write_data[MAX_BUFFER] = "";
+    // Lock acquired! Now prompt user for commands; they may run past
+    // MAX_BUFFER, so collect them on the heap
+    size_t len = 0, cap = MAX_BUFFER;
+    char *write_data = malloc(cap);
     char line[MAX_SENTENCE_LEN];
+    if (write_data) write_data[0] = '\0';
     
     printf("Enter write commands (end with ETIRW):\n");
-    while (1) {
+    while (write_data) {
         if (!fgets(line, sizeof(line), stdin)) break;
         line[strcspn(line, "\n")] = 0;
         
-        if (strcmp(line, "ETIRW") == 0) {
-            strcat(write_data, "ETIRW\n");
-            break;
+        int done = strcmp(line, "ETIRW") == 0;
+        size_t n = strlen(line);
+        if (len + n + 2 > cap) {
+            cap = cap * 2 + n;
+            char *grown = realloc(write_data, cap);
+            if (!grown) {
+                free(write_data);
+                write_data = NULL;
+                break;
+            }
+            write_data = grown;
         }
-        
-        strcat(write_data, line);
-        strcat(write_data, "\n");
+        memcpy(write_data + len, line, n);
+        len += n;
+        strcpy(write_data + len++, "\n");
+        if (done) break;
     }
     
-    // Send the actual write data
-    init_message(&msg);
-    msg.type = MSG_WRITE_FILE;
-    strcpy(msg.filename, filename);
-    msg.sentence_num = sentence_num;
-    strcpy(msg.data, write_data);
-    
-    send_message(ss_sock, &msg);
-    receive_message(ss_sock, &response);
-    close(ss_sock);
+    // Send the actual write data on the locked connection; an empty
+    // commit still releases the lock
+    Message response;
+    docs_write_commit(op, write_data ? write_data : "ETIRW\n");
+    free(write_data);
+    wait_reply(op, &response);
     
     if (response.type == MSG_ACK) {
         printf("Write Successful!\n");
@@ -345,20 +442,8 @@ void handle_write(const char *filename, int sentence_num) {
 }
 
 void handle_delete(const char *filename) {
-    int nm_sock = connect_to_nm();
-    if (nm_sock < 0) return;
-    
-    Message msg;
-    init_message(&msg);
-    msg.type = MSG_DELETE_FILE;
-    strcpy(msg.filename, filename);
-    strcpy(msg.username, username);
-    
-    send_message(nm_sock, &msg);
-    
     Message response;
-    receive_message(nm_sock, &response);
-    close(nm_sock);
+    if (wait_reply(docs_delete(docs, filename), &response) == DOCS_ERR_NM_UNAVAILABLE) return;
     
     if (response.type == MSG_ACK) {
         printf("File '%s' deleted successfully!\n", filename);
@@ -367,108 +452,42 @@ void handle_delete(const char *filename) {
     }
 }
 
-void handle_stream(const char *filename) {
-    int nm_sock = connect_to_nm();
-    if (nm_sock < 0) return;
-    
-    Message msg;
-    init_message(&msg);
-    msg.type = MSG_STREAM_FILE;
-    strcpy(msg.filename, filename);
-    strcpy(msg.username, username);
-    
-    send_message(nm_sock, &msg);
-    
+// Renders chunks as they arrive; the library hands back credit as they are
+// consumed, so the server never runs more than a window ahead of the display
+void print_stream_chunk(DocsOp *op, const char *words, int first_word, void *arg) {
+    (void)op;
+    (void)first_word;
+    *(int*)arg = 1;
+    printf("%s ", words);
+    fflush(stdout);
+}
+
+void handle_stream(const char *filename, int start_word) {
+    int started = 0;
     Message response;
-    receive_message(nm_sock, &response);
-    
-    if (response.type == MSG_ERROR) {
-        printf("Error: Cannot stream file\n");
-        close(nm_sock);
-        return;
-    }
-    
-    close(nm_sock);
-    
-    // Connect to SS
-    int ss_sock = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in ss_addr;
-    ss_addr.sin_family = AF_INET;
-    ss_addr.sin_port = htons(response.ss_port);
-    inet_pton(AF_INET, response.ss_ip, &ss_addr.sin_addr);
-    
-    if (connect(ss_sock, (struct sockaddr*)&ss_addr, sizeof(ss_addr)) < 0) {
-        printf("Error: Storage Server unavailable\n");
-        return;
-    }
-    
-    init_message(&msg);
-    msg.type = MSG_STREAM_FILE;
-    strcpy(msg.filename, filename);
-    send_message(ss_sock, &msg);
-    
-    // Receive and display words
-    while (1) {
-        if (receive_message(ss_sock, &response) < 0) {
-            printf("\nError: Storage Server disconnected\n");
-            break;
-        }
-        
-        if (response.type == MSG_ACK && strcmp(response.data, "STOP") == 0) {
-            printf("\n");
-            break;
-        }
-        
-        printf("%s ", response.data);
-        fflush(stdout);
+    int error = wait_reply(docs_stream(docs, filename, start_word, print_stream_chunk, &started),
+                           &response);
+    if (error == DOCS_ERR_NM_UNAVAILABLE) return;
+    
+    if (error == ERR_SS_UNAVAILABLE) {
+        if (started) printf("\nError: Storage Server disconnected\n");
+        else printf("Error: Storage Server unavailable\n");
+    } else if (response.type == MSG_ERROR) {
+        printf("Error: %s\n", response.data[0] ? response.data : "Cannot stream file");
+    } else {
+        printf("\n");
     }
-    
-    close(ss_sock);
 }
 
 void handle_info(const char *filename) {
-    int nm_sock = connect_to_nm();
-    if (nm_sock < 0) return;
-    
-    Message msg;
-    init_message(&msg);
-    msg.type = MSG_READ_FILE; // Get SS info first
-    strcpy(msg.filename, filename);
-    strcpy(msg.username, username);
-    
-    send_message(nm_sock, &msg);
-    
     Message response;
-    receive_message(nm_sock, &response);
-    
-    if (response.type == MSG_ERROR) {
-        printf("Error: Cannot get file info\n");
-        close(nm_sock);
-        return;
-    }
-    
-    close(nm_sock);
-    
-    // Connect to SS for file info
-    int ss_sock = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in ss_addr;
-    ss_addr.sin_family = AF_INET;
-    ss_addr.sin_port = htons(response.ss_port);
-    inet_pton(AF_INET, response.ss_ip, &ss_addr.sin_addr);
-    
-    if (connect(ss_sock, (struct sockaddr*)&ss_addr, sizeof(ss_addr)) < 0) {
+    int error = wait_reply(docs_info(docs, filename), &response);
+    if (error == DOCS_ERR_NM_UNAVAILABLE) return;
+    if (error == ERR_SS_UNAVAILABLE) {
         printf("Error: Storage Server unavailable\n");
         return;
     }
     
-    init_message(&msg);
-    msg.type = MSG_INFO_FILE;
-    strcpy(msg.filename, filename);
-    send_message(ss_sock, &msg);
-    
-    receive_message(ss_sock, &response);
-    close(ss_sock);
-    
     if (response.type == MSG_RESPONSE) {
         printf("--> File: %s\n", filename);
         printf("--> Owner: %s\n", username);
@@ -479,84 +498,101 @@ void handle_info(const char *filename) {
 }
 
 void handle_list_users() {
-    int nm_sock = connect_to_nm();
-    if (nm_sock < 0) return;
-    
     Message msg;
     init_message(&msg);
     msg.type = MSG_LIST_USERS;
     strcpy(msg.username, username);
     
-    send_message(nm_sock, &msg);
-    
-    Message response;
-    receive_message(nm_sock, &response);
-    close(nm_sock);
-    
-    if (response.type == MSG_RESPONSE) {
-        printf("Users:\n");
-        char *line = strtok(response.data, "\n");
-        while (line) {
+    // Each shard knows the users of its own files; print each name once
+    int shards = docs_num_shards(docs);
+    Message replies[shards];
+    if (nm_call_all(&msg, replies) < 0) return;
+    
+    char (*listed)[MAX_USERNAME] = calloc(shards * MAX_CLIENTS, MAX_USERNAME);
+    int num_listed = 0;
+    printf("Users:\n");
+    for (int i = 0; i < shards; i++) {
+        char *saveptr;
+        char *line = replies[i].type == MSG_RESPONSE ? strtok_r(replies[i].data, "\n", &saveptr) : NULL;
+        for (; line; line = strtok_r(NULL, "\n", &saveptr)) {
+            int seen = 0;
+            for (int j = 0; listed && j < num_listed && !seen; j++) {
+                seen = strcmp(listed[j], line) == 0;
+            }
+            if (seen) continue;
             printf("--> %s\n", line);
-            line = strtok(NULL, "\n");
+            if (listed && num_listed < shards * MAX_CLIENTS) {
+                snprintf(listed[num_listed++], MAX_USERNAME, "%s", line);
+            }
         }
+        free_message(&replies[i]);
     }
+    free(listed);
 }
 
-void handle_undo(const char *filename) {
-    int nm_sock = connect_to_nm();
-    if (nm_sock < 0) return;
-    
+void handle_cache_stats() {
     Message msg;
     init_message(&msg);
-    msg.type = MSG_READ_FILE; // Get SS info first
-    strcpy(msg.filename, filename);
+    msg.type = MSG_CACHE_STATS;
     strcpy(msg.username, username);
     
-    send_message(nm_sock, &msg);
-    
-    Message response;
-    receive_message(nm_sock, &response);
-    
-    if (response.type == MSG_ERROR) {
-        printf("Error: Cannot access file\n");
-        close(nm_sock);
-        return;
+    // A table per naming server shard, one hit rate over all of them
+    int shards = docs_num_shards(docs);
+    Message replies[shards];
+    if (nm_call_all(&msg, replies) < 0) return;
+    
+    unsigned long total_hits = 0, total_misses = 0;
+    for (int i = 0; i < shards; i++) {
+        if (shards > 1) printf("Naming server shard %d:\n", i);
+        if (replies[i].type != MSG_RESPONSE) {
+            printf("Error: %s\n", replies[i].data);
+            free_message(&replies[i]);
+            continue;
+        }
+        
+        printf("%-6s %8s %8s %10s %10s %10s %10s\n", "Shard", "Entries", "Capacity",
+               "Hits", "Misses", "Evictions", "Rejected");
+        char *saveptr;
+        char *line = strtok_r(replies[i].data, "\n", &saveptr);
+        while (line) {
+            int shard, entries, capacity;
+            unsigned long hits, misses, evictions, rejections;
+            if (sscanf(line, "%d\t%d\t%d\t%lu\t%lu\t%lu\t%lu", &shard, &entries, &capacity,
+                       &hits, &misses, &evictions, &rejections) == 7) {
+                printf("%-6d %8d %8d %10lu %10lu %10lu %10lu\n", shard, entries, capacity,
+                       hits, misses, evictions, rejections);
+                total_hits += hits;
+                total_misses += misses;
+            }
+            line = strtok_r(NULL, "\n", &saveptr);
+        }
+        free_message(&replies[i]);
     }
     
-    close(nm_sock);
-    
-    // Connect to SS for undo
-    int ss_sock = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in ss_addr;
-    ss_addr.sin_family = AF_INET;
-    ss_addr.sin_port = htons(response.ss_port);
-    inet_pton(AF_INET, response.ss_ip, &ss_addr.sin_addr);
-    
-    if (connect(ss_sock, (struct sockaddr*)&ss_addr, sizeof(ss_addr)) < 0) {
+    unsigned long lookups = total_hits + total_misses;
+    printf("Hit rate: %.1f%% of %lu lookups\n",
+           lookups ? 100.0 * total_hits / lookups : 0.0, lookups);
+}
+
+void handle_undo(const char *filename) {
+    Message response;
+    int error = wait_reply(docs_undo(docs, filename), &response);
+    if (error == DOCS_ERR_NM_UNAVAILABLE) return;
+    if (error == ERR_SS_UNAVAILABLE) {
         printf("Error: Storage Server unavailable\n");
         return;
     }
     
-    init_message(&msg);
-    msg.type = MSG_UNDO;
-    strcpy(msg.filename, filename);
-    send_message(ss_sock, &msg);
-    
-    receive_message(ss_sock, &response);
-    close(ss_sock);
-    
     if (response.type == MSG_ACK) {
         printf("Undo Successful!\n");
+    } else if (response.type == MSG_ERROR && !response.data[0]) {
+        printf("Error: Cannot access file\n"); // Refused by the naming server
     } else {
         printf("Error: Undo failed\n");
     }
 }
 
 void handle_add_access(const char *flag, const char *filename, const char *target_user) {
-    int nm_sock = connect_to_nm();
-    if (nm_sock < 0) return;
-    
     Message msg;
     init_message(&msg);
     msg.type = MSG_ADD_ACCESS;
@@ -565,11 +601,8 @@ void handle_add_access(const char *flag, const char *filename, const char *targe
     strcpy(msg.data, target_user);
     msg.flags = (strcmp(flag, "-R") == 0) ? 1 : 2; // 1 for read, 2 for write
     
-    send_message(nm_sock, &msg);
-    
     Message response;
-    receive_message(nm_sock, &response);
-    close(nm_sock);
+    if (nm_call(&msg, &response) < 0) return;
     
     if (response.type == MSG_ACK) {
         printf("Access granted successfully!\n");
@@ -579,9 +612,6 @@ void handle_add_access(const char *flag, const char *filename, const char *targe
 }
 
 void handle_rem_access(const char *filename, const char *target_user) {
-    int nm_sock = connect_to_nm();
-    if (nm_sock < 0) return;
-    
     Message msg;
     init_message(&msg);
     msg.type = MSG_REM_ACCESS;
@@ -589,11 +619,8 @@ void handle_rem_access(const char *filename, const char *target_user) {
     strcpy(msg.username, username);
     strcpy(msg.data, target_user);
     
-    send_message(nm_sock, &msg);
-    
     Message response;
-    receive_message(nm_sock, &response);
-    close(nm_sock);
+    if (nm_call(&msg, &response) < 0) return;
     
     if (response.type == MSG_ACK) {
         printf("Access removed successfully!\n");
@@ -603,20 +630,14 @@ void handle_rem_access(const char *filename, const char *target_user) {
 }
 
 void handle_exec(const char *filename) {
-    int nm_sock = connect_to_nm();
-    if (nm_sock < 0) return;
-    
     Message msg;
     init_message(&msg);
     msg.type = MSG_EXEC_FILE;
     strcpy(msg.filename, filename);
     strcpy(msg.username, username);
     
-    send_message(nm_sock, &msg);
-    
     Message response;
-    receive_message(nm_sock, &response);
-    close(nm_sock);
+    if (nm_call(&msg, &response) < 0) return;
     
     if (response.type == MSG_RESPONSE) {
         printf("%s", response.data);
@@ -628,20 +649,14 @@ void handle_exec(const char *filename) {
 // ===== FOLDER MANAGEMENT HANDLERS =====
 
 void handle_create_folder(const char *foldername) {
-    int nm_sock = connect_to_nm();
-    if (nm_sock < 0) return;
-    
     Message msg;
     init_message(&msg);
     msg.type = MSG_CREATE_FOLDER;
     strcpy(msg.folder_path, foldername);
     strcpy(msg.username, username);
     
-    send_message(nm_sock, &msg);
-    
     Message response;
-    receive_message(nm_sock, &response);
-    close(nm_sock);
+    if (nm_call(&msg, &response) < 0) return;
     
     if (response.type == MSG_ACK) {
         printf("Folder '%s' created successfully!\n", foldername);
@@ -651,9 +666,6 @@ void handle_create_folder(const char *foldername) {
 }
 
 void handle_move_file(const char *filename, const char *foldername) {
-    int nm_sock = connect_to_nm();
-    if (nm_sock < 0) return;
-    
     Message msg;
     init_message(&msg);
     msg.type = MSG_MOVE_FILE;
@@ -661,11 +673,8 @@ void handle_move_file(const char *filename, const char *foldername) {
     strcpy(msg.folder_path, foldername);
     strcpy(msg.username, username);
     
-    send_message(nm_sock, &msg);
-    
     Message response;
-    receive_message(nm_sock, &response);
-    close(nm_sock);
+    if (nm_call(&msg, &response) < 0) return;
     
     if (response.type == MSG_ACK) {
         printf("File '%s' moved to folder '%s' successfully!\n", filename, foldername);
@@ -675,20 +684,14 @@ void handle_move_file(const char *filename, const char *foldername) {
 }
 
 void handle_view_folder(const char *foldername) {
-    int nm_sock = connect_to_nm();
-    if (nm_sock < 0) return;
-    
     Message msg;
     init_message(&msg);
     msg.type = MSG_VIEW_FOLDER;
     strcpy(msg.folder_path, foldername);
     strcpy(msg.username, username);
     
-    send_message(nm_sock, &msg);
-    
     Message response;
-    receive_message(nm_sock, &response);
-    close(nm_sock);
+    if (nm_call(&msg, &response) < 0) return;
     
     if (response.type == MSG_RESPONSE) {
         printf("\n=== Contents of folder '%s' ===\n", foldername);
@@ -704,9 +707,6 @@ void handle_view_folder(const char *foldername) {
 // ===== CHECKPOINT MANAGEMENT HANDLERS =====
 
 void handle_checkpoint(const char *filename, const char *tag) {
-    int nm_sock = connect_to_nm();
-    if (nm_sock < 0) return;
-    
     Message msg;
     init_message(&msg);
     msg.type = MSG_CHECKPOINT;
@@ -714,11 +714,8 @@ void handle_checkpoint(const char *filename, const char *tag) {
     strcpy(msg.data, tag);
     strcpy(msg.username, username);
     
-    send_message(nm_sock, &msg);
-    
     Message response;
-    receive_message(nm_sock, &response);
-    close(nm_sock);
+    if (nm_call(&msg, &response) < 0) return;
     
     if (response.type == MSG_ACK) {
         printf("Checkpoint '%s' created successfully for file '%s'!\n", tag, filename);
@@ -728,9 +725,6 @@ void handle_checkpoint(const char *filename, const char *tag) {
 }
 
 void handle_view_checkpoint(const char *filename, const char *tag) {
-    int nm_sock = connect_to_nm();
-    if (nm_sock < 0) return;
-    
     Message msg;
     init_message(&msg);
     msg.type = MSG_VIEWCHECKPOINT;
@@ -738,11 +732,8 @@ void handle_view_checkpoint(const char *filename, const char *tag) {
     strcpy(msg.data, tag);
     strcpy(msg.username, username);
     
-    send_message(nm_sock, &msg);
-    
     Message response;
-    receive_message(nm_sock, &response);
-    close(nm_sock);
+    if (nm_call(&msg, &response) < 0) return;
     
     if (response.type == MSG_RESPONSE) {
         printf("\n=== Checkpoint '%s' of file '%s' ===\n", tag, filename);
@@ -754,9 +745,6 @@ void handle_view_checkpoint(const char *filename, const char *tag) {
 }
 
 void handle_revert_checkpoint(const char *filename, const char *tag) {
-    int nm_sock = connect_to_nm();
-    if (nm_sock < 0) return;
-    
     Message msg;
     init_message(&msg);
     msg.type = MSG_REVERT;
@@ -764,11 +752,8 @@ void handle_revert_checkpoint(const char *filename, const char *tag) {
     strcpy(msg.data, tag);
     strcpy(msg.username, username);
     
-    send_message(nm_sock, &msg);
-    
     Message response;
-    receive_message(nm_sock, &response);
-    close(nm_sock);
+    if (nm_call(&msg, &response) < 0) return;
     
     if (response.type == MSG_ACK) {
         printf("File '%s' reverted to checkpoint '%s' successfully!\n", filename, tag);
@@ -778,20 +763,14 @@ void handle_revert_checkpoint(const char *filename, const char *tag) {
 }
 
 void handle_list_checkpoints(const char *filename) {
-    int nm_sock = connect_to_nm();
-    if (nm_sock < 0) return;
-    
     Message msg;
     init_message(&msg);
     msg.type = MSG_LISTCHECKPOINTS;
     strcpy(msg.filename, filename);
     strcpy(msg.username, username);
     
-    send_message(nm_sock, &msg);
-    
     Message response;
-    receive_message(nm_sock, &response);
-    close(nm_sock);
+    if (nm_call(&msg, &response) < 0) return;
     
     if (response.type == MSG_RESPONSE) {
         printf("\n=== Checkpoints for file '%s' ===\n", filename);
@@ -810,12 +789,13 @@ void handle_list_checkpoints(const char *filename) {
 
 void print_help() {
     printf("\nAvailable Commands:\n");
-    printf("  VIEW [-a] [-l]              - List files\n");
+    printf("  VIEW [-a] [-l] [-o]         - List files\n");
+    printf("  SEARCH [-a] [-g|-s] <pat>   - Find files by prefix, glob or substring\n");
     printf("  READ <filename>             - Read file content\n");
     printf("  CREATE <filename>           - Create new file\n");
     printf("  WRITE <filename> <sent#>    - Write to file\n");
     printf("  DELETE <filename>           - Delete file\n");
-    printf("  STREAM <filename>           - Stream file content\n");
+    printf("  STREAM <filename> [word#]   - Stream file content\n");
     printf("  INFO <filename>             - Get file information\n");
     printf("  LIST                        - List all users\n");
     printf("  UNDO <filename>             - Undo last change\n");
@@ -829,6 +809,7 @@ void print_help() {
     printf("  VIEWCHECKPOINT <file> <tag>- View checkpoint\n");
     printf("  REVERT <file> <tag>        - Revert to checkpoint\n");
     printf("  LISTCHECKPOINTS <filename> - List all checkpoints\n");
+    printf("  CACHESTATS                  - Show naming server cache counters\n");
     printf("  HELP                        - Show this help\n");
     printf("  EXIT                        - Exit client\n\n");
 }
@@ -848,21 +829,22 @@ int main(int argc, char *argv[]) {
     }
     username[strcspn(username, "\n")] = 0;
     
-    // Register with naming server
-    int nm_sock = connect_to_nm();
-    if (nm_sock >= 0) {
-        Message reg_msg;
-        init_message(&reg_msg);
-        reg_msg.type = MSG_REGISTER_CLIENT;
-        strcpy(reg_msg.username, username);
-        gethostname(reg_msg.ss_ip, sizeof(reg_msg.ss_ip));
-        send_message(nm_sock, &reg_msg);
-        
-        Message ack;
-        receive_message(nm_sock, &ack);
-        close(nm_sock);
+    docs = docs_connect(nm_ip, nm_port, username);
+    if (!docs) {
+        fprintf(stderr, "Failed to start client library\n");
+        return 1;
     }
     
+    Message reg_msg;
+    init_message(&reg_msg);
+    reg_msg.type = MSG_REGISTER_CLIENT;
+    strcpy(reg_msg.username, username);
+    gethostname(reg_msg.ss_ip, sizeof(reg_msg.ss_ip));
+    
+    // Every shard lists the users it has seen
+    Message acks[docs_num_shards(docs)];
+    nm_call_all(&reg_msg, acks);
+    
     printf("Welcome, %s!\n", username);
     print_help();
     
@@ -882,48 +864,23 @@ int main(int argc, char *argv[]) {
         } else if (strcmp(cmd, "HELP") == 0) {
             print_help();
         } else if (strcmp(cmd, "VIEW") == 0) {
-            // Validate VIEW command - only allow VIEW, VIEW -a, VIEW -l, VIEW -al
+            // Flags may be given separately or together: -a, -l, -o, -al, ...
             int flags = 0;
-            char *flag = strtok(NULL, " ");
             int valid_flags = 1;
-            
-            if (flag == NULL) {
-                // Just "VIEW" is valid
-                flags = 0;
-            } else if (strcmp(flag, "-a") == 0 || strcmp(flag, "-al") == 0 || strcmp(flag, "-la") == 0) {
-                // Check for -a or -al combinations
-                if (strcmp(flag, "-a") == 0) {
-                    flags = 1; // -a flag
-                    // Check if there's another flag
-                    char *next_flag = strtok(NULL, " ");
-                    if (next_flag) {
-                        if (strcmp(next_flag, "-l") == 0) {
-                            flags = 3; // -a -l = -al
-                        } else {
-                            valid_flags = 0;
-                        }
-                    }
-                } else if (strcmp(flag, "-al") == 0 || strcmp(flag, "-la") == 0) {
-                    flags = 3; // -al flag
-                    // Should not have more flags
-                    if (strtok(NULL, " ") != NULL) {
-                        valid_flags = 0;
-                    }
-                }
-            } else if (strcmp(flag, "-l") == 0) {
-                // Check for -l or -l -a
-                flags = 2; // -l flag
-                char *next_flag = strtok(NULL, " ");
-                if (next_flag) {
-                    if (strcmp(next_flag, "-a") == 0) {
-                        flags = 3; // -l -a = -al
+            char *flag;
+            while ((flag = strtok(NULL, " ")) != NULL) {
+                if (flag[0] != '-' || flag[1] == '\0') valid_flags = 0;
+                for (char *c = flag + 1; valid_flags && *c; c++) {
+                    if (*c == 'a') {
+                        flags |= 1;
+                    } else if (*c == 'l') {
+                        flags |= 2;
+                    } else if (*c == 'o') {
+                        flags |= 4;
                     } else {
                         valid_flags = 0;
                     }
                 }
-            } else {
-                // Invalid flag
-                valid_flags = 0;
             }
             
             if (!valid_flags) {
@@ -932,6 +889,7 @@ int main(int argc, char *argv[]) {
                 printf("  VIEW -a       - List all files on system\n");
                 printf("  VIEW -l       - List user files with details\n");
                 printf("  VIEW -al      - List all files with details\n");
+                printf("  VIEW -o       - List only files you own\n");
             } else {
                 handle_view(flags);
             }
@@ -952,7 +910,8 @@ int main(int argc, char *argv[]) {
             if (filename) handle_delete(filename);
         } else if (strcmp(cmd, "STREAM") == 0) {
             char *filename = strtok(NULL, " ");
-            if (filename) handle_stream(filename);
+            char *start = strtok(NULL, " ");
+            if (filename) handle_stream(filename, start ? atoi(start) : 0);
         } else if (strcmp(cmd, "INFO") == 0) {
             char *filename = strtok(NULL, " ");
             if (filename) handle_info(filename);
@@ -1030,11 +989,29 @@ int main(int argc, char *argv[]) {
             } else {
                 printf("ERROR: Usage: LISTCHECKPOINTS <filename>\n");
             }
+        } else if (strcmp(cmd, "SEARCH") == 0) {
+            // SEARCH [-a] [-g|-s] <pattern>: prefix by default, -g glob, -s substring
+            int flags = 0, mode = SEARCH_PREFIX;
+            char *arg = strtok(NULL, " ");
+            while (arg && arg[0] == '-' && arg[1] && !arg[2] && strchr("ags", arg[1])) {
+                if (arg[1] == 'a') flags |= 1;
+                if (arg[1] == 'g') mode = SEARCH_GLOB;
+                if (arg[1] == 's') mode = SEARCH_SUBSTRING;
+                arg = strtok(NULL, " ");
+            }
+            if (arg) {
+                handle_search(flags, mode, arg);
+            } else {
+                printf("ERROR: Usage: SEARCH [-a] [-g|-s] <pattern>\n");
+            }
+        } else if (strcmp(cmd, "CACHESTATS") == 0) {
+            handle_cache_stats();
         } else {
             printf("Unknown command. Type HELP for available commands.\n");
         }
     }
     
+    docs_disconnect(docs);
     printf("Goodbye!\n");
     return 0;
 }
\ No newline at end of file
@@ -1,4 +1,7 @@
 #include "common.h"
+#include "compress.h"
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 
 void log_message(const char *component, const char *message) {
     time_t now = time(NULL);
@@ -26,38 +29,609 @@ char *get_timestamp() {
     return buffer;
 }
 
+// Per-socket record of what the peer last told us it speaks and accepts
+static unsigned char peer_flags[MAX_TRACKED_FDS];
+
+// Opens a TCP connection with Nagle disabled, since every exchange is a
+// small request followed by a small reply
+int connect_to_server(const char *ip, int port) {
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0) return -1;
+    
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, ip, &addr.sin_addr);
+    
+    if (connect(sockfd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(sockfd);
+        return -1;
+    }
+    
+    int opt = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    if (sockfd < MAX_TRACKED_FDS) peer_flags[sockfd] = 0;
+    return sockfd;
+}
+
+void local_socket_path(char *buf, size_t size, const char *dir, int port) {
+    snprintf(buf, size, "%s/docs-%d.sock", dir, port);
+}
+
+static int local_address(struct sockaddr_un *addr, const char *dir, int port) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(dir) >= MAX_LOCAL_DIR) return -1;
+    local_socket_path(addr->sun_path, sizeof(addr->sun_path), dir, port);
+    return 0;
+}
+
+// Binds the AF_UNIX socket that mirrors TCP port, replacing any left over
+// from an earlier run
+int listen_local(const char *dir, int port) {
+    struct sockaddr_un addr;
+    if (local_address(&addr, dir, port) < 0) return -1;
+    
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    unlink(addr.sun_path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int is_loopback(const char *ip) {
+    struct in_addr addr;
+    return inet_pton(AF_INET, ip, &addr) == 1 && (ntohl(addr.s_addr) >> 24) == 127;
+}
+
+// Connects through the server's AF_UNIX socket when it advertised one and
+// is on this host, falling back to TCP if that fails
+int connect_to_server_via(const char *ip, int port, const char *local_dir) {
+    struct sockaddr_un addr;
+    if (local_dir && local_dir[0] && is_loopback(ip) && local_address(&addr, local_dir, port) == 0) {
+        int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sockfd >= 0 && connect(sockfd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+            if (sockfd < MAX_TRACKED_FDS) peer_flags[sockfd] = 0;
+            return sockfd;
+        }
+        if (sockfd >= 0) close(sockfd);
+    }
+    return connect_to_server(ip, port);
+}
+
+// Layout of the original fixed-size Message. Peers that send this instead of
+// a frame are answered in kind, so old binaries keep working.
+typedef struct {
+    int type;
+    char username[MAX_USERNAME];
+    char filename[MAX_FILENAME];
+    char data[MAX_BUFFER];
+    int sentence_num;
+    int word_index;
+    int error_code;
+    int flags;
+    char ss_ip[INET_ADDRSTRLEN];
+    int ss_port;
+    char folder_path[MAX_PATH];
+} LegacyMessage;
+
 void init_message(Message *msg) {
     memset(msg, 0, sizeof(Message));
 }
 
-int send_message(int sockfd, Message *msg) {
-    int total_sent = 0;
-    int bytes_left = sizeof(Message);
-    int n;
+void free_message(Message *msg) {
+    free(msg->ext_data);
+    msg->ext_data = NULL;
+    msg->ext_len = 0;
+}
+
+char *message_data(Message *msg) {
+    return msg->ext_data ? msg->ext_data : msg->data;
+}
+
+size_t message_data_len(Message *msg) {
+    return msg->ext_data ? msg->ext_len : strlen(msg->data);
+}
+
+// Stores a body of any length: small bodies live in data, larger ones are
+// copied to the heap and data keeps a truncated prefix for display. So do
+// binary bodies, whose length strlen would get wrong.
+void set_message_data(Message *msg, const char *buf, size_t len) {
+    free_message(msg);
+    size_t prefix = len < sizeof(msg->data) - 1 ? len : sizeof(msg->data) - 1;
+    memcpy(msg->data, buf, prefix);
+    msg->data[prefix] = '\0';
     
-    while (total_sent < sizeof(Message)) {
-        n = send(sockfd, ((char*)msg) + total_sent, bytes_left, 0);
+    if (len > prefix || memchr(buf, '\0', len)) {
+        msg->ext_data = malloc(len + 1);
+        if (!msg->ext_data) return;
+        memcpy(msg->ext_data, buf, len);
+        msg->ext_data[len] = '\0';
+        msg->ext_len = len;
+    }
+}
+
+static size_t field_size(size_t len) {
+    return len ? 5 + len : 0;
+}
+
+static char *put_u32(char *p, uint32_t v) {
+    v = htonl(v);
+    memcpy(p, &v, 4);
+    return p + 4;
+}
+
+static uint32_t get_u32(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return ntohl(v);
+}
+
+static char *put_field(char *p, int tag, const void *value, size_t len) {
+    if (!len) return p;
+    *p++ = (char)tag;
+    p = put_u32(p, len);
+    memcpy(p, value, len);
+    return p + len;
+}
+
+static char *put_int_field(char *p, int tag, int value) {
+    if (!value) return p;
+    uint32_t v = htonl((uint32_t)value);
+    return put_field(p, tag, &v, 4);
+}
+
+static const char *body_data(const Message *msg, size_t *len) {
+    if (msg->ext_data) {
+        *len = msg->ext_len;
+        return msg->ext_data;
+    }
+    *len = strlen(msg->data);
+    return msg->data;
+}
+
+// Size of the frame up to, not including, the data field
+static size_t frame_head_size(const Message *msg) {
+    return FRAME_HEADER_SIZE +
+           field_size(strlen(msg->username)) +
+           field_size(strlen(msg->filename)) +
+           field_size(strlen(msg->folder_path)) +
+           field_size(strlen(msg->ss_ip)) +
+           field_size(strlen(msg->local_dir)) +
+           field_size(msg->sentence_num ? 4 : 0) +
+           field_size(msg->word_index ? 4 : 0) +
+           field_size(msg->flags ? 4 : 0) +
+           field_size(msg->ss_port ? 4 : 0) +
+           field_size(msg->epoch ? 4 : 0) +
+           field_size(msg->generation ? 4 : 0);
+}
+
+size_t message_frame_size(const Message *msg) {
+    size_t data_len;
+    body_data(msg, &data_len);
+    return frame_head_size(msg) + field_size(data_len);
+}
+
+// Writes the frame header and every field but data; returns where the data
+// field goes. total is the size of the whole frame.
+static char *encode_head(const Message *msg, char *frame, size_t total) {
+    char *p = put_u32(frame, PROTOCOL_MAGIC);
+    *p++ = PROTOCOL_VERSION;
+    *p++ = FRAME_ACCEPTS_COMPRESSION;
+    uint16_t type = htons((uint16_t)msg->type);
+    memcpy(p, &type, 2);
+    p += 2;
+    p = put_u32(p, msg->request_id);
+    p = put_u32(p, (uint32_t)msg->error_code);
+    p = put_u32(p, total - FRAME_HEADER_SIZE);
+    
+    p = put_field(p, FIELD_USERNAME, msg->username, strlen(msg->username));
+    p = put_field(p, FIELD_FILENAME, msg->filename, strlen(msg->filename));
+    p = put_field(p, FIELD_FOLDER_PATH, msg->folder_path, strlen(msg->folder_path));
+    p = put_field(p, FIELD_SS_IP, msg->ss_ip, strlen(msg->ss_ip));
+    p = put_field(p, FIELD_LOCAL_DIR, msg->local_dir, strlen(msg->local_dir));
+    p = put_int_field(p, FIELD_SENTENCE_NUM, msg->sentence_num);
+    p = put_int_field(p, FIELD_WORD_INDEX, msg->word_index);
+    p = put_int_field(p, FIELD_FLAGS, msg->flags);
+    p = put_int_field(p, FIELD_SS_PORT, msg->ss_port);
+    p = put_int_field(p, FIELD_EPOCH, (int)msg->epoch);
+    return put_int_field(p, FIELD_GENERATION, (int)msg->generation);
+}
+
+// Serializes msg into frame, which must hold message_frame_size(msg) bytes
+void encode_message(const Message *msg, char *frame) {
+    size_t data_len;
+    const char *data = body_data(msg, &data_len);
+    char *p = encode_head(msg, frame, message_frame_size(msg));
+    put_field(p, FIELD_DATA, data, data_len);
+}
+
+// Serializes msg with data, rather than its own data field, compressed into
+// a FIELD_DATA_COMPRESSED. Returns NULL if data is under the threshold or
+// does not shrink by at least an eighth, in which case it goes raw.
+static char *encode_compressed(const Message *msg, const char *data, size_t data_len,
+                               size_t *len) {
+    if (data_len < COMPRESSION_THRESHOLD) return NULL;
+    
+    size_t head_len = frame_head_size(msg);
+    size_t max_len = data_len - data_len / 8;
+    char *frame = malloc(head_len + 9 + max_len);
+    if (!frame) return NULL;
+    
+    size_t compressed_len = compress_block(data, data_len, frame + head_len + 9, max_len);
+    if (compressed_len == 0) {
+        free(frame);
+        return NULL;
+    }
+    
+    *len = head_len + 9 + compressed_len;
+    char *p = encode_head(msg, frame, *len);
+    *p++ = FIELD_DATA_COMPRESSED;
+    p = put_u32(p, 4 + compressed_len);
+    put_u32(p, data_len);
+    return frame;
+}
+
+static void copy_string_field(char *dst, size_t dst_size, const char *src, size_t len) {
+    if (len >= dst_size) len = dst_size - 1;
+    memcpy(dst, src, len);
+    dst[len] = '\0';
+}
+
+static int decode_fields(const char *frame, size_t len, Message *msg) {
+    uint16_t type;
+    memcpy(&type, frame + 6, 2);
+    msg->type = ntohs(type);
+    msg->request_id = get_u32(frame + 8);
+    msg->error_code = (int)get_u32(frame + 12);
+    size_t payload_len = get_u32(frame + 16);
+    if (payload_len > len - FRAME_HEADER_SIZE) return -1;
+    
+    const char *p = frame + FRAME_HEADER_SIZE;
+    const char *end = p + payload_len;
+    while (p < end) {
+        if (end - p < 5) return -1;
+        int tag = (unsigned char)*p;
+        size_t field_len = get_u32(p + 1);
+        p += 5;
+        if (field_len > (size_t)(end - p)) return -1;
+        
+        int value = field_len == 4 ? (int)get_u32(p) : 0;
+        switch (tag) {
+            case FIELD_USERNAME:
+                copy_string_field(msg->username, sizeof(msg->username), p, field_len);
+                break;
+            case FIELD_FILENAME:
+                copy_string_field(msg->filename, sizeof(msg->filename), p, field_len);
+                break;
+            case FIELD_FOLDER_PATH:
+                copy_string_field(msg->folder_path, sizeof(msg->folder_path), p, field_len);
+                break;
+            case FIELD_SS_IP:
+                copy_string_field(msg->ss_ip, sizeof(msg->ss_ip), p, field_len);
+                break;
+            case FIELD_LOCAL_DIR:
+                copy_string_field(msg->local_dir, sizeof(msg->local_dir), p, field_len);
+                break;
+            case FIELD_SENTENCE_NUM: msg->sentence_num = value; break;
+            case FIELD_WORD_INDEX: msg->word_index = value; break;
+            case FIELD_FLAGS: msg->flags = value; break;
+            case FIELD_SS_PORT: msg->ss_port = value; break;
+            case FIELD_EPOCH: msg->epoch = (uint32_t)value; break;
+            case FIELD_GENERATION: msg->generation = (uint32_t)value; break;
+            case FIELD_DATA:
+                set_message_data(msg, p, field_len);
+                break;
+            case FIELD_DATA_COMPRESSED: {
+                if (field_len < 4) return -1;
+                size_t raw_len = get_u32(p);
+                if (raw_len > MAX_FRAME_PAYLOAD) return -1;
+                char *raw = malloc(raw_len + 1);
+                if (!raw) return -1;
+                if (decompress_block(p + 4, field_len - 4, raw, raw_len) < 0) {
+                    free(raw);
+                    return -1;
+                }
+                set_message_data(msg, raw, raw_len);
+                free(raw);
+                break;
+            }
+        }
+        p += field_len;
+    }
+    return 0;
+}
+
+// Parses a complete frame (header included). Unknown tags are skipped so
+// newer peers can add fields without breaking older ones. Any body msg
+// held is freed first, and on failure msg holds none.
+int decode_message(const char *frame, size_t len, Message *msg) {
+    if (len < FRAME_HEADER_SIZE || get_u32(frame) != PROTOCOL_MAGIC) return -1;
+    
+    free_message(msg);
+    init_message(msg);
+    if (decode_fields(frame, len, msg) < 0) {
+        free_message(msg);
+        return -1;
+    }
+    return 0;
+}
+
+static int send_all(int sockfd, const char *buf, size_t len) {
+    size_t total_sent = 0;
+    while (total_sent < len) {
+        ssize_t n = send(sockfd, buf + total_sent, len - total_sent, MSG_NOSIGNAL);
         if (n <= 0) {
             return -1;
         }
         total_sent += n;
-        bytes_left -= n;
     }
     return 0;
 }
 
-int receive_message(int sockfd, Message *msg) {
-    int total_received = 0;
-    int bytes_left = sizeof(Message);
-    int n;
-    
-    while (total_received < sizeof(Message)) {
-        n = recv(sockfd, ((char*)msg) + total_received, bytes_left, 0);
+static int recv_all(int sockfd, char *buf, size_t len) {
+    size_t total_received = 0;
+    while (total_received < len) {
+        ssize_t n = recv(sockfd, buf + total_received, len - total_received, 0);
         if (n <= 0) {
             return -1;
         }
         total_received += n;
-        bytes_left -= n;
     }
     return 0;
-}
\ No newline at end of file
+}
+
+static void message_to_legacy(const Message *msg, LegacyMessage *legacy) {
+    memset(legacy, 0, sizeof(*legacy));
+    legacy->type = msg->type;
+    strcpy(legacy->username, msg->username);
+    strcpy(legacy->filename, msg->filename);
+    strcpy(legacy->data, msg->data);
+    legacy->sentence_num = msg->sentence_num;
+    legacy->word_index = msg->word_index;
+    legacy->error_code = msg->error_code;
+    legacy->flags = msg->flags;
+    strcpy(legacy->ss_ip, msg->ss_ip);
+    legacy->ss_port = msg->ss_port;
+    strcpy(legacy->folder_path, msg->folder_path);
+}
+
+static void legacy_to_message(const LegacyMessage *legacy, Message *msg) {
+    free_message(msg);
+    init_message(msg);
+    msg->type = legacy->type;
+    memcpy(msg->username, legacy->username, sizeof(msg->username));
+    memcpy(msg->filename, legacy->filename, sizeof(msg->filename));
+    memcpy(msg->data, legacy->data, sizeof(msg->data));
+    msg->sentence_num = legacy->sentence_num;
+    msg->word_index = legacy->word_index;
+    msg->error_code = legacy->error_code;
+    msg->flags = legacy->flags;
+    memcpy(msg->ss_ip, legacy->ss_ip, sizeof(msg->ss_ip));
+    msg->ss_port = legacy->ss_port;
+    memcpy(msg->folder_path, legacy->folder_path, sizeof(msg->folder_path));
+    msg->username[MAX_USERNAME - 1] = '\0';
+    msg->filename[MAX_FILENAME - 1] = '\0';
+    msg->data[MAX_BUFFER - 1] = '\0';
+    msg->ss_ip[INET_ADDRSTRLEN - 1] = '\0';
+    msg->folder_path[MAX_PATH - 1] = '\0';
+}
+
+static int send_legacy_message(int sockfd, Message *msg) {
+    LegacyMessage legacy;
+    message_to_legacy(msg, &legacy);
+    return send_all(sockfd, (char*)&legacy, sizeof(legacy));
+}
+
+static int receive_legacy_message(int sockfd, int type, Message *msg) {
+    LegacyMessage legacy;
+    legacy.type = type;
+    if (recv_all(sockfd, ((char*)&legacy) + sizeof(int), sizeof(legacy) - sizeof(int)) < 0) {
+        return -1;
+    }
+    legacy_to_message(&legacy, msg);
+    return 0;
+}
+
+// Non-blocking counterpart of receive_message for event-driven servers:
+// parses one message from the front of buf and sets *peer to what its
+// sender speaks and accepts (PEER_*). Returns the number of bytes consumed,
+// 0 if buf does not yet hold a whole message, or -1 if malformed.
+int parse_message(const char *buf, size_t len, Message *msg, int *peer) {
+    if (len < 4) return 0;
+    
+    if (get_u32(buf) != PROTOCOL_MAGIC) {
+        *peer = PEER_LEGACY;
+        if (len < sizeof(LegacyMessage)) return 0;
+        LegacyMessage legacy_msg;
+        memcpy(&legacy_msg, buf, sizeof(legacy_msg));
+        legacy_to_message(&legacy_msg, msg);
+        return sizeof(LegacyMessage);
+    }
+    
+    if (len < FRAME_HEADER_SIZE) return 0;
+    *peer = buf[5] & FRAME_ACCEPTS_COMPRESSION ? PEER_COMPRESSION : 0;
+    size_t payload_len = get_u32(buf + 16);
+    if ((unsigned char)buf[4] > PROTOCOL_VERSION || payload_len > MAX_FRAME_PAYLOAD) {
+        return -1;
+    }
+    if (len < FRAME_HEADER_SIZE + payload_len) return 0;
+    if (decode_message(buf, FRAME_HEADER_SIZE + payload_len, msg) < 0) return -1;
+    return FRAME_HEADER_SIZE + payload_len;
+}
+
+// Serializes msg for a peer with the given PEER_* flags; caller frees
+char *serialize_message(const Message *msg, int peer, size_t *len) {
+    if (peer & PEER_LEGACY) {
+        LegacyMessage *legacy_msg = malloc(sizeof(LegacyMessage));
+        if (legacy_msg) message_to_legacy(msg, legacy_msg);
+        *len = sizeof(LegacyMessage);
+        return (char*)legacy_msg;
+    }
+    
+    if (peer & PEER_COMPRESSION) {
+        size_t data_len;
+        const char *data = body_data(msg, &data_len);
+        char *frame = encode_compressed(msg, data, data_len, len);
+        if (frame) return frame;
+    }
+    
+    *len = message_frame_size(msg);
+    char *frame = malloc(*len);
+    if (frame) encode_message(msg, frame);
+    return frame;
+}
+
+static int peer_of(int sockfd) {
+    return sockfd >= 0 && sockfd < MAX_TRACKED_FDS ? peer_flags[sockfd] : 0;
+}
+
+void set_peer_flags(int sockfd, int peer) {
+    if (sockfd >= 0 && sockfd < MAX_TRACKED_FDS) peer_flags[sockfd] = peer;
+}
+
+int send_message(int sockfd, Message *msg) {
+    int peer = peer_of(sockfd);
+    if (peer & PEER_LEGACY) {
+        return send_legacy_message(sockfd, msg);
+    }
+    
+    size_t data_len;
+    const char *data = body_data(msg, &data_len);
+    if ((peer & PEER_COMPRESSION) && data_len >= COMPRESSION_THRESHOLD) {
+        size_t len;
+        char *frame = encode_compressed(msg, data, data_len, &len);
+        if (frame) {
+            int ret = send_all(sockfd, frame, len);
+            free(frame);
+            return ret;
+        }
+    }
+    
+    char stack_frame[MAX_BUFFER];
+    size_t len = message_frame_size(msg);
+    char *frame = len <= sizeof(stack_frame) ? stack_frame : malloc(len);
+    if (!frame) return -1;
+    
+    encode_message(msg, frame);
+    int ret = send_all(sockfd, frame, len);
+    if (frame != stack_frame) free(frame);
+    return ret;
+}
+
+// Compresses a file body for a peer that accepts it. Returns 1 if it was
+// sent, 0 if it does not compress and should go out raw, -1 on error.
+static int send_file_compressed(int sockfd, Message *msg, int fd, size_t len) {
+    char *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) return 0;
+    
+    size_t frame_len;
+    char *frame = encode_compressed(msg, map, len, &frame_len);
+    munmap(map, len);
+    if (!frame) return 0;
+    
+    int ret = send_all(sockfd, frame, frame_len);
+    free(frame);
+    return ret < 0 ? -1 : 1;
+}
+
+// Sends msg with the contents of fd as its data field. Only the header and
+// small fields pass through user space; the body goes from the page cache
+// to the socket with sendfile, unless the peer takes it compressed. Legacy
+// peers get the first MAX_BUFFER bytes.
+int send_message_file(int sockfd, Message *msg, int fd, size_t len) {
+    int peer = peer_of(sockfd);
+    if (peer & PEER_LEGACY) {
+        ssize_t n = pread(fd, msg->data, sizeof(msg->data) - 1, 0);
+        msg->data[n > 0 ? n : 0] = '\0';
+        return send_legacy_message(sockfd, msg);
+    }
+    
+    free_message(msg);
+    msg->data[0] = '\0';
+    if (len == 0) return send_message(sockfd, msg);
+    
+    if ((peer & PEER_COMPRESSION) && len >= COMPRESSION_THRESHOLD) {
+        int sent = send_file_compressed(sockfd, msg, fd, len);
+        if (sent != 0) return sent < 0 ? -1 : 0;
+    }
+    
+    char frame[MAX_BUFFER];
+    size_t head_len = message_frame_size(msg);
+    if (head_len + 5 > sizeof(frame)) return -1;
+    encode_message(msg, frame);
+    put_u32(frame + 16, head_len - FRAME_HEADER_SIZE + 5 + len);
+    frame[head_len] = FIELD_DATA;
+    put_u32(frame + head_len + 1, len);
+    
+    // MSG_MORE keeps the header in the same segment as the start of the body
+    size_t sent = 0;
+    while (sent < head_len + 5) {
+        ssize_t n = send(sockfd, frame + sent, head_len + 5 - sent, MSG_NOSIGNAL | MSG_MORE);
+        if (n <= 0) return -1;
+        sent += n;
+    }
+    
+    off_t offset = 0;
+    while ((size_t)offset < len) {
+        ssize_t n = sendfile(sockfd, fd, &offset, len - offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n > 0) continue;
+        if (n == 0) return -1;  // file shrank after the length went out
+        
+        // Not every file system supports sendfile; copy the rest by hand
+        char buf[MAX_BUFFER];
+        while ((size_t)offset < len) {
+            size_t want = len - offset < sizeof(buf) ? len - offset : sizeof(buf);
+            ssize_t got = pread(fd, buf, want, offset);
+            if (got <= 0 || send_all(sockfd, buf, got) < 0) return -1;
+            offset += got;
+        }
+    }
+    return 0;
+}
+
+// Reads one message in whichever protocol the peer speaks. The first word
+// of a frame is the magic; the first word of a legacy Message is its type.
+int receive_message(int sockfd, Message *msg) {
+    char header[FRAME_HEADER_SIZE];
+    if (recv_all(sockfd, header, 4) < 0) {
+        return -1;
+    }
+    
+    int legacy = get_u32(header) != PROTOCOL_MAGIC;
+    if (legacy) {
+        if (sockfd >= 0 && sockfd < MAX_TRACKED_FDS) peer_flags[sockfd] = PEER_LEGACY;
+        int type;
+        memcpy(&type, header, sizeof(int));
+        return receive_legacy_message(sockfd, type, msg);
+    }
+    
+    if (recv_all(sockfd, header + 4, FRAME_HEADER_SIZE - 4) < 0) {
+        return -1;
+    }
+    if (sockfd >= 0 && sockfd < MAX_TRACKED_FDS) {
+        peer_flags[sockfd] = header[5] & FRAME_ACCEPTS_COMPRESSION ? PEER_COMPRESSION : 0;
+    }
+    size_t payload_len = get_u32(header + 16);
+    if ((unsigned char)header[4] > PROTOCOL_VERSION || payload_len > MAX_FRAME_PAYLOAD) {
+        return -1;
+    }
+    
+    char stack_frame[MAX_BUFFER];
+    size_t len = FRAME_HEADER_SIZE + payload_len;
+    char *frame = len <= sizeof(stack_frame) ? stack_frame : malloc(len);
+    if (!frame) return -1;
+    
+    memcpy(frame, header, FRAME_HEADER_SIZE);
+    int ret = recv_all(sockfd, frame + FRAME_HEADER_SIZE, payload_len);
+    if (ret == 0) {
+        ret = decode_message(frame, len, msg);
+    }
+    if (frame != stack_frame) free(frame);
+    return ret;
+}
@@ -8,11 +8,15 @@
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <time.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #define MAX_BUFFER 8192
 #define MAX_PATH 512
@@ -25,6 +29,49 @@
 #define MAX_WORDS 1024
 #define MAX_CHECKPOINTS 50
 #define MAX_CHECKPOINT_TAG 128
+#define SS_POOL_SIZE 8 // Idle connections kept per storage server port
+#define SS_MAX_IN_FLIGHT 16 // Concurrent forwarded requests per storage server port
+
+// Local transport: a server started with -u <dir> also accepts on
+// <dir>/docs-<port>.sock for each TCP port it listens on, and advertises
+// dir. Peers that reach it at a loopback address use the socket instead.
+// Clients look for a local naming server in LOCAL_SOCKET_DIR.
+#define MAX_LOCAL_DIR 80 // Leaves room for the file name in sun_path
+#define LOCAL_SOCKET_DIR "/tmp"
+
+// Wire protocol: every message is a fixed frame header followed by a
+// variable-length body of tagged fields. Empty fields are not sent at all.
+#define PROTOCOL_MAGIC 0x444F4353 // "DOCS"
+#define PROTOCOL_VERSION 1
+#define FRAME_HEADER_SIZE 20
+#define MAX_FRAME_PAYLOAD (64 * 1024 * 1024)
+#define MAX_TRACKED_FDS 65536
+
+// Body field tags
+#define FIELD_USERNAME 1
+#define FIELD_FILENAME 2
+#define FIELD_DATA 3
+#define FIELD_SENTENCE_NUM 4
+#define FIELD_WORD_INDEX 5
+#define FIELD_FLAGS 6
+#define FIELD_SS_IP 7
+#define FIELD_SS_PORT 8
+#define FIELD_FOLDER_PATH 9
+#define FIELD_EPOCH 10
+#define FIELD_DATA_COMPRESSED 11 // Original length (u32), then the compressed block
+#define FIELD_LOCAL_DIR 12
+#define FIELD_GENERATION 13
+
+// Compression is negotiated per connection: every frame we send sets
+// FRAME_ACCEPTS_COMPRESSION in header byte 5, and a peer seen setting it may
+// be sent data fields of COMPRESSION_THRESHOLD bytes or more compressed.
+// Older peers leave the byte zero and keep getting raw data.
+#define FRAME_ACCEPTS_COMPRESSION 0x1
+#define COMPRESSION_THRESHOLD 1024
+
+// What a connection's peer speaks and accepts, learned from its frames
+#define PEER_LEGACY 0x1 // Pre-framing fixed-size Message
+#define PEER_COMPRESSION 0x2
 
 // Error codes
 #define ERR_SUCCESS 0
@@ -36,6 +83,10 @@
 #define ERR_SS_UNAVAILABLE 6
 #define ERR_INVALID_COMMAND 7
 #define ERR_PERMISSION_DENIED 8
+#define ERR_SERVER_BUSY 9
+#define ERR_STALE_LOCATION 10 // File is not on this storage server; look it up again
+#define ERR_WRONG_SHARD 11 // File belongs to another naming server shard
+#define ERR_NOT_PRIMARY 12 // Sent to a follower naming server, which only answers lookups
 
 // Message types
 #define MSG_REGISTER_SS 100
@@ -60,6 +111,12 @@
 #define MSG_VIEWCHECKPOINT 119
 #define MSG_REVERT 120
 #define MSG_LISTCHECKPOINTS 121
+#define MSG_STREAM_CREDIT 122
+#define MSG_BATCH_INFO 123
+#define MSG_CACHE_STATS 124 // Naming server lookup cache counters, one line per shard
+#define MSG_SEARCH 125 // Paged like MSG_LIST_FILES; data holds the pattern
+#define MSG_SHARD_MAP 126 // Reply data is the naming server shard map (see shard_map.h)
+#define MSG_REPLICATE 127 // A follower's poll for changes; filename is its cursor
 #define MSG_RESPONSE 200
 #define MSG_ERROR 201
 #define MSG_ACK 202
@@ -69,6 +126,43 @@
 #define ACCESS_READ 1
 #define ACCESS_WRITE 2
 
+// Chunked streaming: a MSG_STREAM_FILE request with STREAM_CHUNKED in flags
+// gets words in batches, each reply's word_index being the offset of its
+// first word and sentence_num its word count. The request's word_index is
+// the offset to resume from and its sentence_num the initial window in
+// chunks; MSG_STREAM_CREDIT grants sentence_num more, or cancels with 0.
+#define STREAM_CHUNKED 0x1
+#define STREAM_CHUNK_BYTES 4096
+#define STREAM_DEFAULT_WINDOW 8
+
+// Paged listing: a MSG_LIST_FILES reply holds up to sentence_num names
+// (LIST_DEFAULT_PAGE if 0, at most LIST_MAX_PAGE), one per line, in strcmp
+// order. The request's filename is the cursor, the last name of the
+// previous page or empty to start; the reply's filename is the cursor for
+// the next page, empty after the last one.
+#define LIST_ALL 0x1 // Every file, not just those the user may read
+#define LIST_OWNED 0x2 // Only files the user owns
+#define LIST_DEFAULT_PAGE 256
+#define LIST_MAX_PAGE 4096
+
+// How a MSG_SEARCH pattern matches names, given in word_index
+#define SEARCH_PREFIX 0
+#define SEARCH_GLOB 1 // fnmatch(3) syntax
+#define SEARCH_SUBSTRING 2
+
+// Replication: a follower naming server sends MSG_REPLICATE with the
+// cursor from the last reply ("" to start) and gets back the changes made
+// since, as records each preceded by a 32-bit length. REPL_SNAPSHOT in the
+// reply's flags means the records are the primary's whole state, to be
+// applied to an empty one.
+//
+// Naming servers stamp their generation on replies and on MSG_REPLICATE.
+// A follower bumps it when it promotes itself, and then keeps sending
+// MSG_REPLICATE to the old primary with the new generation and its own
+// address in ss_ip and ss_port. A primary that sees a newer generation
+// steps down and follows the server named, if any.
+#define REPL_SNAPSHOT 0x1
+
 // Structures
 typedef struct {
     char folder_path[MAX_PATH];
@@ -77,24 +171,26 @@ typedef struct {
 } FolderInfo;
 
 typedef struct {
-    char filename[MAX_FILENAME];
-    char owner[MAX_USERNAME];
-    time_t created;
-    time_t modified;
-    time_t accessed;
-    long size;
-    int word_count;
-    int char_count;
-    char ss_ip[INET_ADDRSTRLEN];
-    int ss_port;
-    char folder_path[MAX_PATH]; // Path to the folder containing this file
-} FileInfo;
-
-typedef struct {
-    char username[MAX_USERNAME];
+    int user; // Id in the naming server's user table
     int access_level; // ACCESS_READ or ACCESS_WRITE
 } AccessEntry;
 
+// A naming server catalog record
+typedef struct {
+    char filename[MAX_FILENAME]; // Empty if the record is unused
+    uint32_t hash; // Of filename
+    int next; // Next record in the same bucket + 1, 0 at the end
+    int ss_index; // Storage server holding the file, -1 if none
+    int owner; // User id, -1 if the file has no access control
+    AccessEntry *entries; // Sorted by user id; the owner also has an entry
+    int num_entries;
+    int cap;
+    long size; // As last reported by the storage server
+    time_t created; // 0 if not created through this naming server
+    time_t modified;
+    uint32_t seen; // Registration of its storage server that last listed it
+} FileInfo;
+
 typedef struct {
     char tag[MAX_CHECKPOINT_TAG];
     char content[MAX_BUFFER * 4];
@@ -102,12 +198,6 @@ typedef struct {
     char username[MAX_USERNAME];
 } Checkpoint;
 
-typedef struct {
-    char filename[MAX_FILENAME];
-    AccessEntry entries[MAX_CLIENTS];
-    int num_entries;
-} AccessControl;
-
 typedef struct {
     int type;
     char username[MAX_USERNAME];
@@ -120,14 +210,29 @@ typedef struct {
     char ss_ip[INET_ADDRSTRLEN];
     int ss_port;
     char folder_path[MAX_PATH]; // For folder operations
+    char local_dir[MAX_LOCAL_DIR]; // Where the server it names keeps its AF_UNIX sockets
+    uint32_t request_id; // Echoed back in the response
+    uint32_t epoch; // Naming server's location epoch, stamped on its replies
+    uint32_t generation; // Naming server's primary generation (see REPL_SNAPSHOT)
+    char *ext_data; // Heap copy of bodies that do not fit in data (see message_data)
+    uint32_t ext_len;
 } Message;
 
+// Reusable connections from the naming server to one storage server port
+typedef struct {
+    int idle_fds[SS_POOL_SIZE];
+    int num_idle;
+    int in_flight;
+    pthread_cond_t slot_free;
+} SSConnPool;
+
 typedef struct {
     char ip[INET_ADDRSTRLEN];
     int nm_port;
     int client_port;
-    char files[MAX_FILES][MAX_FILENAME];
-    int num_files;
+    char local_dir[MAX_LOCAL_DIR]; // Empty if it has no AF_UNIX sockets
+    SSConnPool nm_pool; // Guarded by lock
+    SSConnPool client_pool;
     int active;
     pthread_mutex_t lock;
 } StorageServerInfo;
@@ -145,7 +250,26 @@ void log_message(const char *component, const char *message);
 void log_request(const char *component, const char *ip, int port, const char *request);
 char *get_timestamp();
 int send_message(int sockfd, Message *msg);
+// msg must be initialised or hold an earlier message, whose body is freed
 int receive_message(int sockfd, Message *msg);
+int send_message_file(int sockfd, Message *msg, int fd, size_t len);
+int connect_to_server(const char *ip, int port);
+int connect_to_server_via(const char *ip, int port, const char *local_dir);
+void local_socket_path(char *buf, size_t size, const char *dir, int port);
+int listen_local(const char *dir, int port);
+int is_loopback(const char *ip);
 void init_message(Message *msg);
+void free_message(Message *msg);
+char *message_data(Message *msg);
+size_t message_data_len(Message *msg);
+void set_message_data(Message *msg, const char *buf, size_t len);
+size_t message_frame_size(const Message *msg);
+void encode_message(const Message *msg, char *frame);
+// Like receive_message, these free any body msg already holds
+int decode_message(const char *frame, size_t len, Message *msg);
+int parse_message(const char *buf, size_t len, Message *msg, int *peer);
+// For sockets read with parse_message: how send_message should answer
+void set_peer_flags(int sockfd, int peer);
+char *serialize_message(const Message *msg, int peer, size_t *len);
 
 #endif
\ No newline at end of file
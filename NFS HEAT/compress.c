@@ -0,0 +1,142 @@
+#include "compress.h"
+#include <stdint.h>
+#include <string.h>
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_LAST_LITERALS 5 // The format ends every block with literals
+#define LZ_MF_LIMIT 12 // No match may start closer than this to the end
+#define LZ_MAX_DISTANCE 65535
+
+static uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static unsigned hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Lengths of 15 and over spill into bytes of 255 after the token
+static unsigned char *put_length(unsigned char *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+static unsigned char *put_literals(unsigned char *op, unsigned char *token,
+                                   const unsigned char *lit, size_t len) {
+    *token = (unsigned char)((len >= 15 ? 15 : len) << 4);
+    if (len >= 15) op = put_length(op, len - 15);
+    memcpy(op, lit, len);
+    return op + len;
+}
+
+// Greedy single-probe matcher: fast rather than tight, which suits text
+// that repeats words and phrases
+size_t compress_block(const char *src, size_t len, char *dst, size_t dst_cap) {
+    const unsigned char *base = (const unsigned char*)src;
+    const unsigned char *end = base + len;
+    const unsigned char *ip = base, *anchor = base;
+    unsigned char *op = (unsigned char*)dst;
+    unsigned char *oend = op + dst_cap;
+    uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    if (len > LZ_MF_LIMIT) {
+        const unsigned char *mf_limit = end - LZ_MF_LIMIT;
+        const unsigned char *match_limit = end - LZ_LAST_LITERALS;
+
+        while (ip < mf_limit) {
+            uint32_t seq = read32(ip);
+            unsigned h = hash4(seq);
+            const unsigned char *ref = base + table[h];
+            table[h] = (uint32_t)(ip - base);
+            if (ref >= ip || ip - ref > LZ_MAX_DISTANCE || read32(ref) != seq) {
+                ip++;
+                continue;
+            }
+
+            while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const unsigned char *m = ip + LZ_MIN_MATCH, *r = ref + LZ_MIN_MATCH;
+            while (m < match_limit && *m == *r) {
+                m++;
+                r++;
+            }
+
+            size_t lit = ip - anchor;
+            size_t match_len = m - ip - LZ_MIN_MATCH;
+            if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit + 2 + match_len / 255 + 1) return 0;
+
+            unsigned char *token = op++;
+            op = put_literals(op, token, anchor, lit);
+            size_t offset = ip - ref;
+            *op++ = (unsigned char)(offset & 0xff);
+            *op++ = (unsigned char)(offset >> 8);
+            *token |= (unsigned char)(match_len >= 15 ? 15 : match_len);
+            if (match_len >= 15) op = put_length(op, match_len - 15);
+
+            ip = anchor = m;
+        }
+    }
+
+    size_t lit = end - anchor;
+    if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit) return 0;
+    unsigned char *token = op++;
+    op = put_literals(op, token, anchor, lit);
+    return op - (unsigned char*)dst;
+}
+
+static int get_length(const unsigned char **ip, const unsigned char *iend, size_t *len) {
+    unsigned b;
+    do {
+        if (*ip >= iend) return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+int decompress_block(const char *src, size_t src_len, char *dst, size_t dst_len) {
+    const unsigned char *ip = (const unsigned char*)src;
+    const unsigned char *iend = ip + src_len;
+    unsigned char *op = (unsigned char*)dst;
+    unsigned char *oend = op + dst_len;
+
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t lit = token >> 4;
+        if (lit == 15 && get_length(&ip, iend, &lit) < 0) return -1;
+        if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend) break; // The last sequence has no match
+
+        if (iend - ip < 2) return -1;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - (unsigned char*)dst)) return -1;
+
+        size_t match_len = token & 15;
+        if (match_len == 15 && get_length(&ip, iend, &match_len) < 0) return -1;
+        match_len += LZ_MIN_MATCH;
+        if (match_len > (size_t)(oend - op)) return -1;
+
+        const unsigned char *ref = op - offset;
+        if (offset >= match_len) {
+            memcpy(op, ref, match_len);
+            op += match_len;
+        } else {
+            while (match_len--) *op++ = *ref++; // Overlapping run
+        }
+    }
+    return op == oend ? 0 : -1;
+}
@@ -0,0 +1,18 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+
+// Built-in codec for message bodies, producing the LZ4 block format: a
+// sequence of (literals, back-reference) pairs with a 64 KB window. It has
+// no framing or checksum of its own; the wire protocol carries the
+// original length next to the block.
+
+// Compresses len bytes into dst. Returns the compressed size, or 0 if it
+// would not fit in dst_cap, so callers can pass the most they will accept.
+size_t compress_block(const char *src, size_t len, char *dst, size_t dst_cap);
+
+// Returns 0 if src decodes to exactly dst_len bytes, -1 if it is corrupt
+int decompress_block(const char *src, size_t src_len, char *dst, size_t dst_len);
+
+#endif
@@ -0,0 +1,520 @@
+#define _GNU_SOURCE
+#include "io_engine.h"
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sched.h>
+
+#define IO_MAX_BATCH 64 // Longest batch sent to the ring; longer ones use the pool
+#define IO_NUM_OPS 9
+
+// One batch from one caller, waiting on its own condition variable
+typedef struct IoBatch {
+    IoRequest *reqs;
+    int n;
+    int linked; // Requests run in order and a failure skips the rest
+    int remaining;
+    struct statx *stx; // Ring results for IO_OP_STAT, converted on completion
+    pthread_cond_t done;
+    struct IoBatch *next;
+} IoBatch;
+
+// What a completion's user_data points at
+typedef struct {
+    IoBatch *batch;
+    int index;
+} IoTag;
+
+// ===== RING =====
+
+static int ring_fd = -1;
+static unsigned sq_entries, cq_entries;
+static unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+static struct io_uring_sqe *sqes;
+static unsigned *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_cqe *cqes;
+static int ring_supports[IO_NUM_OPS]; // Indexed by IO_OP_*
+
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ring_space = PTHREAD_COND_INITIALIZER;
+static unsigned sq_local_tail; // Written by us, not yet necessarily submitted
+static unsigned sq_unsubmitted;
+static unsigned in_flight; // Bounded by cq_entries so completions never overflow
+static int submitting;
+
+// ===== FALLBACK POOL =====
+
+static IoBatch *pool_head, *pool_tail;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_ready = PTHREAD_COND_INITIALIZER;
+
+static int ring_op(int op) {
+    static const int ops[IO_NUM_OPS] = {
+        [IO_OP_OPEN] = IORING_OP_OPENAT,
+        [IO_OP_READ] = IORING_OP_READ,
+        [IO_OP_WRITE] = IORING_OP_WRITE,
+        [IO_OP_FSYNC] = IORING_OP_FSYNC,
+        [IO_OP_CLOSE] = IORING_OP_CLOSE,
+        [IO_OP_RENAME] = IORING_OP_RENAMEAT,
+        [IO_OP_UNLINK] = IORING_OP_UNLINKAT,
+        [IO_OP_STAT] = IORING_OP_STATX,
+    };
+    return ops[op];
+}
+
+static void probe_ops(void) {
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    if (!probe) return;
+
+    if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+        for (int op = 1; op < IO_NUM_OPS; op++) {
+            int code = ring_op(op);
+            ring_supports[op] = code <= probe->last_op &&
+                                (probe->ops[code].flags & IO_URING_OP_SUPPORTED);
+        }
+    }
+    free(probe);
+}
+
+static int ring_setup(unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 2;
+
+    int fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0) return -1;
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    int single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && cq_size > sq_size) sq_size = cq_size;
+
+    char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    fd, IORING_OFF_SQ_RING);
+    char *cq = single ? sq : mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+                                  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    void *sqe_map = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                         PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqe_map == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+
+    ring_fd = fd;
+    sq_entries = p.sq_entries;
+    cq_entries = p.cq_entries;
+    sq_head = (unsigned*)(sq + p.sq_off.head);
+    sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    sq_array = (unsigned*)(sq + p.sq_off.array);
+    sqes = sqe_map;
+    cq_head = (unsigned*)(cq + p.cq_off.head);
+    cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+    // Slot i of the ring always holds SQE i
+    for (unsigned i = 0; i < sq_entries; i++) sq_array[i] = i;
+    sq_local_tail = *sq_tail;
+
+    probe_ops();
+    return 0;
+}
+
+static void prep_sqe(struct io_uring_sqe *sqe, IoRequest *req, struct statx *stx) {
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = ring_op(req->op);
+    sqe->fd = req->fd;
+
+    switch (req->op) {
+        case IO_OP_OPEN:
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (uintptr_t)req->path;
+            sqe->len = req->mode;
+            sqe->open_flags = req->flags;
+            break;
+        case IO_OP_READ:
+        case IO_OP_WRITE:
+            sqe->addr = (uintptr_t)req->buf;
+            sqe->len = req->len;
+            sqe->off = req->offset;
+            break;
+        case IO_OP_RENAME:
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (uintptr_t)req->path;
+            sqe->len = AT_FDCWD;
+            sqe->addr2 = (uintptr_t)req->path2;
+            break;
+        case IO_OP_UNLINK:
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (uintptr_t)req->path;
+            break;
+        case IO_OP_STAT:
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (uintptr_t)req->path;
+            sqe->len = STATX_BASIC_STATS;
+            sqe->addr2 = (uintptr_t)stx;
+            break;
+    }
+}
+
+static int ring_enter(unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+// Queues the batch's SQEs, then submits everything queued so far unless
+// another thread is already doing so; that thread picks ours up too, so
+// concurrent callers share one io_uring_enter
+static void ring_submit(IoBatch *batch, IoTag *tags) {
+    pthread_mutex_lock(&ring_lock);
+    while (sq_entries - (sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE)) < (unsigned)batch->n ||
+           in_flight + batch->n > cq_entries) {
+        pthread_cond_wait(&ring_space, &ring_lock);
+    }
+
+    for (int i = 0; i < batch->n; i++) {
+        struct io_uring_sqe *sqe = &sqes[sq_local_tail & *sq_mask];
+        prep_sqe(sqe, &batch->reqs[i], &batch->stx[i]);
+        if (batch->linked && i + 1 < batch->n) sqe->flags |= IOSQE_IO_LINK;
+        tags[i].batch = batch;
+        tags[i].index = i;
+        sqe->user_data = (uintptr_t)&tags[i];
+        sq_local_tail++;
+    }
+    __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+    sq_unsubmitted += batch->n;
+    in_flight += batch->n;
+
+    if (submitting) {
+        pthread_mutex_unlock(&ring_lock);
+        return;
+    }
+
+    submitting = 1;
+    while (sq_unsubmitted > 0) {
+        unsigned count = sq_unsubmitted;
+        pthread_mutex_unlock(&ring_lock);
+        int ret = ring_enter(count, 0, 0);
+        pthread_mutex_lock(&ring_lock);
+
+        if (ret < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                pthread_mutex_unlock(&ring_lock);
+                sched_yield();
+                pthread_mutex_lock(&ring_lock);
+                continue;
+            }
+            perror("io_uring_enter");
+            exit(1);
+        }
+        sq_unsubmitted -= ret;
+        pthread_cond_broadcast(&ring_space);
+    }
+    submitting = 0;
+    pthread_mutex_unlock(&ring_lock);
+}
+
+static void *reaper_thread(void *arg) {
+    (void)arg;
+    while (1) {
+        if (ring_enter(0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+            perror("io_uring_enter");
+            continue;
+        }
+
+        pthread_mutex_lock(&ring_lock);
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+            IoTag *tag = (IoTag*)(uintptr_t)cqe->user_data;
+            tag->batch->reqs[tag->index].result = cqe->res;
+            if (--tag->batch->remaining == 0) {
+                pthread_cond_signal(&tag->batch->done);
+            }
+            in_flight--;
+            head++;
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&ring_space);
+        pthread_mutex_unlock(&ring_lock);
+    }
+    return NULL;
+}
+
+// ===== FALLBACK POOL =====
+
+static long run_request(IoRequest *req) {
+    long ret = -1;
+    switch (req->op) {
+        case IO_OP_OPEN: ret = open(req->path, req->flags, req->mode); break;
+        case IO_OP_READ: ret = pread(req->fd, req->buf, req->len, req->offset); break;
+        case IO_OP_WRITE: ret = pwrite(req->fd, req->buf, req->len, req->offset); break;
+        case IO_OP_FSYNC: ret = fsync(req->fd); break;
+        case IO_OP_CLOSE: ret = close(req->fd); break;
+        case IO_OP_RENAME: ret = rename(req->path, req->path2); break;
+        case IO_OP_UNLINK: ret = unlink(req->path); break;
+        case IO_OP_STAT: ret = stat(req->path, req->st); break;
+        default: errno = EINVAL;
+    }
+    return ret < 0 ? -errno : ret;
+}
+
+// A linked batch stops at the first failure, as a linked SQE chain does;
+// a short read or write counts as one
+static int breaks_chain(IoRequest *req) {
+    if (req->result < 0) return 1;
+    return (req->op == IO_OP_READ || req->op == IO_OP_WRITE) && (size_t)req->result != req->len;
+}
+
+static void run_batch(IoBatch *batch) {
+    int cancelled = 0;
+    for (int i = 0; i < batch->n; i++) {
+        IoRequest *req = &batch->reqs[i];
+        if (cancelled) {
+            req->result = -ECANCELED;
+            continue;
+        }
+        req->result = run_request(req);
+        if (batch->linked && breaks_chain(req)) cancelled = 1;
+    }
+}
+
+static void *pool_thread(void *arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&pool_lock);
+        while (!pool_head) pthread_cond_wait(&pool_ready, &pool_lock);
+        IoBatch *batch = pool_head;
+        pool_head = batch->next;
+        if (!pool_head) pool_tail = NULL;
+        pthread_mutex_unlock(&pool_lock);
+
+        run_batch(batch);
+
+        pthread_mutex_lock(&pool_lock);
+        batch->remaining = 0;
+        pthread_cond_signal(&batch->done);
+        pthread_mutex_unlock(&pool_lock);
+    }
+    return NULL;
+}
+
+static void pool_run(IoBatch *batch) {
+    pthread_mutex_lock(&pool_lock);
+    batch->next = NULL;
+    if (pool_tail) pool_tail->next = batch;
+    else pool_head = batch;
+    pool_tail = batch;
+    pthread_cond_signal(&pool_ready);
+
+    while (batch->remaining > 0) pthread_cond_wait(&batch->done, &pool_lock);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+// ===== BATCHES =====
+
+static int ring_can_run(IoBatch *batch) {
+    if (ring_fd < 0 || batch->n > IO_MAX_BATCH || (unsigned)batch->n > sq_entries) return 0;
+    for (int i = 0; i < batch->n; i++) {
+        int op = batch->reqs[i].op;
+        if (op <= 0 || op >= IO_NUM_OPS || !ring_supports[op]) return 0;
+    }
+    return 1;
+}
+
+static void stat_from_statx(struct stat *st, const struct statx *stx) {
+    memset(st, 0, sizeof(*st));
+    st->st_mode = stx->stx_mode;
+    st->st_nlink = stx->stx_nlink;
+    st->st_uid = stx->stx_uid;
+    st->st_gid = stx->stx_gid;
+    st->st_size = stx->stx_size;
+    st->st_ino = stx->stx_ino;
+    st->st_blocks = stx->stx_blocks;
+    st->st_atime = stx->stx_atime.tv_sec;
+    st->st_mtime = stx->stx_mtime.tv_sec;
+    st->st_ctime = stx->stx_ctime.tv_sec;
+}
+
+static int run(IoRequest *reqs, int n, int linked) {
+    if (n <= 0) return 0;
+
+    IoBatch batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.reqs = reqs;
+    batch.n = n;
+    batch.linked = linked;
+    batch.remaining = n;
+    pthread_cond_init(&batch.done, NULL);
+
+    IoTag *tags = NULL;
+    if (ring_can_run(&batch)) {
+        tags = malloc(n * sizeof(IoTag));
+        batch.stx = calloc(n, sizeof(struct statx));
+    }
+
+    if (tags && batch.stx) {
+        ring_submit(&batch, tags);
+        pthread_mutex_lock(&ring_lock);
+        while (batch.remaining > 0) pthread_cond_wait(&batch.done, &ring_lock);
+        pthread_mutex_unlock(&ring_lock);
+
+        for (int i = 0; i < n; i++) {
+            if (reqs[i].op == IO_OP_STAT && reqs[i].result == 0) {
+                stat_from_statx(reqs[i].st, &batch.stx[i]);
+            }
+        }
+    } else {
+        pool_run(&batch);
+    }
+    free(tags);
+    free(batch.stx);
+    pthread_cond_destroy(&batch.done);
+
+    // A close skipped by an earlier failure still has to happen
+    int failed = 0;
+    for (int i = 0; i < n; i++) {
+        if (reqs[i].op == IO_OP_CLOSE && reqs[i].result == -ECANCELED) {
+            reqs[i].result = close(reqs[i].fd) < 0 ? -errno : 0;
+        }
+        if (reqs[i].result < 0 && !failed) failed = (int)-reqs[i].result;
+    }
+    if (failed) {
+        errno = failed;
+        return -1;
+    }
+    return 0;
+}
+
+int io_submit_batch(IoRequest *reqs, int n) {
+    return run(reqs, n, 1);
+}
+
+// ===== PUBLIC API =====
+
+int io_engine_start(unsigned entries, int threads) {
+    for (int i = 0; i < threads; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, pool_thread, NULL) != 0) return -1;
+        pthread_detach(tid);
+    }
+
+    if (ring_setup(entries) < 0) {
+        log_message("SS", "io_uring unavailable, using I/O threads");
+        return 0;
+    }
+
+    pthread_t reaper;
+    if (pthread_create(&reaper, NULL, reaper_thread, NULL) != 0) return -1;
+    pthread_detach(reaper);
+    return 0;
+}
+
+const char *io_engine_backend(void) {
+    return ring_fd >= 0 ? "io_uring" : "thread pool";
+}
+
+static int open_path(const char *path, int flags, mode_t mode) {
+    IoRequest req = {.op = IO_OP_OPEN, .path = path, .flags = flags, .mode = mode};
+    if (io_submit_batch(&req, 1) < 0) return -1;
+    return (int)req.result;
+}
+
+// Reads up to buf_size - 1 bytes and terminates them
+int io_read_file(const char *path, char *buf, size_t buf_size) {
+    int fd = open_path(path, O_RDONLY, 0);
+    if (fd < 0) return -1;
+
+    IoRequest reqs[2] = {
+        {.op = IO_OP_READ, .fd = fd, .buf = buf, .len = buf_size - 1},
+        {.op = IO_OP_CLOSE, .fd = fd},
+    };
+    if (io_submit_batch(reqs, 2) < 0 && reqs[0].result < 0) return -1;
+    buf[reqs[0].result] = '\0';
+    return 0;
+}
+
+// Writes to a temporary file and renames it over path only once the data
+// has reached the disk, so readers see the old file or the new one
+int io_write_file(const char *path, const char *data, size_t len) {
+    char tmppath[MAX_PATH + 32];
+    snprintf(tmppath, sizeof(tmppath), "%s.tmp.%lu", path, (unsigned long)pthread_self());
+
+    int fd = open_path(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+
+    IoRequest reqs[4] = {
+        {.op = IO_OP_WRITE, .fd = fd, .buf = (void*)data, .len = len},
+        {.op = IO_OP_FSYNC, .fd = fd},
+        {.op = IO_OP_CLOSE, .fd = fd},
+        {.op = IO_OP_RENAME, .path = tmppath, .path2 = path},
+    };
+    if (io_submit_batch(reqs, 4) < 0) {
+        io_unlink(tmppath);
+        return -1;
+    }
+    return 0;
+}
+
+int io_create_file(const char *path) {
+    int fd = open_path(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    IoRequest req = {.op = IO_OP_CLOSE, .fd = fd};
+    return io_submit_batch(&req, 1);
+}
+
+int io_rename(const char *from, const char *to) {
+    IoRequest req = {.op = IO_OP_RENAME, .path = from, .path2 = to};
+    return io_submit_batch(&req, 1);
+}
+
+int io_unlink(const char *path) {
+    IoRequest req = {.op = IO_OP_UNLINK, .path = path};
+    return io_submit_batch(&req, 1);
+}
+
+// io_uring has no directory read, so the names come from readdir; the
+// stats, one per entry, go out unlinked in batches of IO_MAX_BATCH
+int io_scan_dir(const char *path, IoDirEntryFn fn, void *arg) {
+    DIR *dir = opendir(path);
+    if (!dir) return -1;
+
+    int count = 0, cap = 64;
+    char (*names)[MAX_FILENAME] = malloc(cap * sizeof(*names));
+    struct dirent *entry;
+    while (names && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        if (count == cap) {
+            cap *= 2;
+            void *grown = realloc(names, cap * sizeof(*names));
+            if (!grown) break;
+            names = grown;
+        }
+        snprintf(names[count++], MAX_FILENAME, "%s", entry->d_name);
+    }
+    closedir(dir);
+    if (!names) return -1;
+
+    IoRequest reqs[IO_MAX_BATCH];
+    struct stat stats[IO_MAX_BATCH];
+    char paths[IO_MAX_BATCH][MAX_PATH + MAX_FILENAME];
+    for (int start = 0; start < count; start += IO_MAX_BATCH) {
+        int n = count - start < IO_MAX_BATCH ? count - start : IO_MAX_BATCH;
+        for (int i = 0; i < n; i++) {
+            snprintf(paths[i], sizeof(paths[i]), "%s/%s", path, names[start + i]);
+            memset(&reqs[i], 0, sizeof(reqs[i]));
+            reqs[i].op = IO_OP_STAT;
+            reqs[i].path = paths[i];
+            reqs[i].st = &stats[i];
+        }
+        run(reqs, n, 0);
+        for (int i = 0; i < n; i++) {
+            fn(names[start + i], reqs[i].result == 0 ? &stats[i] : NULL, arg);
+        }
+    }
+    free(names);
+    return 0;
+}
@@ -0,0 +1,63 @@
+#ifndef IO_ENGINE_H
+#define IO_ENGINE_H
+
+#include "common.h"
+
+// Asynchronous disk I/O for the storage server.
+//
+// Handler threads describe their file operations as a batch of IoRequests
+// and hand it to the engine, which submits it to io_uring together with
+// whatever other threads queued meanwhile, and wakes each caller when its
+// own batch has completed. Requests in a batch run in order: each one
+// starts only after the previous one finished, whether or not it failed,
+// so a read or write can be followed by the close of its descriptor.
+//
+// Without io_uring (old kernel, seccomp, or an opcode the kernel does not
+// support) batches run on a small pool of I/O threads instead, with the
+// same semantics.
+
+#define IO_OP_OPEN 1 // path, flags, mode -> fd
+#define IO_OP_READ 2 // fd, buf, len, offset -> bytes read
+#define IO_OP_WRITE 3 // fd, buf, len, offset -> bytes written
+#define IO_OP_FSYNC 4 // fd
+#define IO_OP_CLOSE 5 // fd
+#define IO_OP_RENAME 6 // path -> path2
+#define IO_OP_UNLINK 7 // path
+#define IO_OP_STAT 8 // path -> *st
+
+typedef struct {
+    int op;
+    int fd;
+    const char *path;
+    const char *path2;
+    void *buf;
+    size_t len;
+    off_t offset;
+    int flags;
+    mode_t mode;
+    struct stat *st;
+    long result; // Filled in: >= 0 on success, -errno on failure
+} IoRequest;
+
+// Called once per directory entry, "." and ".." excluded; st is NULL if
+// the entry vanished before it could be stat'ed
+typedef void (*IoDirEntryFn)(const char *name, const struct stat *st, void *arg);
+
+int io_engine_start(unsigned entries, int threads);
+const char *io_engine_backend(void);
+
+// Runs n requests in order and waits for all of them. Returns 0 if every
+// request succeeded, else -1 with errno set from the first failure.
+int io_submit_batch(IoRequest *reqs, int n);
+
+// Whole-file helpers built on batches
+int io_read_file(const char *path, char *buf, size_t buf_size);
+int io_write_file(const char *path, const char *data, size_t len);
+int io_create_file(const char *path);
+int io_rename(const char *from, const char *to);
+int io_unlink(const char *path);
+
+// Lists a directory, stat'ing every entry in one batch
+int io_scan_dir(const char *path, IoDirEntryFn fn, void *arg);
+
+#endif
@@ -0,0 +1,183 @@
+#include "journal.h"
+
+#define JOURNAL_HEADER_SIZE 8
+#define JOURNAL_MAX_RECORD (1024 * 1024)
+
+struct Journal {
+    int fd;
+    pthread_mutex_t lock;
+    pthread_cond_t flushed;
+    char *buf; // Appended, not yet written
+    size_t len, cap;
+    char *spare; // Swapped with buf by the flushing thread
+    size_t spare_cap;
+    uint64_t appended; // Position of the last record appended
+    uint64_t durable; // Position of the last record known to be on disk
+    off_t size;
+    int flushing;
+    int failed; // A flush failed, so records may be missing from the file
+};
+
+static uint32_t checksum(const void *data, size_t len) {
+    const unsigned char *p = data;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ p[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static void put32(char *p, uint32_t v) {
+    memcpy(p, &v, 4);
+}
+
+static uint32_t get32(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+// Replays the intact prefix of the file and returns its length
+static off_t replay_file(int fd, JournalRecordFn replay, void *arg) {
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) return 0;
+
+    char *data = malloc(st.st_size);
+    if (!data) return 0;
+    off_t have = 0;
+    while (have < st.st_size) {
+        ssize_t n = pread(fd, data + have, st.st_size - have, have);
+        if (n <= 0) break;
+        have += n;
+    }
+
+    off_t pos = 0;
+    while (have - pos >= JOURNAL_HEADER_SIZE) {
+        uint32_t len = get32(data + pos);
+        const char *rec = data + pos + JOURNAL_HEADER_SIZE;
+        if (len > JOURNAL_MAX_RECORD || len > have - pos - JOURNAL_HEADER_SIZE) break;
+        if (get32(data + pos + 4) != checksum(rec, len)) break;
+        if (replay) replay(rec, len, arg);
+        pos += JOURNAL_HEADER_SIZE + len;
+    }
+    free(data);
+    return pos;
+}
+
+Journal *journal_open(const char *path, JournalRecordFn replay, void *arg) {
+    Journal *j = calloc(1, sizeof(Journal));
+    if (!j) return NULL;
+    j->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (j->fd < 0) {
+        free(j);
+        return NULL;
+    }
+
+    j->size = replay_file(j->fd, replay, arg);
+    if (ftruncate(j->fd, j->size) < 0) {
+        close(j->fd);
+        free(j);
+        return NULL;
+    }
+    pthread_mutex_init(&j->lock, NULL);
+    pthread_cond_init(&j->flushed, NULL);
+    return j;
+}
+
+uint64_t journal_append(Journal *j, const void *rec, uint32_t len) {
+    pthread_mutex_lock(&j->lock);
+    size_t need = j->len + JOURNAL_HEADER_SIZE + len;
+    if (need > j->cap) {
+        size_t cap = j->cap ? j->cap * 2 : MAX_BUFFER;
+        while (cap < need) cap *= 2;
+        char *grown = realloc(j->buf, cap);
+        if (!grown) {
+            pthread_mutex_unlock(&j->lock);
+            return 0;
+        }
+        j->buf = grown;
+        j->cap = cap;
+    }
+
+    put32(j->buf + j->len, len);
+    put32(j->buf + j->len + 4, checksum(rec, len));
+    memcpy(j->buf + j->len + JOURNAL_HEADER_SIZE, rec, len);
+    j->len = need;
+    j->size += JOURNAL_HEADER_SIZE + len;
+    uint64_t lsn = ++j->appended;
+    pthread_mutex_unlock(&j->lock);
+    return lsn;
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int journal_commit(Journal *j, uint64_t lsn) {
+    if (lsn == 0) return -1;
+    pthread_mutex_lock(&j->lock);
+    while (j->durable < lsn && !j->failed) {
+        if (j->flushing) {
+            pthread_cond_wait(&j->flushed, &j->lock);
+            continue;
+        }
+
+        // Become the flusher for everything appended so far
+        j->flushing = 1;
+        char *buf = j->buf;
+        size_t len = j->len, cap = j->cap;
+        uint64_t target = j->appended;
+        j->buf = j->spare;
+        j->cap = j->spare_cap;
+        j->len = 0;
+        pthread_mutex_unlock(&j->lock);
+
+        int ok = write_all(j->fd, buf, len) == 0 && fdatasync(j->fd) == 0;
+
+        pthread_mutex_lock(&j->lock);
+        j->spare = buf;
+        j->spare_cap = cap;
+        if (ok) {
+            j->durable = target;
+        } else {
+            j->failed = 1;
+        }
+        j->flushing = 0;
+        pthread_cond_broadcast(&j->flushed);
+    }
+    int result = j->durable >= lsn ? 0 : -1;
+    pthread_mutex_unlock(&j->lock);
+    return result;
+}
+
+off_t journal_size(Journal *j) {
+    pthread_mutex_lock(&j->lock);
+    off_t size = j->size;
+    pthread_mutex_unlock(&j->lock);
+    return size;
+}
+
+int journal_truncate(Journal *j) {
+    pthread_mutex_lock(&j->lock);
+    while (j->flushing) pthread_cond_wait(&j->flushed, &j->lock);
+
+    int result = ftruncate(j->fd, 0) == 0 && fdatasync(j->fd) == 0 ? 0 : -1;
+    if (result == 0) {
+        j->len = 0;
+        j->size = 0;
+        j->durable = j->appended;
+        j->failed = 0;
+        pthread_cond_broadcast(&j->flushed);
+    }
+    pthread_mutex_unlock(&j->lock);
+    return result;
+}
@@ -0,0 +1,41 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "common.h"
+
+// Append-only log of metadata changes, made durable with group commit.
+//
+// Callers append records in the order their changes were applied (under
+// their own lock), then commit the position they got back. Commits that
+// arrive while a flush is under way wait for it and are then covered by
+// the next one, so any number of concurrent mutators share one fdatasync.
+//
+// Every record is framed as a 32-bit length, a 32-bit checksum and the
+// payload. On open the file is replayed up to the first record that is
+// incomplete or corrupt, which is where a crash may have cut it off, and
+// is truncated there.
+
+typedef struct Journal Journal;
+
+typedef void (*JournalRecordFn)(const void *rec, uint32_t len, void *arg);
+
+// Opens or creates path, passing each intact record to replay first.
+// Returns NULL on failure.
+Journal *journal_open(const char *path, JournalRecordFn replay, void *arg);
+
+// Queues a record and returns its position (1 for the first). Does not
+// wait for the disk.
+uint64_t journal_append(Journal *j, const void *rec, uint32_t len);
+
+// Waits until every record up to lsn is on disk. Returns 0, or -1 if a
+// write or sync failed.
+int journal_commit(Journal *j, uint64_t lsn);
+
+// Bytes in the log, including records not yet committed
+off_t journal_size(Journal *j);
+
+// Empties the log once a snapshot holds everything appended so far; the
+// caller keeps appends out until it returns
+int journal_truncate(Journal *j);
+
+#endif
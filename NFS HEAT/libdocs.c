@@ -0,0 +1,1241 @@
+#define _GNU_SOURCE
+#include "libdocs.h"
+#include "shard_map.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#define DOCS_MAX_CONNS 8 // Connections kept per server
+#define DOCS_PIPELINE_DEPTH 64 // Requests in flight on one connection
+#define DOCS_PENDING_BUCKETS 4096
+#define DOCS_LOCATION_CACHE_SIZE 4096 // Direct-mapped by filename hash
+#define DOCS_LOCATION_TTL 10 // Seconds a cached location is used without the naming server
+#define DOCS_MAX_EVENTS 64
+
+// Operation kinds
+#define OP_OPEN 1
+#define OP_READ 2
+#define OP_CREATE 3
+#define OP_DELETE 4
+#define OP_INFO 5
+#define OP_UNDO 6
+#define OP_WRITE 7
+#define OP_STREAM 8
+#define OP_REQUEST 9
+
+// Steps of an operation. A file operation looks its file up (unless the
+// location is cached), then talks to the storage server; a write takes the
+// lock before it sends its commands.
+#define STEP_QUEUED 0 // Submitted, not yet seen by the loop
+#define STEP_LOOKUP 1 // Asking the naming server where the file is
+#define STEP_NM 2 // Naming server request in flight
+#define STEP_SS 3 // Storage server request in flight
+#define STEP_LOCKED 4 // Write lock held, waiting for the commands
+#define STEP_COMMIT 5 // Write commands in flight
+#define STEP_STREAMING 6 // Stream requested, chunks arriving
+#define STEP_DONE 7
+
+typedef struct DocsServer DocsServer;
+
+// One connection to a server. Requests are pipelined on it and matched to
+// their operations by request id, except while a write or stream holds it
+// exclusively: both keep talking to the storage server on the same socket.
+typedef struct DocsConn {
+    DocsServer *server;
+    int fd;
+    int connecting;
+    int dead;
+    int want_out;
+    int peer; // PEER_* flags from the server's replies
+    int in_flight;
+    DocsOp *owner; // Operation holding the connection exclusively
+    char *in_buf;
+    size_t in_len, in_cap;
+    char *out_buf;
+    size_t out_len, out_cap;
+    struct DocsConn *next;
+} DocsConn;
+
+struct DocsServer {
+    char ip[INET_ADDRSTRLEN];
+    int port;
+    char local_dir[MAX_LOCAL_DIR]; // Reached over AF_UNIX when set and ip is loopback
+    int is_nm;
+    uint32_t epoch; // Naming servers: epoch on the latest reply
+    DocsClient *client;
+    DocsConn *conns;
+    int num_conns;
+    DocsOp *wait_head, *wait_tail; // Operations waiting for a connection
+    DocsServer *next;
+};
+
+typedef struct {
+    char filename[MAX_FILENAME];
+    char ip[INET_ADDRSTRLEN];
+    int port;
+    char local_dir[MAX_LOCAL_DIR];
+    int access;
+    uint32_t epoch;
+    time_t expires;
+} CachedLocation;
+
+struct DocsClient {
+    char username[MAX_USERNAME];
+    ShardMap map; // Empty if the naming server is not sharded
+    DocsServer *nm; // One per shard, in map order
+    int num_shards;
+    int home; // Shard given to docs_connect, for requests about no one file
+    DocsServer *storage_servers;
+    int epfd;
+    int wake_fd;
+    pthread_t loop;
+
+    // Shared with caller threads
+    pthread_mutex_t lock;
+    pthread_cond_t done_cond;
+    DocsOp *submit_head, *submit_tail;
+    int stopping;
+
+    // Owned by the loop thread
+    DocsOp *pending[DOCS_PENDING_BUCKETS];
+    DocsConn *dead_conns;
+    uint32_t next_id;
+    CachedLocation locations[DOCS_LOCATION_CACHE_SIZE];
+};
+
+struct DocsOp {
+    DocsClient *client;
+    int kind;
+    int step;
+    char filename[MAX_FILENAME];
+    int sentence_num;
+    char *commands;
+    Message *request; // OP_REQUEST only
+    int shard; // OP_REQUEST: naming server shard it goes to
+    Message reply;
+
+    uint32_t request_id;
+    DocsServer *target;
+    DocsConn *conn;
+    int exclusive;
+    int from_cache, relocated, retried;
+
+    int next_word; // Streams: where to resume
+    int credit_owed;
+    DocsChunkHandler on_chunk;
+    void *chunk_arg;
+
+    // Guarded by client->lock
+    int done, completing, released;
+    int queued; // On the submit queue; the loop must leave next alone
+    int error;
+    DocsCompletion on_complete;
+    void *complete_arg;
+
+    DocsOp *next; // Submit queue or server wait queue
+    DocsOp *hash_next; // Pending table
+};
+
+static void op_start(DocsOp *op);
+static void op_complete(DocsOp *op, int error);
+static void server_pump(DocsServer *server);
+static void conn_fail(DocsConn *conn);
+
+// ===== OPERATIONS TABLE =====
+
+static void pending_insert(DocsClient *c, DocsOp *op) {
+    DocsOp **bucket = &c->pending[op->request_id % DOCS_PENDING_BUCKETS];
+    op->hash_next = *bucket;
+    *bucket = op;
+}
+
+static DocsOp *pending_find(DocsClient *c, uint32_t id) {
+    DocsOp *op = c->pending[id % DOCS_PENDING_BUCKETS];
+    while (op && op->request_id != id) op = op->hash_next;
+    return op;
+}
+
+static void pending_remove(DocsClient *c, DocsOp *op) {
+    DocsOp **link = &c->pending[op->request_id % DOCS_PENDING_BUCKETS];
+    while (*link && *link != op) link = &(*link)->hash_next;
+    if (*link) *link = op->hash_next;
+    op->hash_next = NULL;
+}
+
+// ===== LOCATION CACHE =====
+
+static CachedLocation *location_slot(DocsClient *c, const char *filename) {
+    unsigned long hash = 5381;
+    for (const char *p = filename; *p; p++) {
+        hash = hash * 33 + (unsigned char)*p;
+    }
+    return &c->locations[hash % DOCS_LOCATION_CACHE_SIZE];
+}
+
+static int required_access(DocsOp *op) {
+    return op->kind == OP_WRITE ? ACCESS_WRITE : ACCESS_READ;
+}
+
+// Naming server shard that answers for the operation
+static DocsServer *op_nm(DocsOp *op) {
+    DocsClient *c = op->client;
+    return &c->nm[op->kind == OP_REQUEST ? op->shard : shard_of(&c->map, op->filename)];
+}
+
+static CachedLocation *location_lookup(DocsOp *op) {
+    CachedLocation *entry = location_slot(op->client, op->filename);
+    if (strcmp(entry->filename, op->filename) == 0 && entry->epoch == op_nm(op)->epoch &&
+        entry->access >= required_access(op) && time(NULL) < entry->expires) {
+        return entry;
+    }
+    return NULL;
+}
+
+static void location_store(DocsOp *op, const Message *reply) {
+    CachedLocation *entry = location_slot(op->client, op->filename);
+    strcpy(entry->filename, op->filename);
+    strcpy(entry->ip, reply->ss_ip);
+    entry->port = reply->ss_port;
+    strcpy(entry->local_dir, reply->local_dir);
+    entry->access = required_access(op);
+    entry->epoch = reply->epoch;
+    entry->expires = time(NULL) + DOCS_LOCATION_TTL;
+}
+
+static void location_forget(DocsClient *c, const char *filename) {
+    CachedLocation *entry = location_slot(c, filename);
+    if (strcmp(entry->filename, filename) == 0) entry->filename[0] = '\0';
+}
+
+// ===== CONNECTIONS =====
+
+// The local directory only affects new connections, so a server that has
+// just started advertising one is switched over as its connections turn over
+static DocsServer *get_storage_server(DocsClient *c, const char *ip, int port,
+                                      const char *local_dir) {
+    for (DocsServer *s = c->storage_servers; s; s = s->next) {
+        if (s->port == port && strcmp(s->ip, ip) == 0) {
+            strcpy(s->local_dir, local_dir);
+            return s;
+        }
+    }
+
+    DocsServer *s = calloc(1, sizeof(DocsServer));
+    if (!s) return NULL;
+    strcpy(s->ip, ip);
+    s->port = port;
+    strcpy(s->local_dir, local_dir);
+    s->client = c;
+    s->next = c->storage_servers;
+    c->storage_servers = s;
+    return s;
+}
+
+static void conn_watch(DocsClient *c, DocsConn *conn, int op) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | (conn->want_out ? EPOLLOUT : 0);
+    ev.data.ptr = conn;
+    epoll_ctl(c->epfd, op, conn->fd, &ev);
+}
+
+// A local server's AF_UNIX socket accepts or refuses at once, so a failure
+// here just means falling back to TCP
+static int connect_local_nonblocking(DocsServer *server) {
+    if (!server->local_dir[0] || !is_loopback(server->ip)) return -1;
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    local_socket_path(addr.sun_path, sizeof(addr.sun_path), server->local_dir, server->port);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static DocsConn *conn_open(DocsClient *c, DocsServer *server) {
+    int fd = connect_local_nonblocking(server);
+    if (fd < 0) {
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fd < 0) return NULL;
+
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(server->port);
+        inet_pton(AF_INET, server->ip, &addr.sin_addr);
+
+        int opt = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+        if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+            close(fd);
+            return NULL;
+        }
+    }
+
+    DocsConn *conn = calloc(1, sizeof(DocsConn));
+    if (!conn) {
+        close(fd);
+        return NULL;
+    }
+    conn->server = server;
+    conn->fd = fd;
+    conn->connecting = 1;
+    conn->want_out = 1;
+    conn->next = server->conns;
+    server->conns = conn;
+    server->num_conns++;
+    conn_watch(c, conn, EPOLL_CTL_ADD);
+    return conn;
+}
+
+static void conn_flush(DocsClient *c, DocsConn *conn) {
+    if (conn->connecting || conn->dead) return;
+
+    size_t sent = 0;
+    while (sent < conn->out_len) {
+        ssize_t n = send(conn->fd, conn->out_buf + sent, conn->out_len - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n <= 0) {
+            conn_fail(conn);
+            return;
+        }
+        sent += n;
+    }
+    memmove(conn->out_buf, conn->out_buf + sent, conn->out_len - sent);
+    conn->out_len -= sent;
+
+    int want_out = conn->out_len > 0;
+    if (want_out != conn->want_out) {
+        conn->want_out = want_out;
+        conn_watch(c, conn, EPOLL_CTL_MOD);
+    }
+}
+
+static int conn_queue(DocsClient *c, DocsConn *conn, Message *msg) {
+    size_t len;
+    char *frame = serialize_message(msg, conn->peer, &len);
+    if (!frame) return -1;
+
+    if (conn->out_len + len > conn->out_cap) {
+        size_t cap = conn->out_cap ? conn->out_cap : MAX_BUFFER;
+        while (cap < conn->out_len + len) cap *= 2;
+        char *grown = realloc(conn->out_buf, cap);
+        if (!grown) {
+            free(frame);
+            return -1;
+        }
+        conn->out_buf = grown;
+        conn->out_cap = cap;
+    }
+    memcpy(conn->out_buf + conn->out_len, frame, len);
+    conn->out_len += len;
+    free(frame);
+
+    conn_flush(c, conn);
+    return 0;
+}
+
+// Fills in the message for the operation's current step
+static void build_request(DocsOp *op, Message *msg) {
+    DocsClient *c = op->client;
+    init_message(msg);
+
+    if (op->kind == OP_REQUEST && op->step == STEP_NM) {
+        *msg = *op->request;
+        msg->ext_data = NULL;
+        set_message_data(msg, message_data(op->request), message_data_len(op->request));
+        strcpy(msg->username, c->username);
+        return;
+    }
+
+    strcpy(msg->filename, op->filename);
+    switch (op->step) {
+        case STEP_LOOKUP:
+            msg->type = op->kind == OP_WRITE ? MSG_WRITE_FILE :
+                        op->kind == OP_STREAM ? MSG_STREAM_FILE : MSG_READ_FILE;
+            strcpy(msg->username, c->username);
+            break;
+
+        case STEP_NM:
+            msg->type = op->kind == OP_CREATE ? MSG_CREATE_FILE : MSG_DELETE_FILE;
+            strcpy(msg->username, c->username);
+            break;
+
+        case STEP_SS:
+            msg->type = op->kind == OP_READ ? MSG_READ_FILE :
+                        op->kind == OP_INFO ? MSG_INFO_FILE :
+                        op->kind == OP_UNDO ? MSG_UNDO : MSG_WRITE_FILE;
+            msg->sentence_num = op->sentence_num; // Empty data asks for the write lock
+            break;
+
+        case STEP_STREAMING:
+            msg->type = MSG_STREAM_FILE;
+            msg->flags = STREAM_CHUNKED;
+            msg->word_index = op->next_word;
+            msg->sentence_num = STREAM_DEFAULT_WINDOW;
+            break;
+
+        case STEP_COMMIT:
+            msg->type = MSG_WRITE_FILE;
+            msg->sentence_num = op->sentence_num;
+            set_message_data(msg, op->commands, strlen(op->commands));
+            break;
+    }
+}
+
+// Sends the operation's current step on a connection it may use
+static void op_transmit(DocsOp *op, DocsConn *conn) {
+    DocsClient *c = op->client;
+    Message msg;
+    build_request(op, &msg);
+    if (++c->next_id == 0) c->next_id = 1;
+    msg.request_id = op->request_id = c->next_id;
+
+    op->conn = conn;
+    conn->in_flight++;
+    if (op->exclusive) conn->owner = op;
+    pending_insert(c, op);
+
+    if (conn_queue(c, conn, &msg) < 0 && !conn->dead) conn_fail(conn);
+    free_message(&msg);
+}
+
+// Queues the operation for a connection to server
+static void op_send(DocsOp *op, DocsServer *server, int step) {
+    op->step = step;
+    op->target = server;
+    op->exclusive = step == STEP_SS && op->kind == OP_WRITE;
+    op->exclusive |= step == STEP_STREAMING;
+    op->next = NULL;
+
+    if (server->wait_tail) server->wait_tail->next = op;
+    else server->wait_head = op;
+    server->wait_tail = op;
+    server_pump(server);
+}
+
+// Picks a connection for the operation: exclusive steps need an idle one,
+// others share the least loaded connection that is not held
+static DocsConn *pick_conn(DocsClient *c, DocsServer *server, DocsOp *op) {
+    DocsConn *best = NULL;
+    for (DocsConn *conn = server->conns; conn; conn = conn->next) {
+        if (conn->dead || conn->owner) continue;
+        if (op->exclusive ? conn->in_flight > 0 : conn->in_flight >= DOCS_PIPELINE_DEPTH) continue;
+        if (!best || conn->in_flight < best->in_flight) best = conn;
+    }
+
+    if ((!best || best->in_flight > 0) && server->num_conns < DOCS_MAX_CONNS) {
+        DocsConn *fresh = conn_open(c, server);
+        if (fresh) return fresh;
+    }
+    return best;
+}
+
+static void server_pump(DocsServer *server) {
+    while (server->wait_head) {
+        DocsOp *op = server->wait_head;
+        DocsClient *c = op->client;
+        DocsConn *conn = pick_conn(c, server, op);
+        if (!conn) {
+            if (server->num_conns > 0) return; // Wait for a connection to free up
+
+            // Nothing open and nothing can be opened
+            server->wait_head = op->next;
+            if (!server->wait_head) server->wait_tail = NULL;
+            op_complete(op, server->is_nm ? DOCS_ERR_NM_UNAVAILABLE : ERR_SS_UNAVAILABLE);
+            continue;
+        }
+
+        server->wait_head = op->next;
+        if (!server->wait_head) server->wait_tail = NULL;
+        op_transmit(op, conn);
+    }
+}
+
+// Drops a connection. Operations on it are retried where that is safe;
+// the rest fail.
+// Takes a write that holds its lock away from the caller so the loop can
+// fail it. One already submitted is left to drain_submissions, which fails
+// it once it finds the connection gone.
+static int claim_locked(DocsOp *op) {
+    DocsClient *c = op->client;
+    pthread_mutex_lock(&c->lock);
+    int queued = op->queued;
+    if (!queued) op->done = 0;
+    pthread_mutex_unlock(&c->lock);
+    return !queued;
+}
+
+static void conn_fail(DocsConn *conn) {
+    if (conn->dead) return;
+    DocsServer *server = conn->server;
+    DocsClient *c = server->client;
+
+    conn->dead = 1;
+    for (DocsConn **link = &server->conns; *link; link = &(*link)->next) {
+        if (*link == conn) {
+            *link = conn->next;
+            break;
+        }
+    }
+    server->num_conns--;
+
+    DocsOp *orphans = NULL;
+    epoll_ctl(c->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    conn->next = c->dead_conns;
+    c->dead_conns = conn;
+
+    for (int b = 0; b < DOCS_PENDING_BUCKETS; b++) {
+        DocsOp **link = &c->pending[b];
+        while (*link) {
+            DocsOp *op = *link;
+            if (op->conn == conn) {
+                *link = op->hash_next;
+                op->next = orphans;
+                orphans = op;
+            } else {
+                link = &op->hash_next;
+            }
+        }
+    }
+    if (conn->owner && conn->owner->step == STEP_LOCKED) {
+        DocsOp *op = conn->owner;
+        if (claim_locked(op)) {
+            op->next = orphans;
+            orphans = op;
+        } else {
+            conn->owner = NULL;
+            op->conn = NULL;
+        }
+    }
+
+    int never_connected = conn->connecting;
+    while (orphans) {
+        DocsOp *op = orphans;
+        orphans = op->next;
+        op->conn = NULL;
+
+        if (never_connected) {
+            op_complete(op, server->is_nm ? DOCS_ERR_NM_UNAVAILABLE : ERR_SS_UNAVAILABLE);
+        } else if ((op->step == STEP_SS || op->step == STEP_STREAMING) &&
+                   op->from_cache && !op->relocated) {
+            // The cached server is gone; ask the naming server again
+            op->relocated = 1;
+            location_forget(c, op->filename);
+            op_start(op);
+        } else if (!op->retried && (op->step == STEP_LOOKUP || op->step == STEP_STREAMING ||
+                   (op->step == STEP_SS && (op->kind == OP_READ || op->kind == OP_INFO)))) {
+            // Safe to repeat; a stream resumes after the last word delivered
+            op->retried = 1;
+            op_send(op, server, op->step);
+        } else {
+            op_complete(op, server->is_nm ? DOCS_ERR_NM_UNAVAILABLE : ERR_SS_UNAVAILABLE);
+        }
+    }
+
+    // A server that refuses connections fails everything waiting for it
+    if (never_connected) {
+        while (server->wait_head && server->num_conns == 0) {
+            DocsOp *op = server->wait_head;
+            server->wait_head = op->next;
+            if (!server->wait_head) server->wait_tail = NULL;
+            op_complete(op, server->is_nm ? DOCS_ERR_NM_UNAVAILABLE : ERR_SS_UNAVAILABLE);
+        }
+    } else {
+        server_pump(server);
+    }
+}
+
+// ===== OPERATION STATE MACHINE =====
+
+static void op_release_conn(DocsOp *op) {
+    DocsConn *conn = op->conn;
+    op->conn = NULL;
+    if (conn && conn->owner == op) {
+        conn->owner = NULL;
+        if (!conn->dead) server_pump(conn->server);
+    }
+}
+
+static void op_free(DocsOp *op) {
+    free_message(&op->reply);
+    if (op->request) {
+        free_message(op->request);
+        free(op->request);
+    }
+    free(op->commands);
+    free(op);
+}
+
+static void op_complete(DocsOp *op, int error) {
+    DocsClient *c = op->client;
+    op_release_conn(op);
+    op->step = STEP_DONE;
+    if (error && op->reply.type == 0) {
+        op->reply.type = MSG_ERROR;
+        op->reply.error_code = error;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    op->completing = 1;
+    op->error = error;
+    DocsCompletion fn = op->on_complete;
+    void *arg = op->complete_arg;
+    pthread_mutex_unlock(&c->lock);
+
+    if (fn) fn(op, arg);
+
+    pthread_mutex_lock(&c->lock);
+    op->done = 1;
+    int released = op->released;
+    pthread_cond_broadcast(&c->done_cond);
+    pthread_mutex_unlock(&c->lock);
+
+    if (released) op_free(op);
+}
+
+// First step of an operation, or its restart after a stale location
+static void op_start(DocsOp *op) {
+    DocsClient *c = op->client;
+
+    if (op->kind == OP_CREATE || op->kind == OP_DELETE || op->kind == OP_REQUEST) {
+        op_send(op, op_nm(op), STEP_NM);
+        return;
+    }
+
+    CachedLocation *entry = location_lookup(op);
+    if (!entry) {
+        op->from_cache = 0;
+        op_send(op, op_nm(op), STEP_LOOKUP);
+        return;
+    }
+
+    op->from_cache = 1;
+    if (op->kind == OP_OPEN) {
+        init_message(&op->reply);
+        op->reply.type = MSG_RESPONSE;
+        strcpy(op->reply.ss_ip, entry->ip);
+        op->reply.ss_port = entry->port;
+        strcpy(op->reply.local_dir, entry->local_dir);
+        op_complete(op, ERR_SUCCESS);
+        return;
+    }
+
+    DocsServer *server = get_storage_server(c, entry->ip, entry->port, entry->local_dir);
+    if (!server) {
+        op_complete(op, ERR_SS_UNAVAILABLE);
+        return;
+    }
+    op_send(op, server, op->kind == OP_STREAM ? STEP_STREAMING : STEP_SS);
+}
+
+static void op_finish(DocsOp *op, Message *reply) {
+    free_message(&op->reply);
+    op->reply = *reply;
+    op_complete(op, reply->type == MSG_ERROR ? reply->error_code : ERR_SUCCESS);
+}
+
+// Handles the reply to an operation's lookup on the naming server
+static void on_lookup_reply(DocsOp *op, Message *reply) {
+    if (reply->type == MSG_ERROR) {
+        op_finish(op, reply);
+        return;
+    }
+
+    location_store(op, reply);
+    if (op->kind == OP_OPEN) {
+        op_finish(op, reply);
+        return;
+    }
+
+    DocsServer *server = get_storage_server(op->client, reply->ss_ip, reply->ss_port,
+                                            reply->local_dir);
+    free_message(reply);
+    if (!server) {
+        op_complete(op, ERR_SS_UNAVAILABLE);
+        return;
+    }
+    op_send(op, server, op->kind == OP_STREAM ? STEP_STREAMING : STEP_SS);
+}
+
+// Handles a storage server reply that ends a step
+static void on_storage_reply(DocsOp *op, Message *reply) {
+    DocsClient *c = op->client;
+
+    if (reply->type == MSG_ERROR && reply->error_code == ERR_STALE_LOCATION) {
+        location_forget(c, op->filename);
+        if (op->from_cache && !op->relocated) {
+            free_message(reply);
+            op->relocated = 1;
+            op_release_conn(op);
+            op_start(op);
+            return;
+        }
+        // The naming server itself sent us here, so the file is gone
+        reply->error_code = ERR_FILE_NOT_FOUND;
+    }
+
+    if (op->kind == OP_WRITE && op->step == STEP_SS && reply->type == MSG_ACK) {
+        free_message(reply);
+        if (op->commands) {
+            op->step = STEP_COMMIT;
+            op_transmit(op, op->conn);
+            return;
+        }
+
+        // Lock held; hand back to the caller until docs_write_commit
+        pthread_mutex_lock(&c->lock);
+        op->step = STEP_LOCKED;
+        op->error = ERR_SUCCESS;
+        op->done = 1;
+        pthread_cond_broadcast(&c->done_cond);
+        pthread_mutex_unlock(&c->lock);
+        return;
+    }
+
+    op_finish(op, reply);
+}
+
+static void on_stream_chunk(DocsOp *op, Message *chunk) {
+    if (op->on_chunk) op->on_chunk(op, message_data(chunk), chunk->word_index, op->chunk_arg);
+    op->next_word = chunk->word_index + (chunk->sentence_num > 0 ? chunk->sentence_num : 1);
+    free_message(chunk);
+
+    // Hand back credit every half window
+    if (++op->credit_owed >= STREAM_DEFAULT_WINDOW / 2 && op->conn) {
+        Message credit;
+        init_message(&credit);
+        credit.type = MSG_STREAM_CREDIT;
+        credit.request_id = op->request_id;
+        credit.sentence_num = op->credit_owed;
+        op->credit_owed = 0;
+        conn_queue(op->client, op->conn, &credit);
+    }
+}
+
+static void conn_dispatch(DocsClient *c, DocsConn *conn, Message *msg) {
+    if (conn->server->is_nm && msg->epoch) conn->server->epoch = msg->epoch;
+
+    DocsOp *op = pending_find(c, msg->request_id);
+    if (!op || op->conn != conn) {
+        free_message(msg);
+        return;
+    }
+
+    if (op->step == STEP_STREAMING && msg->type == MSG_RESPONSE) {
+        on_stream_chunk(op, msg);
+        return;
+    }
+
+    pending_remove(c, op);
+    conn->in_flight--;
+    op->credit_owed = 0;
+
+    switch (op->step) {
+        case STEP_LOOKUP:
+            op_release_conn(op);
+            on_lookup_reply(op, msg);
+            break;
+        case STEP_NM:
+            if (op->kind == OP_DELETE && msg->type == MSG_ACK) {
+                location_forget(c, op->filename);
+            }
+            op_finish(op, msg);
+            break;
+        case STEP_SS:
+        case STEP_STREAMING:
+        case STEP_COMMIT:
+            on_storage_reply(op, msg);
+            break;
+        default:
+            free_message(msg);
+    }
+
+    if (!conn->dead) server_pump(conn->server);
+}
+
+// ===== EVENT LOOP =====
+
+static void conn_read(DocsClient *c, DocsConn *conn) {
+    while (!conn->dead) {
+        if (conn->in_cap - conn->in_len < MAX_BUFFER) {
+            size_t cap = conn->in_cap ? conn->in_cap * 2 : MAX_BUFFER * 2;
+            char *grown = realloc(conn->in_buf, cap);
+            if (!grown) {
+                conn_fail(conn);
+                return;
+            }
+            conn->in_buf = grown;
+            conn->in_cap = cap;
+        }
+
+        ssize_t n = recv(conn->fd, conn->in_buf + conn->in_len, conn->in_cap - conn->in_len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n <= 0) {
+            conn_fail(conn);
+            return;
+        }
+        conn->in_len += n;
+    }
+
+    size_t offset = 0;
+    while (!conn->dead) {
+        Message msg;
+        init_message(&msg);
+        int used = parse_message(conn->in_buf + offset, conn->in_len - offset, &msg, &conn->peer);
+        if (used == 0) break;
+        if (used < 0 || (conn->peer & PEER_LEGACY)) {
+            conn_fail(conn);
+            return;
+        }
+        offset += used;
+        conn_dispatch(c, conn, &msg);
+    }
+    if (conn->dead) return;
+    memmove(conn->in_buf, conn->in_buf + offset, conn->in_len - offset);
+    conn->in_len -= offset;
+}
+
+static void conn_writable(DocsClient *c, DocsConn *conn) {
+    if (conn->connecting) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+            conn_fail(conn);
+            return;
+        }
+        conn->connecting = 0;
+    }
+    conn_flush(c, conn);
+}
+
+// Takes submitted operations and commits off the shared queue
+static void drain_submissions(DocsClient *c) {
+    uint64_t count;
+    if (read(c->wake_fd, &count, sizeof(count)) < 0) {
+        // Nothing to read; the queue is checked anyway
+    }
+
+    pthread_mutex_lock(&c->lock);
+    DocsOp *op = c->submit_head;
+    c->submit_head = c->submit_tail = NULL;
+    pthread_mutex_unlock(&c->lock);
+
+    while (op) {
+        DocsOp *next = op->next;
+        op->next = NULL;
+        pthread_mutex_lock(&c->lock);
+        op->queued = 0;
+        pthread_mutex_unlock(&c->lock);
+
+        if (op->step == STEP_QUEUED) {
+            op_start(op);
+        } else if (op->step == STEP_LOCKED) {
+            if (!op->conn) {
+                op_complete(op, ERR_SS_UNAVAILABLE);
+            } else if (op->released) {
+                // Abandoned while holding the lock; the storage server
+                // releases it when the connection goes away
+                DocsConn *conn = op->conn;
+                conn->owner = NULL;
+                op->conn = NULL;
+                conn_fail(conn);
+                op_complete(op, ERR_SS_UNAVAILABLE);
+            } else {
+                op->step = STEP_COMMIT;
+                op_transmit(op, op->conn);
+            }
+        }
+        op = next;
+    }
+}
+
+static void fail_waiting(DocsServer *s) {
+    while (s->wait_head) {
+        DocsOp *op = s->wait_head;
+        s->wait_head = op->next;
+        op_complete(op, ERR_SS_UNAVAILABLE);
+    }
+    s->wait_tail = NULL;
+    for (DocsConn *conn = s->conns; conn; conn = conn->next) {
+        if (conn->owner && conn->owner->step == STEP_LOCKED) {
+            DocsOp *op = conn->owner;
+            conn->owner = NULL;
+            op->conn = NULL;
+            if (claim_locked(op)) op_complete(op, ERR_SS_UNAVAILABLE);
+        }
+    }
+}
+
+// Fails every operation still in progress when the client shuts down
+static void fail_everything(DocsClient *c) {
+    for (int b = 0; b < DOCS_PENDING_BUCKETS; b++) {
+        while (c->pending[b]) {
+            DocsOp *op = c->pending[b];
+            c->pending[b] = op->hash_next;
+            op->conn = NULL;
+            op_complete(op, ERR_SS_UNAVAILABLE);
+        }
+    }
+
+    for (int i = 0; i < c->num_shards; i++) {
+        fail_waiting(&c->nm[i]);
+    }
+    for (DocsServer *s = c->storage_servers; s; s = s->next) {
+        fail_waiting(s);
+    }
+}
+
+static void free_dead_conns(DocsClient *c) {
+    while (c->dead_conns) {
+        DocsConn *conn = c->dead_conns;
+        c->dead_conns = conn->next;
+        free(conn->in_buf);
+        free(conn->out_buf);
+        free(conn);
+    }
+}
+
+static void *event_loop(void *arg) {
+    DocsClient *c = arg;
+    struct epoll_event events[DOCS_MAX_EVENTS];
+
+    while (1) {
+        int n = epoll_wait(c->epfd, events, DOCS_MAX_EVENTS, -1);
+        if (n < 0 && errno != EINTR) break;
+
+        for (int i = 0; i < n; i++) {
+            DocsConn *conn = events[i].data.ptr;
+            if (!conn) {
+                drain_submissions(c);
+                continue;
+            }
+            if (conn->dead) continue;
+
+            if (events[i].events & EPOLLOUT) conn_writable(c, conn);
+            if (!conn->dead && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+                if (conn->connecting) conn_writable(c, conn);
+                if (!conn->dead) conn_read(c, conn);
+            }
+        }
+        free_dead_conns(c);
+
+        pthread_mutex_lock(&c->lock);
+        int stopping = c->stopping;
+        pthread_mutex_unlock(&c->lock);
+        if (stopping) break;
+    }
+
+    drain_submissions(c);
+    fail_everything(c);
+    return NULL;
+}
+
+// ===== PUBLIC API =====
+
+// Asks the naming server for its shard map, once and before the loop
+// starts. One that has none, or cannot be reached yet, is the only shard.
+static void load_shard_map(DocsClient *c, const char *nm_ip, int nm_port) {
+    int sock = connect_to_server_via(nm_ip, nm_port, LOCAL_SOCKET_DIR);
+    if (sock >= 0) {
+        Message msg, reply;
+        init_message(&msg);
+        init_message(&reply);
+        msg.type = MSG_SHARD_MAP;
+        strcpy(msg.username, c->username);
+        if (send_message(sock, &msg) >= 0 && receive_message(sock, &reply) >= 0) {
+            if (reply.type != MSG_RESPONSE || !reply.data[0] || shard_map_parse(&c->map, reply.data) < 0) {
+                memset(&c->map, 0, sizeof(c->map));
+            }
+            free_message(&reply);
+        }
+        close(sock);
+    }
+
+    c->home = shard_find(&c->map, nm_ip, nm_port);
+    if (c->home < 0) c->home = 0;
+    if (c->map.num_shards == 0) {
+        strncpy(c->map.shards[0].ip, nm_ip, INET_ADDRSTRLEN - 1);
+        c->map.shards[0].port = nm_port;
+    }
+    c->num_shards = c->map.num_shards > 0 ? c->map.num_shards : 1;
+}
+
+DocsClient *docs_connect(const char *nm_ip, int nm_port, const char *username) {
+    DocsClient *c = calloc(1, sizeof(DocsClient));
+    if (!c) return NULL;
+
+    strncpy(c->username, username, sizeof(c->username) - 1);
+    load_shard_map(c, nm_ip, nm_port);
+    c->nm = calloc(c->num_shards, sizeof(DocsServer));
+    if (!c->nm) {
+        free(c);
+        return NULL;
+    }
+    for (int i = 0; i < c->num_shards; i++) {
+        DocsServer *nm = &c->nm[i];
+        strcpy(nm->ip, c->map.shards[i].ip);
+        nm->port = c->map.shards[i].port;
+        strcpy(nm->local_dir, LOCAL_SOCKET_DIR);
+        nm->is_nm = 1;
+        nm->client = c;
+    }
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->done_cond, NULL);
+
+    c->epfd = epoll_create1(0);
+    c->wake_fd = eventfd(0, EFD_NONBLOCK);
+    if (c->epfd < 0 || c->wake_fd < 0) goto fail;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(c->epfd, EPOLL_CTL_ADD, c->wake_fd, &ev) < 0) goto fail;
+
+    if (pthread_create(&c->loop, NULL, event_loop, c) != 0) goto fail;
+    return c;
+
+fail:
+    if (c->epfd >= 0) close(c->epfd);
+    if (c->wake_fd >= 0) close(c->wake_fd);
+    free(c->nm);
+    free(c);
+    return NULL;
+}
+
+static void wake_loop(DocsClient *c) {
+    uint64_t one = 1;
+    if (write(c->wake_fd, &one, sizeof(one)) < 0) {
+        // Counter saturated; the loop is awake already
+    }
+}
+
+static void close_conns(DocsServer *s) {
+    while (s->conns) {
+        DocsConn *conn = s->conns;
+        s->conns = conn->next;
+        close(conn->fd);
+        free(conn->in_buf);
+        free(conn->out_buf);
+        free(conn);
+    }
+}
+
+void docs_disconnect(DocsClient *client) {
+    if (!client) return;
+
+    pthread_mutex_lock(&client->lock);
+    client->stopping = 1;
+    pthread_mutex_unlock(&client->lock);
+    wake_loop(client);
+    pthread_join(client->loop, NULL);
+
+    for (int i = 0; i < client->num_shards; i++) {
+        close_conns(&client->nm[i]);
+    }
+    while (client->storage_servers) {
+        DocsServer *s = client->storage_servers;
+        client->storage_servers = s->next;
+        close_conns(s);
+        free(s);
+    }
+    free(client->nm);
+    free_dead_conns(client);
+    close(client->epfd);
+    close(client->wake_fd);
+    free(client);
+}
+
+static void submit(DocsOp *op) {
+    DocsClient *c = op->client;
+    pthread_mutex_lock(&c->lock);
+    op->next = NULL;
+    op->queued = 1;
+    if (c->submit_tail) c->submit_tail->next = op;
+    else c->submit_head = op;
+    c->submit_tail = op;
+    pthread_mutex_unlock(&c->lock);
+    wake_loop(c);
+}
+
+static DocsOp *new_op(DocsClient *client, int kind, const char *filename) {
+    if (!client) return NULL;
+    DocsOp *op = calloc(1, sizeof(DocsOp));
+    if (!op) return NULL;
+    op->client = client;
+    op->kind = kind;
+    if (filename) strncpy(op->filename, filename, sizeof(op->filename) - 1);
+    return op;
+}
+
+static DocsOp *submit_new(DocsClient *client, int kind, const char *filename) {
+    DocsOp *op = new_op(client, kind, filename);
+    if (op) submit(op);
+    return op;
+}
+
+DocsOp *docs_open(DocsClient *client, const char *filename) {
+    return submit_new(client, OP_OPEN, filename);
+}
+
+DocsOp *docs_read(DocsClient *client, const char *filename) {
+    return submit_new(client, OP_READ, filename);
+}
+
+DocsOp *docs_create(DocsClient *client, const char *filename) {
+    return submit_new(client, OP_CREATE, filename);
+}
+
+DocsOp *docs_delete(DocsClient *client, const char *filename) {
+    return submit_new(client, OP_DELETE, filename);
+}
+
+DocsOp *docs_info(DocsClient *client, const char *filename) {
+    return submit_new(client, OP_INFO, filename);
+}
+
+DocsOp *docs_undo(DocsClient *client, const char *filename) {
+    return submit_new(client, OP_UNDO, filename);
+}
+
+DocsOp *docs_write_lock(DocsClient *client, const char *filename, int sentence_num) {
+    DocsOp *op = new_op(client, OP_WRITE, filename);
+    if (!op) return NULL;
+    op->sentence_num = sentence_num;
+    submit(op);
+    return op;
+}
+
+DocsOp *docs_write(DocsClient *client, const char *filename, int sentence_num,
+                   const char *commands) {
+    DocsOp *op = new_op(client, OP_WRITE, filename);
+    if (!op) return NULL;
+    op->sentence_num = sentence_num;
+    op->commands = strdup(commands ? commands : "ETIRW\n");
+    if (!op->commands) {
+        free(op);
+        return NULL;
+    }
+    submit(op);
+    return op;
+}
+
+int docs_write_commit(DocsOp *op, const char *commands) {
+    DocsClient *c = op->client;
+    char *copy = strdup(commands ? commands : "ETIRW\n");
+    if (!copy) return -1;
+
+    pthread_mutex_lock(&c->lock);
+    if (op->kind != OP_WRITE || op->step != STEP_LOCKED || !op->done || op->released) {
+        pthread_mutex_unlock(&c->lock);
+        free(copy);
+        return -1;
+    }
+    free(op->commands);
+    op->commands = copy;
+    op->done = 0;
+    pthread_mutex_unlock(&c->lock);
+
+    submit(op);
+    return 0;
+}
+
+DocsOp *docs_stream(DocsClient *client, const char *filename, int start_word,
+                    DocsChunkHandler on_chunk, void *arg) {
+    DocsOp *op = new_op(client, OP_STREAM, filename);
+    if (!op) return NULL;
+    op->next_word = start_word;
+    op->on_chunk = on_chunk;
+    op->chunk_arg = arg;
+    submit(op);
+    return op;
+}
+
+DocsOp *docs_request(DocsClient *client, const Message *msg) {
+    if (!client) return NULL;
+    int shard = shard_keyed_request(msg->type) ? shard_of(&client->map, msg->filename) : client->home;
+    return docs_request_shard(client, shard, msg);
+}
+
+DocsOp *docs_request_shard(DocsClient *client, int shard, const Message *msg) {
+    if (!client || shard < 0 || shard >= client->num_shards) return NULL;
+    DocsOp *op = new_op(client, OP_REQUEST, NULL);
+    if (!op) return NULL;
+    op->shard = shard;
+    op->request = malloc(sizeof(Message));
+    if (!op->request) {
+        free(op);
+        return NULL;
+    }
+    *op->request = *msg;
+    op->request->ext_data = NULL;
+    Message *src = (Message*)msg;
+    set_message_data(op->request, message_data(src), message_data_len(src));
+    submit(op);
+    return op;
+}
+
+int docs_num_shards(DocsClient *client) {
+    return client->num_shards;
+}
+
+int docs_shard_of(DocsClient *client, const char *filename) {
+    return shard_of(&client->map, filename);
+}
+
+int docs_wait(DocsOp *op) {
+    DocsClient *c = op->client;
+    pthread_mutex_lock(&c->lock);
+    while (!op->done) {
+        pthread_cond_wait(&c->done_cond, &c->lock);
+    }
+    int error = op->error;
+    pthread_mutex_unlock(&c->lock);
+    return error;
+}
+
+int docs_done(DocsOp *op) {
+    DocsClient *c = op->client;
+    pthread_mutex_lock(&c->lock);
+    int done = op->done;
+    pthread_mutex_unlock(&c->lock);
+    return done;
+}
+
+void docs_on_complete(DocsOp *op, DocsCompletion fn, void *arg) {
+    DocsClient *c = op->client;
+    pthread_mutex_lock(&c->lock);
+    int already = op->completing || (op->done && op->step != STEP_LOCKED);
+    if (!already) {
+        op->on_complete = fn;
+        op->complete_arg = arg;
+    }
+    pthread_mutex_unlock(&c->lock);
+    if (already && fn) fn(op, arg);
+}
+
+Message *docs_reply(DocsOp *op) {
+    return &op->reply;
+}
+
+void docs_release(DocsOp *op) {
+    if (!op) return;
+    DocsClient *c = op->client;
+
+    pthread_mutex_lock(&c->lock);
+    int free_now = op->done && op->step != STEP_LOCKED;
+    int abandon_lock = op->done && op->step == STEP_LOCKED;
+    op->released = 1;
+    if (abandon_lock) op->done = 0;
+    pthread_mutex_unlock(&c->lock);
+
+    if (free_now) op_free(op);
+    else if (abandon_lock) submit(op);
+}
@@ -0,0 +1,87 @@
+#ifndef LIBDOCS_H
+#define LIBDOCS_H
+
+#include "common.h"
+
+// Asynchronous client library for the document service.
+//
+// A DocsClient owns one event loop thread and a small set of reusable
+// connections to the naming server and to each storage server. Every call
+// below returns immediately with a DocsOp handle; the operation runs on
+// the loop thread, and many of them can be in flight at once. Wait for a
+// handle with docs_wait(), poll it with docs_done(), or register a
+// completion callback with docs_on_complete(). Release every handle with
+// docs_release(), whether or not it has completed.
+//
+// File locations are cached per client and checked against the naming
+// server's location epoch, so steady-state reads go straight to the
+// storage server.
+//
+// Servers on this host that listen on AF_UNIX sockets (-u) are reached
+// through them; the naming server's socket is looked for in
+// LOCAL_SOCKET_DIR.
+//
+// If the naming server is one shard of several, the client fetches the
+// shard map from it on connect and sends each request about a file to the
+// shard that owns that file. Requests about no one file go to the server
+// passed to docs_connect, or to any shard with docs_request_shard; callers
+// that want every shard's answer ask each one.
+
+#define DOCS_ERR_NM_UNAVAILABLE 100 // Naming server could not be reached
+
+typedef struct DocsClient DocsClient;
+typedef struct DocsOp DocsOp;
+
+// Called on the loop thread when an operation completes. Must not block;
+// it may submit further operations but must not wait on them.
+typedef void (*DocsCompletion)(DocsOp *op, void *arg);
+
+// Called on the loop thread for each chunk of a stream: words separated by
+// single spaces, first_word being the file offset of the first one
+typedef void (*DocsChunkHandler)(DocsOp *op, const char *words, int first_word, void *arg);
+
+DocsClient *docs_connect(const char *nm_ip, int nm_port, const char *username);
+void docs_disconnect(DocsClient *client);
+
+// Resolves where a file lives and checks the caller may read it
+DocsOp *docs_open(DocsClient *client, const char *filename);
+DocsOp *docs_read(DocsClient *client, const char *filename);
+DocsOp *docs_create(DocsClient *client, const char *filename);
+DocsOp *docs_delete(DocsClient *client, const char *filename);
+DocsOp *docs_info(DocsClient *client, const char *filename);
+DocsOp *docs_undo(DocsClient *client, const char *filename);
+
+// Applies write commands ("<word#> <content>" lines, as typed after WRITE)
+// to one sentence under the file's write lock
+DocsOp *docs_write(DocsClient *client, const char *filename, int sentence_num,
+                   const char *commands);
+
+// Two-step form of docs_write for callers that want the lock before they
+// have the commands: the handle completes once the lock is held, and
+// docs_write_commit() then sends the commands on it and rearms it
+DocsOp *docs_write_lock(DocsClient *client, const char *filename, int sentence_num);
+int docs_write_commit(DocsOp *op, const char *commands);
+
+// Streams words from start_word on, calling on_chunk as batches arrive
+DocsOp *docs_stream(DocsClient *client, const char *filename, int start_word,
+                    DocsChunkHandler on_chunk, void *arg);
+
+// Sends any other request to the naming server as is; username is filled in
+DocsOp *docs_request(DocsClient *client, const Message *msg);
+DocsOp *docs_request_shard(DocsClient *client, int shard, const Message *msg);
+
+// Naming server shards, 1 if the namespace is not sharded, and the one a
+// file belongs to
+int docs_num_shards(DocsClient *client);
+int docs_shard_of(DocsClient *client, const char *filename);
+
+int docs_wait(DocsOp *op); // Returns ERR_SUCCESS or the error code
+int docs_done(DocsOp *op);
+void docs_on_complete(DocsOp *op, DocsCompletion fn, void *arg);
+
+// The final reply (file content for reads, naming server reply for
+// requests); valid until the handle is released
+Message *docs_reply(DocsOp *op);
+void docs_release(DocsOp *op);
+
+#endif
@@ -0,0 +1,270 @@
+#include "lookup_cache.h"
+
+#define SKETCH_DEPTH 4
+#define SKETCH_WIDTH_PER_ENTRY 4
+#define SKETCH_MAX 15 // Counters saturate here
+#define SKETCH_SAMPLE_PER_ENTRY 10 // Counters halve after this many accesses per entry
+
+typedef struct CacheEntry {
+    uint32_t hash;
+    int ss_index;
+    int in_window;
+    struct CacheEntry *hash_next;
+    struct CacheEntry *prev, *next; // Most recently used first
+    char filename[];
+} CacheEntry;
+
+typedef struct {
+    CacheEntry *head, *tail;
+    int count;
+} CacheList;
+
+typedef struct {
+    pthread_mutex_t lock;
+    CacheEntry **buckets;
+    uint32_t bucket_mask;
+    CacheList window; // TinyLFU only
+    CacheList main;
+    int window_cap, main_cap;
+    uint8_t *sketch; // SKETCH_DEPTH rows of sketch_mask + 1 counters
+    uint32_t sketch_mask;
+    uint32_t sketch_adds, sample_size;
+    LookupCacheStats stats;
+} __attribute__((aligned(64))) CacheShard;
+
+static CacheShard shards[LOOKUP_CACHE_SHARDS];
+static int cache_policy;
+
+static uint32_t cache_hash(const char *s) {
+    uint32_t hash = 2166136261u;
+    for (; *s; s++) {
+        hash = (hash ^ (unsigned char)*s) * 16777619u;
+    }
+    return hash;
+}
+
+// The top bits pick the shard, the low bits the bucket
+static CacheShard *shard_for(uint32_t hash) {
+    return &shards[hash >> 28];
+}
+
+static uint32_t pow2_at_least(uint32_t n) {
+    uint32_t p = 1;
+    while (p < n) p <<= 1;
+    return p;
+}
+
+// ===== FREQUENCY SKETCH =====
+
+static uint8_t *sketch_counter(CacheShard *shard, uint32_t hash, int row) {
+    static const uint32_t seeds[SKETCH_DEPTH] = {0x9E3779B1u, 0x85EBCA77u, 0xC2B2AE3Du, 0x27D4EB2Fu};
+    uint32_t h = (hash ^ (hash >> 15)) * seeds[row];
+    h ^= h >> 13;
+    return &shard->sketch[row * (shard->sketch_mask + 1) + (h & shard->sketch_mask)];
+}
+
+static void sketch_add(CacheShard *shard, uint32_t hash) {
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        uint8_t *c = sketch_counter(shard, hash, row);
+        if (*c < SKETCH_MAX) (*c)++;
+    }
+
+    // Halve everything now and then, so past popularity fades
+    if (++shard->sketch_adds >= shard->sample_size) {
+        size_t size = (size_t)SKETCH_DEPTH * (shard->sketch_mask + 1);
+        for (size_t i = 0; i < size; i++) {
+            shard->sketch[i] >>= 1;
+        }
+        shard->sketch_adds /= 2;
+    }
+}
+
+static int sketch_estimate(CacheShard *shard, uint32_t hash) {
+    int min = SKETCH_MAX;
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        int c = *sketch_counter(shard, hash, row);
+        if (c < min) min = c;
+    }
+    return min;
+}
+
+// ===== LISTS =====
+
+static void list_remove(CacheList *list, CacheEntry *e) {
+    if (e->prev) e->prev->next = e->next;
+    else list->head = e->next;
+    if (e->next) e->next->prev = e->prev;
+    else list->tail = e->prev;
+    list->count--;
+}
+
+static void list_push_front(CacheList *list, CacheEntry *e) {
+    e->prev = NULL;
+    e->next = list->head;
+    if (list->head) list->head->prev = e;
+    list->head = e;
+    if (!list->tail) list->tail = e;
+    list->count++;
+}
+
+static CacheList *list_of(CacheShard *shard, CacheEntry *e) {
+    return e->in_window ? &shard->window : &shard->main;
+}
+
+static CacheEntry *find(CacheShard *shard, uint32_t hash, const char *filename) {
+    CacheEntry *e = shard->buckets[hash & shard->bucket_mask];
+    while (e && (e->hash != hash || strcmp(e->filename, filename) != 0)) e = e->hash_next;
+    return e;
+}
+
+// Drops an entry that is already off its list
+static void discard(CacheShard *shard, CacheEntry *e) {
+    CacheEntry **link = &shard->buckets[e->hash & shard->bucket_mask];
+    while (*link != e) link = &(*link)->hash_next;
+    *link = e->hash_next;
+    free(e);
+}
+
+// ===== API =====
+
+int lookup_cache_init(int capacity, int policy) {
+    cache_policy = policy;
+    int per_shard = (capacity + LOOKUP_CACHE_SHARDS - 1) / LOOKUP_CACHE_SHARDS;
+    if (per_shard < 2) per_shard = 2;
+
+    for (int i = 0; i < LOOKUP_CACHE_SHARDS; i++) {
+        CacheShard *shard = &shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        uint32_t buckets = pow2_at_least(per_shard * 2);
+        shard->buckets = calloc(buckets, sizeof(CacheEntry*));
+        shard->bucket_mask = buckets - 1;
+        if (!shard->buckets) return -1;
+
+        if (policy == CACHE_POLICY_TINYLFU) {
+            shard->window_cap = per_shard / 100 > 0 ? per_shard / 100 : 1;
+            uint32_t width = pow2_at_least(per_shard * SKETCH_WIDTH_PER_ENTRY);
+            shard->sketch = calloc((size_t)SKETCH_DEPTH * width, 1);
+            shard->sketch_mask = width - 1;
+            shard->sample_size = per_shard * SKETCH_SAMPLE_PER_ENTRY;
+            if (!shard->sketch) return -1;
+        }
+        shard->main_cap = per_shard - shard->window_cap;
+        shard->stats.capacity = per_shard;
+    }
+    return 0;
+}
+
+const char *lookup_cache_policy(void) {
+    return cache_policy == CACHE_POLICY_TINYLFU ? "TinyLFU" : "LRU";
+}
+
+int lookup_cache_get(const char *filename) {
+    uint32_t hash = cache_hash(filename);
+    CacheShard *shard = shard_for(hash);
+    int ss_index = -1;
+
+    pthread_mutex_lock(&shard->lock);
+    if (cache_policy == CACHE_POLICY_TINYLFU) sketch_add(shard, hash);
+    CacheEntry *e = find(shard, hash, filename);
+    if (e) {
+        CacheList *list = list_of(shard, e);
+        list_remove(list, e);
+        list_push_front(list, e);
+        ss_index = e->ss_index;
+        shard->stats.hits++;
+    } else {
+        shard->stats.misses++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return ss_index;
+}
+
+// Moves the window's oldest entry into the main list if it beats the main
+// list's victim on frequency, or drops it
+static void admit_from_window(CacheShard *shard) {
+    CacheEntry *candidate = shard->window.tail;
+    list_remove(&shard->window, candidate);
+    candidate->in_window = 0;
+
+    if (shard->main.count < shard->main_cap) {
+        list_push_front(&shard->main, candidate);
+        return;
+    }
+    CacheEntry *victim = shard->main.tail;
+    if (sketch_estimate(shard, candidate->hash) > sketch_estimate(shard, victim->hash)) {
+        list_remove(&shard->main, victim);
+        discard(shard, victim);
+        list_push_front(&shard->main, candidate);
+        shard->stats.evictions++;
+    } else {
+        discard(shard, candidate);
+        shard->stats.rejections++;
+    }
+}
+
+void lookup_cache_put(const char *filename, int ss_index) {
+    uint32_t hash = cache_hash(filename);
+    CacheShard *shard = shard_for(hash);
+
+    pthread_mutex_lock(&shard->lock);
+    CacheEntry *e = find(shard, hash, filename);
+    if (e) {
+        CacheList *list = list_of(shard, e);
+        list_remove(list, e);
+        list_push_front(list, e);
+        e->ss_index = ss_index;
+        pthread_mutex_unlock(&shard->lock);
+        return;
+    }
+
+    size_t len = strlen(filename) + 1;
+    e = malloc(sizeof(CacheEntry) + len);
+    if (!e) {
+        pthread_mutex_unlock(&shard->lock);
+        return;
+    }
+    e->hash = hash;
+    e->ss_index = ss_index;
+    memcpy(e->filename, filename, len);
+    CacheEntry **bucket = &shard->buckets[hash & shard->bucket_mask];
+    e->hash_next = *bucket;
+    *bucket = e;
+
+    if (cache_policy == CACHE_POLICY_TINYLFU) {
+        e->in_window = 1;
+        list_push_front(&shard->window, e);
+        if (shard->window.count > shard->window_cap) admit_from_window(shard);
+    } else {
+        e->in_window = 0;
+        list_push_front(&shard->main, e);
+        if (shard->main.count > shard->main_cap) {
+            CacheEntry *victim = shard->main.tail;
+            list_remove(&shard->main, victim);
+            discard(shard, victim);
+            shard->stats.evictions++;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void lookup_cache_invalidate(const char *filename) {
+    uint32_t hash = cache_hash(filename);
+    CacheShard *shard = shard_for(hash);
+
+    pthread_mutex_lock(&shard->lock);
+    CacheEntry *e = find(shard, hash, filename);
+    if (e) {
+        list_remove(list_of(shard, e), e);
+        discard(shard, e);
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void lookup_cache_stats(LookupCacheStats stats[LOOKUP_CACHE_SHARDS]) {
+    for (int i = 0; i < LOOKUP_CACHE_SHARDS; i++) {
+        pthread_mutex_lock(&shards[i].lock);
+        stats[i] = shards[i].stats;
+        stats[i].entries = shards[i].window.count + shards[i].main.count;
+        pthread_mutex_unlock(&shards[i].lock);
+    }
+}
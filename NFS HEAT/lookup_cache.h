@@ -0,0 +1,42 @@
+#ifndef LOOKUP_CACHE_H
+#define LOOKUP_CACHE_H
+
+#include "common.h"
+
+// The naming server's cache of filename -> storage server index.
+//
+// Entries are spread over shards by filename hash, each with its own lock,
+// hash table and LRU lists, so lookups for different files rarely contend.
+// Under the TinyLFU policy a new entry first lands in a small LRU window
+// (1% of the shard); when it falls out of the window it only displaces
+// the main LRU's victim if a frequency sketch says it has been asked for
+// more often. One-off lookups then cannot flush the popular files out.
+
+#define LOOKUP_CACHE_SHARDS 16
+#define LOOKUP_CACHE_DEFAULT_ENTRIES 4096
+
+#define CACHE_POLICY_LRU 0
+#define CACHE_POLICY_TINYLFU 1
+
+typedef struct {
+    int entries;
+    int capacity;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t rejections; // New entries TinyLFU turned away
+} LookupCacheStats;
+
+// Call once before any other function. Returns -1 if out of memory.
+int lookup_cache_init(int capacity, int policy);
+const char *lookup_cache_policy(void);
+
+// Storage server index cached for filename, or -1
+int lookup_cache_get(const char *filename);
+void lookup_cache_put(const char *filename, int ss_index);
+void lookup_cache_invalidate(const char *filename);
+
+// Fills one entry per shard
+void lookup_cache_stats(LookupCacheStats stats[LOOKUP_CACHE_SHARDS]);
+
+#endif
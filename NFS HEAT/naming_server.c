@@ -1,6 +1,32 @@
+#define _GNU_SOURCE
 #include "common.h"
+#include "journal.h"
+#include "art.h"
+#include "lookup_cache.h"
+#include "bloom.h"
+#include "shard_map.h"
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <fnmatch.h>
+#include <sched.h>
 
-#define ACCESS_CONTROL_FILE "access_control.dat"
+#define ACCESS_CONTROL_FILE "access_control.dat" // Snapshot
+#define ACCESS_CONTROL_LOG "access_control.log" // Changes since the snapshot
+#define ACL_SNAPSHOT_BYTES (4 * 1024 * 1024) // Log size that triggers a new snapshot
+#define NM_WORKER_THREADS 16 // Threads serving requests that may block
+#define NM_WORK_QUEUE_DEPTH 1024
+#define NM_MAX_EVENTS 256
+
+// Directory holding the files above and the catalog (-d), so a naming
+// server keeps its state wherever it is started from
+static const char *state_dir = ".";
+
+// Builds the path of one of the state files. Returns -1 if it is too long.
+static int state_path(char *path, const char *name) {
+    int n = snprintf(path, MAX_PATH, "%s/%s", state_dir, name);
+    return n < 0 || n >= MAX_PATH ? -1 : 0;
+}
 
 // Global data structures
 StorageServerInfo storage_servers[MAX_SS];
@@ -11,915 +37,2937 @@ ClientInfo clients[MAX_CLIENTS];
 int num_clients = 0;
 pthread_mutex_t client_lock = PTHREAD_MUTEX_INITIALIZER;
 
-AccessControl access_controls[MAX_FILES];
-int num_access_controls = 0;
-pthread_mutex_t access_lock = PTHREAD_MUTEX_INITIALIZER;
+// Every file the naming server knows of (see FILE CATALOG). Guarded by
+// catalog_lock together with the user table: lookups share it, changes
+// take it exclusively.
+static FileInfo *catalog;
+static int catalog_used, catalog_cap; // Slots handed out so far, and mapped
+static int num_files;
+pthread_rwlock_t catalog_lock = PTHREAD_RWLOCK_INITIALIZER;
 
-// Function to save access control to disk
-void save_access_control() {
-    pthread_mutex_lock(&access_lock);
-    
-    FILE *fp = fopen(ACCESS_CONTROL_FILE, "wb");
-    if (fp) {
-        fwrite(&num_access_controls, sizeof(int), 1, fp);
-        fwrite(access_controls, sizeof(AccessControl), num_access_controls, fp);
-        fclose(fp);
+// Advanced whenever a location a client may have cached could have become
+// wrong or no longer be permitted: a file deleted or moved, access revoked,
+// or a storage server (re)registered. Every reply carries it, and clients
+// drop cached locations from older epochs.
+uint32_t location_epoch = 1;
+
+void bump_location_epoch() {
+    __atomic_add_fetch(&location_epoch, 1, __ATOMIC_RELEASE);
+}
+
+// This server's part of a sharded namespace (see shard_map.h). Without -S
+// it is the only shard and owns every name.
+static ShardMap shard_map;
+static int shard_self = -1;
+
+static int shard_owns(const char *filename) {
+    return shard_self < 0 || shard_of(&shard_map, filename) == shard_self;
+}
+
+static unsigned name_hash(const char *s) {
+    unsigned hash = 5381;
+    for (; *s; s++) {
+        hash = hash * 33 + (unsigned char)*s;
+    }
+    return hash;
+}
+
+// ===== REPLICATION LOG =====
+
+// Every change to the catalog, access control and storage server table, in
+// the order it was made, for followers to apply (see REPLICATION). Records
+// share the access control journal's layout: a kind byte, an argument byte
+// and two NUL-terminated strings. The last REPL_LOG_RECORDS are kept in
+// memory, numbered from 1; a follower that is new or further behind than
+// that starts from a snapshot instead. Nothing is kept until a follower
+// first asks, since its snapshot covers everything before.
+#define REPL_LOG_RECORDS 65536
+#define REPL_LOCATE 5 // filename, ""; argument is the storage server index
+#define REPL_UNLOCATE 6 // filename, ""
+#define REPL_SERVER 7 // "ip nm_port client_port active", local_dir; argument is the index
+#define REPL_RECORD_MAX (2 + MAX_FILENAME + MAX_PATH)
+
+typedef struct {
+    uint32_t len;
+    char *rec; // NULL if it could not be kept, which sends followers to a snapshot
+} ReplEntry;
+
+static ReplEntry repl_log[REPL_LOG_RECORDS]; // Record seq lives at seq % REPL_LOG_RECORDS
+static uint64_t repl_seq; // Last record appended
+static int repl_enabled;
+static uint32_t repl_incarnation; // Tells this process's numbering from an earlier one's
+static pthread_mutex_t repl_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t repl_news = PTHREAD_COND_INITIALIZER;
+
+// Returns the record's length, or 0 if it does not fit in size bytes
+static uint32_t repl_encode(char *rec, size_t size, int kind, int arg, const char *a, const char *b) {
+    size_t la = strlen(a) + 1, lb = strlen(b) + 1;
+    if (2 + la + lb > size) return 0;
+    rec[0] = (char)kind;
+    rec[1] = (char)arg;
+    memcpy(rec + 2, a, la);
+    memcpy(rec + 2 + la, b, lb);
+    return 2 + la + lb;
+}
+
+// Caller holds catalog_lock for writing, so records go out in the order
+// the changes were made
+static void repl_append(const char *rec, uint32_t len) {
+    pthread_mutex_lock(&repl_lock);
+    if (repl_enabled) {
+        ReplEntry *e = &repl_log[++repl_seq % REPL_LOG_RECORDS];
+        free(e->rec);
+        e->rec = len ? malloc(len) : NULL;
+        e->len = len;
+        if (e->rec) memcpy(e->rec, rec, len);
+        pthread_cond_broadcast(&repl_news);
+    }
+    pthread_mutex_unlock(&repl_lock);
+}
+
+static void repl_location(const char *filename, int ss_idx) {
+    char rec[REPL_RECORD_MAX];
+    int kind = ss_idx >= 0 ? REPL_LOCATE : REPL_UNLOCATE;
+    repl_append(rec, repl_encode(rec, sizeof(rec), kind, ss_idx >= 0 ? ss_idx : 0, filename, ""));
+}
+
+static void repl_server(int ss_idx) {
+    StorageServerInfo *ss = &storage_servers[ss_idx];
+    char addr[INET_ADDRSTRLEN + 40];
+    snprintf(addr, sizeof(addr), "%s %d %d %d", ss->ip, ss->nm_port, ss->client_port, ss->active);
+    char rec[REPL_RECORD_MAX];
+    repl_append(rec, repl_encode(rec, sizeof(rec), REPL_SERVER, ss_idx, addr, ss->local_dir));
+}
+
+// ===== END REPLICATION LOG =====
+
+// ===== FILE CATALOG =====
+
+// One record per file, whether it is known from a storage server's file
+// list, from access control, or both: its location, owner, access entries,
+// size and timestamps. Records are found by filename through a chained hash
+// index whose bucket array doubles as the catalog grows; each record keeps
+// its filename's hash, so growing never rehashes a name. Records never
+// move and the slots of removed ones are reused, so a record index stays
+// valid until that record is removed. Caller holds catalog_lock.
+//
+// The record array is the tail of CATALOG_FILE, mapped shared, and the
+// header in front of it also keeps the storage server table, so the
+// catalog outlives the process (see load_catalog).
+#define CATALOG_MIN_BUCKETS 1024 // Power of two
+#define CATALOG_FILE "catalog.dat"
+#define CATALOG_MAGIC 0x54414344 // "DCAT"
+#define CATALOG_VERSION 1
+#define CATALOG_HEADER_BYTES 8192 // Page-aligned, and holds a CatalogHeader
+
+typedef struct {
+    char ip[INET_ADDRSTRLEN];
+    int nm_port;
+    int client_port;
+    char local_dir[MAX_LOCAL_DIR];
+} CatalogServer;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size; // sizeof(FileInfo), so a build with another layout starts afresh
+    uint32_t capacity; // Records the file has room for
+    uint32_t used; // Records ever handed out, used or free
+    uint32_t num_servers;
+    CatalogServer servers[MAX_SS];
+    uint32_t generation; // Primary generation (see REPLICATION); 0 in older files
+} CatalogHeader;
+
+_Static_assert(sizeof(CatalogHeader) <= CATALOG_HEADER_BYTES, "CatalogHeader outgrew CATALOG_HEADER_BYTES");
+
+static CatalogHeader *catalog_header; // Start of the mapping
+static size_t catalog_map_len;
+static int catalog_fd = -1;
+
+static int *catalog_buckets; // First record + 1, 0 if empty
+static uint32_t catalog_mask;
+static int catalog_free; // First unused slot + 1, chained through next
+
+// Record index for filename, or -1
+static int catalog_find(const char *filename) {
+    if (!catalog_buckets) return -1;
+    unsigned hash = name_hash(filename);
+    int link = catalog_buckets[hash & catalog_mask];
+    while (link) {
+        FileInfo *f = &catalog[link - 1];
+        if (f->hash == hash && strcmp(f->filename, filename) == 0) return link - 1;
+        link = f->next;
     }
+    return -1;
+}
+
+// Makes room for cap records, growing the file and its mapping
+static int catalog_reserve(int cap) {
+    size_t len = CATALOG_HEADER_BYTES + (size_t)cap * sizeof(FileInfo);
+    if (ftruncate(catalog_fd, len) < 0) return -1;
+    void *map = mremap(catalog_header, catalog_map_len, len, MREMAP_MAYMOVE);
+    if (map == MAP_FAILED) return -1;
     
-    pthread_mutex_unlock(&access_lock);
+    catalog_header = map;
+    catalog_map_len = len;
+    catalog = (FileInfo*)((char*)map + CATALOG_HEADER_BYTES);
+    catalog_cap = cap;
+    catalog_header->capacity = cap;
+    return 0;
 }
 
-// Function to load access control from disk
-void load_access_control() {
-    FILE *fp = fopen(ACCESS_CONTROL_FILE, "rb");
-    if (fp) {
-        pthread_mutex_lock(&access_lock);
-        fread(&num_access_controls, sizeof(int), 1, fp);
-        fread(access_controls, sizeof(AccessControl), num_access_controls, fp);
-        pthread_mutex_unlock(&access_lock);
-        fclose(fp);
-        
-        log_message("NM", "Access control data loaded from disk");
+static int catalog_grow_buckets() {
+    uint32_t buckets = catalog_buckets ? (catalog_mask + 1) * 2 : CATALOG_MIN_BUCKETS;
+    int *grown = calloc(buckets, sizeof(int));
+    if (!grown) return -1;
+    for (int i = 0; i < catalog_used; i++) {
+        if (catalog[i].filename[0] == '\0') continue;
+        int *bucket = &grown[catalog[i].hash & (buckets - 1)];
+        catalog[i].next = *bucket;
+        *bucket = i + 1;
     }
+    free(catalog_buckets);
+    catalog_buckets = grown;
+    catalog_mask = buckets - 1;
+    return 0;
 }
 
-// LRU Cache for file lookups
-typedef struct CacheNode {
-    char filename[MAX_FILENAME];
-    int ss_index;
-    time_t timestamp;
-    struct CacheNode *next, *prev;
-} CacheNode;
-
-CacheNode *cache_head = NULL;
-CacheNode *cache_tail = NULL;
-int cache_size = 0;
-#define MAX_CACHE_SIZE 100
-pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
-
-// Trie for efficient file search
-typedef struct TrieNode {
-    struct TrieNode *children[256];
-    int ss_index;
-    int is_end;
-} TrieNode;
-
-TrieNode *trie_root = NULL;
-pthread_mutex_t trie_lock = PTHREAD_MUTEX_INITIALIZER;
-
-TrieNode* create_trie_node() {
-    TrieNode *node = (TrieNode*)calloc(1, sizeof(TrieNode));
-    node->ss_index = -1;
-    return node;
-}
-
-void insert_trie(const char *filename, int ss_index) {
-    pthread_mutex_lock(&trie_lock);
-    if (!trie_root) trie_root = create_trie_node();
-    
-    TrieNode *curr = trie_root;
-    for (int i = 0; filename[i]; i++) {
-        unsigned char c = (unsigned char)filename[i];
-        if (!curr->children[c]) {
-            curr->children[c] = create_trie_node();
-        }
-        curr = curr->children[c];
-    }
-    curr->is_end = 1;
-    curr->ss_index = ss_index;
-    pthread_mutex_unlock(&trie_lock);
-}
-
-int search_trie(const char *filename) {
-    pthread_mutex_lock(&trie_lock);
-    if (!trie_root) {
-        pthread_mutex_unlock(&trie_lock);
-        return -1;
+// Record for filename, added with no location and no owner if there is
+// none yet. Returns -1 if the name is unusable or memory ran out.
+static int catalog_add(const char *filename) {
+    int rec = catalog_find(filename);
+    if (rec >= 0) return rec;
+    size_t len = strlen(filename);
+    if (len == 0 || len >= MAX_FILENAME) return -1;
+    
+    if (!catalog_buckets || (uint32_t)num_files > catalog_mask) {
+        if (catalog_grow_buckets() < 0) return -1;
+    }
+    if (catalog_free) {
+        rec = catalog_free - 1;
+        catalog_free = catalog[rec].next;
+    } else {
+        if (catalog_used == catalog_cap && catalog_reserve(catalog_cap * 2) < 0) return -1;
+        rec = catalog_used++;
+        catalog_header->used = catalog_used;
     }
     
-    TrieNode *curr = trie_root;
-    for (int i = 0; filename[i]; i++) {
-        unsigned char c = (unsigned char)filename[i];
-        if (!curr->children[c]) {
-            pthread_mutex_unlock(&trie_lock);
-            return -1;
-        }
-        curr = curr->children[c];
+    FileInfo *f = &catalog[rec];
+    memset(f, 0, sizeof(*f));
+    memcpy(f->filename, filename, len + 1);
+    f->hash = name_hash(filename);
+    f->ss_index = -1;
+    f->owner = -1;
+    int *bucket = &catalog_buckets[f->hash & catalog_mask];
+    f->next = *bucket;
+    *bucket = rec + 1;
+    num_files++;
+    return rec;
+}
+
+// Names of the files that have a location, so find_file_ss can turn away
+// a name that is on no storage server without taking catalog_lock. Once
+// it holds more names than it was sized for it is rebuilt from the catalog
+// at twice the size.
+//
+// Lookups count themselves in one of two reader counters, chosen by
+// filter_phase, around their use of the filter. A rebuild publishes the
+// new filter, then for each counter in turn points new lookups at the
+// other one and waits for it to drain. Any lookup that could still hold
+// the old filter was counted before it was replaced, so once both
+// counters have been seen empty the old filter is freed.
+#define LOCATED_FILTER_MIN_KEYS 1024
+
+static BloomFilter *located_filter;
+static int num_located;
+static int filter_readers[2];
+static int filter_phase;
+
+// 0 if filename is certainly on no storage server
+static int located_filter_may_contain(const char *filename) {
+    int phase = __atomic_load_n(&filter_phase, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&filter_readers[phase], 1, __ATOMIC_SEQ_CST);
+    BloomFilter *filter = __atomic_load_n(&located_filter, __ATOMIC_SEQ_CST);
+    int found = !filter || bloom_may_contain(filter, filename);
+    __atomic_fetch_sub(&filter_readers[phase], 1, __ATOMIC_RELEASE);
+    return found;
+}
+
+// Caller holds catalog_lock for writing, so rebuilds never overlap
+static void located_filter_rebuild() {
+    uint32_t keys = num_located * 2 > LOCATED_FILTER_MIN_KEYS ? num_located * 2 : LOCATED_FILTER_MIN_KEYS;
+    BloomFilter *filter = bloom_create(keys);
+    if (!filter) return; // The old one still never turns away a file that exists
+    for (int i = 0; i < catalog_used; i++) {
+        if (catalog[i].ss_index >= 0) bloom_add(filter, catalog[i].filename);
     }
+    BloomFilter *old = __atomic_exchange_n(&located_filter, filter, __ATOMIC_SEQ_CST);
+    if (!old) return;
     
-    int result = (curr->is_end) ? curr->ss_index : -1;
-    pthread_mutex_unlock(&trie_lock);
-    return result;
+    for (int i = 0; i < 2; i++) {
+        int phase = __atomic_load_n(&filter_phase, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&filter_phase, !phase, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&filter_readers[phase], __ATOMIC_ACQUIRE) > 0) sched_yield();
+    }
+    bloom_free(old);
 }
 
-void update_cache(const char *filename, int ss_index) {
-    pthread_mutex_lock(&cache_lock);
-    
-    // Check if already in cache
-    CacheNode *curr = cache_head;
-    while (curr) {
-        if (strcmp(curr->filename, filename) == 0) {
-            // Move to front
-            if (curr != cache_head) {
-                if (curr->prev) curr->prev->next = curr->next;
-                if (curr->next) curr->next->prev = curr->prev;
-                if (curr == cache_tail) cache_tail = curr->prev;
-                
-                curr->next = cache_head;
-                curr->prev = NULL;
-                cache_head->prev = curr;
-                cache_head = curr;
-            }
-            curr->timestamp = time(NULL);
-            pthread_mutex_unlock(&cache_lock);
-            return;
+// Puts a record on a storage server, or on none with -1
+static void catalog_set_location(int rec, int ss_idx) {
+    FileInfo *f = &catalog[rec];
+    if (f->ss_index != ss_idx) repl_location(f->filename, ss_idx);
+    if (f->ss_index < 0 && ss_idx >= 0) {
+        f->ss_index = ss_idx;
+        num_located++;
+        if (located_filter) bloom_add(located_filter, f->filename);
+        if (!located_filter || (uint32_t)num_located > bloom_capacity(located_filter)) {
+            located_filter_rebuild();
         }
-        curr = curr->next;
+    } else if (f->ss_index >= 0 && ss_idx < 0) {
+        f->ss_index = -1;
+        num_located--;
+        if (located_filter) bloom_remove(located_filter, f->filename);
+    } else {
+        f->ss_index = ss_idx;
     }
+}
+
+// Removes a record once it has neither a location nor access control
+static void catalog_release(int rec) {
+    FileInfo *f = &catalog[rec];
+    if (f->ss_index >= 0 || f->owner >= 0) return;
     
-    // Add new node
-    CacheNode *node = (CacheNode*)malloc(sizeof(CacheNode));
-    strcpy(node->filename, filename);
-    node->ss_index = ss_index;
-    node->timestamp = time(NULL);
-    node->prev = NULL;
-    node->next = cache_head;
+    int *link = &catalog_buckets[f->hash & catalog_mask];
+    while (*link != rec + 1) link = &catalog[*link - 1].next;
+    *link = f->next;
+    f->filename[0] = '\0';
+    f->next = catalog_free;
+    catalog_free = rec + 1;
+    num_files--;
+}
+
+// ===== END FILE CATALOG =====
+
+// ===== ACCESS CONTROL INDEX =====
+
+// A file's access control lives in its catalog record: the owner's user id
+// and a growable vector of (user id, level) entries sorted by id, so a
+// permission check is a binary search over integers. A record without an
+// owner has no access control.
+#define USER_BUCKETS 4096 // Power of two
+
+static pthread_mutex_t acl_save_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Usernames are interned once and never dropped, so an id names the same
+// user for the life of the table; the snapshot saves them in id order.
+static char (*user_names)[MAX_USERNAME];
+static int *user_next; // Next id in the same bucket + 1, 0 at the end
+static int num_users, user_cap;
+static int user_buckets[USER_BUCKETS]; // First id + 1, 0 if empty
+
+// Per user, the records of the files they hold an entry on, in filename
+// order, so a listing can start after any name. While access control is
+// being loaded records are only appended, and the lists are sorted once
+// at the end.
+typedef struct {
+    int *recs;
+    int count, cap;
+} VisibleFiles;
+
+static VisibleFiles *user_visible; // Indexed by user id
+static int visible_unsorted;
+
+// Id for username, or -1 if it is not in the table
+static int user_lookup(const char *username) {
+    int link = user_buckets[name_hash(username) & (USER_BUCKETS - 1)];
+    while (link) {
+        if (strcmp(user_names[link - 1], username) == 0) return link - 1;
+        link = user_next[link - 1];
+    }
+    return -1;
+}
+
+// Id for username, adding it if needed. Returns -1 if out of memory.
+static int user_intern(const char *username) {
+    int id = user_lookup(username);
+    if (id >= 0) return id;
     
-    if (cache_head) cache_head->prev = node;
-    cache_head = node;
-    if (!cache_tail) cache_tail = node;
-    cache_size++;
+    if (num_users == user_cap) {
+        int cap = user_cap ? user_cap * 2 : 256;
+        char (*names)[MAX_USERNAME] = realloc(user_names, cap * sizeof(*names));
+        if (!names) return -1;
+        user_names = names;
+        int *next = realloc(user_next, cap * sizeof(int));
+        if (!next) return -1;
+        user_next = next;
+        VisibleFiles *visible = realloc(user_visible, cap * sizeof(VisibleFiles));
+        if (!visible) return -1;
+        user_visible = visible;
+        user_cap = cap;
+    }
     
-    // Evict if necessary
-    if (cache_size > MAX_CACHE_SIZE) {
-        CacheNode *old = cache_tail;
-        cache_tail = old->prev;
-        if (cache_tail) cache_tail->next = NULL;
-        free(old);
-        cache_size--;
+    id = num_users++;
+    snprintf(user_names[id], MAX_USERNAME, "%s", username);
+    memset(&user_visible[id], 0, sizeof(VisibleFiles));
+    int *bucket = &user_buckets[name_hash(username) & (USER_BUCKETS - 1)];
+    user_next[id] = *bucket;
+    *bucket = id + 1;
+    return id;
+}
+
+// First position in a list whose filename is not before name
+static int visible_lower(const VisibleFiles *v, const char *name) {
+    int lo = 0, hi = v->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (strcmp(catalog[v->recs[mid]].filename, name) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static int visible_add(int user, int rec) {
+    VisibleFiles *v = &user_visible[user];
+    if (v->count == v->cap) {
+        int cap = v->cap ? v->cap * 2 : 16;
+        int *grown = realloc(v->recs, cap * sizeof(int));
+        if (!grown) return -1;
+        v->recs = grown;
+        v->cap = cap;
     }
     
-    pthread_mutex_unlock(&cache_lock);
+    int pos = visible_unsorted ? v->count : visible_lower(v, catalog[rec].filename);
+    memmove(&v->recs[pos + 1], &v->recs[pos], (v->count - pos) * sizeof(int));
+    v->recs[pos] = rec;
+    v->count++;
+    return 0;
 }
 
-int find_file_ss(const char *filename) {
-    // Check cache first
-    pthread_mutex_lock(&cache_lock);
-    CacheNode *curr = cache_head;
-    while (curr) {
-        if (strcmp(curr->filename, filename) == 0) {
-            int ss_idx = curr->ss_index;
-            pthread_mutex_unlock(&cache_lock);
-            return ss_idx;
+static void visible_remove(int user, int rec) {
+    VisibleFiles *v = &user_visible[user];
+    int pos = 0;
+    if (visible_unsorted) {
+        while (pos < v->count && v->recs[pos] != rec) pos++;
+    } else {
+        pos = visible_lower(v, catalog[rec].filename);
+    }
+    if (pos == v->count || v->recs[pos] != rec) return;
+    memmove(&v->recs[pos], &v->recs[pos + 1], (v->count - pos - 1) * sizeof(int));
+    v->count--;
+}
+
+static int visible_compare(const void *a, const void *b) {
+    return strcmp(catalog[*(const int*)a].filename, catalog[*(const int*)b].filename);
+}
+
+static void visible_sort() {
+    for (int id = 0; id < num_users; id++) {
+        qsort(user_visible[id].recs, user_visible[id].count, sizeof(int), visible_compare);
+    }
+    visible_unsorted = 0;
+}
+
+// Record index for a file with access control, or -1
+static int acl_find(const char *filename) {
+    int rec = catalog_find(filename);
+    return rec >= 0 && catalog[rec].owner >= 0 ? rec : -1;
+}
+
+// Where user's entry is in a record, or where it would be inserted
+static int acl_entry_pos(const FileInfo *f, int user) {
+    int lo = 0, hi = f->num_entries;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (f->entries[mid].user < user) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
-        curr = curr->next;
     }
-    pthread_mutex_unlock(&cache_lock);
+    return lo;
+}
+
+static int acl_level(int rec, int user) {
+    const FileInfo *f = &catalog[rec];
+    int pos = acl_entry_pos(f, user);
+    if (pos < f->num_entries && f->entries[pos].user == user) return f->entries[pos].access_level;
+    return ACCESS_NONE;
+}
+
+static int acl_set(FileInfo *f, int user, int access_level) {
+    int pos = acl_entry_pos(f, user);
+    if (pos < f->num_entries && f->entries[pos].user == user) {
+        f->entries[pos].access_level = access_level;
+        return 0;
+    }
     
-    // Search trie
-    int ss_idx = search_trie(filename);
-    if (ss_idx >= 0) {
-        update_cache(filename, ss_idx);
-        return ss_idx;
+    if (f->num_entries == f->cap) {
+        int cap = f->cap ? f->cap * 2 : 2;
+        AccessEntry *grown = realloc(f->entries, cap * sizeof(AccessEntry));
+        if (!grown) return -1;
+        f->entries = grown;
+        f->cap = cap;
+    }
+    if (visible_add(user, f - catalog) < 0) return -1;
+    memmove(&f->entries[pos + 1], &f->entries[pos],
+            (f->num_entries - pos) * sizeof(AccessEntry));
+    f->entries[pos].user = user;
+    f->entries[pos].access_level = access_level;
+    f->num_entries++;
+    return 0;
+}
+
+static void acl_clear(int rec) {
+    FileInfo *f = &catalog[rec];
+    for (int i = 0; i < f->num_entries; i++) {
+        visible_remove(f->entries[i].user, rec);
+    }
+    free(f->entries);
+    f->entries = NULL;
+    f->num_entries = 0;
+    f->cap = 0;
+}
+
+// Drops a record's access control, and the record too if it has no location
+static void acl_remove_file(int rec) {
+    acl_clear(rec);
+    catalog[rec].owner = -1;
+    catalog_release(rec);
+}
+
+// Gives filename an owner and no entries, replacing any access control left
+// over for it. Returns -1 if out of memory.
+static int acl_new_file(const char *filename, int owner) {
+    int rec = catalog_add(filename);
+    if (rec < 0) return -1;
+    acl_clear(rec);
+    catalog[rec].owner = owner;
+    return rec;
+}
+
+// Adds access control with write access for its owner only
+static int acl_add_file(const char *filename, const char *owner) {
+    int user = user_intern(owner);
+    int rec = user >= 0 ? acl_new_file(filename, user) : -1;
+    if (rec < 0) return -1;
+    if (acl_set(&catalog[rec], user, ACCESS_WRITE) < 0) {
+        acl_remove_file(rec);
+        return -1;
     }
+    return rec;
+}
+
+// Sets username's level on a record, adding an entry if it has none
+static int acl_grant(int rec, const char *username, int access_level) {
+    int user = user_intern(username);
+    if (user < 0) return -1;
+    return acl_set(&catalog[rec], user, access_level);
+}
+
+// Removes username's entry, never the owner's. Returns 1 if there was one.
+static int acl_revoke(int rec, const char *username) {
+    FileInfo *f = &catalog[rec];
+    int user = user_lookup(username);
+    if (user < 0 || user == f->owner) return 0;
     
-    // Linear search as fallback
-    pthread_mutex_lock(&ss_lock);
-    for (int i = 0; i < num_ss; i++) {
-        if (!storage_servers[i].active) continue;
-        for (int j = 0; j < storage_servers[i].num_files; j++) {
-            if (strcmp(storage_servers[i].files[j], filename) == 0) {
-                pthread_mutex_unlock(&ss_lock);
-                update_cache(filename, i);
-                insert_trie(filename, i);
-                return i;
-            }
+    int pos = acl_entry_pos(f, user);
+    if (pos == f->num_entries || f->entries[pos].user != user) return 0;
+    memmove(&f->entries[pos], &f->entries[pos + 1],
+            (f->num_entries - pos - 1) * sizeof(AccessEntry));
+    f->num_entries--;
+    visible_remove(user, rec);
+    return 1;
+}
+
+static int acl_is_owner(int rec, const char *username) {
+    return rec >= 0 && strcmp(user_names[catalog[rec].owner], username) == 0;
+}
+
+// Copies filename's owner into owner and returns 1, or returns 0 if unknown
+int get_owner(const char *filename, char *owner) {
+    pthread_rwlock_rdlock(&catalog_lock);
+    int rec = acl_find(filename);
+    if (rec >= 0) strcpy(owner, user_names[catalog[rec].owner]);
+    pthread_rwlock_unlock(&catalog_lock);
+    return rec >= 0;
+}
+
+// ===== END ACCESS CONTROL INDEX =====
+
+// ===== ACCESS CONTROL PERSISTENCE =====
+
+// Changes are appended to a journal and made durable before the request
+// is answered; concurrent changes share one fsync. Once the journal has
+// grown past ACL_SNAPSHOT_BYTES the whole table is written out as a new
+// snapshot and the journal is emptied. Startup loads the snapshot and
+// replays the journal over it.
+//
+// Each record is a kind byte, an access level byte, the filename and then
+// the username, both NUL-terminated. Replaying a record that the snapshot
+// already reflects leaves the table unchanged, so a crash between writing
+// a snapshot and emptying the journal is harmless.
+#define ACL_LOG_CREATE 1 // filename, owner
+#define ACL_LOG_DELETE 2 // filename
+#define ACL_LOG_GRANT 3 // filename, username, level
+#define ACL_LOG_REVOKE 4 // filename, username
+
+static Journal *acl_journal;
+
+// Records a change already applied to the table, in the journal and for
+// followers. Caller holds catalog_lock for writing, so both see changes in
+// the order they were made. Callers check usernames against MAX_USERNAME
+// first; a record that still does not fit is not kept.
+static uint64_t acl_log(int kind, const char *filename, const char *username, int level) {
+    char rec[REPL_RECORD_MAX];
+    uint32_t len = repl_encode(rec, sizeof(rec), kind, level, filename, username);
+    repl_append(rec, len); // An empty entry sends followers to a snapshot
+    if (len == 0) return 0;
+    return journal_append(acl_journal, rec, len);
+}
+
+// Splits a record into its two strings. Returns -1 if it is malformed.
+static int record_parse(const char *rec, uint32_t len, const char **a, const char **b) {
+    if (len < 4 || rec[len - 1] != '\0') return -1;
+    *a = rec + 2;
+    size_t la = strnlen(*a, len - 2) + 1;
+    if (la >= MAX_FILENAME || 2 + la >= len) return -1;
+    *b = *a + la;
+    return 0;
+}
+
+static void acl_apply(int kind, int level, const char *filename, const char *username) {
+    int r = acl_find(filename);
+    switch (kind) {
+        case ACL_LOG_CREATE:
+            acl_add_file(filename, username);
+            break;
+        case ACL_LOG_DELETE:
+            if (r >= 0) acl_remove_file(r);
+            break;
+        case ACL_LOG_GRANT:
+            if (r >= 0) acl_grant(r, username, level);
+            break;
+        case ACL_LOG_REVOKE:
+            if (r >= 0) acl_revoke(r, username);
+            break;
+    }
+}
+
+static void acl_replay(const void *data, uint32_t len, void *arg) {
+    const char *rec = data;
+    int *replayed = arg;
+    const char *filename, *username;
+    if (record_parse(rec, len, &filename, &username) < 0 || strlen(username) >= MAX_USERNAME) return;
+    acl_apply(rec[0], rec[1], filename, username);
+    (*replayed)++;
+}
+
+// Snapshot layout, all integers in host order:
+//   magic, user count, then per user a length byte and the name;
+//   file count, then per file a 16-bit length and the name, the owner id,
+//   the entry count, and per entry the user id and a level byte.
+// A file without the magic is the old fixed-size format (a count followed
+// by fixed-size records with MAX_CLIENTS inline usernames each) and is
+// converted when loaded.
+#define ACL_SNAPSHOT_MAGIC 0x4C434144 // "DACL"
+
+typedef struct {
+    char filename[MAX_FILENAME];
+    struct {
+        char username[MAX_USERNAME];
+        int access_level;
+    } entries[MAX_CLIENTS];
+    int num_entries;
+} LegacyAccessControl;
+
+static int acl_write_snapshot(FILE *fp) {
+    uint32_t head[2] = {ACL_SNAPSHOT_MAGIC, num_users};
+    int ok = fwrite(head, sizeof(head), 1, fp) == 1;
+    for (int i = 0; ok && i < num_users; i++) {
+        unsigned char len = strlen(user_names[i]);
+        ok = fwrite(&len, 1, 1, fp) == 1 && fwrite(user_names[i], 1, len, fp) == len;
+    }
+    
+    uint32_t files = 0;
+    for (int i = 0; i < catalog_used; i++) {
+        if (catalog[i].owner >= 0) files++;
+    }
+    ok = ok && fwrite(&files, sizeof(files), 1, fp) == 1;
+    for (int i = 0; ok && i < catalog_used; i++) {
+        FileInfo *f = &catalog[i];
+        if (f->owner < 0) continue;
+        uint16_t len = strlen(f->filename);
+        uint32_t meta[2] = {f->owner, f->num_entries};
+        ok = fwrite(&len, sizeof(len), 1, fp) == 1 && fwrite(f->filename, 1, len, fp) == len &&
+             fwrite(meta, sizeof(meta), 1, fp) == 1;
+        for (int j = 0; ok && j < f->num_entries; j++) {
+            uint32_t user = f->entries[j].user;
+            unsigned char level = f->entries[j].access_level;
+            ok = fwrite(&user, sizeof(user), 1, fp) == 1 && fwrite(&level, 1, 1, fp) == 1;
         }
     }
-    pthread_mutex_unlock(&ss_lock);
-    return -1;
+    return ok ? 0 : -1;
 }
 
-int check_access(const char *filename, const char *username, int required_level) {
-    pthread_mutex_lock(&access_lock);
-    
-    for (int i = 0; i < num_access_controls; i++) {
-        if (strcmp(access_controls[i].filename, filename) == 0) {
-            for (int j = 0; j < access_controls[i].num_entries; j++) {
-                if (strcmp(access_controls[i].entries[j].username, username) == 0) {
-                    int has_access = access_controls[i].entries[j].access_level >= required_level;
-                    pthread_mutex_unlock(&access_lock);
-                    return has_access;
-                }
+typedef struct {
+    const char *p, *end;
+} SnapshotReader;
+
+static int take(SnapshotReader *r, void *out, size_t n) {
+    if ((size_t)(r->end - r->p) < n) return -1;
+    memcpy(out, r->p, n);
+    r->p += n;
+    return 0;
+}
+
+static int acl_read_legacy(const char *data, size_t size) {
+    SnapshotReader r = {data, data + size};
+    int count;
+    if (take(&r, &count, sizeof(count)) < 0 || count < 0 || count > MAX_FILES) return -1;
+    
+    LegacyAccessControl *old = malloc(sizeof(LegacyAccessControl));
+    if (!old) return -1;
+    int result = 0;
+    for (int i = 0; i < count && result == 0; i++) {
+        if (take(&r, old, sizeof(*old)) < 0 || old->num_entries < 1 || old->num_entries > MAX_CLIENTS) {
+            result = -1;
+            break;
+        }
+        old->filename[MAX_FILENAME - 1] = '\0';
+        
+        // The owner was always the first entry
+        old->entries[0].username[MAX_USERNAME - 1] = '\0';
+        int owner = user_intern(old->entries[0].username);
+        int rec = owner >= 0 ? acl_new_file(old->filename, owner) : -1;
+        for (int j = 0; rec >= 0 && j < old->num_entries && result == 0; j++) {
+            old->entries[j].username[MAX_USERNAME - 1] = '\0';
+            result = acl_grant(rec, old->entries[j].username, old->entries[j].access_level);
+        }
+        if (rec < 0) result = -1;
+    }
+    free(old);
+    return result;
+}
+
+static int acl_read_snapshot(const char *data, size_t size) {
+    SnapshotReader r = {data, data + size};
+    uint32_t magic, users, files;
+    if (take(&r, &magic, sizeof(magic)) < 0 || magic != ACL_SNAPSHOT_MAGIC) {
+        return acl_read_legacy(data, size);
+    }
+    
+    if (take(&r, &users, sizeof(users)) < 0) return -1;
+    for (uint32_t i = 0; i < users; i++) {
+        unsigned char len;
+        char name[MAX_USERNAME];
+        if (take(&r, &len, 1) < 0 || len >= MAX_USERNAME || take(&r, name, len) < 0) return -1;
+        name[len] = '\0';
+        if (user_intern(name) != (int)i) return -1;
+    }
+    
+    if (take(&r, &files, sizeof(files)) < 0) return -1;
+    for (uint32_t i = 0; i < files; i++) {
+        uint16_t len;
+        char name[MAX_FILENAME];
+        uint32_t meta[2];
+        if (take(&r, &len, sizeof(len)) < 0 || len >= MAX_FILENAME || take(&r, name, len) < 0 ||
+            take(&r, meta, sizeof(meta)) < 0 || meta[0] >= users) {
+            return -1;
+        }
+        name[len] = '\0';
+        
+        int rec = acl_new_file(name, meta[0]);
+        if (rec < 0) return -1;
+        for (uint32_t j = 0; j < meta[1]; j++) {
+            uint32_t user;
+            unsigned char level;
+            if (take(&r, &user, sizeof(user)) < 0 || take(&r, &level, 1) < 0 || user >= users ||
+                acl_set(&catalog[rec], user, level) < 0) {
+                return -1;
             }
-            pthread_mutex_unlock(&access_lock);
-            return 0;
         }
     }
-    pthread_mutex_unlock(&access_lock);
     return 0;
 }
 
-void *handle_ss_registration(void *arg) {
-    int sockfd = *(int*)arg;
-    free(arg);
+// Writes the table to a new snapshot and, once it is safely in place,
+// empties the journal. Appends are held off meanwhile by catalog_lock.
+void save_access_control() {
+    pthread_mutex_lock(&acl_save_lock);
+    pthread_rwlock_rdlock(&catalog_lock);
     
-    Message msg;
-    if (receive_message(sockfd, &msg) < 0) {
-        close(sockfd);
-        return NULL;
+    char path[MAX_PATH], tmp[MAX_PATH];
+    FILE *fp = NULL;
+    if (state_path(path, ACCESS_CONTROL_FILE) == 0 && state_path(tmp, ACCESS_CONTROL_FILE ".tmp") == 0) {
+        fp = fopen(tmp, "wb");
+    }
+    if (fp) {
+        int ok = acl_write_snapshot(fp) == 0 && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+        if (fclose(fp) == 0 && ok && rename(tmp, path) == 0) {
+            if (acl_journal) journal_truncate(acl_journal);
+        } else {
+            log_message("NM", "Access control snapshot failed");
+        }
     }
     
-    pthread_mutex_lock(&ss_lock);
-    if (num_ss >= MAX_SS) {
-        pthread_mutex_unlock(&ss_lock);
-        msg.type = MSG_ERROR;
-        msg.error_code = ERR_SS_UNAVAILABLE;
-        send_message(sockfd, &msg);
-        close(sockfd);
-        return NULL;
-    }
-    
-    int ss_idx = num_ss++;
-    strcpy(storage_servers[ss_idx].ip, msg.ss_ip);
-    storage_servers[ss_idx].nm_port = msg.ss_port;
-    storage_servers[ss_idx].client_port = msg.flags; // Using flags field
-    storage_servers[ss_idx].active = 1;
-    pthread_mutex_init(&storage_servers[ss_idx].lock, NULL);
+    pthread_rwlock_unlock(&catalog_lock);
+    pthread_mutex_unlock(&acl_save_lock);
+}
+
+// Waits until a logged change is durable. A failed journal write is made
+// good by a snapshot.
+static void acl_commit(uint64_t lsn) {
+    if (lsn == 0) return;
+    int failed = journal_commit(acl_journal, lsn) < 0;
+    if (failed) log_message("NM", "Access control journal write failed");
+    if (failed || journal_size(acl_journal) >= ACL_SNAPSHOT_BYTES) save_access_control();
+}
+
+// Held on the journal for as long as the process runs
+static int acl_lock_fd = -1;
+
+// Loads the snapshot, then replays the journal over it. Returns -1 if
+// either cannot be read, rather than starting with permissions missing,
+// and with errno EWOULDBLOCK if another naming server holds the journal.
+int load_access_control() {
+    char path[MAX_PATH], log_path[MAX_PATH];
+    if (state_path(path, ACCESS_CONTROL_FILE) < 0 || state_path(log_path, ACCESS_CONTROL_LOG) < 0) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    acl_lock_fd = open(log_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (acl_lock_fd < 0) return -1;
+    if (flock(acl_lock_fd, LOCK_EX | LOCK_NB) < 0) {
+        int err = errno;
+        close(acl_lock_fd);
+        acl_lock_fd = -1;
+        errno = err;
+        return -1;
+    }
     
-    // Parse file list from data field
-    char *token = strtok(msg.data, "\n");
-    storage_servers[ss_idx].num_files = 0;
-    while (token && storage_servers[ss_idx].num_files < MAX_FILES) {
-        strcpy(storage_servers[ss_idx].files[storage_servers[ss_idx].num_files++], token);
-        insert_trie(token, ss_idx);
-        token = strtok(NULL, "\n");
+    int loaded = 0, result = 0;
+    pthread_rwlock_wrlock(&catalog_lock);
+    visible_unsorted = 1;
+    FILE *fp = fopen(path, "rb");
+    if (fp) {
+        struct stat st;
+        char *data = NULL;
+        if (fstat(fileno(fp), &st) == 0 && (data = malloc(st.st_size + 1)) != NULL &&
+            fread(data, 1, st.st_size, fp) == (size_t)st.st_size) {
+            result = acl_read_snapshot(data, st.st_size);
+        } else {
+            result = -1;
+        }
+        free(data);
+        fclose(fp);
+        loaded = 1;
     }
     
-    pthread_mutex_unlock(&ss_lock);
+    int replayed = 0;
+    if (result == 0) acl_journal = journal_open(log_path, acl_replay, &replayed);
+    visible_sort();
+    pthread_rwlock_unlock(&catalog_lock);
+    if (!acl_journal) return -1;
     
-    log_message("NM", "Storage Server registered successfully");
+    if (loaded || replayed > 0) log_message("NM", "Access control data loaded from disk");
+    if (replayed > 0) save_access_control();
+    return 0;
+}
+
+// ===== END ACCESS CONTROL PERSISTENCE =====
+
+// Filename -> storage server index. Lookups take no lock.
+ArtTree file_index;
+
+// A delete removes the name from file_index before invalidating the cache,
+// so checking the index again after a put catches a delete that raced it
+static void cache_location(const char *filename, int ss_idx) {
+    lookup_cache_put(filename, ss_idx);
+    if (art_lookup(&file_index, filename) != ss_idx) lookup_cache_invalidate(filename);
+}
+
+int find_file_ss(const char *filename) {
+    // Check cache first
+    int cached = lookup_cache_get(filename);
+    if (cached >= 0) return cached;
     
-    msg.type = MSG_ACK;
-    send_message(sockfd, &msg);
+    // A name the filter has never seen is on no storage server
+    if (!located_filter_may_contain(filename)) return -1;
     
-    close(sockfd);
-    return NULL;
+    // Search the index
+    int ss_idx = art_lookup(&file_index, filename);
+    if (ss_idx >= 0) {
+        cache_location(filename, ss_idx);
+        return ss_idx;
+    }
+    
+    // Fall back to the catalog, for names the index could not take
+    pthread_rwlock_rdlock(&catalog_lock);
+    int rec = catalog_find(filename);
+    ss_idx = rec >= 0 ? catalog[rec].ss_index : -1;
+    if (ss_idx >= 0) art_insert(&file_index, filename, ss_idx); // Under catalog_lock, so a delete cannot slip in first
+    pthread_rwlock_unlock(&catalog_lock);
+    
+    if (ss_idx >= 0) cache_location(filename, ss_idx);
+    return ss_idx;
+}
+
+int check_access(const char *filename, const char *username, int required_level) {
+    pthread_rwlock_rdlock(&catalog_lock);
+    int rec = acl_find(filename);
+    int user = user_lookup(username);
+    int has_access = rec >= 0 && user >= 0 && acl_level(rec, user) >= required_level;
+    pthread_rwlock_unlock(&catalog_lock);
+    return has_access;
+}
+
+// ===== STORAGE SERVER CONNECTION POOL =====
+
+static int pool_connection_alive(int fd) {
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
 }
 
-void *handle_client(void *arg) {
-    int sockfd = *(int*)arg;
-    free(arg);
+// Takes an in-flight slot on the pool, waiting while the storage server is
+// at its cap, and returns an idle connection or -1 if a new one is needed
+static int pool_acquire(StorageServerInfo *ss, SSConnPool *pool) {
+    pthread_mutex_lock(&ss->lock);
+    while (pool->in_flight >= SS_MAX_IN_FLIGHT) {
+        pthread_cond_wait(&pool->slot_free, &ss->lock);
+    }
+    pool->in_flight++;
     
-    Message msg;
-    while (1) {
-        if (receive_message(sockfd, &msg) < 0) {
-            break;
+    int fd = -1;
+    while (pool->num_idle > 0) {
+        fd = pool->idle_fds[--pool->num_idle];
+        if (pool_connection_alive(fd)) break;
+        close(fd);
+        fd = -1;
+    }
+    pthread_mutex_unlock(&ss->lock);
+    return fd;
+}
+
+static void pool_release(StorageServerInfo *ss, SSConnPool *pool, int fd) {
+    pthread_mutex_lock(&ss->lock);
+    pool->in_flight--;
+    if (fd >= 0) {
+        if (pool->num_idle < SS_POOL_SIZE) {
+            pool->idle_fds[pool->num_idle++] = fd;
+        } else {
+            close(fd);
         }
-        
-        log_request("NM", msg.ss_ip, msg.ss_port, "Client request");
-        
-        Message response;
-        init_message(&response);
-        
-        switch (msg.type) {
-            case MSG_REGISTER_CLIENT: {
-                // Register client
-                pthread_mutex_lock(&client_lock);
-                if (num_clients < MAX_CLIENTS) {
-                    strcpy(clients[num_clients].username, msg.username);
-                    clients[num_clients].active = 1;
-                    num_clients++;
-                }
-                pthread_mutex_unlock(&client_lock);
-                
-                response.type = MSG_ACK;
-                send_message(sockfd, &response);
-                log_message("NM", "Client registered");
-                break;
-            }
-            
-            case MSG_LIST_FILES: {
-                pthread_mutex_lock(&ss_lock);
-                response.type = MSG_RESPONSE;
-                response.data[0] = '\0';
-                
-                // Use a temporary array to track unique files
-                char unique_files[MAX_FILES][MAX_FILENAME];
-                int num_unique = 0;
-                
-                for (int i = 0; i < num_ss; i++) {
-                    if (!storage_servers[i].active) continue;
-                    for (int j = 0; j < storage_servers[i].num_files; j++) {
-                        // Check if user has access or if -a flag is set
-                        if (msg.flags == 1 || check_access(storage_servers[i].files[j], 
-                                                           msg.username, ACCESS_READ)) {
-                            // Check if file is already in unique list
-                            int is_duplicate = 0;
-                            for (int k = 0; k < num_unique; k++) {
-                                if (strcmp(unique_files[k], storage_servers[i].files[j]) == 0) {
-                                    is_duplicate = 1;
-                                    break;
-                                }
-                            }
-                            
-                            if (!is_duplicate) {
-                                strcpy(unique_files[num_unique++], storage_servers[i].files[j]);
-                                strcat(response.data, storage_servers[i].files[j]);
-                                strcat(response.data, "\n");
-                            }
-                        }
-                    }
-                }
-                pthread_mutex_unlock(&ss_lock);
-                send_message(sockfd, &response);
-                break;
-            }
-            
-            case MSG_READ_FILE:
-            case MSG_WRITE_FILE:
-            case MSG_STREAM_FILE: {
-                int ss_idx = find_file_ss(msg.filename);
-                if (ss_idx < 0) {
-                    response.type = MSG_ERROR;
-                    response.error_code = ERR_FILE_NOT_FOUND;
-                } else if (!check_access(msg.filename, msg.username, 
-                          (msg.type == MSG_WRITE_FILE) ? ACCESS_WRITE : ACCESS_READ)) {
-                    response.type = MSG_ERROR;
-                    response.error_code = ERR_UNAUTHORIZED;
-                } else {
-                    response.type = MSG_RESPONSE;
-                    strcpy(response.ss_ip, storage_servers[ss_idx].ip);
-                    response.ss_port = storage_servers[ss_idx].client_port;
-                }
-                send_message(sockfd, &response);
-                break;
-            }
-            
-            case MSG_CREATE_FILE: {
-                // Forward to first available SS
-                int ss_idx = -1;
-                pthread_mutex_lock(&ss_lock);
-                for (int i = 0; i < num_ss; i++) {
-                    if (storage_servers[i].active) {
-                        ss_idx = i;
-                        break;
-                    }
-                }
-                pthread_mutex_unlock(&ss_lock);
-                
-                if (ss_idx < 0) {
-                    response.type = MSG_ERROR;
-                    response.error_code = ERR_SS_UNAVAILABLE;
-                    send_message(sockfd, &response);
-                } else {
-                    // Connect to SS and forward request
-                    int ss_sock = socket(AF_INET, SOCK_STREAM, 0);
-                    struct sockaddr_in ss_addr;
-                    ss_addr.sin_family = AF_INET;
-                    ss_addr.sin_port = htons(storage_servers[ss_idx].nm_port);
-                    inet_pton(AF_INET, storage_servers[ss_idx].ip, &ss_addr.sin_addr);
-                    
-                    if (connect(ss_sock, (struct sockaddr*)&ss_addr, sizeof(ss_addr)) == 0) {
-                        send_message(ss_sock, &msg);
-                        receive_message(ss_sock, &response);
-                        
-                        if (response.type == MSG_ACK) {
-                            pthread_mutex_lock(&ss_lock);
-                            strcpy(storage_servers[ss_idx].files[storage_servers[ss_idx].num_files++], 
-                                   msg.filename);
-                            pthread_mutex_unlock(&ss_lock);
-                            insert_trie(msg.filename, ss_idx);
-                            
-                            // Add owner to access control
-                            pthread_mutex_lock(&access_lock);
-                            strcpy(access_controls[num_access_controls].filename, msg.filename);
-                            strcpy(access_controls[num_access_controls].entries[0].username, msg.username);
-                            access_controls[num_access_controls].entries[0].access_level = ACCESS_WRITE;
-                            access_controls[num_access_controls].num_entries = 1;
-                            num_access_controls++;
-                            pthread_mutex_unlock(&access_lock);
-                            save_access_control();
-                        }
-                        close(ss_sock);
-                    } else {
-                        response.type = MSG_ERROR;
-                        response.error_code = ERR_SS_UNAVAILABLE;
-                    }
-                    send_message(sockfd, &response);
-                }
-                break;
+    }
+    pthread_cond_signal(&pool->slot_free);
+    pthread_mutex_unlock(&ss->lock);
+}
+
+static void pool_init(SSConnPool *pool) {
+    pool->num_idle = 0;
+    pool->in_flight = 0;
+    pthread_cond_init(&pool->slot_free, NULL);
+}
+
+// Sends msg to a storage server over a pooled connection and reads its reply.
+// A pooled connection the server has since closed is replaced transparently.
+int forward_to_ss(int ss_idx, int client_port, Message *msg, Message *response) {
+    StorageServerInfo *ss = &storage_servers[ss_idx];
+    SSConnPool *pool = client_port ? &ss->client_pool : &ss->nm_pool;
+    int port = client_port ? ss->client_port : ss->nm_port;
+    
+    int fd = pool_acquire(ss, pool);
+    int sent = fd >= 0 && send_message(fd, msg) == 0;
+    if (!sent) {
+        if (fd >= 0) close(fd);
+        fd = connect_to_server_via(ss->ip, port, ss->local_dir);
+        if (fd >= 0) {
+            int opt = 1;
+            setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &opt, sizeof(opt));
+            sent = send_message(fd, msg) == 0;
+        }
+    }
+    
+    if (!sent || receive_message(fd, response) < 0) {
+        if (fd >= 0) close(fd);
+        pool_release(ss, pool, -1);
+        free_message(response);
+        init_message(response);
+        response->request_id = msg->request_id;
+        response->type = MSG_ERROR;
+        response->error_code = ERR_SS_UNAVAILABLE;
+        return -1;
+    }
+    
+    pool_release(ss, pool, fd);
+    return 0;
+}
+
+// ===== END STORAGE SERVER CONNECTION POOL =====
+
+static uint32_t registration_seq; // Guarded by catalog_lock
+
+static void ss_slot_init(int ss_idx) {
+    pthread_mutex_init(&storage_servers[ss_idx].lock, NULL);
+    pool_init(&storage_servers[ss_idx].nm_pool);
+    pool_init(&storage_servers[ss_idx].client_pool);
+}
+
+// Keeps a storage server's address in the mapped header, and tells
+// followers. Caller holds catalog_lock for writing.
+static void catalog_save_server(int ss_idx) {
+    StorageServerInfo *ss = &storage_servers[ss_idx];
+    CatalogServer *saved = &catalog_header->servers[ss_idx];
+    strcpy(saved->ip, ss->ip);
+    saved->nm_port = ss->nm_port;
+    saved->client_port = ss->client_port;
+    strcpy(saved->local_dir, ss->local_dir);
+    if (catalog_header->num_servers <= (uint32_t)ss_idx) catalog_header->num_servers = ss_idx + 1;
+    repl_server(ss_idx);
+}
+
+// A storage server that registered before, in this run or the last, gets
+// its old slot back. Its file list is then the truth about what it holds:
+// listed files point at it, and files the catalog still placed on it but
+// that it no longer lists are dropped.
+void register_storage_server(Message *msg, Message *response) {
+    pthread_mutex_lock(&ss_lock);
+    int ss_idx = -1;
+    for (int i = 0; i < num_ss && ss_idx < 0; i++) {
+        if (strcmp(storage_servers[i].ip, msg->ss_ip) == 0 && storage_servers[i].nm_port == msg->ss_port) {
+            ss_idx = i;
+        }
+    }
+    if (ss_idx < 0) {
+        if (num_ss >= MAX_SS) {
+            pthread_mutex_unlock(&ss_lock);
+            response->type = MSG_ERROR;
+            response->error_code = ERR_SS_UNAVAILABLE;
+            return;
+        }
+        ss_idx = num_ss++;
+        ss_slot_init(ss_idx);
+    }
+    
+    StorageServerInfo *ss = &storage_servers[ss_idx];
+    strcpy(ss->ip, msg->ss_ip);
+    ss->nm_port = msg->ss_port;
+    ss->client_port = msg->flags; // Using flags field
+    strcpy(ss->local_dir, msg->local_dir);
+    ss->active = 1;
+    pthread_mutex_unlock(&ss_lock);
+    
+    pthread_rwlock_wrlock(&catalog_lock);
+    catalog_save_server(ss_idx);
+    uint32_t seq = ++registration_seq;
+    
+    // Parse file list from data field; other shards take the names they own
+    char *saveptr;
+    char *token = strtok_r(message_data(msg), "\n", &saveptr);
+    for (; token; token = strtok_r(NULL, "\n", &saveptr)) {
+        if (!shard_owns(token)) continue;
+        int rec = catalog_add(token);
+        if (rec >= 0) {
+            catalog_set_location(rec, ss_idx);
+            catalog[rec].seen = seq;
+        }
+        art_insert(&file_index, token, ss_idx);
+        lookup_cache_invalidate(token);
+    }
+    
+    int dropped = 0;
+    for (int i = 0; i < catalog_used; i++) {
+        FileInfo *f = &catalog[i];
+        if (f->ss_index != ss_idx || f->seen == seq) continue;
+        art_remove(&file_index, f->filename);
+        catalog_set_location(i, -1);
+        lookup_cache_invalidate(f->filename);
+        catalog_release(i);
+        dropped++;
+    }
+    pthread_rwlock_unlock(&catalog_lock);
+    
+    bump_location_epoch();
+    if (dropped > 0) {
+        char log_msg[128];
+        snprintf(log_msg, sizeof(log_msg), "Dropped %d files the storage server no longer has", dropped);
+        log_message("NM", log_msg);
+    }
+    log_message("NM", "Storage Server registered successfully");
+    response->type = MSG_ACK;
+}
+
+// ===== CATALOG RECOVERY =====
+
+// Maps CATALOG_FILE and rebuilds everything derived from it, so lookups
+// are answered as soon as the naming server starts rather than once every
+// storage server has registered again. Servers from the last run come back
+// inactive: clients are still sent to them, but new files and folders go
+// only to servers that have registered since. A file with another layout
+// or version is started afresh, and records that do not check out are
+// dropped. Access control is attached afterwards by load_access_control.
+//
+// The file is locked for as long as the process runs, so a second naming
+// server started on the same state fails here, with errno EWOULDBLOCK,
+// instead of mapping it too.
+//
+// The kernel writes the mapping back on its own, so a crash of the naming
+// server loses nothing. After a crash of the machine, whatever had not
+// reached the disk is put right as storage servers register.
+int load_catalog() {
+    char path[MAX_PATH];
+    if (state_path(path, CATALOG_FILE) < 0) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    
+    struct stat st;
+    CatalogHeader head;
+    int valid = fstat(fd, &st) == 0 && st.st_size >= CATALOG_HEADER_BYTES &&
+                pread(fd, &head, sizeof(head), 0) == sizeof(head) &&
+                head.magic == CATALOG_MAGIC && head.version == CATALOG_VERSION &&
+                head.record_size == sizeof(FileInfo) && head.capacity > 0 &&
+                head.used <= head.capacity && head.num_servers <= MAX_SS &&
+                (size_t)st.st_size >= CATALOG_HEADER_BYTES + (size_t)head.capacity * sizeof(FileInfo);
+    int cap = valid ? (int)head.capacity : 256;
+    size_t len = CATALOG_HEADER_BYTES + (size_t)cap * sizeof(FileInfo);
+    void *map = MAP_FAILED;
+    if ((valid || ftruncate(fd, 0) == 0) && ftruncate(fd, len) == 0) {
+        map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (map == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    
+    catalog_fd = fd;
+    catalog_header = map;
+    catalog_map_len = len;
+    catalog = (FileInfo*)((char*)map + CATALOG_HEADER_BYTES);
+    catalog_cap = cap;
+    if (!valid) {
+        memset(catalog_header, 0, sizeof(CatalogHeader));
+        catalog_header->magic = CATALOG_MAGIC;
+        catalog_header->version = CATALOG_VERSION;
+        catalog_header->record_size = sizeof(FileInfo);
+        catalog_header->capacity = cap;
+    }
+    
+    num_ss = catalog_header->num_servers;
+    for (int i = 0; i < num_ss; i++) {
+        CatalogServer *saved = &catalog_header->servers[i];
+        StorageServerInfo *ss = &storage_servers[i];
+        snprintf(ss->ip, INET_ADDRSTRLEN, "%.*s", INET_ADDRSTRLEN - 1, saved->ip);
+        ss->nm_port = saved->nm_port;
+        ss->client_port = saved->client_port;
+        snprintf(ss->local_dir, MAX_LOCAL_DIR, "%.*s", MAX_LOCAL_DIR - 1, saved->local_dir);
+        ss->active = 0; // Until it registers again
+        ss_slot_init(i);
+    }
+    
+    pthread_rwlock_wrlock(&catalog_lock);
+    catalog_used = catalog_header->used;
+    for (int i = 0; i < catalog_used; i++) {
+        FileInfo *f = &catalog[i];
+        int ok = memchr(f->filename, '\0', MAX_FILENAME) && f->filename[0] &&
+                 f->hash == name_hash(f->filename) && f->ss_index >= 0 && f->ss_index < num_ss &&
+                 shard_owns(f->filename);
+        f->owner = -1;
+        f->entries = NULL;
+        f->num_entries = 0;
+        f->cap = 0;
+        f->seen = 0;
+        if (!ok) {
+            f->filename[0] = '\0';
+            f->ss_index = -1;
+            continue;
+        }
+        num_files++;
+        num_located++;
+        art_insert(&file_index, f->filename, f->ss_index);
+    }
+    
+    int result = 0;
+    while (result == 0 && (!catalog_buckets || (uint32_t)num_files > catalog_mask)) {
+        result = catalog_grow_buckets();
+    }
+    for (int i = catalog_used - 1; i >= 0; i--) {
+        if (catalog[i].filename[0] != '\0') continue;
+        catalog[i].next = catalog_free;
+        catalog_free = i + 1;
+    }
+    located_filter_rebuild();
+    pthread_rwlock_unlock(&catalog_lock);
+    
+    if (num_files > 0) {
+        char log_msg[128];
+        snprintf(log_msg, sizeof(log_msg), "File catalog loaded: %d files on %d storage servers",
+                 num_files, num_ss);
+        log_message("NM", log_msg);
+    }
+    return result;
+}
+
+// ===== END CATALOG RECOVERY =====
+
+// ===== REPLICATION =====
+
+// A naming server started with -F follows a primary: it polls the primary
+// for its replication log and applies each record to its own catalog,
+// access control and storage server table, which it keeps on disk as a
+// primary would. Meanwhile it answers lookups and listings from that copy
+// and refuses every change with ERR_NOT_PRIMARY. Once the primary has not
+// answered for REPL_PROMOTE_AFTER seconds the follower stops following and
+// takes changes itself. Storage servers need not know: they are reached
+// at the addresses the primary recorded.
+//
+// Promotion bumps the generation kept in the catalog header, which every
+// reply and poll carries. The old primary may only have been cut off, so
+// the promoted server keeps telling it the new generation and where to
+// find the new primary; on hearing of a newer generation from anyone, a
+// primary stops taking changes and follows. A server told of a newer
+// generation without an address refuses changes until it is restarted.
+#define REPL_POLL_MS 1000 // How long a poll waits for a change
+#define REPL_BATCH_BYTES (1024 * 1024) // Records per reply, roughly
+#define REPL_RETRY_MS 250
+#define REPL_PROMOTE_AFTER 5 // Seconds
+#define REPL_FENCE_EVERY 2 // Seconds between reminders to a deposed primary
+
+static int following; // Set by -F or on stepping down, cleared on promotion
+static char primary_ip[INET_ADDRSTRLEN]; // Guarded by primary_lock
+static int primary_port;
+static int primary_changed; // Bumped when the address above changes
+static int follower_running; // follower_thread started
+static int self_port; // Port this server listens on, sent to a deposed primary
+static pthread_mutex_t primary_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *follower_thread(void *arg);
+
+static uint32_t repl_generation() {
+    return __atomic_load_n(&catalog_header->generation, __ATOMIC_ACQUIRE);
+}
+
+// Records a newer generation, durably before anything is answered under
+// it. Caller holds primary_lock.
+static void repl_set_generation(uint32_t generation) {
+    __atomic_store_n(&catalog_header->generation, generation, __ATOMIC_RELEASE);
+    if (msync(catalog_header, CATALOG_HEADER_BYTES, MS_SYNC) < 0) {
+        log_message("NM", "Catalog header sync failed");
+    }
+}
+
+// Called on a request stamped with a newer generation than ours, or on a
+// promoted server's reminder (ip given): stops taking changes and, given
+// the new primary's address, follows it. A reminder of our own generation
+// counts too, since a deposed primary restarted without -F still has it.
+static void repl_step_down(uint32_t generation, const char *ip, int port) {
+    int announced = ip && ip[0] && port > 0;
+    pthread_mutex_lock(&primary_lock);
+    uint32_t current = repl_generation();
+    if (generation < current || (generation == current && (!announced ||
+        (__atomic_load_n(&following, __ATOMIC_ACQUIRE) && strcmp(ip, primary_ip) == 0 &&
+         port == primary_port)))) {
+        pthread_mutex_unlock(&primary_lock);
+        return;
+    }
+    if (generation > current) repl_set_generation(generation);
+    int was_following = __atomic_exchange_n(&following, 1, __ATOMIC_ACQ_REL);
+    int start = 0;
+    if (announced) {
+        strcpy(primary_ip, ip);
+        primary_port = port;
+        primary_changed++;
+        start = !follower_running;
+        follower_running = 1;
+    }
+    pthread_mutex_unlock(&primary_lock);
+    
+    if (!was_following) {
+        char log_msg[128];
+        snprintf(log_msg, sizeof(log_msg), "Another primary has generation %u; stepped down", generation);
+        log_message("NM", log_msg);
+        printf("%s\n", log_msg);
+    }
+    if (start) {
+        pthread_t tid;
+        pthread_create(&tid, NULL, follower_thread, NULL);
+        pthread_detach(tid);
+    }
+}
+
+typedef struct {
+    char *data;
+    size_t len, cap;
+    int failed;
+} ReplBatch;
+
+static void batch_put(ReplBatch *b, const char *rec, uint32_t len) {
+    if (b->failed) return;
+    if (b->len + 4 + len > b->cap) {
+        size_t cap = b->cap ? b->cap * 2 + len : MAX_BUFFER + len;
+        char *grown = realloc(b->data, cap);
+        if (!grown) {
+            b->failed = 1;
+            return;
+        }
+        b->data = grown;
+        b->cap = cap;
+    }
+    memcpy(b->data + b->len, &len, 4);
+    memcpy(b->data + b->len + 4, rec, len);
+    b->len += 4 + len;
+}
+
+static void batch_record(ReplBatch *b, int kind, int arg, const char *x, const char *y) {
+    char rec[REPL_RECORD_MAX];
+    uint32_t len = repl_encode(rec, sizeof(rec), kind, arg, x, y);
+    if (len == 0) b->failed = 1;
+    batch_put(b, rec, len);
+}
+
+// Everything a follower needs to start from, as records, and the log
+// position it stands for. Writers wait while it is taken.
+static void repl_snapshot(Message *response) {
+    ReplBatch b = {0};
+    pthread_rwlock_rdlock(&catalog_lock);
+    pthread_mutex_lock(&ss_lock);
+    for (int i = 0; i < num_ss; i++) {
+        StorageServerInfo *ss = &storage_servers[i];
+        char addr[INET_ADDRSTRLEN + 40];
+        snprintf(addr, sizeof(addr), "%s %d %d %d", ss->ip, ss->nm_port, ss->client_port, ss->active);
+        batch_record(&b, REPL_SERVER, i, addr, ss->local_dir);
+    }
+    pthread_mutex_unlock(&ss_lock);
+    
+    for (int i = 0; i < catalog_used; i++) {
+        FileInfo *f = &catalog[i];
+        if (f->filename[0] == '\0') continue;
+        if (f->ss_index >= 0) batch_record(&b, REPL_LOCATE, f->ss_index, f->filename, "");
+        if (f->owner < 0) continue;
+        batch_record(&b, ACL_LOG_CREATE, ACCESS_WRITE, f->filename, user_names[f->owner]);
+        for (int j = 0; j < f->num_entries; j++) {
+            if (f->entries[j].user == f->owner) continue;
+            batch_record(&b, ACL_LOG_GRANT, f->entries[j].access_level, f->filename,
+                         user_names[f->entries[j].user]);
+        }
+    }
+    
+    pthread_mutex_lock(&repl_lock);
+    repl_enabled = 1;
+    uint64_t seq = repl_seq;
+    pthread_mutex_unlock(&repl_lock);
+    pthread_rwlock_unlock(&catalog_lock);
+    
+    if (b.failed) {
+        response->type = MSG_ERROR;
+        response->error_code = ERR_SERVER_BUSY;
+    } else {
+        response->type = MSG_RESPONSE;
+        response->flags = REPL_SNAPSHOT;
+        set_message_data(response, b.data, b.len);
+        snprintf(response->filename, MAX_FILENAME, "%u:%llu", repl_incarnation, (unsigned long long)seq);
+    }
+    free(b.data);
+}
+
+// Sends the records after the follower's cursor, waiting up to
+// REPL_POLL_MS for one if there are none yet
+void handle_replicate(Message *msg, Message *response) {
+    unsigned incarnation = 0;
+    unsigned long long after = 0;
+    int resumable = sscanf(msg->filename, "%u:%llu", &incarnation, &after) == 2;
+    
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += REPL_POLL_MS / 1000;
+    deadline.tv_nsec += (REPL_POLL_MS % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    
+    pthread_mutex_lock(&repl_lock);
+    while (resumable && repl_enabled && incarnation == repl_incarnation && after == repl_seq &&
+           pthread_cond_timedwait(&repl_news, &repl_lock, &deadline) == 0) {
+        // Woken by a new record
+    }
+    
+    ReplBatch b = {0};
+    uint64_t seq = after;
+    resumable = resumable && repl_enabled && incarnation == repl_incarnation && after <= repl_seq &&
+                repl_seq - after < REPL_LOG_RECORDS;
+    while (resumable && seq < repl_seq && b.len < REPL_BATCH_BYTES) {
+        ReplEntry *e = &repl_log[(seq + 1) % REPL_LOG_RECORDS];
+        if (!e->rec) {
+            resumable = 0;
+            break;
+        }
+        batch_put(&b, e->rec, e->len);
+        seq++;
+    }
+    pthread_mutex_unlock(&repl_lock);
+    
+    if (!resumable || b.failed) {
+        free(b.data);
+        repl_snapshot(response);
+        return;
+    }
+    response->type = MSG_RESPONSE;
+    if (b.len > 0) set_message_data(response, b.data, b.len);
+    snprintf(response->filename, MAX_FILENAME, "%u:%llu", repl_incarnation, (unsigned long long)seq);
+    free(b.data);
+}
+
+// Empties the catalog and access control before a snapshot is applied.
+// Caller holds catalog_lock for writing; returns the journal position.
+static uint64_t replica_reset() {
+    uint64_t lsn = 0;
+    for (int i = 0; i < catalog_used; i++) {
+        FileInfo *f = &catalog[i];
+        if (f->filename[0] == '\0') continue;
+        art_remove(&file_index, f->filename);
+        lookup_cache_invalidate(f->filename);
+        catalog_set_location(i, -1);
+        if (f->owner >= 0) {
+            lsn = acl_log(ACL_LOG_DELETE, f->filename, "", ACCESS_NONE);
+            acl_remove_file(i);
+        } else {
+            catalog_release(i);
+        }
+    }
+    return lsn;
+}
+
+// Applies one record from the primary. Caller holds catalog_lock for
+// writing; returns the journal position of an access control change.
+static uint64_t replica_apply(const char *rec, uint32_t len) {
+    const char *a, *b;
+    if (record_parse(rec, len, &a, &b) < 0 || strlen(b) >= MAX_PATH) return 0;
+    int kind = rec[0], arg = (unsigned char)rec[1];
+    
+    switch (kind) {
+        case ACL_LOG_CREATE:
+        case ACL_LOG_DELETE:
+        case ACL_LOG_GRANT:
+        case ACL_LOG_REVOKE:
+            if (strlen(b) >= MAX_USERNAME) return 0;
+            acl_apply(kind, arg, a, b);
+            return acl_log(kind, a, b, arg);
+        
+        case REPL_LOCATE: {
+            if (arg >= num_ss) return 0;
+            int r = catalog_add(a);
+            if (r >= 0) catalog_set_location(r, arg);
+            art_insert(&file_index, a, arg);
+            lookup_cache_invalidate(a);
+            return 0;
+        }
+        
+        case REPL_UNLOCATE: {
+            art_remove(&file_index, a);
+            int r = catalog_find(a);
+            if (r >= 0) {
+                catalog_set_location(r, -1);
+                catalog_release(r);
+            }
+            lookup_cache_invalidate(a);
+            return 0;
+        }
+        
+        case REPL_SERVER: {
+            char ip[INET_ADDRSTRLEN];
+            int nm_port, client_port, active;
+            if (arg >= MAX_SS || strlen(b) >= MAX_LOCAL_DIR ||
+                sscanf(a, "%15s %d %d %d", ip, &nm_port, &client_port, &active) != 4) {
+                return 0;
+            }
+            pthread_mutex_lock(&ss_lock);
+            while (num_ss <= arg) ss_slot_init(num_ss++);
+            StorageServerInfo *ss = &storage_servers[arg];
+            strcpy(ss->ip, ip);
+            ss->nm_port = nm_port;
+            ss->client_port = client_port;
+            strcpy(ss->local_dir, b);
+            ss->active = active;
+            pthread_mutex_unlock(&ss_lock);
+            catalog_save_server(arg);
+            return 0;
+        }
+    }
+    return 0;
+}
+
+static void replica_apply_batch(Message *reply) {
+    const char *p = message_data(reply);
+    const char *end = p + message_data_len(reply);
+    int snapshot = reply->flags & REPL_SNAPSHOT;
+    uint64_t lsn = 0;
+    int applied = 0;
+    
+    pthread_rwlock_wrlock(&catalog_lock);
+    if (snapshot) lsn = replica_reset();
+    while (end - p >= 4) {
+        uint32_t len;
+        memcpy(&len, p, 4);
+        p += 4;
+        if (len > (size_t)(end - p)) break;
+        uint64_t at = replica_apply(p, len);
+        if (at) lsn = at;
+        p += len;
+        applied++;
+    }
+    pthread_rwlock_unlock(&catalog_lock);
+    
+    acl_commit(lsn);
+    if (snapshot || applied > 0) bump_location_epoch();
+    if (snapshot) {
+        char log_msg[128];
+        snprintf(log_msg, sizeof(log_msg), "Loaded snapshot from primary: %d records", applied);
+        log_message("NM", log_msg);
+    }
+}
+
+// Polls the primary until it has been out of reach for REPL_PROMOTE_AFTER
+// seconds
+static void follow_primary() {
+    char cursor[MAX_FILENAME] = "";
+    time_t last_contact = time(NULL);
+    int fd = -1, target = -1;
+    
+    while (1) {
+        pthread_mutex_lock(&primary_lock);
+        char ip[INET_ADDRSTRLEN];
+        strcpy(ip, primary_ip);
+        int port = primary_port;
+        int changed = primary_changed != target;
+        target = primary_changed;
+        pthread_mutex_unlock(&primary_lock);
+        if (changed) {
+            // A new primary starts us from its snapshot
+            if (fd >= 0) close(fd);
+            fd = -1;
+            cursor[0] = '\0';
+            last_contact = time(NULL);
+        }
+        
+        if (fd < 0) {
+            fd = connect_to_server(ip, port);
+            struct timeval tv = {REPL_POLL_MS / 1000 + REPL_PROMOTE_AFTER, 0};
+            if (fd >= 0) setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        }
+        
+        Message msg, reply;
+        init_message(&msg);
+        init_message(&reply);
+        msg.type = MSG_REPLICATE;
+        msg.generation = repl_generation();
+        strcpy(msg.filename, cursor);
+        if (fd >= 0 && send_message(fd, &msg) >= 0 && receive_message(fd, &reply) >= 0) {
+            last_contact = time(NULL);
+            if (reply.generation > repl_generation()) {
+                pthread_mutex_lock(&primary_lock);
+                if (reply.generation > repl_generation()) repl_set_generation(reply.generation);
+                pthread_mutex_unlock(&primary_lock);
+            }
+            if (reply.type == MSG_RESPONSE) {
+                replica_apply_batch(&reply);
+                strcpy(cursor, reply.filename);
+                free_message(&reply);
+                continue;
             }
+            free_message(&reply); // Alive but unable to answer; ask again shortly
+        } else if (fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+        
+        if (time(NULL) - last_contact >= REPL_PROMOTE_AFTER) break;
+        usleep(REPL_RETRY_MS * 1000);
+    }
+    if (fd >= 0) close(fd);
+}
+
+// Tells the old primary, for as long as we are primary, the generation
+// that replaced it and where to find us
+static void fence_old_primary() {
+    while (!__atomic_load_n(&following, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&primary_lock);
+        char ip[INET_ADDRSTRLEN];
+        strcpy(ip, primary_ip);
+        int port = primary_port;
+        pthread_mutex_unlock(&primary_lock);
+        
+        int fd = connect_to_server(ip, port);
+        if (fd >= 0) {
+            struct timeval tv = {REPL_FENCE_EVERY, 0};
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
             
-            case MSG_DELETE_FILE: {
-                // Check if user is owner
-                int is_owner = 0;
-                pthread_mutex_lock(&access_lock);
-                for (int i = 0; i < num_access_controls; i++) {
-                    if (strcmp(access_controls[i].filename, msg.filename) == 0) {
-                        if (strcmp(access_controls[i].entries[0].username, msg.username) == 0) {
-                            is_owner = 1;
-                        }
-                        break;
-                    }
-                }
-                pthread_mutex_unlock(&access_lock);
-                
-                if (!is_owner) {
-                    response.type = MSG_ERROR;
-                    response.error_code = ERR_PERMISSION_DENIED;
-                    send_message(sockfd, &response);
-                    break;
-                }
-                
-                // Find SS with file and forward delete
-                int ss_idx = find_file_ss(msg.filename);
-                if (ss_idx < 0) {
-                    response.type = MSG_ERROR;
-                    response.error_code = ERR_FILE_NOT_FOUND;
-                    send_message(sockfd, &response);
-                    break;
-                }
-                
-                // Connect to SS and forward request
-                int ss_sock = socket(AF_INET, SOCK_STREAM, 0);
-                struct sockaddr_in ss_addr;
-                ss_addr.sin_family = AF_INET;
-                ss_addr.sin_port = htons(storage_servers[ss_idx].nm_port);
-                inet_pton(AF_INET, storage_servers[ss_idx].ip, &ss_addr.sin_addr);
-                
-                if (connect(ss_sock, (struct sockaddr*)&ss_addr, sizeof(ss_addr)) == 0) {
-                    send_message(ss_sock, &msg);
-                    receive_message(ss_sock, &response);
-                    
-                    if (response.type == MSG_ACK) {
-                        // Remove from SS file list
-                        pthread_mutex_lock(&ss_lock);
-                        for (int i = 0; i < storage_servers[ss_idx].num_files; i++) {
-                            if (strcmp(storage_servers[ss_idx].files[i], msg.filename) == 0) {
-                                for (int j = i; j < storage_servers[ss_idx].num_files - 1; j++) {
-                                    strcpy(storage_servers[ss_idx].files[j], 
-                                           storage_servers[ss_idx].files[j + 1]);
-                                }
-                                storage_servers[ss_idx].num_files--;
-                                break;
-                            }
-                        }
-                        pthread_mutex_unlock(&ss_lock);
-                        
-                        // Remove from access control
-                        pthread_mutex_lock(&access_lock);
-                        for (int i = 0; i < num_access_controls; i++) {
-                            if (strcmp(access_controls[i].filename, msg.filename) == 0) {
-                                for (int j = i; j < num_access_controls - 1; j++) {
-                                    access_controls[j] = access_controls[j + 1];
-                                }
-                                num_access_controls--;
-                                break;
-                            }
-                        }
-                        pthread_mutex_unlock(&access_lock);
-                        save_access_control();
-                    }
-                    close(ss_sock);
-                } else {
-                    response.type = MSG_ERROR;
-                    response.error_code = ERR_SS_UNAVAILABLE;
+            // Our address as the old primary reaches it
+            Message msg, reply;
+            init_message(&msg);
+            init_message(&reply);
+            struct sockaddr_in self;
+            socklen_t self_len = sizeof(self);
+            if (getsockname(fd, (struct sockaddr*)&self, &self_len) == 0) {
+                inet_ntop(AF_INET, &self.sin_addr, msg.ss_ip, sizeof(msg.ss_ip));
+            }
+            msg.type = MSG_REPLICATE;
+            msg.generation = repl_generation();
+            msg.ss_port = self_port;
+            if (send_message(fd, &msg) >= 0 && receive_message(fd, &reply) >= 0) {
+                free_message(&reply);
+            }
+            close(fd);
+        }
+        sleep(REPL_FENCE_EVERY);
+    }
+}
+
+static void *follower_thread(void *arg) {
+    (void)arg;
+    while (1) {
+        follow_primary();
+        
+        pthread_mutex_lock(&primary_lock);
+        uint32_t generation = repl_generation() + 1;
+        repl_set_generation(generation);
+        __atomic_store_n(&following, 0, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&primary_lock);
+        bump_location_epoch();
+        
+        char log_msg[128];
+        snprintf(log_msg, sizeof(log_msg), "Primary unreachable; promoted to primary (generation %u)",
+                 generation);
+        log_message("NM", log_msg);
+        printf("%s\n", log_msg);
+        
+        // Returns once a newer primary has deposed us in turn
+        fence_old_primary();
+    }
+    return NULL;
+}
+
+// What a follower answers itself; everything else belongs to the primary
+static int follower_serves(int type) {
+    switch (type) {
+        case MSG_READ_FILE:
+        case MSG_STREAM_FILE:
+        case MSG_GET_OWNER:
+        case MSG_LIST_FILES:
+        case MSG_SEARCH:
+        case MSG_BATCH_INFO:
+        case MSG_LIST_USERS:
+        case MSG_REGISTER_CLIENT:
+        case MSG_CACHE_STATS:
+        case MSG_SHARD_MAP:
+        case MSG_REPLICATE:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// ===== END REPLICATION =====
+
+// ===== BATCHED METADATA =====
+
+// The files of one batch that live on the same storage server, sent to it
+// as a single stats request
+typedef struct {
+    int ss_idx;
+    uint32_t request_id;
+    char *names;
+    size_t len, cap;
+    Message reply;
+    int ok;
+} BatchGroup;
+
+typedef struct {
+    char *name;
+    char owner[MAX_USERNAME];
+    int ss_idx;
+    int group; // -1 if the user may not see this file's location
+} BatchRow;
+
+static void *batch_group_thread(void *arg) {
+    BatchGroup *group = arg;
+    Message ss_msg;
+    init_message(&ss_msg);
+    ss_msg.type = MSG_BATCH_INFO;
+    ss_msg.request_id = group->request_id;
+    set_message_data(&ss_msg, group->names, group->len);
+    group->ok = forward_to_ss(group->ss_idx, 0, &ss_msg, &group->reply) == 0 &&
+                group->reply.type == MSG_RESPONSE;
+    free_message(&ss_msg);
+    return NULL;
+}
+
+static int batch_group_add(BatchGroup *group, const char *name) {
+    size_t n = strlen(name);
+    if (group->len + n + 1 > group->cap) {
+        size_t cap = group->cap ? group->cap * 2 + n : MAX_BUFFER + n;
+        char *grown = realloc(group->names, cap);
+        if (!grown) return -1;
+        group->names = grown;
+        group->cap = cap;
+    }
+    memcpy(group->names + group->len, name, n);
+    group->len += n;
+    group->names[group->len++] = '\n';
+    return 0;
+}
+
+// Keeps the catalog's copy of stats a storage server just reported
+static void catalog_set_stats(const char *filename, long size, long mtime) {
+    pthread_rwlock_wrlock(&catalog_lock);
+    int rec = catalog_find(filename);
+    if (rec >= 0) {
+        catalog[rec].size = size;
+        catalog[rec].modified = mtime;
+    }
+    pthread_rwlock_unlock(&catalog_lock);
+}
+
+// Resolves owner, location and stats for every file named in the request,
+// one name per line. Files are grouped by storage server and each server
+// gets a single stats request; the servers are queried in parallel. Each
+// line of the reply is
+// "name\towner\tss_ip\tss_port\tsize\twords\tmtime", with "-" for a
+// missing owner or location and zeros for missing stats.
+void handle_batch(Message *msg, Message *response) {
+    char *names = strdup(message_data(msg));
+    size_t max_rows = 1;
+    for (char *p = names; p && *p; p++) {
+        if (*p == '\n') max_rows++;
+    }
+    BatchRow *rows = calloc(max_rows, sizeof(BatchRow));
+    BatchGroup *groups = calloc(MAX_SS, sizeof(BatchGroup));
+    if (!names || !rows || !groups) {
+        free(names);
+        free(rows);
+        free(groups);
+        response->type = MSG_ERROR;
+        response->error_code = ERR_SERVER_BUSY;
+        return;
+    }
+    
+    int num_rows = 0, num_groups = 0;
+    char *saveptr;
+    char *name = strtok_r(names, "\n", &saveptr);
+    while (name) {
+        BatchRow *row = &rows[num_rows++];
+        row->name = name;
+        row->group = -1;
+        strcpy(row->owner, "-");
+        
+        get_owner(name, row->owner);
+        
+        // Same rule as a READ lookup: no location without read access
+        row->ss_idx = find_file_ss(name);
+        if (row->ss_idx >= 0 && check_access(name, msg->username, ACCESS_READ)) {
+            int g = 0;
+            while (g < num_groups && groups[g].ss_idx != row->ss_idx) g++;
+            if (g == num_groups) {
+                groups[g].ss_idx = row->ss_idx;
+                groups[g].request_id = msg->request_id;
+                num_groups++;
+            }
+            if (batch_group_add(&groups[g], name) == 0) row->group = g;
+        }
+        name = strtok_r(NULL, "\n", &saveptr);
+    }
+    
+    pthread_t threads[MAX_SS];
+    int started[MAX_SS] = {0};
+    for (int g = 1; g < num_groups; g++) {
+        started[g] = pthread_create(&threads[g], NULL, batch_group_thread, &groups[g]) == 0;
+        if (!started[g]) batch_group_thread(&groups[g]);
+    }
+    if (num_groups > 0) batch_group_thread(&groups[0]);
+    for (int g = 1; g < num_groups; g++) {
+        if (started[g]) pthread_join(threads[g], NULL);
+    }
+    
+    // Storage servers answer in request order, one line per file
+    char *cursors[MAX_SS];
+    for (int g = 0; g < num_groups; g++) {
+        cursors[g] = groups[g].ok ? message_data(&groups[g].reply) : NULL;
+    }
+    
+    size_t len = 0, cap = MAX_BUFFER;
+    char *out = malloc(cap);
+    for (int r = 0; out && r < num_rows; r++) {
+        BatchRow *row = &rows[r];
+        long size = 0, mtime = 0;
+        int words = 0;
+        const char *ss_ip = "-";
+        int ss_port = 0;
+        
+        if (row->group >= 0) {
+            ss_ip = storage_servers[row->ss_idx].ip;
+            ss_port = storage_servers[row->ss_idx].client_port;
+            
+            char **cursor = &cursors[row->group];
+            if (*cursor && **cursor) {
+                char *end = strchr(*cursor, '\n');
+                if (end) *end = '\0';
+                char *stats = strchr(*cursor, '\t');
+                if (stats && sscanf(stats, "\t%ld\t%d\t%ld", &size, &words, &mtime) == 3) {
+                    catalog_set_stats(row->name, size, mtime);
                 }
-                send_message(sockfd, &response);
+                *cursor = end ? end + 1 : NULL;
+            }
+        }
+        
+        char line[MAX_FILENAME + MAX_USERNAME + INET_ADDRSTRLEN + 96];
+        int n = snprintf(line, sizeof(line), "%s\t%s\t%s\t%d\t%ld\t%d\t%ld\n",
+                         row->name, row->owner, ss_ip, ss_port, size, words, mtime);
+        if (len + n > cap) {
+            cap = cap * 2 + n;
+            char *grown = realloc(out, cap);
+            if (!grown) {
+                free(out);
+                out = NULL;
                 break;
             }
+            out = grown;
+        }
+        memcpy(out + len, line, n);
+        len += n;
+    }
+    
+    if (out) {
+        response->type = MSG_RESPONSE;
+        set_message_data(response, out, len);
+        free(out);
+    } else {
+        response->type = MSG_ERROR;
+        response->error_code = ERR_SERVER_BUSY;
+    }
+    
+    for (int g = 0; g < num_groups; g++) {
+        free(groups[g].names);
+        free_message(&groups[g].reply);
+    }
+    free(groups);
+    free(rows);
+    free(names);
+}
+
+// ===== END BATCHED METADATA =====
+
+// ===== FILE LISTING AND SEARCH =====
+
+// One page of a MSG_LIST_FILES or MSG_SEARCH reply. A listing is a search
+// with an empty substring. The files a user may read are found by walking
+// that user's visibility list, and every file by walking file_index. Both
+// are in name order, so each walk starts at the cursor, or at the pattern's
+// literal prefix if that comes later, and stops once names no longer start
+// with that prefix. A page costs its own length plus the names the pattern
+// rejects inside that range, never the whole namespace, and no lock is held
+// from one page to the next.
+typedef struct {
+    const char *pattern;
+    int mode; // SEARCH_*
+    char literal[MAX_FILENAME]; // Every match starts with this
+    size_t literal_len;
+    char *out;
+    size_t len, cap;
+    size_t last; // Where the last name starts
+    int rows, limit;
+    int more; // A match past the end of the page exists
+    int failed;
+} ListPage;
+
+static int list_match(const ListPage *page, const char *name) {
+    switch (page->mode) {
+        case SEARCH_GLOB:
+            return fnmatch(page->pattern, name, 0) == 0;
+        case SEARCH_SUBSTRING:
+            return strstr(name, page->pattern) != NULL;
+        default:
+            return 1; // The literal prefix is the whole pattern
+    }
+}
+
+// Adds a match, or notes that the page is already full. Returns 1 to stop.
+static int list_add(ListPage *page, const char *name) {
+    if (page->rows == page->limit) {
+        page->more = 1;
+        return 1;
+    }
+    
+    size_t n = strlen(name);
+    if (page->len + n + 2 > page->cap) {
+        size_t cap = page->cap ? page->cap * 2 + n : MAX_BUFFER + n;
+        char *grown = realloc(page->out, cap);
+        if (!grown) {
+            page->failed = 1;
+            return 1;
+        }
+        page->out = grown;
+        page->cap = cap;
+    }
+    page->last = page->len;
+    memcpy(page->out + page->len, name, n);
+    page->len += n;
+    page->out[page->len++] = '\n';
+    page->out[page->len] = '\0';
+    page->rows++;
+    return 0;
+}
+
+static int list_scan_fn(const char *name, int ss_idx, void *arg) {
+    ListPage *page = arg;
+    (void)ss_idx;
+    if (strncmp(name, page->literal, page->literal_len) != 0) return 1; // Past every match
+    return list_match(page, name) ? list_add(page, name) : 0;
+}
+
+// Fills response with the page of names matching pattern that follows
+// the request's cursor
+static void list_page(Message *msg, Message *response, const char *pattern, int mode) {
+    ListPage page = {0};
+    page.pattern = pattern;
+    page.mode = mode;
+    page.limit = msg->sentence_num > 0 ? msg->sentence_num : LIST_DEFAULT_PAGE;
+    if (page.limit > LIST_MAX_PAGE) page.limit = LIST_MAX_PAGE;
+    if (mode != SEARCH_SUBSTRING) {
+        // Up to the first wildcard; a prefix pattern is all literal
+        page.literal_len = mode == SEARCH_GLOB ? strcspn(pattern, "*?[\\") : strlen(pattern);
+        memcpy(page.literal, pattern, page.literal_len);
+    }
+    msg->filename[MAX_FILENAME - 1] = '\0';
+    
+    // Start after the cursor, or at the literal prefix itself
+    const char *after = msg->filename;
+    int from_literal = strcmp(after, page.literal) < 0;
+    
+    if ((msg->flags & LIST_ALL) && !(msg->flags & LIST_OWNED)) {
+        if (from_literal) {
+            if (art_lookup(&file_index, page.literal) >= 0 && list_match(&page, page.literal)) {
+                list_add(&page, page.literal);
+            }
+            after = page.literal;
+        }
+        art_scan(&file_index, after, list_scan_fn, &page);
+    } else {
+        // An owner always holds an entry, so owned files are in the list too
+        pthread_rwlock_rdlock(&catalog_lock);
+        int user = user_lookup(msg->username);
+        VisibleFiles *v = user >= 0 ? &user_visible[user] : NULL;
+        int pos = 0;
+        if (v && from_literal) {
+            pos = visible_lower(v, page.literal);
+        } else if (v) {
+            pos = visible_lower(v, after);
+            if (pos < v->count && strcmp(catalog[v->recs[pos]].filename, after) == 0) pos++;
+        }
+        for (; v && pos < v->count; pos++) {
+            FileInfo *f = &catalog[v->recs[pos]];
+            if (strncmp(f->filename, page.literal, page.literal_len) != 0) break;
+            if (f->ss_index < 0) continue;
+            if ((msg->flags & LIST_OWNED) && f->owner != user) continue;
+            if (list_match(&page, f->filename) && list_add(&page, f->filename)) break;
+        }
+        pthread_rwlock_unlock(&catalog_lock);
+    }
+    
+    if (page.failed && page.rows == 0) {
+        response->type = MSG_ERROR;
+        response->error_code = ERR_SERVER_BUSY;
+    } else {
+        response->type = MSG_RESPONSE;
+        if (page.rows > 0) {
+            set_message_data(response, page.out, page.len);
+            if (page.more || page.failed) {
+                // The cursor is the last name, without its newline
+                snprintf(response->filename, MAX_FILENAME, "%.*s",
+                         (int)(page.len - page.last - 1), page.out + page.last);
+            }
+        }
+    }
+    free(page.out);
+}
+
+void handle_list_files(Message *msg, Message *response) {
+    list_page(msg, response, "", SEARCH_SUBSTRING);
+}
+
+void handle_search(Message *msg, Message *response) {
+    const char *pattern = message_data(msg);
+    int mode = msg->word_index;
+    if (strlen(pattern) >= MAX_FILENAME ||
+        (mode != SEARCH_PREFIX && mode != SEARCH_GLOB && mode != SEARCH_SUBSTRING)) {
+        response->type = MSG_ERROR;
+        response->error_code = ERR_INVALID_COMMAND;
+        return;
+    }
+    list_page(msg, response, pattern, mode);
+}
+
+// ===== END FILE LISTING AND SEARCH =====
+
+// Executes one request and fills in its response. Runs on an event loop
+// thread, or on a worker for requests that may block (see is_blocking_request).
+void handle_request(Message *msg, Message *response) {
+    log_request("NM", msg->ss_ip, msg->ss_port, "Client request");
+    
+    // Read before any lookup, so a location in this reply is never newer
+    // than the epoch it is stamped with
+    uint32_t epoch = __atomic_load_n(&location_epoch, __ATOMIC_ACQUIRE);
+    
+    // Whoever sent a newer generation has seen a primary promoted since
+    int announced = msg->type == MSG_REPLICATE && msg->ss_port > 0;
+    if (msg->generation > repl_generation() ||
+        (announced && msg->generation && msg->generation == repl_generation())) {
+        repl_step_down(msg->generation, announced ? msg->ss_ip : NULL, msg->ss_port);
+        response->type = MSG_ERROR;
+        response->error_code = ERR_NOT_PRIMARY;
+        response->epoch = epoch;
+        response->generation = repl_generation();
+        return;
+    }
+    uint32_t generation = repl_generation();
+    
+    // A client routing with an older shard map
+    if (shard_keyed_request(msg->type) && !shard_owns(msg->filename)) {
+        response->type = MSG_ERROR;
+        response->error_code = ERR_WRONG_SHARD;
+        response->epoch = epoch;
+        response->generation = generation;
+        return;
+    }
+    
+    if (__atomic_load_n(&following, __ATOMIC_ACQUIRE) && !follower_serves(msg->type)) {
+        response->type = MSG_ERROR;
+        response->error_code = ERR_NOT_PRIMARY;
+        response->epoch = epoch;
+        response->generation = generation;
+        return;
+    }
+    
+    switch (msg->type) {
+        case MSG_REGISTER_SS:
+            register_storage_server(msg, response);
+            break;
+        
+        case MSG_REGISTER_CLIENT: {
+            // Register client
+            pthread_mutex_lock(&client_lock);
+            if (num_clients < MAX_CLIENTS) {
+                strcpy(clients[num_clients].username, msg->username);
+                clients[num_clients].active = 1;
+                num_clients++;
+            }
+            pthread_mutex_unlock(&client_lock);
             
-            case MSG_LIST_USERS: {
-                response.type = MSG_RESPONSE;
-                response.data[0] = '\0';
-                
-                // Use array to track unique usernames
-                char unique_users[MAX_CLIENTS][MAX_USERNAME];
-                int num_unique = 0;
-                
-                // Add from client list
-                pthread_mutex_lock(&client_lock);
-                for (int i = 0; i < num_clients; i++) {
-                    int is_duplicate = 0;
-                    for (int j = 0; j < num_unique; j++) {
-                        if (strcmp(unique_users[j], clients[i].username) == 0) {
-                            is_duplicate = 1;
-                            break;
-                        }
-                    }
-                    if (!is_duplicate && num_unique < MAX_CLIENTS) {
-                        strcpy(unique_users[num_unique++], clients[i].username);
-                    }
-                }
-                pthread_mutex_unlock(&client_lock);
-                
-                // Add from access control
-                pthread_mutex_lock(&access_lock);
-                for (int i = 0; i < num_access_controls; i++) {
-                    for (int j = 0; j < access_controls[i].num_entries; j++) {
-                        int is_duplicate = 0;
-                        for (int k = 0; k < num_unique; k++) {
-                            if (strcmp(unique_users[k], access_controls[i].entries[j].username) == 0) {
-                                is_duplicate = 1;
-                                break;
-                            }
-                        }
-                        if (!is_duplicate && num_unique < MAX_CLIENTS) {
-                            strcpy(unique_users[num_unique++], access_controls[i].entries[j].username);
-                        }
-                    }
-                }
-                pthread_mutex_unlock(&access_lock);
-                
-                // Build response
-                for (int i = 0; i < num_unique; i++) {
-                    strcat(response.data, unique_users[i]);
-                    strcat(response.data, "\n");
+            response->type = MSG_ACK;
+            log_message("NM", "Client registered");
+            break;
+        }
+        
+        case MSG_SHARD_MAP:
+            response->type = MSG_RESPONSE;
+            response->data[0] = '\0';
+            if (shard_self >= 0) shard_map_format(&shard_map, response->data, sizeof(response->data));
+            break;
+        
+        case MSG_LIST_FILES:
+            handle_list_files(msg, response);
+            break;
+        
+        case MSG_SEARCH:
+            handle_search(msg, response);
+            break;
+        
+        case MSG_REPLICATE:
+            handle_replicate(msg, response);
+            break;
+        
+        case MSG_READ_FILE:
+        case MSG_WRITE_FILE:
+        case MSG_STREAM_FILE: {
+            int ss_idx = find_file_ss(msg->filename);
+            if (ss_idx < 0) {
+                response->type = MSG_ERROR;
+                response->error_code = ERR_FILE_NOT_FOUND;
+            } else if (!check_access(msg->filename, msg->username, 
+                      (msg->type == MSG_WRITE_FILE) ? ACCESS_WRITE : ACCESS_READ)) {
+                response->type = MSG_ERROR;
+                response->error_code = ERR_UNAUTHORIZED;
+            } else {
+                response->type = MSG_RESPONSE;
+                strcpy(response->ss_ip, storage_servers[ss_idx].ip);
+                response->ss_port = storage_servers[ss_idx].client_port;
+                strcpy(response->local_dir, storage_servers[ss_idx].local_dir);
+            }
+            break;
+        }
+        
+        case MSG_CREATE_FILE: {
+            // Forward to first available SS
+            int ss_idx = -1;
+            pthread_mutex_lock(&ss_lock);
+            for (int i = 0; i < num_ss; i++) {
+                if (storage_servers[i].active) {
+                    ss_idx = i;
+                    break;
                 }
-                
-                send_message(sockfd, &response);
-                break;
             }
+            pthread_mutex_unlock(&ss_lock);
             
-            case MSG_ADD_ACCESS: {
-                // Check if requester is owner
-                int is_owner = 0;
-                pthread_mutex_lock(&access_lock);
-                for (int i = 0; i < num_access_controls; i++) {
-                    if (strcmp(access_controls[i].filename, msg.filename) == 0) {
-                        if (strcmp(access_controls[i].entries[0].username, msg.username) == 0) {
-                            is_owner = 1;
+            if (ss_idx < 0) {
+                response->type = MSG_ERROR;
+                response->error_code = ERR_SS_UNAVAILABLE;
+            } else {
+                // Forward request to SS
+                if (forward_to_ss(ss_idx, 0, msg, response) == 0) {
+                    if (response->type == MSG_ACK) {
+                        uint64_t lsn = 0;
+                        pthread_rwlock_wrlock(&catalog_lock);
+                        int rec = catalog_add(msg->filename);
+                        if (rec >= 0) {
+                            catalog_set_location(rec, ss_idx);
+                            catalog[rec].size = 0;
+                            catalog[rec].created = catalog[rec].modified = time(NULL);
                         }
+                        art_insert(&file_index, msg->filename, ss_idx);
                         
-                        if (is_owner) {
-                            // Check if user already has access
-                            int found = -1;
-                            for (int j = 0; j < access_controls[i].num_entries; j++) {
-                                if (strcmp(access_controls[i].entries[j].username, msg.data) == 0) {
-                                    found = j;
-                                    break;
-                                }
-                            }
-                            
-                            if (found >= 0) {
-                                // Update existing access
-                                access_controls[i].entries[found].access_level = 
-                                    (msg.flags == 1) ? ACCESS_READ : ACCESS_WRITE;
-                            } else {
-                                // Add new access
-                                int idx = access_controls[i].num_entries++;
-                                strcpy(access_controls[i].entries[idx].username, msg.data);
-                                access_controls[i].entries[idx].access_level = 
-                                    (msg.flags == 1) ? ACCESS_READ : ACCESS_WRITE;
-                            }
-                            response.type = MSG_ACK;
+                        // Add owner to access control
+                        if (rec < 0 || acl_add_file(msg->filename, msg->username) < 0) {
+                            log_message("NM", "Out of memory for file catalog");
                         } else {
-                            response.type = MSG_ERROR;
-                            response.error_code = ERR_PERMISSION_DENIED;
+                            lsn = acl_log(ACL_LOG_CREATE, msg->filename, msg->username, ACCESS_WRITE);
                         }
-                        break;
+                        pthread_rwlock_unlock(&catalog_lock);
+                        acl_commit(lsn);
                     }
                 }
-                pthread_mutex_unlock(&access_lock);
-                save_access_control();
-                send_message(sockfd, &response);
+            }
+            break;
+        }
+        
+        case MSG_DELETE_FILE: {
+            // Check if user is owner
+            pthread_rwlock_rdlock(&catalog_lock);
+            int is_owner = acl_is_owner(acl_find(msg->filename), msg->username);
+            pthread_rwlock_unlock(&catalog_lock);
+            
+            if (!is_owner) {
+                response->type = MSG_ERROR;
+                response->error_code = ERR_PERMISSION_DENIED;
                 break;
             }
             
-            case MSG_REM_ACCESS: {
-                // Check if requester is owner
-                int is_owner = 0;
-                pthread_mutex_lock(&access_lock);
-                for (int i = 0; i < num_access_controls; i++) {
-                    if (strcmp(access_controls[i].filename, msg.filename) == 0) {
-                        if (strcmp(access_controls[i].entries[0].username, msg.username) == 0) {
-                            is_owner = 1;
-                        }
-                        
-                        if (is_owner) {
-                            // Remove access
-                            for (int j = 1; j < access_controls[i].num_entries; j++) {
-                                if (strcmp(access_controls[i].entries[j].username, msg.data) == 0) {
-                                    // Shift entries
-                                    for (int k = j; k < access_controls[i].num_entries - 1; k++) {
-                                        access_controls[i].entries[k] = access_controls[i].entries[k + 1];
-                                    }
-                                    access_controls[i].num_entries--;
-                                    break;
-                                }
-                            }
-                            response.type = MSG_ACK;
-                        } else {
-                            response.type = MSG_ERROR;
-                            response.error_code = ERR_PERMISSION_DENIED;
-                        }
-                        break;
-                    }
-                }
-                pthread_mutex_unlock(&access_lock);
-                save_access_control();
-                send_message(sockfd, &response);
+            // Find SS with file and forward delete
+            int ss_idx = find_file_ss(msg->filename);
+            if (ss_idx < 0) {
+                response->type = MSG_ERROR;
+                response->error_code = ERR_FILE_NOT_FOUND;
                 break;
             }
             
-            case MSG_EXEC_FILE: {
-                int ss_idx = find_file_ss(msg.filename);
-                if (ss_idx < 0) {
-                    response.type = MSG_ERROR;
-                    response.error_code = ERR_FILE_NOT_FOUND;
-                    send_message(sockfd, &response);
-                    break;
-                }
-                
-                if (!check_access(msg.filename, msg.username, ACCESS_READ)) {
-                    response.type = MSG_ERROR;
-                    response.error_code = ERR_UNAUTHORIZED;
-                    send_message(sockfd, &response);
-                    break;
-                }
-                
-                // Get file content from SS
-                int ss_sock = socket(AF_INET, SOCK_STREAM, 0);
-                struct sockaddr_in ss_addr;
-                ss_addr.sin_family = AF_INET;
-                ss_addr.sin_port = htons(storage_servers[ss_idx].nm_port);
-                inet_pton(AF_INET, storage_servers[ss_idx].ip, &ss_addr.sin_addr);
-                
-                if (connect(ss_sock, (struct sockaddr*)&ss_addr, sizeof(ss_addr)) == 0) {
-                    Message ss_msg;
-                    init_message(&ss_msg);
-                    ss_msg.type = MSG_READ_FILE;
-                    strcpy(ss_msg.filename, msg.filename);
-                    send_message(ss_sock, &ss_msg);
-                    
-                    Message ss_resp;
-                    receive_message(ss_sock, &ss_resp);
-                    close(ss_sock);
-                    
-                    if (ss_resp.type == MSG_RESPONSE) {
-                        // Execute commands
-                        FILE *fp = popen(ss_resp.data, "r");
-                        if (fp) {
-                            response.data[0] = '\0';
-                            char line[256];
-                            while (fgets(line, sizeof(line), fp)) {
-                                if (strlen(response.data) + strlen(line) < sizeof(response.data)) {
-                                    strcat(response.data, line);
-                                }
-                            }
-                            pclose(fp);
-                            response.type = MSG_RESPONSE;
+            // Forward request to SS
+            if (forward_to_ss(ss_idx, 0, msg, response) == 0) {
+                if (response->type == MSG_ACK) {
+                    // Remove from the catalog, access control included
+                    uint64_t lsn = 0;
+                    pthread_rwlock_wrlock(&catalog_lock);
+                    art_remove(&file_index, msg->filename);
+                    int rec = catalog_find(msg->filename);
+                    if (rec >= 0) {
+                        catalog_set_location(rec, -1);
+                        if (catalog[rec].owner >= 0) {
+                            acl_remove_file(rec);
+                            lsn = acl_log(ACL_LOG_DELETE, msg->filename, "", ACCESS_NONE);
                         } else {
-                            response.type = MSG_ERROR;
-                            response.error_code = ERR_INVALID_COMMAND;
+                            catalog_release(rec);
                         }
-                    } else {
-                        response.type = MSG_ERROR;
-                        response.error_code = ERR_FILE_NOT_FOUND;
                     }
-                } else {
-                    response.type = MSG_ERROR;
-                    response.error_code = ERR_SS_UNAVAILABLE;
+                    pthread_rwlock_unlock(&catalog_lock);
+                    lookup_cache_invalidate(msg->filename);
+                    
+                    // Only now, so a reply stamped with the new epoch
+                    // cannot still carry the deleted location
+                    bump_location_epoch();
+                    acl_commit(lsn);
                 }
-                send_message(sockfd, &response);
-                break;
             }
+            break;
+        }
+        
+        case MSG_LIST_USERS: {
+            response->type = MSG_RESPONSE;
+            response->data[0] = '\0';
+            
+            // Use array to track unique usernames
+            char unique_users[MAX_CLIENTS][MAX_USERNAME];
+            int num_unique = 0;
             
-            case MSG_GET_OWNER: {
-                response.type = MSG_RESPONSE;
-                response.data[0] = '\0';
-                
-                // Find owner from access control
-                pthread_mutex_lock(&access_lock);
-                for (int i = 0; i < num_access_controls; i++) {
-                    if (strcmp(access_controls[i].filename, msg.filename) == 0) {
-                        // Owner is always the first entry
-                        strcpy(response.data, access_controls[i].entries[0].username);
+            // Add from client list
+            pthread_mutex_lock(&client_lock);
+            for (int i = 0; i < num_clients; i++) {
+                int is_duplicate = 0;
+                for (int j = 0; j < num_unique; j++) {
+                    if (strcmp(unique_users[j], clients[i].username) == 0) {
+                        is_duplicate = 1;
                         break;
                     }
                 }
-                pthread_mutex_unlock(&access_lock);
-                
-                send_message(sockfd, &response);
-                break;
+                if (!is_duplicate && num_unique < MAX_CLIENTS) {
+                    strcpy(unique_users[num_unique++], clients[i].username);
+                }
             }
+            pthread_mutex_unlock(&client_lock);
             
-            // ===== FOLDER OPERATIONS =====
-            case MSG_CREATE_FOLDER: {
-                // Forward to a storage server
-                int ss_idx = 0; // Use first active storage server
-                pthread_mutex_lock(&ss_lock);
-                for (int i = 0; i < num_ss; i++) {
-                    if (storage_servers[i].active) {
-                        ss_idx = i;
+            // Add from access control, skipping users who hold no access any more
+            pthread_rwlock_rdlock(&catalog_lock);
+            char *granted = calloc(num_users ? num_users : 1, 1);
+            for (int i = 0; granted && i < catalog_used; i++) {
+                for (int j = 0; j < catalog[i].num_entries; j++) {
+                    granted[catalog[i].entries[j].user] = 1;
+                }
+            }
+            for (int id = 0; granted && id < num_users; id++) {
+                if (!granted[id]) continue;
+                int is_duplicate = 0;
+                for (int k = 0; k < num_unique; k++) {
+                    if (strcmp(unique_users[k], user_names[id]) == 0) {
+                        is_duplicate = 1;
                         break;
                     }
                 }
-                pthread_mutex_unlock(&ss_lock);
-                
-                if (ss_idx >= 0) {
-                    int ss_sock = socket(AF_INET, SOCK_STREAM, 0);
-                    struct sockaddr_in ss_addr;
-                    ss_addr.sin_family = AF_INET;
-                    ss_addr.sin_port = htons(storage_servers[ss_idx].client_port);
-                    inet_pton(AF_INET, storage_servers[ss_idx].ip, &ss_addr.sin_addr);
-                    
-                    if (connect(ss_sock, (struct sockaddr*)&ss_addr, sizeof(ss_addr)) == 0) {
-                        send_message(ss_sock, &msg);
-                        receive_message(ss_sock, &response);
-                        close(ss_sock);
-                    } else {
-                        response.type = MSG_ERROR;
-                        response.error_code = ERR_SS_UNAVAILABLE;
-                    }
-                } else {
-                    response.type = MSG_ERROR;
-                    response.error_code = ERR_SS_UNAVAILABLE;
+                if (!is_duplicate && num_unique < MAX_CLIENTS) {
+                    strcpy(unique_users[num_unique++], user_names[id]);
                 }
-                send_message(sockfd, &response);
-                break;
             }
+            free(granted);
+            pthread_rwlock_unlock(&catalog_lock);
             
-            case MSG_MOVE_FILE: {
-                // Find SS containing the file
-                int ss_idx = find_file_ss(msg.filename);
-                if (ss_idx < 0) {
-                    response.type = MSG_ERROR;
-                    response.error_code = ERR_FILE_NOT_FOUND;
-                    send_message(sockfd, &response);
-                    break;
-                }
-                
-                // Check access
-                if (!check_access(msg.filename, msg.username, ACCESS_WRITE)) {
-                    response.type = MSG_ERROR;
-                    response.error_code = ERR_UNAUTHORIZED;
-                    send_message(sockfd, &response);
-                    break;
+            // Build response
+            for (int i = 0; i < num_unique; i++) {
+                strcat(response->data, unique_users[i]);
+                strcat(response->data, "\n");
+            }
+            
+            break;
+        }
+        
+        case MSG_ADD_ACCESS: {
+            // Only the owner may grant access
+            int level = (msg->flags == 1) ? ACCESS_READ : ACCESS_WRITE;
+            uint64_t lsn = 0;
+            pthread_rwlock_wrlock(&catalog_lock);
+            int rec = acl_find(msg->filename);
+            if (rec >= 0) {
+                if (!acl_is_owner(rec, msg->username)) {
+                    response->type = MSG_ERROR;
+                    response->error_code = ERR_PERMISSION_DENIED;
+                } else if (strlen(msg->data) >= MAX_USERNAME) {
+                    response->type = MSG_ERROR;
+                    response->error_code = ERR_INVALID_COMMAND;
+                } else if (acl_grant(rec, msg->data, level) < 0) {
+                    response->type = MSG_ERROR;
+                    response->error_code = ERR_SERVER_BUSY;
+                } else {
+                    lsn = acl_log(ACL_LOG_GRANT, msg->filename, msg->data, level);
+                    response->type = MSG_ACK;
                 }
-                
-                // Forward to the storage server
-                int ss_sock = socket(AF_INET, SOCK_STREAM, 0);
-                struct sockaddr_in ss_addr;
-                ss_addr.sin_family = AF_INET;
-                ss_addr.sin_port = htons(storage_servers[ss_idx].client_port);
-                inet_pton(AF_INET, storage_servers[ss_idx].ip, &ss_addr.sin_addr);
-                
-                if (connect(ss_sock, (struct sockaddr*)&ss_addr, sizeof(ss_addr)) == 0) {
-                    send_message(ss_sock, &msg);
-                    receive_message(ss_sock, &response);
-                    close(ss_sock);
+            }
+            pthread_rwlock_unlock(&catalog_lock);
+            acl_commit(lsn);
+            break;
+        }
+        
+        case MSG_REM_ACCESS: {
+            // Only the owner may revoke access
+            uint64_t lsn = 0;
+            pthread_rwlock_wrlock(&catalog_lock);
+            int rec = acl_find(msg->filename);
+            if (rec >= 0) {
+                if (acl_is_owner(rec, msg->username)) {
+                    // A name that long was never granted anything
+                    if (strlen(msg->data) < MAX_USERNAME && acl_revoke(rec, msg->data)) {
+                        lsn = acl_log(ACL_LOG_REVOKE, msg->filename, msg->data, ACCESS_NONE);
+                        bump_location_epoch();
+                    }
+                    response->type = MSG_ACK;
                 } else {
-                    response.type = MSG_ERROR;
-                    response.error_code = ERR_SS_UNAVAILABLE;
+                    response->type = MSG_ERROR;
+                    response->error_code = ERR_PERMISSION_DENIED;
                 }
-                send_message(sockfd, &response);
+            }
+            pthread_rwlock_unlock(&catalog_lock);
+            acl_commit(lsn);
+            break;
+        }
+        
+        case MSG_EXEC_FILE: {
+            int ss_idx = find_file_ss(msg->filename);
+            if (ss_idx < 0) {
+                response->type = MSG_ERROR;
+                response->error_code = ERR_FILE_NOT_FOUND;
                 break;
             }
             
-            case MSG_VIEW_FOLDER: {
-                // Use first active storage server to view folder
-                int ss_idx = 0;
-                pthread_mutex_lock(&ss_lock);
-                for (int i = 0; i < num_ss; i++) {
-                    if (storage_servers[i].active) {
-                        ss_idx = i;
-                        break;
-                    }
-                }
-                pthread_mutex_unlock(&ss_lock);
-                
-                if (ss_idx >= 0) {
-                    int ss_sock = socket(AF_INET, SOCK_STREAM, 0);
-                    struct sockaddr_in ss_addr;
-                    ss_addr.sin_family = AF_INET;
-                    ss_addr.sin_port = htons(storage_servers[ss_idx].client_port);
-                    inet_pton(AF_INET, storage_servers[ss_idx].ip, &ss_addr.sin_addr);
-                    
-                    if (connect(ss_sock, (struct sockaddr*)&ss_addr, sizeof(ss_addr)) == 0) {
-                        send_message(ss_sock, &msg);
-                        receive_message(ss_sock, &response);
-                        close(ss_sock);
+            if (!check_access(msg->filename, msg->username, ACCESS_READ)) {
+                response->type = MSG_ERROR;
+                response->error_code = ERR_UNAUTHORIZED;
+                break;
+            }
+            
+            // Get file content from SS
+            Message ss_msg;
+            init_message(&ss_msg);
+            ss_msg.type = MSG_READ_FILE;
+            ss_msg.request_id = msg->request_id;
+            strcpy(ss_msg.filename, msg->filename);
+            
+            Message ss_resp;
+            init_message(&ss_resp);
+            if (forward_to_ss(ss_idx, 0, &ss_msg, &ss_resp) == 0) {
+                if (ss_resp.type == MSG_RESPONSE) {
+                    // Execute commands
+                    FILE *fp = popen(message_data(&ss_resp), "r");
+                    if (fp) {
+                        response->data[0] = '\0';
+                        char line[256];
+                        while (fgets(line, sizeof(line), fp)) {
+                            if (strlen(response->data) + strlen(line) < sizeof(response->data)) {
+                                strcat(response->data, line);
+                            }
+                        }
+                        pclose(fp);
+                        response->type = MSG_RESPONSE;
                     } else {
-                        response.type = MSG_ERROR;
-                        response.error_code = ERR_SS_UNAVAILABLE;
+                        response->type = MSG_ERROR;
+                        response->error_code = ERR_INVALID_COMMAND;
                     }
                 } else {
-                    response.type = MSG_ERROR;
-                    response.error_code = ERR_SS_UNAVAILABLE;
+                    response->type = MSG_ERROR;
+                    response->error_code = ERR_FILE_NOT_FOUND;
                 }
-                send_message(sockfd, &response);
-                break;
+                free_message(&ss_resp);
+            } else {
+                *response = ss_resp;
             }
-            // ===== END FOLDER OPERATIONS =====
+            break;
+        }
+        
+        case MSG_BATCH_INFO:
+            handle_batch(msg, response);
+            break;
+        
+        case MSG_GET_OWNER: {
+            response->type = MSG_RESPONSE;
+            response->data[0] = '\0';
             
-            // ===== CHECKPOINT OPERATIONS =====
-            case MSG_CHECKPOINT:
-            case MSG_VIEWCHECKPOINT:
-            case MSG_REVERT:
-            case MSG_LISTCHECKPOINTS: {
-                // Find SS containing the file
-                int ss_idx = find_file_ss(msg.filename);
-                if (ss_idx < 0) {
-                    response.type = MSG_ERROR;
-                    response.error_code = ERR_FILE_NOT_FOUND;
-                    send_message(sockfd, &response);
+            get_owner(msg->filename, response->data);
+            
+            break;
+        }
+        
+        case MSG_CACHE_STATS: {
+            // One line per shard:
+            // "shard\tentries\tcapacity\thits\tmisses\tevictions\trejections"
+            LookupCacheStats stats[LOOKUP_CACHE_SHARDS];
+            lookup_cache_stats(stats);
+            response->type = MSG_RESPONSE;
+            size_t len = 0;
+            for (int i = 0; i < LOOKUP_CACHE_SHARDS; i++) {
+                len += snprintf(response->data + len, sizeof(response->data) - len,
+                                "%d\t%d\t%d\t%lu\t%lu\t%lu\t%lu\n", i, stats[i].entries,
+                                stats[i].capacity, (unsigned long)stats[i].hits,
+                                (unsigned long)stats[i].misses, (unsigned long)stats[i].evictions,
+                                (unsigned long)stats[i].rejections);
+            }
+            break;
+        }
+        
+        // ===== FOLDER OPERATIONS =====
+        case MSG_CREATE_FOLDER: {
+            // Forward to a storage server
+            int ss_idx = -1; // Use first active storage server
+            pthread_mutex_lock(&ss_lock);
+            for (int i = 0; i < num_ss; i++) {
+                if (storage_servers[i].active) {
+                    ss_idx = i;
                     break;
                 }
-                
-                // Check access based on operation type
-                int required_level = (msg.type == MSG_CHECKPOINT) ? ACCESS_WRITE : ACCESS_READ;
-                if (!check_access(msg.filename, msg.username, required_level)) {
-                    response.type = MSG_ERROR;
-                    response.error_code = ERR_UNAUTHORIZED;
-                    send_message(sockfd, &response);
+            }
+            pthread_mutex_unlock(&ss_lock);
+            
+            if (ss_idx >= 0) {
+                forward_to_ss(ss_idx, 1, msg, response);
+            } else {
+                response->type = MSG_ERROR;
+                response->error_code = ERR_SS_UNAVAILABLE;
+            }
+            break;
+        }
+        
+        case MSG_MOVE_FILE: {
+            // Find SS containing the file
+            int ss_idx = find_file_ss(msg->filename);
+            if (ss_idx < 0) {
+                response->type = MSG_ERROR;
+                response->error_code = ERR_FILE_NOT_FOUND;
+                break;
+            }
+            
+            // Check access
+            if (!check_access(msg->filename, msg->username, ACCESS_WRITE)) {
+                response->type = MSG_ERROR;
+                response->error_code = ERR_UNAUTHORIZED;
+                break;
+            }
+            
+            // Forward to the storage server
+            if (forward_to_ss(ss_idx, 1, msg, response) == 0 && response->type == MSG_ACK) {
+                lookup_cache_invalidate(msg->filename);
+                bump_location_epoch();
+            }
+            break;
+        }
+        
+        case MSG_VIEW_FOLDER: {
+            // Use first active storage server to view folder
+            int ss_idx = -1;
+            pthread_mutex_lock(&ss_lock);
+            for (int i = 0; i < num_ss; i++) {
+                if (storage_servers[i].active) {
+                    ss_idx = i;
                     break;
                 }
-                
-                // Forward to the storage server
-                int ss_sock = socket(AF_INET, SOCK_STREAM, 0);
-                struct sockaddr_in ss_addr;
-                ss_addr.sin_family = AF_INET;
-                ss_addr.sin_port = htons(storage_servers[ss_idx].client_port);
-                inet_pton(AF_INET, storage_servers[ss_idx].ip, &ss_addr.sin_addr);
-                
-                if (connect(ss_sock, (struct sockaddr*)&ss_addr, sizeof(ss_addr)) == 0) {
-                    send_message(ss_sock, &msg);
-                    receive_message(ss_sock, &response);
-                    close(ss_sock);
-                } else {
-                    response.type = MSG_ERROR;
-                    response.error_code = ERR_SS_UNAVAILABLE;
-                }
-                send_message(sockfd, &response);
+            }
+            pthread_mutex_unlock(&ss_lock);
+            
+            if (ss_idx >= 0) {
+                forward_to_ss(ss_idx, 1, msg, response);
+            } else {
+                response->type = MSG_ERROR;
+                response->error_code = ERR_SS_UNAVAILABLE;
+            }
+            break;
+        }
+        // ===== END FOLDER OPERATIONS =====
+        
+        // ===== CHECKPOINT OPERATIONS =====
+        case MSG_CHECKPOINT:
+        case MSG_VIEWCHECKPOINT:
+        case MSG_REVERT:
+        case MSG_LISTCHECKPOINTS: {
+            // Find SS containing the file
+            int ss_idx = find_file_ss(msg->filename);
+            if (ss_idx < 0) {
+                response->type = MSG_ERROR;
+                response->error_code = ERR_FILE_NOT_FOUND;
                 break;
             }
-            // ===== END CHECKPOINT OPERATIONS =====
+            
+            // Check access based on operation type
+            int required_level = (msg->type == MSG_CHECKPOINT) ? ACCESS_WRITE : ACCESS_READ;
+            if (!check_access(msg->filename, msg->username, required_level)) {
+                response->type = MSG_ERROR;
+                response->error_code = ERR_UNAUTHORIZED;
+                break;
+            }
+            
+            // Forward to the storage server
+            forward_to_ss(ss_idx, 1, msg, response);
+            break;
         }
+        // ===== END CHECKPOINT OPERATIONS =====
+    }
+    
+    response->epoch = epoch;
+    response->generation = generation;
+}
+
+// ===== EVENT LOOP =====
+
+typedef struct {
+    int fd;
+    int epfd;
+    int peer; // What the peer speaks and accepts (PEER_*)
+    char *in_buf; // Only touched by the owning event loop
+    size_t in_len, in_cap;
+    pthread_mutex_t lock; // Guards everything below
+    char *out_buf;
+    size_t out_len, out_cap;
+    int refs; // Event loop plus queued/running requests
+    int closed;
+} Connection;
+
+typedef struct {
+    Connection *conn;
+    Message *msg;
+} WorkItem;
+
+WorkItem work_queue[NM_WORK_QUEUE_DEPTH];
+int work_head = 0, work_count = 0;
+pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t work_ready = PTHREAD_COND_INITIALIZER;
+
+// Requests that talk to a storage server or to disk go to the worker pool
+// so they never stall an event loop
+int is_blocking_request(int type) {
+    switch (type) {
+        case MSG_REGISTER_SS: // Takes catalog_lock to reconcile its whole file list
+        case MSG_CREATE_FILE:
+        case MSG_DELETE_FILE:
+        case MSG_EXEC_FILE:
+        case MSG_BATCH_INFO:
+        case MSG_SEARCH:
+        case MSG_REPLICATE:
+        case MSG_ADD_ACCESS:
+        case MSG_REM_ACCESS:
+        case MSG_CREATE_FOLDER:
+        case MSG_MOVE_FILE:
+        case MSG_VIEW_FOLDER:
+        case MSG_CHECKPOINT:
+        case MSG_VIEWCHECKPOINT:
+        case MSG_REVERT:
+        case MSG_LISTCHECKPOINTS:
+            return 1;
+    }
+    return 0;
+}
+
+static void conn_release(Connection *conn) {
+    pthread_mutex_lock(&conn->lock);
+    int last = --conn->refs == 0;
+    pthread_mutex_unlock(&conn->lock);
+    if (!last) return;
+    
+    close(conn->fd);
+    pthread_mutex_destroy(&conn->lock);
+    free(conn->in_buf);
+    free(conn->out_buf);
+    free(conn);
+}
+
+// Called by the owning event loop; the fd stays open until the last
+// in-flight request on it finishes
+static void conn_close(Connection *conn) {
+    pthread_mutex_lock(&conn->lock);
+    conn->closed = 1;
+    epoll_ctl(conn->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    pthread_mutex_unlock(&conn->lock);
+    conn_release(conn);
+}
+
+// Writes as much of the output buffer as the socket accepts and waits for
+// EPOLLOUT if anything is left. Caller holds conn->lock.
+static void conn_flush(Connection *conn) {
+    size_t sent = 0;
+    while (sent < conn->out_len) {
+        ssize_t n = send(conn->fd, conn->out_buf + sent, conn->out_len - sent, MSG_NOSIGNAL);
+        if (n <= 0) break;
+        sent += n;
     }
+    memmove(conn->out_buf, conn->out_buf + sent, conn->out_len - sent);
+    conn->out_len -= sent;
+    
+    struct epoll_event ev;
+    ev.events = EPOLLIN | (conn->out_len > 0 ? EPOLLOUT : 0);
+    ev.data.ptr = conn;
+    epoll_ctl(conn->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+// Queues a response on the connection; safe to call from any thread
+void conn_send(Connection *conn, Message *response) {
+    size_t len;
+    char *buf = serialize_message(response, conn->peer, &len);
+    if (!buf) return;
     
-    close(sockfd);
+    pthread_mutex_lock(&conn->lock);
+    if (!conn->closed) {
+        if (conn->out_len + len > conn->out_cap) {
+            size_t cap = conn->out_cap ? conn->out_cap : MAX_BUFFER;
+            while (cap < conn->out_len + len) cap *= 2;
+            char *grown = realloc(conn->out_buf, cap);
+            if (grown) {
+                conn->out_buf = grown;
+                conn->out_cap = cap;
+            }
+        }
+        if (conn->out_len + len <= conn->out_cap) {
+            memcpy(conn->out_buf + conn->out_len, buf, len);
+            conn->out_len += len;
+            conn_flush(conn);
+        }
+    }
+    pthread_mutex_unlock(&conn->lock);
+    free(buf);
+}
+
+void *worker_thread(void *arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&work_lock);
+        while (work_count == 0) {
+            pthread_cond_wait(&work_ready, &work_lock);
+        }
+        WorkItem item = work_queue[work_head];
+        work_head = (work_head + 1) % NM_WORK_QUEUE_DEPTH;
+        work_count--;
+        pthread_mutex_unlock(&work_lock);
+        
+        Message response;
+        init_message(&response);
+        response.request_id = item.msg->request_id;
+        handle_request(item.msg, &response);
+        conn_send(item.conn, &response);
+        
+        free_message(&response);
+        free_message(item.msg);
+        free(item.msg);
+        conn_release(item.conn);
+    }
     return NULL;
 }
 
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <port>\n", argv[0]);
-        return 1;
+// Hands a blocking request to the worker pool. Returns -1 when the queue
+// is full so the caller can answer ERR_SERVER_BUSY instead.
+static int submit_work(Connection *conn, Message *msg) {
+    Message *copy = malloc(sizeof(Message));
+    if (!copy) return -1;
+    
+    pthread_mutex_lock(&work_lock);
+    if (work_count >= NM_WORK_QUEUE_DEPTH) {
+        pthread_mutex_unlock(&work_lock);
+        free(copy);
+        return -1;
+    }
+    *copy = *msg;
+    pthread_mutex_lock(&conn->lock);
+    conn->refs++;
+    pthread_mutex_unlock(&conn->lock);
+    work_queue[(work_head + work_count) % NM_WORK_QUEUE_DEPTH] = (WorkItem){conn, copy};
+    work_count++;
+    pthread_cond_signal(&work_ready);
+    pthread_mutex_unlock(&work_lock);
+    return 0;
+}
+
+static void dispatch_message(Connection *conn, Message *msg) {
+    Message response;
+    init_message(&response);
+    response.request_id = msg->request_id;
+    
+    if (is_blocking_request(msg->type)) {
+        if (submit_work(conn, msg) == 0) return;
+        response.type = MSG_ERROR;
+        response.error_code = ERR_SERVER_BUSY;
+    } else {
+        handle_request(msg, &response);
     }
     
-    int port = atoi(argv[1]);
-    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    conn_send(conn, &response);
+    free_message(&response);
+    free_message(msg);
+}
+
+// Drains the socket and dispatches every complete message in it. Returns
+// -1 when the connection should be closed.
+static int conn_read(Connection *conn) {
+    while (1) {
+        if (conn->in_len > FRAME_HEADER_SIZE + MAX_FRAME_PAYLOAD) return -1;
+        if (conn->in_cap - conn->in_len < MAX_BUFFER) {
+            size_t cap = conn->in_cap ? conn->in_cap * 2 : 2 * MAX_BUFFER;
+            char *grown = realloc(conn->in_buf, cap);
+            if (!grown) return -1;
+            conn->in_buf = grown;
+            conn->in_cap = cap;
+        }
+        
+        ssize_t n = recv(conn->fd, conn->in_buf + conn->in_len, conn->in_cap - conn->in_len, 0);
+        if (n == 0) return -1;
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        conn->in_len += n;
+    }
+    
+    size_t offset = 0;
+    while (offset < conn->in_len) {
+        Message msg;
+        init_message(&msg);
+        int used = parse_message(conn->in_buf + offset, conn->in_len - offset, &msg, &conn->peer);
+        if (used < 0) return -1;
+        if (used == 0) break;
+        offset += used;
+        dispatch_message(conn, &msg);
+    }
+    memmove(conn->in_buf, conn->in_buf + offset, conn->in_len - offset);
+    conn->in_len -= offset;
+    
+    // Release the buffer of connections that go idle after a large request
+    if (conn->in_len == 0 && conn->in_cap > 4 * MAX_BUFFER) {
+        free(conn->in_buf);
+        conn->in_buf = NULL;
+        conn->in_cap = 0;
+    }
+    return 0;
+}
+
+static void accept_connections(int server_fd, int epfd) {
+    while (1) {
+        int fd = accept4(server_fd, NULL, NULL, SOCK_NONBLOCK);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            return;
+        }
+        
+        int opt = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+        
+        Connection *conn = calloc(1, sizeof(Connection));
+        if (!conn) {
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+        conn->epfd = epfd;
+        conn->refs = 1;
+        pthread_mutex_init(&conn->lock, NULL);
+        
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            conn_release(conn);
+        }
+    }
+}
+
+typedef struct {
+    int tcp_fd; // This loop's own SO_REUSEPORT listener
+    int local_fd; // AF_UNIX listener shared by every loop, or -1
+} LoopListeners;
+
+// One event loop per core, each accepting on its own SO_REUSEPORT listener
+// so the kernel spreads new connections across loops. The local socket
+// cannot be split that way; EPOLLEXCLUSIVE wakes one loop per connection.
+void *event_loop_thread(void *arg) {
+    LoopListeners *listeners = arg;
+    int server_fd = listeners->tcp_fd;
+    
+    int epfd = epoll_create1(0);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, server_fd, &ev);
+    if (listeners->local_fd >= 0) {
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = &listeners->local_fd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, listeners->local_fd, &ev);
+    }
+    
+    struct epoll_event events[NM_MAX_EVENTS];
+    while (1) {
+        int n = epoll_wait(epfd, events, NM_MAX_EVENTS, -1);
+        for (int i = 0; i < n; i++) {
+            Connection *conn = events[i].data.ptr;
+            if (!conn) {
+                accept_connections(server_fd, epfd);
+                continue;
+            }
+            if (events[i].data.ptr == &listeners->local_fd) {
+                accept_connections(listeners->local_fd, epfd);
+                continue;
+            }
+            
+            if (events[i].events & EPOLLOUT) {
+                pthread_mutex_lock(&conn->lock);
+                conn_flush(conn);
+                pthread_mutex_unlock(&conn->lock);
+            }
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                if (conn_read(conn) < 0) conn_close(conn);
+            }
+        }
+    }
+    return NULL;
+}
+
+static int create_listener(int port) {
+    int server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
     int opt = 1;
     setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
     
     struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = INADDR_ANY;
     addr.sin_port = htons(port);
     
     if (bind(server_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
         perror("Bind failed");
-        return 1;
+        close(server_fd);
+        return -1;
     }
     
-    if (listen(server_fd, 50) < 0) {
+    if (listen(server_fd, SOMAXCONN) < 0) {
         perror("Listen failed");
+        close(server_fd);
+        return -1;
+    }
+    return server_fd;
+}
+
+// ===== END EVENT LOOP =====
+
+int main(int argc, char *argv[]) {
+    if (argc < 2 || argc % 2 != 0) {
+        fprintf(stderr, "Usage: %s <port> [-u socket_dir] [-c cache_entries] "
+                        "[-p lru|tinylfu] [-S ip:port,ip:port,...] [-I shard] "
+                        "[-F primary_ip:port] [-d state_dir]\n", argv[0]);
         return 1;
     }
     
-    log_message("NM", "Naming Server started");
-    printf("Naming Server listening on port %d\n", port);
+    const char *socket_dir = NULL;
+    int cache_entries = LOOKUP_CACHE_DEFAULT_ENTRIES;
+    int cache_policy = CACHE_POLICY_TINYLFU;
+    const char *shard_spec = NULL;
+    int shard_index = -1;
+    for (int i = 2; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-u") == 0 && strlen(argv[i + 1]) < MAX_LOCAL_DIR) {
+            socket_dir = argv[i + 1];
+        } else if (strcmp(argv[i], "-c") == 0 && atoi(argv[i + 1]) > 0) {
+            cache_entries = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-p") == 0 && strcmp(argv[i + 1], "lru") == 0) {
+            cache_policy = CACHE_POLICY_LRU;
+        } else if (strcmp(argv[i], "-p") == 0 && strcmp(argv[i + 1], "tinylfu") == 0) {
+            cache_policy = CACHE_POLICY_TINYLFU;
+        } else if (strcmp(argv[i], "-S") == 0) {
+            shard_spec = argv[i + 1];
+        } else if (strcmp(argv[i], "-I") == 0 && atoi(argv[i + 1]) >= 0) {
+            shard_index = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-F") == 0 &&
+                   sscanf(argv[i + 1], "%15[^:]:%d", primary_ip, &primary_port) == 2) {
+            following = 1;
+        } else if (strcmp(argv[i], "-d") == 0) {
+            state_dir = argv[i + 1];
+        } else {
+            fprintf(stderr, "Unknown option: %s %s\n", argv[i], argv[i + 1]);
+            return 1;
+        }
+    }
+    
+    int port = atoi(argv[1]);
+    if (shard_spec) {
+        if (shard_map_parse(&shard_map, shard_spec) < 0) {
+            fprintf(stderr, "Bad shard map: %s\n", shard_spec);
+            return 1;
+        }
+        // Without -I, this server is the one entry on its port
+        for (int s = 0; shard_index < 0 && s < shard_map.num_shards; s++) {
+            if (shard_map.shards[s].port == port) shard_index = s;
+        }
+        if (shard_index < 0 || shard_index >= shard_map.num_shards) {
+            fprintf(stderr, "This server is not in the shard map; give its index with -I\n");
+            return 1;
+        }
+        shard_self = shard_index;
+    }
+    long num_loops = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_loops < 1) num_loops = 1;
     
-    load_access_control();
+    // Bind every listener up front so a busy port is reported immediately
+    int listeners[num_loops];
+    for (long i = 0; i < num_loops; i++) {
+        listeners[i] = create_listener(port);
+        if (listeners[i] < 0) return 1;
+    }
     
-    while (1) {
-        struct sockaddr_in client_addr;
-        socklen_t len = sizeof(client_addr);
-        int *client_sock = malloc(sizeof(int));
-        *client_sock = accept(server_fd, (struct sockaddr*)&client_addr, &len);
-        
-        if (*client_sock < 0) {
-            free(client_sock);
-            continue;
+    int local_fd = -1;
+    if (socket_dir) {
+        local_fd = listen_local(socket_dir, port);
+        if (local_fd < 0) {
+            perror("Local socket failed");
+            return 1;
         }
-        
-        // Peek at message type to determine handler
-        Message peek_msg;
-        if (recv(*client_sock, &peek_msg, sizeof(Message), MSG_PEEK) > 0) {
-            pthread_t tid;
-            if (peek_msg.type == MSG_REGISTER_SS) {
-                pthread_create(&tid, NULL, handle_ss_registration, client_sock);
-            } else {
-                pthread_create(&tid, NULL, handle_client, client_sock);
-            }
-            pthread_detach(tid);
+        fcntl(local_fd, F_SETFL, O_NONBLOCK);
+        printf("Also listening on local sockets in %s\n", socket_dir);
+    }
+    
+    log_message("NM", "Naming Server started");
+    printf("Naming Server listening on port %d (%ld event loops)\n", port, num_loops);
+    
+    art_init(&file_index);
+    if (lookup_cache_init(cache_entries, cache_policy) < 0) {
+        perror("Lookup cache failed");
+        return 1;
+    }
+    printf("Lookup cache: %d entries, %s\n", cache_entries, lookup_cache_policy());
+    if (shard_self >= 0) {
+        printf("Shard %d of %d\n", shard_self, shard_map.num_shards);
+    }
+    if (load_catalog() < 0) {
+        if (errno == EWOULDBLOCK) {
+            fprintf(stderr, "Another naming server is running on the state in %s\n", state_dir);
+        } else {
+            perror("File catalog failed");
+        }
+        return 1;
+    }
+    if (load_access_control() < 0) {
+        if (errno == EWOULDBLOCK) {
+            fprintf(stderr, "Another naming server is running on the state in %s\n", state_dir);
         } else {
-            close(*client_sock);
-            free(client_sock);
+            perror("Access control journal failed");
         }
+        return 1;
+    }
+    
+    for (int i = 0; i < NM_WORKER_THREADS; i++) {
+        pthread_t tid;
+        pthread_create(&tid, NULL, worker_thread, NULL);
+        pthread_detach(tid);
+    }
+    
+    repl_incarnation = (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16);
+    self_port = port;
+    if (!following && repl_generation() == 0) {
+        pthread_mutex_lock(&primary_lock);
+        repl_set_generation(1);
+        pthread_mutex_unlock(&primary_lock);
+    }
+    if (following) {
+        follower_running = 1;
+        pthread_t tid;
+        pthread_create(&tid, NULL, follower_thread, NULL);
+        pthread_detach(tid);
+        printf("Following primary at %s:%d\n", primary_ip, primary_port);
+    }
+    
+    pthread_t loops[num_loops];
+    LoopListeners loop_listeners[num_loops];
+    for (long i = 0; i < num_loops; i++) {
+        loop_listeners[i].tcp_fd = listeners[i];
+        loop_listeners[i].local_fd = local_fd;
+        pthread_create(&loops[i], NULL, event_loop_thread, &loop_listeners[i]);
+    }
+    for (long i = 0; i < num_loops; i++) {
+        pthread_join(loops[i], NULL);
     }
     
     return 0;
-}
\ No newline at end of file
+}
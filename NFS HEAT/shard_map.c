@@ -0,0 +1,108 @@
+#include "shard_map.h"
+
+static uint32_t ring_hash(const char *s) {
+    uint32_t hash = 2166136261u;
+    for (; *s; s++) {
+        hash = (hash ^ (unsigned char)*s) * 16777619u;
+    }
+
+    // FNV alone leaves similar names close together on the ring
+    hash ^= hash >> 16;
+    hash *= 0x85EBCA6Bu;
+    hash ^= hash >> 13;
+    hash *= 0xC2B2AE35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+static int point_cmp(const void *a, const void *b) {
+    const ShardPoint *x = a, *y = b;
+    if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+    return x->shard - y->shard; // Same order everywhere if two points collide
+}
+
+int shard_map_parse(ShardMap *map, const char *spec) {
+    memset(map, 0, sizeof(*map));
+    char copy[MAX_BUFFER];
+    if (strlen(spec) >= sizeof(copy)) return -1;
+    strcpy(copy, spec);
+
+    char *saveptr;
+    for (char *entry = strtok_r(copy, ",\n", &saveptr); entry; entry = strtok_r(NULL, ",\n", &saveptr)) {
+        char *colon = strrchr(entry, ':');
+        if (!colon || colon == entry || colon - entry >= INET_ADDRSTRLEN) return -1;
+        if (map->num_shards == MAX_NM_SHARDS) return -1;
+        *colon = '\0';
+        int port = atoi(colon + 1);
+        if (port <= 0 || port > 65535 || shard_find(map, entry, port) >= 0) return -1;
+
+        ShardAddr *addr = &map->shards[map->num_shards++];
+        strcpy(addr->ip, entry);
+        addr->port = port;
+    }
+
+    int n = 0;
+    for (int s = 0; s < map->num_shards; s++) {
+        for (int v = 0; v < SHARD_VNODES; v++) {
+            char key[INET_ADDRSTRLEN + 24];
+            snprintf(key, sizeof(key), "%s:%d#%d", map->shards[s].ip, map->shards[s].port, v);
+            map->points[n].hash = ring_hash(key);
+            map->points[n].shard = s;
+            n++;
+        }
+    }
+    qsort(map->points, n, sizeof(ShardPoint), point_cmp);
+    return map->num_shards > 0 ? 0 : -1;
+}
+
+void shard_map_format(const ShardMap *map, char *buf, size_t size) {
+    size_t len = 0;
+    buf[0] = '\0';
+    for (int s = 0; s < map->num_shards && len < size; s++) {
+        len += snprintf(buf + len, size - len, "%s:%d\n", map->shards[s].ip, map->shards[s].port);
+    }
+}
+
+int shard_of(const ShardMap *map, const char *filename) {
+    if (map->num_shards <= 1) return 0;
+    uint32_t hash = ring_hash(filename);
+    int n = map->num_shards * SHARD_VNODES;
+
+    // First point at or after hash, wrapping past the top of the ring
+    int lo = 0, hi = n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (map->points[mid].hash < hash) lo = mid + 1;
+        else hi = mid;
+    }
+    return map->points[lo == n ? 0 : lo].shard;
+}
+
+int shard_find(const ShardMap *map, const char *ip, int port) {
+    for (int s = 0; s < map->num_shards; s++) {
+        if (map->shards[s].port == port && strcmp(map->shards[s].ip, ip) == 0) return s;
+    }
+    return -1;
+}
+
+int shard_keyed_request(int type) {
+    switch (type) {
+        case MSG_CREATE_FILE:
+        case MSG_DELETE_FILE:
+        case MSG_READ_FILE:
+        case MSG_WRITE_FILE:
+        case MSG_STREAM_FILE:
+        case MSG_EXEC_FILE:
+        case MSG_ADD_ACCESS:
+        case MSG_REM_ACCESS:
+        case MSG_GET_OWNER:
+        case MSG_MOVE_FILE:
+        case MSG_CHECKPOINT:
+        case MSG_VIEWCHECKPOINT:
+        case MSG_REVERT:
+        case MSG_LISTCHECKPOINTS:
+            return 1;
+        default:
+            return 0;
+    }
+}
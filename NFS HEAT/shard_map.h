@@ -0,0 +1,56 @@
+#ifndef SHARD_MAP_H
+#define SHARD_MAP_H
+
+#include "common.h"
+
+// Consistent-hash ring that splits the filename namespace between naming
+// server shards.
+//
+// Each shard puts SHARD_VNODES points on a 32-bit ring, hashed from its
+// address, and a file belongs to the shard owning the first point at or
+// after the hash of its name. Everyone who builds the ring from the same
+// list of addresses agrees on where every file lives, and adding a shard
+// only takes over the names that land next to its own points.
+//
+// A map is written as "ip:port" entries, one per shard, separated by commas
+// or newlines. Naming servers are started with it (-S) and hand it out in
+// reply to MSG_SHARD_MAP; a naming server without one answers with an
+// empty map and owns every name.
+
+#define MAX_NM_SHARDS 16
+#define SHARD_VNODES 64 // Ring points per shard
+
+typedef struct {
+    char ip[INET_ADDRSTRLEN];
+    int port;
+} ShardAddr;
+
+typedef struct {
+    uint32_t hash;
+    int shard;
+} ShardPoint;
+
+typedef struct {
+    int num_shards;
+    ShardAddr shards[MAX_NM_SHARDS];
+    ShardPoint points[MAX_NM_SHARDS * SHARD_VNODES]; // Sorted by hash
+} ShardMap;
+
+// Returns -1 if spec is malformed, repeats an address or lists too many
+// shards
+int shard_map_parse(ShardMap *map, const char *spec);
+
+// Writes the map one entry per line, as shard_map_parse reads it
+void shard_map_format(const ShardMap *map, char *buf, size_t size);
+
+// Shard that owns filename; 0 if the map has one shard or none
+int shard_of(const ShardMap *map, const char *filename);
+
+// Index of the shard at ip:port, or -1
+int shard_find(const ShardMap *map, const char *ip, int port);
+
+// Whether a request of this type is about the one file in its filename
+// field, and so belongs to that file's shard
+int shard_keyed_request(int type);
+
+#endif
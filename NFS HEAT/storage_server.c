@@ -1,4 +1,15 @@
 #include "common.h"
+#include "io_engine.h"
+#include "shard_map.h"
+#include <sys/epoll.h>
+#include <sys/mman.h>
+
+#define SS_DEFAULT_WORKERS 16
+#define SS_DEFAULT_QUEUE_DEPTH 256
+#define SS_MAX_EVENTS 64
+#define SS_IO_RING_ENTRIES 256
+#define SS_IO_THREADS 4 // Only used when io_uring is unavailable
+#define SS_SEND_TIMEOUT_SEC 10 // A client that stops reading is dropped after this
 
 char storage_dir[MAX_PATH];
 pthread_mutex_t file_locks[MAX_FILES];
@@ -18,6 +29,45 @@ pthread_mutex_t file_lock_list_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 int nm_port_listen; // Port for NM commands
 int client_port_listen; // Port for client operations
+char local_dir[MAX_LOCAL_DIR]; // AF_UNIX socket directory, empty without -u
+
+#define MAX_SENTENCES 1000
+
+// Large working buffers for one request, allocated once per worker so a
+// burst of writers cannot grow thread stacks or the heap
+typedef struct {
+    char content[MAX_BUFFER * 4];
+    char sentences[MAX_SENTENCES][MAX_SENTENCE_LEN];
+    char words[MAX_WORDS][MAX_FILENAME];
+} WorkerScratch;
+
+// A connection parked in the epoll set between requests. The dispatcher
+// reads whatever has arrived into in_buf without blocking, and a worker
+// takes it only to serve the whole requests there.
+typedef struct {
+    int fd;
+    int from_nm; // Accepted on the NM port rather than the client port
+    int peer; // PEER_* flags of its last request
+    char *in_buf;
+    size_t in_len, in_cap;
+    int write_lock; // Held from a WRITE's lock phase until its commit, or -1
+    struct Stream *stream; // Chunked stream waiting for credit, or a legacy one's
+} SSConnection;
+
+// Returned by serve_client_request once a thread of its own has the
+// connection
+#define CONN_DETACHED 1
+
+static void drop_connection(SSConnection *conn);
+static void resume_connection(SSConnection *conn);
+
+int num_workers = SS_DEFAULT_WORKERS;
+int queue_depth = SS_DEFAULT_QUEUE_DEPTH;
+SSConnection **work_queue;
+int work_head = 0, work_count = 0;
+pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t work_ready = PTHREAD_COND_INITIALIZER;
+int conn_epfd; // Idle connections waiting for their next request
 
 typedef struct {
     char filename[MAX_FILENAME];
@@ -128,11 +178,309 @@ void save_undo(const char *filename, const char *content) {
     pthread_mutex_unlock(&undo_lock);
 }
 
+// Builds the path of name, inside folder if one is given, under
+// storage_dir. Returns -1 if it does not fit in MAX_PATH.
+static int storage_path(char *path, const char *folder, const char *name) {
+    int n = folder ? snprintf(path, MAX_PATH, "%s/%s/%s", storage_dir, folder, name)
+                   : snprintf(path, MAX_PATH, "%s/%s", storage_dir, name);
+    return n < 0 || n >= MAX_PATH ? -1 : 0;
+}
+
+int read_file_content(const char *filename, char *buffer, size_t buf_size) {
+    char filepath[MAX_PATH];
+    if (storage_path(filepath, NULL, filename) < 0) return -1;
+    return io_read_file(filepath, buffer, buf_size);
+}
+
+// Writes to a temporary file and renames it over the original, so a read
+// that is still streaming the old inode with sendfile never sees a
+// half-written file.
+int write_file_content(const char *filename, const char *content) {
+    char filepath[MAX_PATH];
+    if (storage_path(filepath, NULL, filename) < 0) return -1;
+    return io_write_file(filepath, content, strlen(content));
+}
+
+// Answers a read with the whole file. The body is sent with sendfile, so it
+// is neither copied through user space nor limited to the Message buffer.
+int send_file_response(int sockfd, Message *response, const char *filename) {
+    char filepath[MAX_PATH];
+    int fd = storage_path(filepath, NULL, filename) == 0 ? open(filepath, O_RDONLY) : -1;
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) close(fd);
+        response->type = MSG_ERROR;
+        response->error_code = ERR_FILE_NOT_FOUND;
+        return send_message(sockfd, response);
+    }
+    
+    if (st.st_size > MAX_FRAME_PAYLOAD - MAX_BUFFER) {
+        close(fd);
+        response->type = MSG_ERROR;
+        response->error_code = ERR_INVALID_COMMAND;
+        strcpy(response->data, "File too large to read in one message");
+        return send_message(sockfd, response);
+    }
+    
+    response->type = MSG_RESPONSE;
+    int ret = send_message_file(sockfd, response, fd, st.st_size);
+    close(fd);
+    return ret;
+}
+
+static int is_word_separator(char c) {
+    return c == ' ' || c == '\n';
+}
+
+// A stream in progress: a file mapped read-only and how far it has been
+// sent. Chunked clients get batches of words paced by the credit they
+// grant, and the connection waits in the epoll set while they have none.
+// Older clients get one message per word at a fixed pace, on a thread of
+// their own.
+typedef struct Stream {
+    char *map;
+    size_t len, pos;
+    int word_num, start_word;
+    int chunked, credit;
+    uint32_t request_id;
+} Stream;
+
+// Maps msg->filename for streaming from word msg->word_index. Returns NULL
+// after answering with an error.
+static Stream *stream_open(int sockfd, Message *msg) {
+    Message response;
+    init_message(&response);
+    response.request_id = msg->request_id;
+    
+    char filepath[MAX_PATH];
+    int fd = storage_path(filepath, NULL, msg->filename) == 0 ? open(filepath, O_RDONLY) : -1;
+    struct stat st;
+    Stream *stream = calloc(1, sizeof(Stream));
+    if (!stream || fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) close(fd);
+        free(stream);
+        response.type = MSG_ERROR;
+        response.error_code = ERR_FILE_NOT_FOUND;
+        send_message(sockfd, &response);
+        return NULL;
+    }
+    
+    stream->len = st.st_size;
+    if (stream->len > 0) {
+        stream->map = mmap(NULL, stream->len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (stream->map == MAP_FAILED) stream->map = NULL;
+        else madvise(stream->map, stream->len, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    if (stream->len > 0 && !stream->map) {
+        free(stream);
+        response.type = MSG_ERROR;
+        response.error_code = ERR_FILE_NOT_FOUND;
+        send_message(sockfd, &response);
+        return NULL;
+    }
+    
+    stream->chunked = msg->flags & STREAM_CHUNKED;
+    stream->credit = msg->sentence_num > 0 ? msg->sentence_num : STREAM_DEFAULT_WINDOW;
+    stream->start_word = msg->word_index;
+    stream->request_id = msg->request_id;
+    return stream;
+}
+
+static void stream_close(Stream *stream) {
+    if (stream->map) munmap(stream->map, stream->len);
+    free(stream);
+}
+
+// Sends the next chunk, or the STOP once the words run out. Returns 1
+// after a chunk, 0 after the STOP, or -1 if the connection failed.
+static int stream_step(int sockfd, Stream *stream) {
+    const char *map = stream->map;
+    char chunk[STREAM_CHUNK_BYTES];
+    size_t chunk_len = 0;
+    int chunk_words = 0;
+    int first_word = stream->word_num;
+    
+    while (stream->pos < stream->len) {
+        size_t pos = stream->pos;
+        while (pos < stream->len && is_word_separator(map[pos])) pos++;
+        size_t end = pos;
+        while (end < stream->len && !is_word_separator(map[end])) end++;
+        if (end == pos) {
+            stream->pos = pos;
+            break;
+        }
+        
+        if (stream->word_num < stream->start_word) {
+            stream->word_num++;
+            first_word = stream->word_num;
+            stream->pos = end;
+            continue;
+        }
+        
+        size_t word_len = end - pos;
+        if (chunk_words > 0 &&
+            (!stream->chunked || chunk_len + 1 + word_len > sizeof(chunk) - 1)) {
+            break;
+        }
+        if (chunk_words > 0) chunk[chunk_len++] = ' ';
+        if (word_len > sizeof(chunk) - 1 - chunk_len) {
+            word_len = sizeof(chunk) - 1 - chunk_len;
+        }
+        memcpy(chunk + chunk_len, map + pos, word_len);
+        chunk_len += word_len;
+        chunk_words++;
+        stream->word_num++;
+        stream->pos = end;
+    }
+    
+    Message response;
+    init_message(&response);
+    response.request_id = stream->request_id;
+    if (chunk_words == 0) {
+        response.type = MSG_ACK;
+        strcpy(response.data, "STOP");
+        return send_message(sockfd, &response) < 0 ? -1 : 0;
+    }
+    
+    response.type = MSG_RESPONSE;
+    memcpy(response.data, chunk, chunk_len);
+    response.data[chunk_len] = '\0';
+    response.word_index = first_word;
+    response.sentence_num = chunk_words;
+    return send_message(sockfd, &response) < 0 ? -1 : 1;
+}
+
+// Whether any word is left to send
+static int stream_has_more(const Stream *stream) {
+    size_t pos = stream->pos;
+    while (pos < stream->len && is_word_separator(stream->map[pos])) pos++;
+    return pos < stream->len;
+}
+
+// Sends a chunked stream's chunks while it has credit. Returns 1 while it
+// waits for more, 0 once it has ended, or -1 if the connection failed.
+static int stream_pump(int sockfd, Stream *stream) {
+    while (stream->credit > 0 || !stream_has_more(stream)) {
+        int sent = stream_step(sockfd, stream);
+        if (sent <= 0) return sent;
+        stream->credit--;
+    }
+    return 1;
+}
+
+// Pumps the connection's chunked stream and lets it go once it has ended
+static int stream_continue(SSConnection *conn) {
+    int ret = stream_pump(conn->fd, conn->stream);
+    if (ret <= 0) {
+        stream_close(conn->stream);
+        conn->stream = NULL;
+    }
+    return ret < 0 ? -1 : 0;
+}
+
+static void *legacy_stream_thread(void *arg) {
+    SSConnection *conn = arg;
+    int sent;
+    while ((sent = stream_step(conn->fd, conn->stream)) > 0) {
+        usleep(100000); // 0.1 second delay
+    }
+    stream_close(conn->stream);
+    conn->stream = NULL;
+    if (sent < 0) drop_connection(conn);
+    else resume_connection(conn);
+    return NULL;
+}
+
+// Hands a paced stream for an older client to a thread of its own, which
+// gives the connection back when it is done
+static int stream_detach(SSConnection *conn, Stream *stream) {
+    conn->stream = stream;
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, legacy_stream_thread, conn) != 0) {
+        Message response;
+        init_message(&response);
+        response.request_id = stream->request_id;
+        stream_close(stream);
+        conn->stream = NULL;
+        response.type = MSG_ERROR;
+        response.error_code = ERR_SERVER_BUSY;
+        return send_message(conn->fd, &response);
+    }
+    pthread_detach(tid);
+    return CONN_DETACHED;
+}
+
+// Stats reported by INFO: the word count is one per separator plus one for
+// a non-empty file. Returns -1 if the file does not exist.
+int file_stats(const char *filename, struct stat *st, int *word_count) {
+    char filepath[MAX_PATH];
+    if (storage_path(filepath, NULL, filename) < 0) return -1;
+    
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0 || fstat(fd, st) < 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    
+    *word_count = 0;
+    if (st->st_size > 0) {
+        char *map = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            for (off_t i = 0; i < st->st_size && map[i]; i++) {
+                if (is_word_separator(map[i])) (*word_count)++;
+            }
+            if (map[0]) (*word_count)++;
+            munmap(map, st->st_size);
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+// Answers a MSG_BATCH_INFO from the naming server: one line of stats per file
+// named in the request, in request order, as
+// "name\tsize\twords\tmtime" or "name\t-" if the file is missing.
+static int serve_stats_batch(int sockfd, Message *msg, Message *response) {
+    size_t len = 0, cap = MAX_BUFFER;
+    char *out = malloc(cap);
+    if (!out) return -1;
+    
+    char *saveptr;
+    char *name = strtok_r(message_data(msg), "\n", &saveptr);
+    while (name) {
+        char line[MAX_FILENAME + 64];
+        struct stat st;
+        int words;
+        int n = file_stats(name, &st, &words) == 0
+            ? snprintf(line, sizeof(line), "%s\t%ld\t%d\t%ld\n",
+                       name, (long)st.st_size, words, (long)st.st_mtime)
+            : snprintf(line, sizeof(line), "%s\t-\n", name);
+        
+        if (len + n > cap) {
+            char *grown = realloc(out, cap * 2 + n);
+            if (!grown) break;
+            out = grown;
+            cap = cap * 2 + n;
+        }
+        memcpy(out + len, line, n);
+        len += n;
+        name = strtok_r(NULL, "\n", &saveptr);
+    }
+    
+    response->type = MSG_RESPONSE;
+    set_message_data(response, out, len);
+    free(out);
+    int ret = send_message(sockfd, response);
+    free_message(response);
+    return ret;
+}
+
 // ===== FOLDER MANAGEMENT FUNCTIONS =====
 
 int create_folder(const char *folder_path) {
     char full_path[MAX_PATH];
-    snprintf(full_path, sizeof(full_path), "%s/%s", storage_dir, folder_path);
+    if (storage_path(full_path, NULL, folder_path) < 0) return -1;
     
     // Create directory recursively
     char path[MAX_PATH];
@@ -154,7 +502,7 @@ int create_folder(const char *folder_path) {
 
 int folder_exists(const char *folder_path) {
     char full_path[MAX_PATH];
-    snprintf(full_path, sizeof(full_path), "%s/%s", storage_dir, folder_path);
+    if (storage_path(full_path, NULL, folder_path) < 0) return 0;
     
     struct stat st;
     return (stat(full_path, &st) == 0 && S_ISDIR(st.st_mode)) ? 1 : 0;
@@ -164,8 +512,10 @@ int move_file_to_folder(const char *filename, const char *folder_path) {
     char old_path[MAX_PATH];
     char new_path[MAX_PATH];
     
-    snprintf(old_path, sizeof(old_path), "%s/%s", storage_dir, filename);
-    snprintf(new_path, sizeof(new_path), "%s/%s/%s", storage_dir, folder_path, filename);
+    if (storage_path(old_path, NULL, filename) < 0 ||
+        storage_path(new_path, folder_path, filename) < 0) {
+        return -1; // Path too long
+    }
     
     // Check if folder exists
     if (!folder_exists(folder_path)) {
@@ -179,45 +529,41 @@ int move_file_to_folder(const char *filename, const char *folder_path) {
     }
     
     // Move file
-    if (rename(old_path, new_path) == 0) {
+    if (io_rename(old_path, new_path) == 0) {
         return 0; // Success
     }
     return -1; // Failed
 }
 
+typedef struct {
+    char *buffer;
+    size_t buf_size;
+} FolderListing;
+
+static void add_folder_entry(const char *name, const struct stat *st, void *arg) {
+    FolderListing *listing = arg;
+    if (!st) return; // Removed while we were listing
+    
+    char *buffer = listing->buffer;
+    size_t buf_size = listing->buf_size;
+    if (S_ISDIR(st->st_mode)) {
+        strncat(buffer, "[FOLDER] ", buf_size - strlen(buffer) - 1);
+    } else {
+        strncat(buffer, "[FILE] ", buf_size - strlen(buffer) - 1);
+    }
+    strncat(buffer, name, buf_size - strlen(buffer) - 1);
+    strncat(buffer, "\n", buf_size - strlen(buffer) - 1);
+}
+
 int list_folder_contents(const char *folder_path, char *buffer, size_t buf_size) {
     char full_path[MAX_PATH];
-    snprintf(full_path, sizeof(full_path), "%s/%s", storage_dir, folder_path);
-    
-    DIR *dir = opendir(full_path);
-    if (!dir) {
-        return -1; // Folder doesn't exist
-    }
+    if (storage_path(full_path, NULL, folder_path) < 0) return -1;
     
     buffer[0] = '\0';
-    struct dirent *entry;
-    
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
-        }
-        
-        char entry_path[MAX_PATH];
-        snprintf(entry_path, sizeof(entry_path), "%s/%s", full_path, entry->d_name);
-        
-        struct stat st;
-        if (stat(entry_path, &st) == 0) {
-            if (S_ISDIR(st.st_mode)) {
-                strncat(buffer, "[FOLDER] ", buf_size - strlen(buffer) - 1);
-            } else {
-                strncat(buffer, "[FILE] ", buf_size - strlen(buffer) - 1);
-            }
-            strncat(buffer, entry->d_name, buf_size - strlen(buffer) - 1);
-            strncat(buffer, "\n", buf_size - strlen(buffer) - 1);
-        }
+    FolderListing listing = {buffer, buf_size};
+    if (io_scan_dir(full_path, add_folder_entry, &listing) < 0) {
+        return -1; // Folder doesn't exist
     }
-    
-    closedir(dir);
     return 0; // Success
 }
 
@@ -331,29 +677,23 @@ int revert_checkpoint(const char *filename, const char *tag) {
     
     pthread_mutex_lock(&checkpoint_storage[idx].lock);
     
-    // Find checkpoint
+    // Find checkpoint; its content is copied out so the disk write does not
+    // hold up other checkpoint operations on this file
+    char *content = NULL;
     for (int i = 0; i < checkpoint_storage[idx].num_checkpoints; i++) {
         if (strcmp(checkpoint_storage[idx].checkpoints[i].tag, tag) == 0) {
-            // Revert file content
-            char filepath[MAX_PATH];
-            snprintf(filepath, sizeof(filepath), "%s/%s", storage_dir, filename);
-            
-            FILE *fp = fopen(filepath, "w");
-            if (!fp) {
-                pthread_mutex_unlock(&checkpoint_storage[idx].lock);
-                return -1;
-            }
-            
-            fprintf(fp, "%s", checkpoint_storage[idx].checkpoints[i].content);
-            fclose(fp);
-            
-            pthread_mutex_unlock(&checkpoint_storage[idx].lock);
-            return 0;
+            content = strdup(checkpoint_storage[idx].checkpoints[i].content);
+            break;
         }
     }
     
     pthread_mutex_unlock(&checkpoint_storage[idx].lock);
-    return -1; // Checkpoint not found
+    if (!content) return -1; // Checkpoint not found
+    
+    // Revert file content
+    int ret = write_file_content(filename, content);
+    free(content);
+    return ret;
 }
 
 int list_checkpoints(const char *filename, char *buffer, size_t buf_size) {
@@ -380,31 +720,6 @@ int list_checkpoints(const char *filename, char *buffer, size_t buf_size) {
 
 // ===== END CHECKPOINT MANAGEMENT FUNCTIONS =====
 
-int read_file_content(const char *filename, char *buffer, size_t buf_size) {
-    char filepath[MAX_PATH];
-    snprintf(filepath, sizeof(filepath), "%s/%s", storage_dir, filename);
-    
-    FILE *fp = fopen(filepath, "r");
-    if (!fp) return -1;
-    
-    size_t bytes_read = fread(buffer, 1, buf_size - 1, fp);
-    buffer[bytes_read] = '\0';
-    fclose(fp);
-    return 0;
-}
-
-int write_file_content(const char *filename, const char *content) {
-    char filepath[MAX_PATH];
-    snprintf(filepath, sizeof(filepath), "%s/%s", storage_dir, filename);
-    
-    FILE *fp = fopen(filepath, "w");
-    if (!fp) return -1;
-    
-    fprintf(fp, "%s", content);
-    fclose(fp);
-    return 0;
-}
-
 void split_into_sentences(const char *content, char sentences[][MAX_SENTENCE_LEN], int *num_sentences) {
     *num_sentences = 0;
     int sent_idx = 0;
@@ -456,42 +771,40 @@ void split_into_words(const char *sentence, char words[][MAX_FILENAME], int *num
     *num_words = word_idx;
 }
 
-void reconstruct_sentence(char words[][MAX_FILENAME], int num_words, char *sentence) {
+// Joins words with spaces. Returns -1 if they do not fit in
+// MAX_SENTENCE_LEN.
+int reconstruct_sentence(char words[][MAX_FILENAME], int num_words, char *sentence) {
+    size_t len = 0;
     sentence[0] = '\0';
     for (int i = 0; i < num_words; i++) {
-        if (i > 0) strcat(sentence, " ");
-        strcat(sentence, words[i]);
+        len += snprintf(sentence + len, MAX_SENTENCE_LEN - len, "%s%s", i > 0 ? " " : "", words[i]);
+        if (len >= MAX_SENTENCE_LEN) return -1;
     }
+    return 0;
 }
 
-void *handle_nm_request(void *arg) {
-    int sockfd = *(int*)arg;
-    free(arg);
-    
-    Message msg;
-    if (receive_message(sockfd, &msg) < 0) {
-        close(sockfd);
-        return NULL;
-    }
-    
+// Serves one naming server request; the connection is pooled by the naming
+// server, so it stays open for the next one
+static int serve_nm_request(int sockfd, Message *msg) {
     Message response;
     init_message(&response);
+    response.request_id = msg->request_id;
     
-    switch (msg.type) {
+    switch (msg->type) {
         case MSG_CREATE_FILE: {
             char filepath[MAX_PATH];
-            snprintf(filepath, sizeof(filepath), "%s/%s", storage_dir, msg.filename);
-            
-            // Check if file already exists
-            if (access(filepath, F_OK) == 0) {
+            if (storage_path(filepath, NULL, msg->filename) < 0) {
+                response.type = MSG_ERROR;
+                response.error_code = ERR_INVALID_COMMAND;
+                strcpy(response.data, "File name too long");
+            } else if (access(filepath, F_OK) == 0) {
+                // File already exists
                 response.type = MSG_ERROR;
                 response.error_code = ERR_FILE_EXISTS;
                 strcpy(response.data, "File already exists");
                 log_message("SS", "File creation failed - file already exists");
             } else {
-                FILE *fp = fopen(filepath, "w");
-                if (fp) {
-                    fclose(fp);
+                if (io_create_file(filepath) == 0) {
                     response.type = MSG_ACK;
                     log_message("SS", "File created successfully");
                 } else {
@@ -504,9 +817,7 @@ void *handle_nm_request(void *arg) {
         
         case MSG_DELETE_FILE: {
             char filepath[MAX_PATH];
-            snprintf(filepath, sizeof(filepath), "%s/%s", storage_dir, msg.filename);
-            
-            if (remove(filepath) == 0) {
+            if (storage_path(filepath, NULL, msg->filename) == 0 && io_unlink(filepath) == 0) {
                 response.type = MSG_ACK;
                 log_message("SS", "File deleted successfully");
             } else {
@@ -516,342 +827,358 @@ void *handle_nm_request(void *arg) {
             break;
         }
         
-        case MSG_READ_FILE: {
-            if (read_file_content(msg.filename, response.data, sizeof(response.data)) == 0) {
-                response.type = MSG_RESPONSE;
-            } else {
-                response.type = MSG_ERROR;
-                response.error_code = ERR_FILE_NOT_FOUND;
-            }
-            break;
-        }
+        case MSG_READ_FILE:
+            return send_file_response(sockfd, &response, msg->filename);
+        
+        case MSG_BATCH_INFO:
+            return serve_stats_batch(sockfd, msg, &response);
     }
     
-    send_message(sockfd, &response);
-    close(sockfd);
-    return NULL;
+    return send_message(sockfd, &response);
 }
 
-void *handle_client_request(void *arg) {
-    int sockfd = *(int*)arg;
-    free(arg);
-    
-    Message msg;
-    if (receive_message(sockfd, &msg) < 0) {
-        close(sockfd);
-        return NULL;
+// Client requests that name a file this server is expected to hold
+static int is_file_request(int type) {
+    switch (type) {
+        case MSG_READ_FILE:
+        case MSG_WRITE_FILE:
+        case MSG_STREAM_FILE:
+        case MSG_INFO_FILE:
+        case MSG_UNDO:
+            return 1;
     }
-    
+    return 0;
+}
+
+static int stores_file(const char *filename) {
+    char filepath[MAX_PATH];
+    return storage_path(filepath, NULL, filename) == 0 && access(filepath, F_OK) == 0;
+}
+
+// Applies a WRITE's commands while holding file_lock_idx, which it
+// releases, and answers
+static int apply_write(int sockfd, Message *msg, int file_lock_idx, WorkerScratch *scratch) {
     Message response;
     init_message(&response);
+    response.request_id = msg->request_id;
     
-    switch (msg.type) {
-        case MSG_READ_FILE: {
-            // Check if file is locked for writing
-            if (is_file_locked_for_write(msg.filename)) {
-                response.type = MSG_ERROR;
-                response.error_code = ERR_SENTENCE_LOCKED;
-                strcpy(response.data, "File is currently being written");
-            } else if (read_file_content(msg.filename, response.data, sizeof(response.data)) == 0) {
-                response.type = MSG_RESPONSE;
-            } else {
-                response.type = MSG_ERROR;
-                response.error_code = ERR_FILE_NOT_FOUND;
-            }
+    char *content = scratch->content;
+    if (read_file_content(msg->filename, content, sizeof(scratch->content)) < 0) {
+        content[0] = '\0'; // Empty file
+    }
+    
+    // Save for undo
+    save_undo(msg->filename, content);
+    
+    // Split into sentences
+    char (*sentences)[MAX_SENTENCE_LEN] = scratch->sentences;
+    int num_sentences = 0;
+    
+    if (strlen(content) > 0) {
+        split_into_sentences(content, sentences, &num_sentences);
+    }
+    
+    // Validate sentence index:
+    // 1. Index must be >= 0 and <= num_sentences
+    // 2. If writing to sentence x where x > 0, sentence x-1 must exist and have proper delimiters
+    if (msg->sentence_num < 0 || msg->sentence_num > num_sentences) {
+        response.type = MSG_ERROR;
+        response.error_code = ERR_INVALID_INDEX;
+        strcpy(response.data, "Sentence index out of range");
+        if (file_lock_idx >= 0) unlock_file_for_write(file_lock_idx);
+        return send_message(sockfd, &response);
+    }
+    
+    // Additional validation: if writing to sentence x where x > 0, 
+    // sentence x-1 must exist and end with a delimiter
+    if (msg->sentence_num > 0 && msg->sentence_num > num_sentences) {
+        response.type = MSG_ERROR;
+        response.error_code = ERR_INVALID_INDEX;
+        strcpy(response.data, "Sentence index out of range. Previous sentence must exist.");
+        if (file_lock_idx >= 0) unlock_file_for_write(file_lock_idx);
+        return send_message(sockfd, &response);
+    }
+    
+    // Check if previous sentence has proper delimiter if trying to write beyond current sentences
+    if (msg->sentence_num == num_sentences && num_sentences > 0) {
+        // Check that the last sentence ends with a delimiter
+        int last_sent_idx = num_sentences - 1;
+        if (strlen(sentences[last_sent_idx]) == 0 || 
+            (sentences[last_sent_idx][strlen(sentences[last_sent_idx])-1] != '.' &&
+             sentences[last_sent_idx][strlen(sentences[last_sent_idx])-1] != '!' &&
+             sentences[last_sent_idx][strlen(sentences[last_sent_idx])-1] != '?')) {
+            response.type = MSG_ERROR;
+            response.error_code = ERR_INVALID_INDEX;
+            strcpy(response.data, "Sentence index out of range. Previous sentence must be complete with delimiter.");
+            if (file_lock_idx >= 0) unlock_file_for_write(file_lock_idx);
+            return send_message(sockfd, &response);
+        }
+    }
+    
+    // Initialize or get existing sentence
+    char (*words)[MAX_FILENAME] = scratch->words;
+    int num_words = 0;
+    int current_sentence = msg->sentence_num;
+    
+    if (current_sentence < num_sentences && strlen(sentences[current_sentence]) > 0) {
+        split_into_words(sentences[current_sentence], words, &num_words);
+    }
+    
+    // Process write operations from the body, which may be larger
+    // than msg->data holds
+    size_t data_len = message_data_len(msg);
+    char *data_copy = data_len < sizeof(scratch->content) ? malloc(data_len + 1) : NULL;
+    if (!data_copy) {
+        response.type = MSG_ERROR;
+        response.error_code = ERR_INVALID_COMMAND;
+        strcpy(response.data, "Write is too large");
+        if (file_lock_idx >= 0) unlock_file_for_write(file_lock_idx);
+        return send_message(sockfd, &response);
+    }
+    memcpy(data_copy, message_data(msg), data_len);
+    data_copy[data_len] = '\0';
+    
+    char *saveptr;
+    char *line = strtok_r(data_copy, "\n", &saveptr);
+    while (line != NULL) {
+        if (strcmp(line, "ETIRW") == 0) {
             break;
         }
         
-        case MSG_WRITE_FILE: {
-            // Check if this is the lock acquisition phase (empty data)
-            if (strlen(msg.data) == 0) {
-                // Phase 1: Try to acquire file lock
-                int file_lock_idx = lock_file_for_write(msg.filename);
-                if (file_lock_idx < 0) {
-                    response.type = MSG_ERROR;
-                    response.error_code = ERR_SENTENCE_LOCKED;
-                    strcpy(response.data, "File is currently being accessed by another user");
-                    send_message(sockfd, &response);
-                    close(sockfd);
-                    return NULL;
-                }
-                
-                // Lock acquired! Send acknowledgment
-                response.type = MSG_ACK;
-                strcpy(response.data, "LOCK_ACQUIRED");
-                send_message(sockfd, &response);
-                
-                // Now wait for the actual write data
-                Message write_msg;
-                if (receive_message(sockfd, &write_msg) < 0) {
-                    unlock_file_for_write(file_lock_idx);
-                    close(sockfd);
-                    return NULL;
-                }
-                
-                // Process the actual write with the data
-                msg = write_msg;
-            } else {
-                // This shouldn't happen in the new protocol, but handle it anyway
-                int file_lock_idx = lock_file_for_write(msg.filename);
-                if (file_lock_idx < 0) {
-                    response.type = MSG_ERROR;
-                    response.error_code = ERR_SENTENCE_LOCKED;
-                    strcpy(response.data, "File is currently being accessed by another user");
-                    send_message(sockfd, &response);
-                    close(sockfd);
-                    return NULL;
-                }
-            }
-            
-            // Find the lock index for this file
-            int file_lock_idx = -1;
-            pthread_mutex_lock(&file_lock_list_mutex);
-            for (int i = 0; i < file_lock_count; i++) {
-                if (strcmp(file_write_locks[i].filename, msg.filename) == 0) {
-                    file_lock_idx = i;
-                    break;
-                }
-            }
-            pthread_mutex_unlock(&file_lock_list_mutex);
-            
-            char content[MAX_BUFFER * 4];
-            if (read_file_content(msg.filename, content, sizeof(content)) < 0) {
-                content[0] = '\0'; // Empty file
-            }
-            
-            // Save for undo
-            save_undo(msg.filename, content);
-            
-            // Split into sentences
-            char sentences[1000][MAX_SENTENCE_LEN];
-            int num_sentences = 0;
-            
-            if (strlen(content) > 0) {
-                split_into_sentences(content, sentences, &num_sentences);
-            }
-            
-            // Validate sentence index:
-            // 1. Index must be >= 0 and <= num_sentences
-            // 2. If writing to sentence x where x > 0, sentence x-1 must exist and have proper delimiters
-            if (msg.sentence_num < 0 || msg.sentence_num > num_sentences) {
-                response.type = MSG_ERROR;
-                response.error_code = ERR_INVALID_INDEX;
-                strcpy(response.data, "Sentence index out of range");
-                if (file_lock_idx >= 0) unlock_file_for_write(file_lock_idx);
-                send_message(sockfd, &response);
-                close(sockfd);
-                return NULL;
-            }
-            
-            // Additional validation: if writing to sentence x where x > 0, 
-            // sentence x-1 must exist and end with a delimiter
-            if (msg.sentence_num > 0 && msg.sentence_num > num_sentences) {
-                response.type = MSG_ERROR;
-                response.error_code = ERR_INVALID_INDEX;
-                strcpy(response.data, "Sentence index out of range. Previous sentence must exist.");
-                if (file_lock_idx >= 0) unlock_file_for_write(file_lock_idx);
-                send_message(sockfd, &response);
-                close(sockfd);
-                return NULL;
-            }
-            
-            // Check if previous sentence has proper delimiter if trying to write beyond current sentences
-            if (msg.sentence_num == num_sentences && num_sentences > 0) {
-                // Check that the last sentence ends with a delimiter
-                int last_sent_idx = num_sentences - 1;
-                if (strlen(sentences[last_sent_idx]) == 0 || 
-                    (sentences[last_sent_idx][strlen(sentences[last_sent_idx])-1] != '.' &&
-                     sentences[last_sent_idx][strlen(sentences[last_sent_idx])-1] != '!' &&
-                     sentences[last_sent_idx][strlen(sentences[last_sent_idx])-1] != '?')) {
-                    response.type = MSG_ERROR;
-                    response.error_code = ERR_INVALID_INDEX;
-                    strcpy(response.data, "Sentence index out of range. Previous sentence must be complete with delimiter.");
-                    if (file_lock_idx >= 0) unlock_file_for_write(file_lock_idx);
-                    send_message(sockfd, &response);
-                    close(sockfd);
-                    return NULL;
-                }
-            }
-            
-            // Initialize or get existing sentence
-            char words[MAX_WORDS][MAX_FILENAME];
-            int num_words = 0;
-            int current_sentence = msg.sentence_num;
-            
-            if (current_sentence < num_sentences && strlen(sentences[current_sentence]) > 0) {
-                split_into_words(sentences[current_sentence], words, &num_words);
-            }
-            
-            // Process write operations from msg.data
-            char data_copy[MAX_BUFFER];
-            strncpy(data_copy, msg.data, sizeof(data_copy) - 1);
-            data_copy[sizeof(data_copy) - 1] = '\0';
+        int word_idx;
+        char word_content[MAX_SENTENCE_LEN];
+        
+        if (sscanf(line, "%d %4095[^\n]", &word_idx, word_content) == 2) {
+            // Parse the content and handle delimiters
+            int i = 0;
+            while (word_content[i] && word_content[i] == ' ') i++; // Skip leading spaces
             
-            char *line = strtok(data_copy, "\n");
-            while (line != NULL) {
-                if (strcmp(line, "ETIRW") == 0) {
-                    break;
-                }
+            while (word_content[i]) {
+                char current_word[MAX_FILENAME] = "";
+                int word_len = 0;
+                int has_delimiter = 0;
                 
-                int word_idx;
-                char word_content[MAX_SENTENCE_LEN];
+                // Extract one word (including delimiter if present)
+                while (word_content[i] && word_content[i] != ' ') {
+                    if (word_len < MAX_FILENAME - 1) current_word[word_len++] = word_content[i];
+                    // Check if this character is a delimiter
+                    if (word_content[i] == '.' || word_content[i] == '!' || word_content[i] == '?') {
+                        has_delimiter = 1;
+                    }
+                    i++;
+                }
+                current_word[word_len] = '\0';
                 
-                if (sscanf(line, "%d %[^\n]", &word_idx, word_content) == 2) {
-                    // Parse the content and handle delimiters
-                    int i = 0;
-                    while (word_content[i] && word_content[i] == ' ') i++; // Skip leading spaces
+                if (word_len > 0) {
+                    // Validate word index - using 1-based indexing
+                    // Valid range: 1 to num_words+1 (inclusive for insertion at end)
+                    if (word_idx < 1 || word_idx > num_words + 1) {
+                        response.type = MSG_ERROR;
+                        response.error_code = ERR_INVALID_INDEX;
+                        snprintf(response.data, sizeof(response.data), 
+                                 "Word index %d out of range (valid: 1 to %d)", word_idx, num_words + 1);
+                        if (file_lock_idx >= 0) unlock_file_for_write(file_lock_idx);
+                        free(data_copy);
+                        return send_message(sockfd, &response);
+                    }
+                    if (num_words == MAX_WORDS || num_sentences + 1 >= MAX_SENTENCES) {
+                        response.type = MSG_ERROR;
+                        response.error_code = ERR_INVALID_INDEX;
+                        strcpy(response.data, "Too many words or sentences");
+                        if (file_lock_idx >= 0) unlock_file_for_write(file_lock_idx);
+                        free(data_copy);
+                        return send_message(sockfd, &response);
+                    }
                     
-                    while (word_content[i]) {
-                        char current_word[MAX_FILENAME] = "";
-                        int word_len = 0;
-                        int has_delimiter = 0;
-                        
-                        // Extract one word (including delimiter if present)
-                        while (word_content[i] && word_content[i] != ' ') {
-                            current_word[word_len++] = word_content[i];
-                            // Check if this character is a delimiter
-                            if (word_content[i] == '.' || word_content[i] == '!' || word_content[i] == '?') {
-                                has_delimiter = 1;
-                            }
-                            i++;
+                    // Convert to 0-based for internal array operations
+                    int array_idx = word_idx - 1;
+                    
+                    // Insert the word at array_idx
+                    for (int j = num_words; j > array_idx; j--) {
+                        strcpy(words[j], words[j-1]);
+                    }
+                    strcpy(words[array_idx], current_word);
+                    num_words++;
+                    word_idx++; // Move to next position for subsequent words
+                    
+                    // If word contains delimiter, finalize this sentence and start new one
+                    if (has_delimiter) {
+                        // Reconstruct current sentence
+                        if (reconstruct_sentence(words, num_words, sentences[current_sentence]) < 0) {
+                            response.type = MSG_ERROR;
+                            response.error_code = ERR_INVALID_INDEX;
+                            strcpy(response.data, "Sentence is too long");
+                            if (file_lock_idx >= 0) unlock_file_for_write(file_lock_idx);
+                            free(data_copy);
+                            return send_message(sockfd, &response);
                         }
-                        current_word[word_len] = '\0';
                         
-                        if (word_len > 0) {
-                            // Validate word index - using 1-based indexing
-                            // Valid range: 1 to num_words+1 (inclusive for insertion at end)
-                            if (word_idx < 1 || word_idx > num_words + 1) {
-                                response.type = MSG_ERROR;
-                                response.error_code = ERR_INVALID_INDEX;
-                                snprintf(response.data, sizeof(response.data), 
-                                         "Word index %d out of range (valid: 1 to %d)", word_idx, num_words + 1);
-                                if (file_lock_idx >= 0) unlock_file_for_write(file_lock_idx);
-                                send_message(sockfd, &response);
-                                close(sockfd);
-                                return NULL;
-                            }
-                            
-                            // Convert to 0-based for internal array operations
-                            int array_idx = word_idx - 1;
-                            
-                            // Insert the word at array_idx
-                            for (int j = num_words; j > array_idx; j--) {
-                                strcpy(words[j], words[j-1]);
-                            }
-                            strcpy(words[array_idx], current_word);
-                            num_words++;
-                            word_idx++; // Move to next position for subsequent words
-                            
-                            // If word contains delimiter, finalize this sentence and start new one
-                            if (has_delimiter) {
-                                // Reconstruct current sentence
-                                reconstruct_sentence(words, num_words, sentences[current_sentence]);
-                                
-                                // Move remaining sentences down if we're inserting in middle
-                                if (current_sentence < num_sentences - 1) {
-                                    for (int j = num_sentences; j > current_sentence + 1; j--) {
-                                        strcpy(sentences[j], sentences[j-1]);
-                                    }
-                                }
-                                
-                                // Move to next sentence index
-                                current_sentence++;
-                                num_sentences = (current_sentence >= num_sentences) ? current_sentence + 1 : num_sentences + 1;
-                                
-                                // Initialize new sentence (empty for now, will be filled if there are more words)
-                                num_words = 0;
-                                word_idx = 1; // Reset to 1 for 1-based indexing
-                                sentences[current_sentence][0] = '\0';
+                        // Move remaining sentences down if we're inserting in middle
+                        if (current_sentence < num_sentences - 1) {
+                            for (int j = num_sentences; j > current_sentence + 1; j--) {
+                                strcpy(sentences[j], sentences[j-1]);
                             }
                         }
                         
-                        // Skip spaces
-                        while (word_content[i] && word_content[i] == ' ') i++;
+                        // Move to next sentence index
+                        current_sentence++;
+                        num_sentences = (current_sentence >= num_sentences) ? current_sentence + 1 : num_sentences + 1;
+                        
+                        // Initialize new sentence (empty for now, will be filled if there are more words)
+                        num_words = 0;
+                        word_idx = 1; // Reset to 1 for 1-based indexing
+                        sentences[current_sentence][0] = '\0';
                     }
                 }
                 
-                line = strtok(NULL, "\n");
+                // Skip spaces
+                while (word_content[i] && word_content[i] == ' ') i++;
             }
-            
-            // Reconstruct final sentence if there are remaining words
-            if (num_words > 0) {
-                if (current_sentence >= num_sentences) {
-                    num_sentences = current_sentence + 1;
-                }
-                reconstruct_sentence(words, num_words, sentences[current_sentence]);
+        }
+        
+        line = strtok_r(NULL, "\n", &saveptr);
+    }
+    free(data_copy);
+    
+    // Reconstruct final sentence if there are remaining words
+    if (num_words > 0) {
+        if (current_sentence >= num_sentences) {
+            num_sentences = current_sentence + 1;
+        }
+        if (reconstruct_sentence(words, num_words, sentences[current_sentence]) < 0) {
+            response.type = MSG_ERROR;
+            response.error_code = ERR_INVALID_INDEX;
+            strcpy(response.data, "Sentence is too long");
+            if (file_lock_idx >= 0) unlock_file_for_write(file_lock_idx);
+            return send_message(sockfd, &response);
+        }
+    }
+    
+    // Reconstruct file content
+    content[0] = '\0';
+    size_t content_len = 0;
+    for (int i = 0; i < num_sentences; i++) {
+        size_t len = strlen(sentences[i]);
+        if (len > 0) {
+            if (content_len + len + 1 >= sizeof(scratch->content)) {
+                response.type = MSG_ERROR;
+                response.error_code = ERR_INVALID_COMMAND;
+                strcpy(response.data, "File would exceed the maximum size");
+                if (file_lock_idx >= 0) unlock_file_for_write(file_lock_idx);
+                return send_message(sockfd, &response);
             }
-            
-            // Reconstruct file content
-            content[0] = '\0';
-            for (int i = 0; i < num_sentences; i++) {
-                if (strlen(sentences[i]) > 0) {
-                    strcat(content, sentences[i]);
-                    if (i < num_sentences - 1 && strlen(sentences[i+1]) > 0) {
-                        strcat(content, " ");
-                    }
-                }
+            memcpy(content + content_len, sentences[i], len + 1);
+            content_len += len;
+            if (i < num_sentences - 1 && strlen(sentences[i+1]) > 0) {
+                strcpy(content + content_len++, " ");
             }
-            
-            write_file_content(msg.filename, content);
-            
-            // Unlock file
-            if (file_lock_idx >= 0) unlock_file_for_write(file_lock_idx);
-            
-            response.type = MSG_ACK;
-            break;
         }
+    }
+    
+    write_file_content(msg->filename, content);
+    
+    // Unlock file
+    if (file_lock_idx >= 0) unlock_file_for_write(file_lock_idx);
+    
+    response.type = MSG_ACK;
+    return send_message(sockfd, &response);
+}
 
-        case MSG_STREAM_FILE: {
+// Serves one client request. Returns -1 once the connection is unusable,
+// or CONN_DETACHED if it now belongs to another thread.
+static int serve_client_request(SSConnection *conn, Message *msg, WorkerScratch *scratch) {
+    int sockfd = conn->fd;
+    Message response;
+    init_message(&response);
+    response.request_id = msg->request_id;
+    
+    // Clients may come here from a cached location. If the file is not
+    // here, redirect them back to the naming server rather than report it
+    // missing.
+    if (is_file_request(msg->type) && !stores_file(msg->filename)) {
+        response.type = MSG_ERROR;
+        response.error_code = ERR_STALE_LOCATION;
+        strcpy(response.data, "File is not on this storage server");
+        return send_message(sockfd, &response);
+    }
+    
+    switch (msg->type) {
+        case MSG_READ_FILE: {
             // Check if file is locked for writing
-            if (is_file_locked_for_write(msg.filename)) {
+            if (is_file_locked_for_write(msg->filename)) {
                 response.type = MSG_ERROR;
                 response.error_code = ERR_SENTENCE_LOCKED;
                 strcpy(response.data, "File is currently being written");
-                send_message(sockfd, &response);
-                break;
+            } else {
+                return send_file_response(sockfd, &response, msg->filename);
             }
-            
-            char content[MAX_BUFFER * 4];
-            if (read_file_content(msg.filename, content, sizeof(content)) < 0) {
+            break;
+        }
+        
+        case MSG_WRITE_FILE: {
+            int file_lock_idx = lock_file_for_write(msg->filename);
+            if (file_lock_idx < 0) {
                 response.type = MSG_ERROR;
-                response.error_code = ERR_FILE_NOT_FOUND;
-                send_message(sockfd, &response);
-                break;
+                response.error_code = ERR_SENTENCE_LOCKED;
+                strcpy(response.data, "File is currently being accessed by another user");
+                return send_message(sockfd, &response);
             }
             
-            // Stream word by word
-            char *word = strtok(content, " \n");
-            while (word) {
-                init_message(&response);
-                response.type = MSG_RESPONSE;
-                strcpy(response.data, word);
-                send_message(sockfd, &response);
-                usleep(100000); // 0.1 second delay
-                word = strtok(NULL, " \n");
+            // Without commands this is the lock acquisition phase. The lock
+            // stays with the connection, which waits in the epoll set for
+            // the commit rather than holding a worker while the user types.
+            if (message_data_len(msg) == 0) {
+                response.type = MSG_ACK;
+                strcpy(response.data, "LOCK_ACQUIRED");
+                conn->write_lock = file_lock_idx;
+                return send_message(sockfd, &response);
+            }
+            
+            // Older clients send the commands with the request
+            return apply_write(sockfd, msg, file_lock_idx, scratch);
+        }
+
+        case MSG_STREAM_FILE: {
+            // Check if file is locked for writing
+            if (is_file_locked_for_write(msg->filename)) {
+                response.type = MSG_ERROR;
+                response.error_code = ERR_SENTENCE_LOCKED;
+                strcpy(response.data, "File is currently being written");
+                return send_message(sockfd, &response);
             }
             
-            // Send STOP signal
-            init_message(&response);
-            response.type = MSG_ACK;
-            strcpy(response.data, "STOP");
-            send_message(sockfd, &response);
-            close(sockfd);
-            return NULL;
+            Stream *stream = stream_open(sockfd, msg);
+            if (!stream) return 0;
+            if (!stream->chunked) return stream_detach(conn, stream);
+            
+            if (conn->stream) stream_close(conn->stream); // Abandoned by the client
+            conn->stream = stream;
+            return stream_continue(conn);
         }
         
+        case MSG_STREAM_CREDIT:
+            // A grant that crossed the end of its stream; nothing to answer
+            if (!conn->stream) return 0;
+            if (msg->sentence_num <= 0) {
+                conn->stream->pos = conn->stream->len; // Cancelled: just the STOP
+            } else {
+                conn->stream->credit += msg->sentence_num;
+            }
+            return stream_continue(conn);
+        
         case MSG_UNDO: {
             pthread_mutex_lock(&undo_lock);
             int found = -1;
             for (int i = undo_count - 1; i >= 0; i--) {
                 int idx = i % MAX_FILES;
-                if (strcmp(undo_history[idx].filename, msg.filename) == 0) {
+                if (strcmp(undo_history[idx].filename, msg->filename) == 0) {
                     found = idx;
                     break;
                 }
             }
             
             if (found >= 0) {
-                write_file_content(msg.filename, undo_history[found].content);
+                write_file_content(msg->filename, undo_history[found].content);
                 response.type = MSG_ACK;
             } else {
                 response.type = MSG_ERROR;
@@ -863,19 +1190,9 @@ void *handle_client_request(void *arg) {
         
         case MSG_INFO_FILE: {
             struct stat st;
-            char filepath[MAX_PATH];
-            snprintf(filepath, sizeof(filepath), "%s/%s", storage_dir, msg.filename);
+            int word_count;
             
-            if (stat(filepath, &st) == 0) {
-                char content[MAX_BUFFER];
-                read_file_content(msg.filename, content, sizeof(content));
-                
-                int word_count = 0;
-                for (int i = 0; content[i]; i++) {
-                    if (content[i] == ' ' || content[i] == '\n') word_count++;
-                }
-                if (content[0]) word_count++;
-                
+            if (file_stats(msg->filename, &st, &word_count) == 0) {
                 snprintf(response.data, sizeof(response.data),
                          "Size: %ld bytes\nWords: %d\nChars: %ld\nModified: %s",
                          st.st_size, word_count, st.st_size, ctime(&st.st_mtime));
@@ -889,44 +1206,44 @@ void *handle_client_request(void *arg) {
         
         // ===== FOLDER OPERATIONS =====
         case MSG_CREATE_FOLDER: {
-            if (create_folder(msg.folder_path) == 0) {
+            if (create_folder(msg->folder_path) == 0) {
                 response.type = MSG_ACK;
-                snprintf(response.data, sizeof(response.data), "Folder '%s' created successfully", msg.folder_path);
+                snprintf(response.data, sizeof(response.data), "Folder '%s' created successfully", msg->folder_path);
                 log_message("SS", "Folder created");
             } else {
                 response.type = MSG_ERROR;
                 response.error_code = ERR_INVALID_COMMAND;
-                snprintf(response.data, sizeof(response.data), "Failed to create folder '%s'", msg.folder_path);
+                snprintf(response.data, sizeof(response.data), "Failed to create folder '%s'", msg->folder_path);
             }
             break;
         }
         
         case MSG_MOVE_FILE: {
-            // msg.filename contains the file to move
-            // msg.folder_path contains the destination folder
-            if (move_file_to_folder(msg.filename, msg.folder_path) == 0) {
+            // msg->filename contains the file to move
+            // msg->folder_path contains the destination folder
+            if (move_file_to_folder(msg->filename, msg->folder_path) == 0) {
                 response.type = MSG_ACK;
                 snprintf(response.data, sizeof(response.data), "File '%s' moved to folder '%s' successfully", 
-                         msg.filename, msg.folder_path);
+                         msg->filename, msg->folder_path);
                 log_message("SS", "File moved to folder");
             } else {
                 response.type = MSG_ERROR;
                 response.error_code = ERR_INVALID_COMMAND;
                 snprintf(response.data, sizeof(response.data), "Failed to move file '%s' to folder '%s'", 
-                         msg.filename, msg.folder_path);
+                         msg->filename, msg->folder_path);
             }
             break;
         }
         
         case MSG_VIEW_FOLDER: {
-            // msg.folder_path contains the folder to view
-            if (list_folder_contents(msg.folder_path, response.data, sizeof(response.data)) == 0) {
+            // msg->folder_path contains the folder to view
+            if (list_folder_contents(msg->folder_path, response.data, sizeof(response.data)) == 0) {
                 response.type = MSG_RESPONSE;
                 log_message("SS", "Folder contents listed");
             } else {
                 response.type = MSG_ERROR;
                 response.error_code = ERR_FILE_NOT_FOUND;
-                snprintf(response.data, sizeof(response.data), "Folder '%s' not found", msg.folder_path);
+                snprintf(response.data, sizeof(response.data), "Folder '%s' not found", msg->folder_path);
             }
             break;
         }
@@ -934,34 +1251,34 @@ void *handle_client_request(void *arg) {
         
         // ===== CHECKPOINT OPERATIONS =====
         case MSG_CHECKPOINT: {
-            // msg.filename contains the filename
-            // msg.data contains the tag
+            // msg->filename contains the filename
+            // msg->data contains the tag
             // Read current file content first
-            char current_content[MAX_BUFFER * 4];
-            if (read_file_content(msg.filename, current_content, sizeof(current_content)) == 0) {
+            char *current_content = scratch->content;
+            if (read_file_content(msg->filename, current_content, sizeof(scratch->content)) == 0) {
                 // Create checkpoint
-                if (create_checkpoint(msg.filename, msg.data, current_content, msg.username) == 0) {
+                if (create_checkpoint(msg->filename, msg->data, current_content, msg->username) == 0) {
                     response.type = MSG_ACK;
-                    snprintf(response.data, sizeof(response.data), "Checkpoint '%s' created successfully", msg.data);
+                    snprintf(response.data, sizeof(response.data), "Checkpoint '%s' created successfully", msg->data);
                     log_message("SS", "Checkpoint created");
                 } else {
                     response.type = MSG_ERROR;
                     response.error_code = ERR_INVALID_COMMAND;
-                    snprintf(response.data, sizeof(response.data), "Failed to create checkpoint '%s' (may already exist)", msg.data);
+                    snprintf(response.data, sizeof(response.data), "Failed to create checkpoint '%s' (may already exist)", msg->data);
                 }
             } else {
                 response.type = MSG_ERROR;
                 response.error_code = ERR_FILE_NOT_FOUND;
-                snprintf(response.data, sizeof(response.data), "File '%s' not found", msg.filename);
+                snprintf(response.data, sizeof(response.data), "File '%s' not found", msg->filename);
             }
             break;
         }
         
         case MSG_VIEWCHECKPOINT: {
-            // msg.filename contains the filename
-            // msg.data contains the tag
-            char checkpoint_content[MAX_BUFFER * 4];
-            if (view_checkpoint(msg.filename, msg.data, checkpoint_content, sizeof(checkpoint_content)) == 0) {
+            // msg->filename contains the filename
+            // msg->data contains the tag
+            char *checkpoint_content = scratch->content;
+            if (view_checkpoint(msg->filename, msg->data, checkpoint_content, sizeof(scratch->content)) == 0) {
                 response.type = MSG_RESPONSE;
                 strncpy(response.data, checkpoint_content, sizeof(response.data) - 1);
                 response.data[sizeof(response.data) - 1] = '\0';
@@ -969,92 +1286,360 @@ void *handle_client_request(void *arg) {
             } else {
                 response.type = MSG_ERROR;
                 response.error_code = ERR_FILE_NOT_FOUND;
-                snprintf(response.data, sizeof(response.data), "Checkpoint '%s' not found for file '%s'", msg.data, msg.filename);
+                snprintf(response.data, sizeof(response.data), "Checkpoint '%s' not found for file '%s'", msg->data, msg->filename);
             }
             break;
         }
         
         case MSG_REVERT: {
-            // msg.filename contains the filename
-            // msg.data contains the tag
-            if (revert_checkpoint(msg.filename, msg.data) == 0) {
+            // msg->filename contains the filename
+            // msg->data contains the tag
+            if (revert_checkpoint(msg->filename, msg->data) == 0) {
                 response.type = MSG_ACK;
-                snprintf(response.data, sizeof(response.data), "File reverted to checkpoint '%s'", msg.data);
+                snprintf(response.data, sizeof(response.data), "File reverted to checkpoint '%s'", msg->data);
                 log_message("SS", "File reverted to checkpoint");
             } else {
                 response.type = MSG_ERROR;
                 response.error_code = ERR_FILE_NOT_FOUND;
-                snprintf(response.data, sizeof(response.data), "Checkpoint '%s' not found for file '%s'", msg.data, msg.filename);
+                snprintf(response.data, sizeof(response.data), "Checkpoint '%s' not found for file '%s'", msg->data, msg->filename);
             }
             break;
         }
         
         case MSG_LISTCHECKPOINTS: {
-            // msg.filename contains the filename
-            if (list_checkpoints(msg.filename, response.data, sizeof(response.data)) == 0) {
+            // msg->filename contains the filename
+            if (list_checkpoints(msg->filename, response.data, sizeof(response.data)) == 0) {
                 response.type = MSG_RESPONSE;
                 log_message("SS", "Checkpoints listed");
             } else {
                 response.type = MSG_ERROR;
                 response.error_code = ERR_FILE_NOT_FOUND;
-                snprintf(response.data, sizeof(response.data), "No checkpoints found for file '%s'", msg.filename);
+                snprintf(response.data, sizeof(response.data), "No checkpoints found for file '%s'", msg->filename);
             }
             break;
         }
         // ===== END CHECKPOINT OPERATIONS =====
     }
     
-    send_message(sockfd, &response);
-    close(sockfd);
-    return NULL;
+    return send_message(sockfd, &response);
+}
+
+// ===== WORKER POOL =====
+
+static void park_connection(SSConnection *conn) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = conn;
+    if (epoll_ctl(conn_epfd, EPOLL_CTL_MOD, conn->fd, &ev) < 0 &&
+        epoll_ctl(conn_epfd, EPOLL_CTL_ADD, conn->fd, &ev) < 0) {
+        drop_connection(conn);
+    }
+}
+
+static void drop_connection(SSConnection *conn) {
+    if (conn->write_lock >= 0) unlock_file_for_write(conn->write_lock);
+    if (conn->stream) stream_close(conn->stream);
+    epoll_ctl(conn_epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    free(conn->in_buf);
+    free(conn);
+}
+
+// Returns -1 if the queue is full
+static int queue_connection(SSConnection *conn) {
+    pthread_mutex_lock(&work_lock);
+    int queued = work_count < queue_depth;
+    if (queued) {
+        work_queue[(work_head + work_count) % queue_depth] = conn;
+        work_count++;
+        pthread_cond_signal(&work_ready);
+    }
+    pthread_mutex_unlock(&work_lock);
+    return queued ? 0 : -1;
+}
+
+// Parks a connection, or queues it straight away if it holds bytes that
+// arrived while it was busy, since epoll will not report those again
+static void resume_connection(SSConnection *conn) {
+    if (conn->in_len > 0 && queue_connection(conn) == 0) return;
+    park_connection(conn);
+}
+
+// Reads everything that has arrived without blocking. Returns -1 once the
+// peer has closed or sent more than a frame can hold.
+static int conn_fill(SSConnection *conn) {
+    while (1) {
+        if (conn->in_len > FRAME_HEADER_SIZE + MAX_FRAME_PAYLOAD) return -1;
+        if (conn->in_cap - conn->in_len < MAX_BUFFER) {
+            size_t cap = conn->in_cap ? conn->in_cap * 2 : 2 * MAX_BUFFER;
+            char *grown = realloc(conn->in_buf, cap);
+            if (!grown) return -1;
+            conn->in_buf = grown;
+            conn->in_cap = cap;
+        }
+        
+        ssize_t n = recv(conn->fd, conn->in_buf + conn->in_len, conn->in_cap - conn->in_len, MSG_DONTWAIT);
+        if (n == 0) return -1;
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        conn->in_len += n;
+    }
 }
 
-void *nm_listener_thread(void *arg) {
-    int server_fd = *(int*)arg;
+// Takes the first whole request off the buffer. Returns 0 if there is none
+// yet, or -1 if it is malformed.
+static int conn_next(SSConnection *conn, Message *msg) {
+    int used = parse_message(conn->in_buf, conn->in_len, msg, &conn->peer);
+    if (used <= 0) return used;
+    set_peer_flags(conn->fd, conn->peer);
+    memmove(conn->in_buf, conn->in_buf + used, conn->in_len - used);
+    conn->in_len -= used;
+    
+    // Release the buffer of connections that go idle after a large request
+    if (conn->in_len == 0 && conn->in_cap > 4 * MAX_BUFFER) {
+        free(conn->in_buf);
+        conn->in_buf = NULL;
+        conn->in_cap = 0;
+    }
+    return 1;
+}
+
+// Serves every whole request buffered on a connection, then parks it
+static void serve_connection(SSConnection *conn, WorkerScratch *scratch) {
+    while (1) {
+        Message msg;
+        init_message(&msg);
+        int got = conn_next(conn, &msg);
+        if (got < 0) {
+            drop_connection(conn);
+            return;
+        }
+        if (got == 0) break;
+        
+        int ret;
+        if (conn->write_lock >= 0) {
+            // The commit for the lock this connection holds
+            int file_lock_idx = conn->write_lock;
+            conn->write_lock = -1;
+            ret = apply_write(conn->fd, &msg, file_lock_idx, scratch);
+        } else if (conn->from_nm) {
+            ret = serve_nm_request(conn->fd, &msg);
+        } else {
+            ret = serve_client_request(conn, &msg, scratch);
+        }
+        free_message(&msg);
+        
+        if (ret < 0) {
+            drop_connection(conn);
+            return;
+        }
+        if (ret == CONN_DETACHED) return;
+    }
+    park_connection(conn);
+}
+
+void *worker_thread(void *arg) {
+    WorkerScratch *scratch = arg;
     
     while (1) {
-        int *client_sock = malloc(sizeof(int));
-        *client_sock = accept(server_fd, NULL, NULL);
+        pthread_mutex_lock(&work_lock);
+        while (work_count == 0) {
+            pthread_cond_wait(&work_ready, &work_lock);
+        }
+        SSConnection *conn = work_queue[work_head];
+        work_head = (work_head + 1) % queue_depth;
+        work_count--;
+        pthread_mutex_unlock(&work_lock);
         
-        if (*client_sock < 0) {
-            free(client_sock);
-            continue;
+        serve_connection(conn, scratch);
+    }
+    return NULL;
+}
+
+// Answers every whole request buffered on a connection with
+// ERR_SERVER_BUSY when every worker is occupied and the queue is full, so
+// none is left where epoll will not report it again; a partial one is
+// kept. A connection waiting on a write lock or a stream gives it up,
+// since the client takes the error as the end of it.
+static void reject_overloaded(SSConnection *conn) {
+    while (1) {
+        Message msg, response;
+        init_message(&msg);
+        int got = conn_next(conn, &msg);
+        if (got < 0) {
+            drop_connection(conn);
+            return;
+        }
+        if (got == 0) break;
+        
+        // Stray credit, for a stream already over, has nobody to tell
+        int answer = msg.type != MSG_STREAM_CREDIT || conn->stream;
+        if (conn->write_lock >= 0) {
+            unlock_file_for_write(conn->write_lock);
+            conn->write_lock = -1;
+        }
+        if (conn->stream) {
+            stream_close(conn->stream);
+            conn->stream = NULL;
+        }
+        
+        init_message(&response);
+        response.request_id = msg.request_id;
+        response.type = MSG_ERROR;
+        response.error_code = ERR_SERVER_BUSY;
+        strcpy(response.data, "Storage server overloaded, try again later");
+        free_message(&msg);
+        
+        if (answer && send_message(conn->fd, &response) < 0) {
+            drop_connection(conn);
+            return;
         }
+    }
+    park_connection(conn);
+}
+
+// Reads what arrived on ready connections and queues those with data
+void *dispatcher_thread(void *arg) {
+    (void)arg;
+    struct epoll_event events[SS_MAX_EVENTS];
+    
+    while (1) {
+        int n = epoll_wait(conn_epfd, events, SS_MAX_EVENTS, -1);
+        for (int i = 0; i < n; i++) {
+            SSConnection *conn = events[i].data.ptr;
+            if (conn_fill(conn) < 0) {
+                drop_connection(conn);
+            } else if (conn->in_len == 0) {
+                park_connection(conn);
+            } else if (queue_connection(conn) < 0) {
+                log_message("SS", "Work queue full, rejecting request");
+                reject_overloaded(conn);
+            }
+        }
+    }
+    return NULL;
+}
+
+int start_worker_pool() {
+    conn_epfd = epoll_create1(0);
+    work_queue = calloc(queue_depth, sizeof(SSConnection*));
+    if (conn_epfd < 0 || !work_queue) return -1;
+    
+    for (int i = 0; i < num_workers; i++) {
+        WorkerScratch *scratch = malloc(sizeof(WorkerScratch));
+        if (!scratch) return -1;
         
         pthread_t tid;
-        pthread_create(&tid, NULL, handle_nm_request, client_sock);
+        pthread_create(&tid, NULL, worker_thread, scratch);
         pthread_detach(tid);
     }
     
-    return NULL;
+    pthread_t tid;
+    pthread_create(&tid, NULL, dispatcher_thread, NULL);
+    pthread_detach(tid);
+    return 0;
 }
 
-void *client_listener_thread(void *arg) {
-    int server_fd = *(int*)arg;
+// ===== END WORKER POOL =====
+
+typedef struct {
+    int server_fd;
+    int from_nm;
+} ListenerArgs;
+
+void *listener_thread(void *arg) {
+    ListenerArgs *listener = arg;
     
     while (1) {
-        int *client_sock = malloc(sizeof(int));
-        *client_sock = accept(server_fd, NULL, NULL);
+        int fd = accept(listener->server_fd, NULL, NULL);
+        if (fd < 0) continue;
         
-        if (*client_sock < 0) {
-            free(client_sock);
+        int opt = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+        struct timeval tv = {SS_SEND_TIMEOUT_SEC, 0};
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        
+        SSConnection *conn = calloc(1, sizeof(SSConnection));
+        if (!conn) {
+            close(fd);
             continue;
         }
-        
-        pthread_t tid;
-        pthread_create(&tid, NULL, handle_client_request, client_sock);
-        pthread_detach(tid);
+        conn->fd = fd;
+        conn->from_nm = listener->from_nm;
+        conn->write_lock = -1;
+        set_peer_flags(fd, 0);
+        park_connection(conn);
     }
     
     return NULL;
 }
 
+// Sends one request to a naming server and waits for its reply, locally if
+// it shares our socket directory. Returns -1 if it cannot be reached.
+int nm_exchange(const char *ip, int port, Message *msg, Message *reply) {
+    int sock = connect_to_server_via(ip, port, local_dir);
+    if (sock < 0) return -1;
+    int ok = send_message(sock, msg) >= 0 && receive_message(sock, reply) >= 0;
+    close(sock);
+    return ok ? 0 : -1;
+}
+
+// The naming server we were pointed at, or every shard of its namespace if
+// it is one of several; each shard keeps the part of our file list it owns
+int register_with_naming_servers(const char *nm_ip, int nm_port, Message *reg_msg) {
+    ShardMap map;
+    memset(&map, 0, sizeof(map));
+    
+    Message req, reply;
+    init_message(&req);
+    init_message(&reply);
+    req.type = MSG_SHARD_MAP;
+    if (nm_exchange(nm_ip, nm_port, &req, &reply) < 0) return -1;
+    if (reply.type != MSG_RESPONSE || !reply.data[0] || shard_map_parse(&map, reply.data) < 0) {
+        map.num_shards = 1;
+        strcpy(map.shards[0].ip, nm_ip);
+        map.shards[0].port = nm_port;
+    }
+    free_message(&reply);
+    
+    for (int s = 0; s < map.num_shards; s++) {
+        if (nm_exchange(map.shards[s].ip, map.shards[s].port, reg_msg, &reply) < 0) return -1;
+        int type = reply.type;
+        free_message(&reply);
+        if (type != MSG_ACK) return -1;
+    }
+    
+    if (map.num_shards > 1) {
+        char log_msg[64];
+        snprintf(log_msg, sizeof(log_msg), "Registered with %d naming server shards", map.num_shards);
+        log_message("SS", log_msg);
+    }
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
-    if (argc != 5) {
-        fprintf(stderr, "Usage: %s <nm_ip> <nm_port> <ss_port> <storage_dir>\n", argv[0]);
+    if (argc < 5 || argc % 2 == 0) {
+        fprintf(stderr, "Usage: %s <nm_ip> <nm_port> <ss_port> <storage_dir> "
+                        "[-w workers] [-q queue_depth] [-u socket_dir]\n", argv[0]);
         return 1;
     }
     
+    for (int i = 5; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-w") == 0 && atoi(argv[i + 1]) > 0) {
+            num_workers = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-q") == 0 && atoi(argv[i + 1]) > 0) {
+            queue_depth = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-u") == 0 && strlen(argv[i + 1]) < MAX_LOCAL_DIR) {
+            strcpy(local_dir, argv[i + 1]);
+        } else {
+            fprintf(stderr, "Unknown option: %s %s\n", argv[i], argv[i + 1]);
+            return 1;
+        }
+    }
+    
     char *nm_ip = argv[1];
     int nm_port = atoi(argv[2]);
     int ss_port = atoi(argv[3]);
@@ -1063,20 +1648,13 @@ int main(int argc, char *argv[]) {
     nm_port_listen = ss_port;
     client_port_listen = ss_port + 1;
     
-    init_storage();
-    
-    // Register with Naming Server
-    int nm_sock = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in nm_addr;
-    nm_addr.sin_family = AF_INET;
-    nm_addr.sin_port = htons(nm_port);
-    inet_pton(AF_INET, nm_ip, &nm_addr.sin_addr);
-    
-    if (connect(nm_sock, (struct sockaddr*)&nm_addr, sizeof(nm_addr)) < 0) {
-        perror("Failed to connect to Naming Server");
+    if (io_engine_start(SS_IO_RING_ENTRIES, SS_IO_THREADS) < 0) {
+        fprintf(stderr, "Failed to start I/O engine\n");
         return 1;
     }
+    init_storage();
     
+    // Register with Naming Server
     Message reg_msg;
     init_message(&reg_msg);
     reg_msg.type = MSG_REGISTER_SS;
@@ -1086,28 +1664,37 @@ int main(int argc, char *argv[]) {
     inet_ntop(AF_INET, &addr, reg_msg.ss_ip, sizeof(reg_msg.ss_ip));
     reg_msg.ss_port = nm_port_listen;
     reg_msg.flags = client_port_listen;
+    strcpy(reg_msg.local_dir, local_dir);
     
     // List files in storage directory
     DIR *dir = opendir(storage_dir);
     if (dir) {
         struct dirent *ent;
-        reg_msg.data[0] = '\0';
-        while ((ent = readdir(dir))) {
+        size_t list_len = 0, list_cap = MAX_BUFFER;
+        char *file_list = malloc(list_cap);
+        while (file_list && (ent = readdir(dir))) {
             if (ent->d_type == DT_REG) {
-                strcat(reg_msg.data, ent->d_name);
-                strcat(reg_msg.data, "\n");
+                size_t name_len = strlen(ent->d_name);
+                if (list_len + name_len + 2 > list_cap) {
+                    list_cap *= 2;
+                    file_list = realloc(file_list, list_cap);
+                    if (!file_list) break;
+                }
+                memcpy(file_list + list_len, ent->d_name, name_len);
+                list_len += name_len;
+                file_list[list_len++] = '\n';
             }
         }
         closedir(dir);
+        if (file_list) {
+            set_message_data(&reg_msg, file_list, list_len);
+            free(file_list);
+        }
     }
     
-    send_message(nm_sock, &reg_msg);
-    
-    Message ack;
-    receive_message(nm_sock, &ack);
-    close(nm_sock);
-    
-    if (ack.type != MSG_ACK) {
+    int registered = register_with_naming_servers(nm_ip, nm_port, &reg_msg);
+    free_message(&reg_msg);
+    if (registered < 0) {
         fprintf(stderr, "Registration failed\n");
         return 1;
     }
@@ -1141,10 +1728,38 @@ int main(int argc, char *argv[]) {
     printf("  NM port: %d\n", nm_port_listen);
     printf("  Client port: %d\n", client_port_listen);
     
+    int nm_local_fd = -1, client_local_fd = -1;
+    if (local_dir[0]) {
+        nm_local_fd = listen_local(local_dir, nm_port_listen);
+        client_local_fd = listen_local(local_dir, client_port_listen);
+        if (nm_local_fd < 0 || client_local_fd < 0) {
+            perror("Failed to listen on local sockets");
+            return 1;
+        }
+        printf("  Local sockets: %s\n", local_dir);
+    }
+    
+    if (start_worker_pool() < 0) {
+        fprintf(stderr, "Failed to start worker pool\n");
+        return 1;
+    }
+    printf("  Workers: %d, queue depth: %d\n", num_workers, queue_depth);
+    printf("  Disk I/O: %s\n", io_engine_backend());
+    
     // Start listener threads
     pthread_t nm_thread, client_thread;
-    pthread_create(&nm_thread, NULL, nm_listener_thread, &nm_server_fd);
-    pthread_create(&client_thread, NULL, client_listener_thread, &client_server_fd);
+    ListenerArgs nm_listener = {nm_server_fd, 1};
+    ListenerArgs client_listener = {client_server_fd, 0};
+    pthread_create(&nm_thread, NULL, listener_thread, &nm_listener);
+    pthread_create(&client_thread, NULL, listener_thread, &client_listener);
+    
+    ListenerArgs nm_local_listener = {nm_local_fd, 1};
+    ListenerArgs client_local_listener = {client_local_fd, 0};
+    if (local_dir[0]) {
+        pthread_t local_threads[2];
+        pthread_create(&local_threads[0], NULL, listener_thread, &nm_local_listener);
+        pthread_create(&local_threads[1], NULL, listener_thread, &client_local_listener);
+    }
     
     pthread_join(nm_thread, NULL);
     pthread_join(client_thread, NULL);
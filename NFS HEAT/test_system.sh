@@ -6,6 +6,135 @@ GREEN='\033[0;32m'
 YELLOW='\033[1;33m'
 NC='\033[0m' # No Color
 
+# Scripted runs, each in a directory of its own under test_runs/:
+#   bash test_system.sh shards   - two naming server shards, one storage server
+#   bash test_system.sh replica  - a primary and a follower, then failover
+#   bash test_system.sh checks   - the standalone module checks (make check)
+# With no argument the servers are started for testing by hand.
+FAILED=0
+ROOT=$(pwd)
+
+pass() {
+    echo -e "${GREEN}✓ $1${NC}"
+}
+
+fail() {
+    echo -e "${RED}✗ $1${NC}"
+    FAILED=1
+}
+
+# expect <description> <pattern> <output>
+expect() {
+    if echo "$3" | grep -q -- "$2"; then pass "$1"; else fail "$1"; fi
+}
+
+# run_client <port> <commands...>: one session as alice, one command per argument
+run_client() {
+    local port=$1
+    shift
+    { echo alice; printf '%s\n' "$@"; echo EXIT; } | timeout 10 "$ROOT/client" 127.0.0.1 "$port" 2>&1
+}
+
+# Starts a server in directory $1 from the remaining arguments, logging to $1/out.log
+start_in() {
+    local dir=$1
+    shift
+    (cd "$dir" && exec "$@" > out.log 2>&1) &
+    echo $!
+}
+
+run_shards() {
+    echo -e "\n${YELLOW}Two naming server shards...${NC}"
+    rm -rf test_runs/shards
+    mkdir -p test_runs/shards/nm0 test_runs/shards/nm1 test_runs/shards/ss/store
+    cd test_runs/shards
+    local map=127.0.0.1:8180,127.0.0.1:8181
+    local nm0=$(start_in nm0 "$ROOT/naming_server" 8180 -d . -S $map)
+    local nm1=$(start_in nm1 "$ROOT/naming_server" 8181 -d . -S $map)
+    sleep 1
+    local ss=$(start_in ss "$ROOT/storage_server" 127.0.0.1 8180 9101 store)
+    sleep 1
+
+    local cmds=()
+    for i in 1 2 3 4 5 6 7 8; do
+        cmds+=("CREATE s$i.txt" "WRITE s$i.txt 0" "1 shard file $i." "ETIRW")
+    done
+    for i in 1 2 3 4 5 6 7 8; do cmds+=("READ s$i.txt"); done
+    cmds+=("VIEW -a")
+    local out=$(run_client 8180 "${cmds[@]}")
+    expect "Files created through shard 0" "File Created Successfully" "$out"
+    for i in 1 2 3 4 5 6 7 8; do
+        expect "s$i.txt reads back" "shard file $i\." "$out"
+    done
+    expect "Listing merges both shards" "s8.txt" "$out"
+
+    # Each shard keeps only its own names, and both got some
+    local on0=$(grep -ao "s[0-9].txt" nm0/catalog.dat | sort -u | wc -l)
+    local on1=$(grep -ao "s[0-9].txt" nm1/catalog.dat | sort -u | wc -l)
+    if [ "$on0" -gt 0 ] && [ "$on1" -gt 0 ] && [ $((on0 + on1)) -eq 8 ]; then
+        pass "Names split between shards ($on0 + $on1)"
+    else
+        fail "Names split between shards ($on0 + $on1)"
+    fi
+
+    out=$(run_client 8181 "READ s1.txt" "READ s2.txt")
+    expect "Reads work through shard 1 too" "shard file 2\." "$out"
+
+    kill $nm0 $nm1 $ss 2>/dev/null
+    wait $nm0 $nm1 $ss 2>/dev/null
+    cd "$ROOT"
+}
+
+run_replica() {
+    echo -e "\n${YELLOW}Primary and follower naming servers...${NC}"
+    rm -rf test_runs/replica
+    mkdir -p test_runs/replica/primary test_runs/replica/follower test_runs/replica/ss/store
+    cd test_runs/replica
+    local primary=$(start_in primary "$ROOT/naming_server" 8280 -d .)
+    sleep 1
+    local follower=$(start_in follower "$ROOT/naming_server" 8281 -d . -F 127.0.0.1:8280)
+    local ss=$(start_in ss "$ROOT/storage_server" 127.0.0.1 8280 9201 store)
+    sleep 1
+
+    local out=$(run_client 8280 "CREATE r1.txt" "WRITE r1.txt 0" "1 replicated." "ETIRW")
+    expect "File created on the primary" "File Created Successfully" "$out"
+    sleep 2
+
+    out=$(run_client 8281 "READ r1.txt" "CREATE r2.txt")
+    expect "Follower answers reads" "replicated\." "$out"
+    expect "Follower refuses changes" "creation failed" "$out"
+
+    # Cut the primary off; the follower takes over
+    kill -STOP $primary
+    sleep 8
+    expect "Follower promoted itself" "promoted to primary" "$(cat follower/system.log)"
+    out=$(run_client 8281 "CREATE r2.txt" "READ r1.txt")
+    expect "Promoted follower takes changes" "File Created Successfully" "$out"
+    expect "Promoted follower kept the data" "replicated\." "$out"
+
+    # The old primary comes back and is fenced
+    kill -CONT $primary
+    sleep 5
+    expect "Old primary stepped down" "stepped down" "$(cat primary/system.log)"
+    out=$(run_client 8280 "CREATE r3.txt")
+    expect "Old primary refuses changes" "creation failed" "$out"
+
+    kill $primary $follower $ss 2>/dev/null
+    wait $primary $follower $ss 2>/dev/null
+    cd "$ROOT"
+}
+
+if [ -n "$1" ]; then
+    make > /dev/null || exit 1
+    case "$1" in
+        shards) run_shards ;;
+        replica) run_replica ;;
+        checks) make check || FAILED=1 ;;
+        *) echo "Usage: $0 [shards|replica|checks]"; exit 1 ;;
+    esac
+    exit $FAILED
+fi
+
 echo -e "${GREEN}========================================${NC}"
 echo -e "${GREEN}Distributed File System - Test Suite${NC}"
 echo -e "${GREEN}========================================${NC}"
@@ -42,7 +171,7 @@ fi
 
 # Start Naming Server
 echo -e "\n${YELLOW}Starting Naming Server on port 8080...${NC}"
-./naming_server 8080 > nm.log 2>&1 &
+./naming_server 8080 -u /tmp > nm.log 2>&1 &
 NM_PID=$!
 sleep 2
 
@@ -55,7 +184,7 @@ fi
 
 # Start Storage Servers
 echo -e "\n${YELLOW}Starting Storage Server 1 on port 9001...${NC}"
-./storage_server 127.0.0.1 8080 9001 storage1 > ss1.log 2>&1 &
+./storage_server 127.0.0.1 8080 9001 storage1 -u /tmp > ss1.log 2>&1 &
 SS1_PID=$!
 sleep 1
 
@@ -66,7 +195,7 @@ else
 fi
 
 echo -e "\n${YELLOW}Starting Storage Server 2 on port 9002...${NC}"
-./storage_server 127.0.0.1 8080 9002 storage2 > ss2.log 2>&1 &
+./storage_server 127.0.0.1 8080 9002 storage2 -u /tmp > ss2.log 2>&1 &
 SS2_PID=$!
 sleep 1
 
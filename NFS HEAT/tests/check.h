@@ -0,0 +1,23 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Standalone checks for the modules under the servers, run by `make check`.
+// Each is a plain program that exits nonzero at the first failed CHECK.
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        exit(1); \
+    } \
+} while (0)
+
+// Deterministic, so a failure can be reproduced
+static inline unsigned check_rand(unsigned *state) {
+    *state = *state * 1103515245u + 12345u;
+    return *state >> 8;
+}
+
+#endif
@@ -0,0 +1,147 @@
+#include "check.h"
+#include "../art.h"
+
+// Random inserts and removes against a plain array of the same keys, so
+// that nodes of every size grow, shrink and split their prefixes. After
+// each round every lookup and a full and a partial scan must agree with it.
+
+#define NUM_KEYS 4000
+#define ROUNDS 40
+#define OPS_PER_ROUND 2000
+
+static char keys[NUM_KEYS][MAX_FILENAME];
+static int values[NUM_KEYS]; // -1 if not in the tree
+
+static int by_name(const void *a, const void *b) {
+    return strcmp(keys[*(const int*)a], keys[*(const int*)b]);
+}
+
+typedef struct {
+    const int *expect; // Key indexes in strcmp order
+    int count, seen;
+} ScanState;
+
+static int check_next(const char *key, int value, void *arg) {
+    ScanState *s = arg;
+    CHECK(s->seen < s->count);
+    int k = s->expect[s->seen++];
+    CHECK(strcmp(key, keys[k]) == 0);
+    CHECK(value == values[k]);
+    return 0;
+}
+
+static int stop_after_three(const char *key, int value, void *arg) {
+    (void)key;
+    (void)value;
+    return ++*(int*)arg == 3;
+}
+
+static void make_keys(void) {
+    unsigned seed = 1;
+    for (int i = 0; i < NUM_KEYS; i++) {
+        switch (i % 4) {
+            case 0: // Long shared prefixes
+                snprintf(keys[i], MAX_FILENAME, "projects/report/draft_%d.txt", i);
+                break;
+            case 1: // Short keys that fan out over every byte value
+                keys[i][0] = (char)(1 + i % 255);
+                keys[i][1] = (char)(1 + (i / 255) % 255);
+                keys[i][2] = '\0';
+                break;
+            case 2: // Keys that are prefixes of others but for the NUL
+                snprintf(keys[i], MAX_FILENAME, "%.*s", 1 + i % 40,
+                         "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa");
+                snprintf(keys[i] + strlen(keys[i]), MAX_FILENAME - 40, "%d", i);
+                break;
+            default: // Random names
+                for (int j = 0, n = 1 + check_rand(&seed) % 30; j < n; j++) {
+                    keys[i][j] = (char)('a' + check_rand(&seed) % 26);
+                    keys[i][j + 1] = '\0';
+                }
+                break;
+        }
+    }
+    // Random names may repeat; keep the first of each
+    for (int i = 3; i < NUM_KEYS; i += 4) {
+        for (int j = 0; j < i; j++) {
+            if (strcmp(keys[i], keys[j]) == 0) {
+                snprintf(keys[i], MAX_FILENAME, "unique_%d", i);
+                break;
+            }
+        }
+    }
+}
+
+static void verify(ArtTree *tree) {
+    static int present[NUM_KEYS];
+    int count = 0;
+    for (int i = 0; i < NUM_KEYS; i++) {
+        CHECK(art_lookup(tree, keys[i]) == values[i]);
+        if (values[i] >= 0) present[count++] = i;
+    }
+    CHECK(art_lookup(tree, "not a key") == -1);
+    qsort(present, count, sizeof(int), by_name);
+
+    ScanState all = {present, count, 0};
+    art_scan(tree, "", check_next, &all);
+    CHECK(all.seen == count);
+
+    if (count > 1) {
+        // Resume after the middle key, as a paged listing does
+        int mid = count / 2;
+        ScanState rest = {present + mid + 1, count - mid - 1, 0};
+        art_scan(tree, keys[present[mid]], check_next, &rest);
+        CHECK(rest.seen == rest.count);
+    }
+
+    int stopped = 0;
+    art_scan(tree, "", stop_after_three, &stopped);
+    CHECK(stopped == (count < 3 ? count : 3));
+}
+
+int main(void) {
+    make_keys();
+    for (int i = 0; i < NUM_KEYS; i++) values[i] = -1;
+
+    ArtTree tree;
+    art_init(&tree);
+    verify(&tree);
+
+    unsigned seed = 7;
+    for (int round = 0; round < ROUNDS; round++) {
+        // Early rounds mostly insert, later ones mostly remove
+        unsigned insert_share = round < ROUNDS / 2 ? 75 : 25;
+        for (int op = 0; op < OPS_PER_ROUND; op++) {
+            int k = check_rand(&seed) % NUM_KEYS;
+            if (check_rand(&seed) % 100 < insert_share) {
+                int value = check_rand(&seed) % 1000;
+                CHECK(art_insert(&tree, keys[k], value) == 0);
+                values[k] = value;
+            } else {
+                CHECK(art_remove(&tree, keys[k]) == (values[k] >= 0));
+                values[k] = -1;
+            }
+        }
+        verify(&tree);
+    }
+
+    // Empty it completely, then fill it again
+    for (int i = 0; i < NUM_KEYS; i++) {
+        CHECK(art_remove(&tree, keys[i]) == (values[i] >= 0));
+        values[i] = -1;
+    }
+    verify(&tree);
+    for (int i = 0; i < NUM_KEYS; i++) {
+        CHECK(art_insert(&tree, keys[i], i) == 0);
+        values[i] = i;
+    }
+    verify(&tree);
+
+    char too_long[MAX_FILENAME * 2];
+    memset(too_long, 'x', sizeof(too_long) - 1);
+    too_long[sizeof(too_long) - 1] = '\0';
+    CHECK(art_insert(&tree, too_long, 1) == -1);
+
+    printf("check_art: ok\n");
+    return 0;
+}
@@ -0,0 +1,76 @@
+#include "check.h"
+#include "../compress.h"
+#include <string.h>
+
+// Round trips through the LZ4 block codec for inputs that compress well,
+// not at all, and at every length around the format's end-of-block rules
+
+#define MAX_INPUT (256 * 1024)
+
+static char src[MAX_INPUT], packed[MAX_INPUT + MAX_INPUT / 255 + 64], out[MAX_INPUT];
+
+static size_t round_trip(size_t len) {
+    size_t n = compress_block(src, len, packed, sizeof(packed));
+    CHECK(n > 0 || len == 0);
+    memset(out, 0x5A, len);
+    CHECK(decompress_block(packed, n, out, len) == 0);
+    CHECK(memcmp(src, out, len) == 0);
+    return n;
+}
+
+static void fill_text(size_t len, unsigned *seed) {
+    static const char *words[] = {"the", "storage", "server", "naming", "file", "sentence",
+                                  "write", "read", "stream", "client", "word", "lock"};
+    size_t pos = 0;
+    while (pos < len) {
+        const char *w = words[check_rand(seed) % 12];
+        for (size_t i = 0; w[i] && pos < len; i++) src[pos++] = w[i];
+        if (pos < len) src[pos++] = check_rand(seed) % 9 ? ' ' : '.';
+    }
+}
+
+int main(void) {
+    unsigned seed = 3;
+
+    // Every short length, where blocks are all or mostly literals
+    for (size_t len = 0; len <= 300; len++) {
+        fill_text(len, &seed);
+        round_trip(len);
+        for (size_t i = 0; i < len; i++) src[i] = (char)check_rand(&seed);
+        round_trip(len);
+    }
+
+    // Text shrinks
+    fill_text(MAX_INPUT, &seed);
+    CHECK(round_trip(MAX_INPUT) < MAX_INPUT / 2);
+
+    // Long runs, with matches that overlap their own output
+    memset(src, 'z', MAX_INPUT);
+    CHECK(round_trip(MAX_INPUT) < MAX_INPUT / 100);
+    for (size_t i = 0; i < MAX_INPUT; i++) src[i] = "ab"[i % 2];
+    round_trip(MAX_INPUT);
+
+    // Random bytes do not, but still come back intact
+    for (size_t i = 0; i < MAX_INPUT; i++) src[i] = (char)check_rand(&seed);
+    round_trip(MAX_INPUT);
+
+    // Repeats further apart than the 64 KB window
+    for (size_t i = 0; i < 70000; i++) src[i] = (char)check_rand(&seed);
+    memcpy(src + 70000, src, 70000);
+    round_trip(140000);
+
+    // Too little room is reported, not overrun
+    fill_text(4096, &seed);
+    size_t n = compress_block(src, 4096, packed, sizeof(packed));
+    CHECK(n > 0);
+    CHECK(compress_block(src, 4096, packed, n - 1) == 0);
+
+    // Damaged blocks and wrong lengths are rejected
+    n = compress_block(src, 4096, packed, sizeof(packed));
+    CHECK(decompress_block(packed, n - 1, out, 4096) == -1);
+    CHECK(decompress_block(packed, n, out, 4095) == -1);
+    CHECK(decompress_block(packed, n, out, 4097) == -1);
+
+    printf("check_compress: ok\n");
+    return 0;
+}
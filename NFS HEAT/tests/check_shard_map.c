@@ -0,0 +1,78 @@
+#include "check.h"
+#include "../shard_map.h"
+
+// Clients and naming servers each build the ring from the map they were
+// given, so they must agree on every name without talking to each other:
+// the owner depends only on the addresses, adding a shard only takes names
+// for itself, and the hash never changes between builds.
+
+#define NUM_NAMES 20000
+
+static const char *owner(const ShardMap *map, const char *name) {
+    static char addr[INET_ADDRSTRLEN + 8];
+    const ShardAddr *a = &map->shards[shard_of(map, name)];
+    snprintf(addr, sizeof(addr), "%s:%d", a->ip, a->port);
+    return addr;
+}
+
+int main(void) {
+    ShardMap two, two_again, three, three_reordered, one, reformatted;
+    CHECK(shard_map_parse(&two, "127.0.0.1:8080,127.0.0.1:8081") == 0);
+    CHECK(shard_map_parse(&two_again, "127.0.0.1:8080\n127.0.0.1:8081\n") == 0);
+    CHECK(shard_map_parse(&three, "127.0.0.1:8080,127.0.0.1:8081,127.0.0.1:8082") == 0);
+    CHECK(shard_map_parse(&three_reordered, "127.0.0.1:8082,127.0.0.1:8080,127.0.0.1:8081") == 0);
+    CHECK(shard_map_parse(&one, "127.0.0.1:8080") == 0);
+
+    char text[1024];
+    shard_map_format(&three, text, sizeof(text));
+    CHECK(shard_map_parse(&reformatted, text) == 0);
+
+    int per_shard[3] = {0, 0, 0};
+    int moved = 0;
+    for (int i = 0; i < NUM_NAMES; i++) {
+        char name[MAX_FILENAME];
+        snprintf(name, sizeof(name), i % 2 ? "file_%d.txt" : "dir%d/notes", i);
+
+        CHECK(shard_of(&one, name) == 0);
+        CHECK(shard_of(&two, name) == shard_of(&two_again, name));
+        CHECK(shard_of(&three, name) == shard_of(&reformatted, name));
+
+        char in_three[INET_ADDRSTRLEN + 8];
+        strcpy(in_three, owner(&three, name));
+        CHECK(strcmp(in_three, owner(&three_reordered, name)) == 0);
+
+        // Growing from two shards to three moves names only to the new one
+        if (strcmp(in_three, owner(&two, name)) != 0) {
+            CHECK(strcmp(in_three, "127.0.0.1:8082") == 0);
+            moved++;
+        }
+        per_shard[shard_of(&three, name)]++;
+    }
+
+    // Roughly a third each, and roughly a third moved
+    for (int s = 0; s < 3; s++) CHECK(per_shard[s] > NUM_NAMES / 5);
+    CHECK(moved > NUM_NAMES / 5 && moved < NUM_NAMES / 2);
+
+    // Pinned so a change to the ring hash, which would send clients of
+    // an older build to the wrong shard, does not go unnoticed
+    static const struct {
+        const char *name;
+        int shard;
+    } pinned[] = {
+        {"a.txt", 2},
+        {"dir1/notes", 2},
+        {"file_12345.txt", 1},
+        {"x", 0},
+    };
+    for (size_t i = 0; i < sizeof(pinned) / sizeof(pinned[0]); i++) {
+        CHECK(shard_of(&three, pinned[i].name) == pinned[i].shard);
+    }
+
+    CHECK(shard_find(&three, "127.0.0.1", 8081) == 1);
+    CHECK(shard_find(&three, "127.0.0.1", 9999) == -1);
+    CHECK(shard_map_parse(&reformatted, "127.0.0.1:8080,127.0.0.1:8080") == -1);
+    CHECK(shard_map_parse(&reformatted, "not an address") == -1);
+
+    printf("check_shard_map: ok\n");
+    return 0;
+}